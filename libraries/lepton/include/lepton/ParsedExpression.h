@@ -40,6 +40,7 @@
 namespace Lepton {
 
 class CompiledExpression;
+class CompiledVectorExpression;
 class ExpressionProgram;
 
 /**
@@ -102,6 +103,11 @@ public:
      * Create a CompiledExpression that represents the same calculation as this expression.
      */
     CompiledExpression createCompiledExpression() const;
+    /**
+     * Create a CompiledVectorExpression that represents the same calculation as this expression, evaluating
+     * it for "width" sets of variable values at once.
+     */
+    CompiledVectorExpression createCompiledVectorExpression(int width) const;
     /**
      * Create a new ParsedExpression which is identical to this one, except that the names of some
      * variables have been changed.
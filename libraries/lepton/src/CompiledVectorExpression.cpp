@@ -0,0 +1,283 @@
+/* -------------------------------------------------------------------------- *
+ *                                   Lepton                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the Lepton expression parser originating from              *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2013-2026 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "lepton/CompiledVectorExpression.h"
+#include "lepton/Operation.h"
+#include "lepton/ParsedExpression.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+using namespace Lepton;
+using namespace std;
+
+CompiledVectorExpression::CompiledVectorExpression() : width(1) {
+}
+
+CompiledVectorExpression::CompiledVectorExpression(const ParsedExpression& expression, int width) : width(width) {
+    if (width < 1)
+        throw Exception("CompiledVectorExpression: width must be at least 1");
+    ParsedExpression expr = expression.optimize(); // Just in case it wasn't already optimized.
+    vector<pair<ExpressionTreeNode, int> > temps;
+    compileExpression(expr.getRootNode(), temps);
+    int maxArguments = 1;
+    for (int i = 0; i < (int) operation.size(); i++)
+        if (operation[i]->getNumArguments() > maxArguments)
+            maxArguments = operation[i]->getNumArguments();
+    argValues.resize(maxArguments);
+}
+
+CompiledVectorExpression::~CompiledVectorExpression() {
+    for (int i = 0; i < (int) operation.size(); i++)
+        if (operation[i] != NULL)
+            delete operation[i];
+}
+
+CompiledVectorExpression::CompiledVectorExpression(const CompiledVectorExpression& expression) {
+    *this = expression;
+}
+
+CompiledVectorExpression& CompiledVectorExpression::operator=(const CompiledVectorExpression& expression) {
+    if (this == &expression)
+        return *this;
+    for (int i = 0; i < (int) operation.size(); i++)
+        if (operation[i] != NULL)
+            delete operation[i];
+    width = expression.width;
+    arguments = expression.arguments;
+    target = expression.target;
+    variableIndices = expression.variableIndices;
+    variableNames = expression.variableNames;
+    workspace.resize(expression.workspace.size());
+    argValues.resize(expression.argValues.size());
+    operation.resize(expression.operation.size());
+    for (int i = 0; i < (int) operation.size(); i++)
+        operation[i] = expression.operation[i]->clone();
+    map<string, double*> locations = expression.variablePointers;
+    setVariableLocations(locations);
+    return *this;
+}
+
+void CompiledVectorExpression::compileExpression(const ExpressionTreeNode& node, vector<pair<ExpressionTreeNode, int> >& temps) {
+    if (findTempIndex(node, temps) != -1)
+        return; // We have already processed a node identical to this one.
+
+    // Process the child nodes.
+
+    vector<int> args;
+    for (int i = 0; i < node.getChildren().size(); i++) {
+        compileExpression(node.getChildren()[i], temps);
+        args.push_back(findTempIndex(node.getChildren()[i], temps));
+    }
+
+    // Process this node.  Each node gets a slot of "width" consecutive elements in the workspace.
+
+    int slot = (int) (workspace.size()/width);
+    if (node.getOperation().getId() == Operation::VARIABLE) {
+        variableIndices[node.getOperation().getName()] = slot;
+        variableNames.insert(node.getOperation().getName());
+    }
+    else {
+        arguments.push_back(args);
+        target.push_back(slot);
+        operation.push_back(node.getOperation().clone());
+    }
+    temps.push_back(make_pair(node, slot));
+    workspace.resize(workspace.size()+width, 0.0);
+}
+
+int CompiledVectorExpression::findTempIndex(const ExpressionTreeNode& node, vector<pair<ExpressionTreeNode, int> >& temps) {
+    for (int i = 0; i < (int) temps.size(); i++)
+        if (temps[i].first == node)
+            return i;
+    return -1;
+}
+
+int CompiledVectorExpression::getWidth() const {
+    return width;
+}
+
+const set<string>& CompiledVectorExpression::getVariables() const {
+    return variableNames;
+}
+
+double* CompiledVectorExpression::getVariablePointer(const string& name) {
+    map<string, double*>::iterator pointer = variablePointers.find(name);
+    if (pointer != variablePointers.end())
+        return pointer->second;
+    map<string, int>::iterator index = variableIndices.find(name);
+    if (index == variableIndices.end())
+        throw Exception("getVariablePointer: Unknown variable '"+name+"'");
+    return &workspace[index->second*width];
+}
+
+void CompiledVectorExpression::setVariableLocations(map<string, double*>& variableLocations) {
+    variablePointers = variableLocations;
+
+    // Make a list of all variables we will need to copy before evaluating the expression.
+
+    variablesToCopy.clear();
+    for (map<string, int>::const_iterator iter = variableIndices.begin(); iter != variableIndices.end(); ++iter) {
+        map<string, double*>::iterator pointer = variablePointers.find(iter->first);
+        if (pointer != variablePointers.end())
+            variablesToCopy.push_back(make_pair(iter->second*width, pointer->second));
+    }
+}
+
+const double* CompiledVectorExpression::evaluate() const {
+    const int n = width;
+    double* ws = &workspace[0];
+    for (int i = 0; i < (int) variablesToCopy.size(); i++)
+        copy(variablesToCopy[i].second, variablesToCopy[i].second+n, ws+variablesToCopy[i].first);
+
+    // Loop over the operations and evaluate each one for all values at once.  The most common operations
+    // have specialized loops; everything else falls back to evaluating the Operation one value at a time.
+
+    for (int step = 0; step < (int) operation.size(); step++) {
+        const vector<int>& args = arguments[step];
+        double* result = ws+target[step]*n;
+        const double* a = (args.size() > 0 ? ws+args[0]*n : NULL);
+        const double* b = (args.size() > 1 ? ws+args[1]*n : NULL);
+        const Operation& op = *operation[step];
+        switch (op.getId()) {
+            case Operation::CONSTANT: {
+                double value = dynamic_cast<const Operation::Constant&>(op).getValue();
+                for (int i = 0; i < n; i++)
+                    result[i] = value;
+                break;
+            }
+            case Operation::ADD:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]+b[i];
+                break;
+            case Operation::SUBTRACT:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]-b[i];
+                break;
+            case Operation::MULTIPLY:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]*b[i];
+                break;
+            case Operation::DIVIDE:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]/b[i];
+                break;
+            case Operation::NEGATE:
+                for (int i = 0; i < n; i++)
+                    result[i] = -a[i];
+                break;
+            case Operation::SQRT:
+                for (int i = 0; i < n; i++)
+                    result[i] = sqrt(a[i]);
+                break;
+            case Operation::EXP:
+                for (int i = 0; i < n; i++)
+                    result[i] = exp(a[i]);
+                break;
+            case Operation::LOG:
+                for (int i = 0; i < n; i++)
+                    result[i] = log(a[i]);
+                break;
+            case Operation::SQUARE:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]*a[i];
+                break;
+            case Operation::CUBE:
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]*a[i]*a[i];
+                break;
+            case Operation::RECIPROCAL:
+                for (int i = 0; i < n; i++)
+                    result[i] = 1.0/a[i];
+                break;
+            case Operation::ADD_CONSTANT: {
+                double value = dynamic_cast<const Operation::AddConstant&>(op).getValue();
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]+value;
+                break;
+            }
+            case Operation::MULTIPLY_CONSTANT: {
+                double value = dynamic_cast<const Operation::MultiplyConstant&>(op).getValue();
+                for (int i = 0; i < n; i++)
+                    result[i] = a[i]*value;
+                break;
+            }
+            case Operation::POWER_CONSTANT: {
+                double value = dynamic_cast<const Operation::PowerConstant&>(op).getValue();
+                int exponent = (int) value;
+                if (exponent == value) {
+                    // Integer powers can be computed much more quickly by repeated multiplication.
+
+                    bool invert = (exponent < 0);
+                    if (invert)
+                        exponent = -exponent;
+                    for (int i = 0; i < n; i++) {
+                        double base = (invert ? 1.0/a[i] : a[i]);
+                        double power = 1.0;
+                        for (int e = exponent; e != 0; e >>= 1) {
+                            if ((e&1) == 1)
+                                power *= base;
+                            base *= base;
+                        }
+                        result[i] = power;
+                    }
+                }
+                else
+                    for (int i = 0; i < n; i++)
+                        result[i] = pow(a[i], value);
+                break;
+            }
+            case Operation::MIN:
+                for (int i = 0; i < n; i++)
+                    result[i] = (min)(a[i], b[i]);
+                break;
+            case Operation::MAX:
+                for (int i = 0; i < n; i++)
+                    result[i] = (max)(a[i], b[i]);
+                break;
+            case Operation::ABS:
+                for (int i = 0; i < n; i++)
+                    result[i] = fabs(a[i]);
+                break;
+            case Operation::STEP:
+                for (int i = 0; i < n; i++)
+                    result[i] = (a[i] >= 0.0 ? 1.0 : 0.0);
+                break;
+            default:
+                for (int i = 0; i < n; i++) {
+                    for (int j = 0; j < (int) args.size(); j++)
+                        argValues[j] = ws[args[j]*n+i];
+                    result[i] = op.evaluate(&argValues[0], dummyVariables);
+                }
+        }
+    }
+    return ws+workspace.size()-n;
+}
@@ -67,12 +67,15 @@
 #include "openmm/NoseHooverIntegrator.h"
 #include "openmm/NoseHooverChain.h"
 #include <iosfwd>
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
 namespace OpenMM {
 
+class ThreadPool;
+
 /**
  * This kernel is invoked at the beginning and end of force and energy computations.  It gives the
  * Platform a chance to clear buffers and do other initialization at the beginning, and to do any
@@ -1511,6 +1514,13 @@ public:
     }
     CalcPmeReciprocalForceKernel(std::string name, const Platform& platform) : KernelImpl(name, platform) {
     }
+    /**
+     * Set the ThreadPool the kernel should run on.  Platforms that manage their own worker threads may call
+     * this before initialize() so the reciprocal space calculation shares those threads.  If it is not called,
+     * the kernel creates threads of its own.
+     */
+    virtual void setThreadPool(std::shared_ptr<ThreadPool> threads) {
+    }
     /**
      * Initialize the kernel.
      * 
@@ -1584,6 +1594,13 @@ public:
     }
     CalcDispersionPmeReciprocalForceKernel(std::string name, const Platform& platform) : KernelImpl(name, platform) {
     }
+    /**
+     * Set the ThreadPool the kernel should run on.  Platforms that manage their own worker threads may call
+     * this before initialize() so the reciprocal space calculation shares those threads.  If it is not called,
+     * the kernel creates threads of its own.
+     */
+    virtual void setThreadPool(std::shared_ptr<ThreadPool> threads) {
+    }
     /**
      * Initialize the kernel.
      * 
@@ -34,7 +34,10 @@
 
 #define NOMINMAX
 #include "windowsExport.h"
+#include <atomic>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <pthread.h>
 #include <vector>
 
@@ -49,11 +52,30 @@ namespace OpenMM {
  * next syncThreads(), and the final call waits until they exit from the Task's execute() method.
  * After calling waitForThreads() to block at a synchronization point, the parent thread should
  * call resumeThreads() to instruct the worker threads to resume.
+ *
+ * For work that is not evenly divided between threads, there are two other ways of using it.
+ * parallelFor() divides a range of indices into chunks that are handed out to threads as they
+ * become free.  Alternatively you can build a TaskGraph containing many small tasks, each of which
+ * may depend on other tasks, and pass it to execute().  Each thread keeps a queue of tasks that are
+ * ready to run, and threads that run out of work steal tasks from the other queues.
+ *
+ * A ThreadPool may be used by several parent threads at once, for example by several Contexts that
+ * share the pool returned by getSharedPool().  Each parent thread takes ownership of the pool when it
+ * calls execute(), and keeps it until waitForThreads() reports that the worker threads have finished.
+ * Other parent threads block in execute() until then, and are served in the order they arrived.
+ * If the parent thread might throw an exception between execute() and waitForThreads(), it should
+ * create a CompletionGuard so the task is finished and the pool released on the way out.
+ *
+ * If a task throws an exception on a worker thread, the exception is caught so the other threads
+ * can finish, and the final call to waitForThreads() rethrows it in the parent thread.  When a task
+ * in a TaskGraph throws, the tasks that have not started yet are skipped.
  */
 class OPENMM_EXPORT ThreadPool {
 public:
     class Task;
+    class TaskGraph;
     class ThreadData;
+    class CompletionGuard;
     /**
      * Create a ThreadPool.
      *
@@ -62,10 +84,29 @@ public:
      */
     ThreadPool(int numThreads=0);
     ~ThreadPool();
+    /**
+     * Get a ThreadPool that is shared by everything in the process that requests one with the same
+     * number of threads.  The pool is deleted once no one holds a reference to it any longer.
+     *
+     * @param numThreads  the number of worker threads.  If this is 0 (the default), the number of
+     *                    threads is set equal to the number of logical CPU cores available
+     */
+    static std::shared_ptr<ThreadPool> getSharedPool(int numThreads=0);
     /**
      * Get the number of worker threads in the pool.
      */
     int getNumThreads() const;
+    /**
+     * Bind each worker thread to a particular logical CPU core.  This prevents the operating system from
+     * migrating threads between cores, and on machines with multiple NUMA nodes it ensures that memory
+     * first touched by a thread stays local to it.  This is currently only supported on Linux.
+     *
+     * @param cores   the index of the core to bind each thread to.  Thread i is bound to cores[i%cores.size()].
+     * @return true if the threads were bound.  If binding threads is not supported on this platform, or the
+     *         operating system refuses to bind one of them (for example because the core is not available to this
+     *         process), this returns false and the threads are left free to run on any core.
+     */
+    bool setThreadAffinity(const std::vector<int>& cores);
     /**
      * Execute a Task in parallel on the worker threads.
      */
@@ -74,6 +115,24 @@ public:
      * Execute a function in parallel on the worker threads.
      */
     void execute(std::function<void (ThreadPool&, int)> task);
+    /**
+     * Execute all the tasks in a TaskGraph in parallel on the worker threads.  Each task is run exactly
+     * once, and only after all tasks it depends on have completed.  Call waitForThreads() to block until
+     * all tasks have finished.  The graph must not be modified or destroyed until then.
+     */
+    void execute(TaskGraph& graph);
+    /**
+     * Execute a function for every index in a range, handing out chunks of indices to threads as they
+     * become free.  This blocks until all indices have been processed.
+     *
+     * @param start      the first index to process
+     * @param end        one past the last index to process
+     * @param task       the function to execute.  It is called as task(pool, threadIndex, chunkStart, chunkEnd)
+     *                   to process the indices from chunkStart up to (but not including) chunkEnd.
+     * @param chunkSize  the number of indices to hand out at a time.  If this is 0 (the default), a size is
+     *                   chosen to give each thread about ten chunks.
+     */
+    void parallelFor(int start, int end, std::function<void (ThreadPool&, int, int, int)> task, int chunkSize=0);
     /**
      * This is called by the worker threads to block until all threads have reached the same point
      * and the master thread instructs them to continue by calling resumeThreads().
@@ -82,6 +141,7 @@ public:
     /**
      * This is called by the master thread to wait until all threads have completed the Task.  Alternatively,
      * if the threads call syncThreads(), this blocks until all threads have reached the synchronization point.
+     * If the Task threw an exception on any thread, the call that waits for it to complete rethrows it.
      */
     void waitForThreads();
     /**
@@ -89,14 +149,27 @@ public:
      */
     void resumeThreads();
 private:
-    bool isDeleted;
+    class GraphState;
+    void executeGraph(int threadIndex);
+    void acquireOwnership();
+    void releaseOwnership();
+    void recordException(std::exception_ptr exception);
+    void finishAbandonedTask();
+    bool isDeleted, hasOwner;
     int numThreads, waitCount;
+    std::atomic<int> finishedCount;
+    long long nextTicket, currentTicket;
+    pthread_t ownerThread;
+    pthread_cond_t ownerCondition;
+    pthread_mutex_t ownerLock;
     std::vector<pthread_t> thread;
     std::vector<ThreadData*> threadData;
     pthread_cond_t startCondition, endCondition;
     pthread_mutex_t lock;
     Task* currentTask;
     std::function<void (ThreadPool& pool, int)> currentFunction;
+    GraphState* graphState;
+    std::exception_ptr taskException;
 };
 
 /**
@@ -113,6 +186,57 @@ public:
     virtual void execute(ThreadPool& pool, int threadIndex) = 0;
 };
 
+/**
+ * A CompletionGuard makes sure a task started with execute() is finished even if the parent thread
+ * leaves the scope through an exception before calling waitForThreads().  When the guard is destroyed,
+ * if the parent thread still owns the pool, it waits for the task to run to completion (resuming the
+ * threads past any synchronization points), discards any exception the task threw, and releases
+ * the pool so other parent threads can use it.  If waitForThreads() already completed the task, it
+ * does nothing.
+ */
+class OPENMM_EXPORT ThreadPool::CompletionGuard {
+public:
+    CompletionGuard(ThreadPool& pool) : pool(pool) {
+    }
+    ~CompletionGuard() {
+        pool.finishAbandonedTask();
+    }
+private:
+    ThreadPool& pool;
+};
+
+/**
+ * A TaskGraph is a collection of tasks, each of which may depend on other tasks.  Pass it to
+ * ThreadPool::execute() to run the tasks.  A graph can be executed any number of times.
+ */
+class OPENMM_EXPORT ThreadPool::TaskGraph {
+public:
+    /**
+     * Add a task to the graph.
+     *
+     * @param task          the function to execute.  It is called as task(pool, threadIndex).
+     * @param dependencies  the indices of tasks that must complete before this one can begin.  Every
+     *                      one must have been added before this task.
+     * @return the index of the newly added task
+     */
+    int addTask(std::function<void (ThreadPool&, int)> task, const std::vector<int>& dependencies=std::vector<int>());
+    /**
+     * Get the number of tasks in the graph.
+     */
+    int getNumTasks() const {
+        return tasks.size();
+    }
+    /**
+     * Remove all tasks from the graph.
+     */
+    void clear();
+private:
+    friend class ThreadPool;
+    std::vector<std::function<void (ThreadPool&, int)> > tasks;
+    std::vector<std::vector<int> > dependents;
+    std::vector<int> numDependencies;
+};
+
 } // namespace OpenMM
 
 #endif // OPENMM_THREAD_POOL_H_
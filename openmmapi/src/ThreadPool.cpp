@@ -31,6 +31,16 @@
 
 #include "openmm/internal/ThreadPool.h"
 #include "openmm/internal/hardware.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#if defined(__linux__) && !defined(__ANDROID__)
+    #include <sched.h>
+#endif
 
 using namespace std;
 
@@ -41,10 +51,16 @@ public:
     ThreadData(ThreadPool& owner, int index) : owner(owner), index(index), isDeleted(false) {
     }
     void executeTask() {
-        if (owner.currentTask != NULL)
-            owner.currentTask->execute(owner, index);
-        else
-            owner.currentFunction(owner, index);
+        try {
+            if (owner.currentTask != NULL)
+                owner.currentTask->execute(owner, index);
+            else
+                owner.currentFunction(owner, index);
+        }
+        catch (...) {
+            owner.recordException(current_exception());
+        }
+        owner.finishedCount++;
     }
     ThreadPool& owner;
     int index;
@@ -53,6 +69,126 @@ public:
     function<void (ThreadPool& pool, int)> currentFunction;
 };
 
+/**
+ * This holds the state of a TaskGraph while it is being executed.
+ */
+class ThreadPool::GraphState {
+public:
+    GraphState(int numThreads) : graph(NULL), queues(numThreads), queueLocks(numThreads), readyTasks(0), idleThreads(0), maxTasks(0), failed(false) {
+        for (auto& queueLock : queueLocks)
+            pthread_mutex_init(&queueLock, NULL);
+        pthread_mutex_init(&idleLock, NULL);
+        pthread_cond_init(&idleCondition, NULL);
+    }
+    ~GraphState() {
+        for (auto& queueLock : queueLocks)
+            pthread_mutex_destroy(&queueLock);
+        pthread_mutex_destroy(&idleLock);
+        pthread_cond_destroy(&idleCondition);
+    }
+    void start(TaskGraph& graph) {
+        this->graph = &graph;
+        int numTasks = graph.getNumTasks();
+        if (numTasks > maxTasks) {
+            remainingDependencies.reset(new atomic<int>[numTasks]);
+            maxTasks = numTasks;
+        }
+        tasksRemaining = numTasks;
+        failed = false;
+
+        // Distribute the tasks that are ready to run between the threads.
+
+        int nextQueue = 0;
+        int numReady = 0;
+        for (int i = 0; i < numTasks; i++) {
+            remainingDependencies[i] = graph.numDependencies[i];
+            if (graph.numDependencies[i] == 0) {
+                queues[nextQueue].push_back(i);
+                nextQueue = (nextQueue+1)%queues.size();
+                numReady++;
+            }
+        }
+        readyTasks = numReady;
+    }
+    void push(int threadIndex, int task) {
+        pthread_mutex_lock(&queueLocks[threadIndex]);
+        queues[threadIndex].push_back(task);
+        pthread_mutex_unlock(&queueLocks[threadIndex]);
+        readyTasks++;
+        wakeIdleThreads();
+    }
+    void taskFinished() {
+        if (--tasksRemaining == 0)
+            wakeIdleThreads();
+    }
+    void wakeIdleThreads() {
+        // Taking the lock makes sure a thread that has just decided to sleep is already waiting.  If no
+        // thread is idle, the lock can be skipped, since any thread that becomes idle will check again.
+
+        if (idleThreads > 0) {
+            pthread_mutex_lock(&idleLock);
+            pthread_cond_broadcast(&idleCondition);
+            pthread_mutex_unlock(&idleLock);
+        }
+    }
+    void waitForTask() {
+        // Sleep until another thread queues a task or the graph is finished, so idle threads do not use
+        // cores while the others work through serial parts of the graph.
+
+        pthread_mutex_lock(&idleLock);
+        idleThreads++;
+        while (readyTasks == 0 && tasksRemaining > 0)
+            pthread_cond_wait(&idleCondition, &idleLock);
+        idleThreads--;
+        pthread_mutex_unlock(&idleLock);
+    }
+    bool pop(int threadIndex, int& task) {
+        // A thread takes the most recently added task from its own queue, since it is most likely
+        // to use data that is still in cache.
+
+        bool found = false;
+        pthread_mutex_lock(&queueLocks[threadIndex]);
+        if (!queues[threadIndex].empty()) {
+            task = queues[threadIndex].back();
+            queues[threadIndex].pop_back();
+            found = true;
+        }
+        pthread_mutex_unlock(&queueLocks[threadIndex]);
+        if (found)
+            readyTasks--;
+        return found;
+    }
+    bool steal(int threadIndex, int& task) {
+        // Take the oldest task from another thread's queue.
+
+        int numThreads = queues.size();
+        for (int i = 1; i < numThreads; i++) {
+            int victim = (threadIndex+i)%numThreads;
+            pthread_mutex_lock(&queueLocks[victim]);
+            bool found = !queues[victim].empty();
+            if (found) {
+                task = queues[victim].front();
+                queues[victim].pop_front();
+            }
+            pthread_mutex_unlock(&queueLocks[victim]);
+            if (found) {
+                readyTasks--;
+                return true;
+            }
+        }
+        return false;
+    }
+    TaskGraph* graph;
+    vector<deque<int> > queues;
+    vector<pthread_mutex_t> queueLocks;
+    unique_ptr<atomic<int>[]> remainingDependencies;
+    atomic<int> tasksRemaining, readyTasks, idleThreads;
+    int maxTasks;
+    atomic<bool> failed;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCondition;
+};
+
 static void* threadBody(void* args) {
     ThreadPool::ThreadData& data = *reinterpret_cast<ThreadPool::ThreadData*>(args);
     while (true) {
@@ -67,13 +203,15 @@ static void* threadBody(void* args) {
     return 0;
 }
 
-ThreadPool::ThreadPool(int numThreads) : currentTask(NULL) {
+ThreadPool::ThreadPool(int numThreads) : hasOwner(false), finishedCount(0), nextTicket(0), currentTicket(0), currentTask(NULL), graphState(NULL) {
     if (numThreads <= 0)
         numThreads = getNumProcessors();
     this->numThreads = numThreads;
     pthread_cond_init(&startCondition, NULL);
     pthread_cond_init(&endCondition, NULL);
     pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&ownerCondition, NULL);
+    pthread_mutex_init(&ownerLock, NULL);
     thread.resize(numThreads);
     pthread_mutex_lock(&lock);
     waitCount = 0;
@@ -99,23 +237,188 @@ ThreadPool::~ThreadPool() {
     pthread_mutex_destroy(&lock);
     pthread_cond_destroy(&startCondition);
     pthread_cond_destroy(&endCondition);
+    pthread_mutex_destroy(&ownerLock);
+    pthread_cond_destroy(&ownerCondition);
+    if (graphState != NULL)
+        delete graphState;
+}
+
+shared_ptr<ThreadPool> ThreadPool::getSharedPool(int numThreads) {
+    static mutex poolsLock;
+    static map<int, weak_ptr<ThreadPool> > pools;
+    if (numThreads <= 0)
+        numThreads = getNumProcessors();
+    lock_guard<mutex> guard(poolsLock);
+    shared_ptr<ThreadPool> pool = pools[numThreads].lock();
+    if (!pool) {
+        pool = make_shared<ThreadPool>(numThreads);
+        pools[numThreads] = pool;
+    }
+    return pool;
+}
+
+void ThreadPool::acquireOwnership() {
+    // Parent threads take turns in the order they arrive.  A thread that already owns the pool
+    // (for example, because execute(TaskGraph&) calls execute() internally) keeps it.
+
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&ownerLock);
+    if (!(hasOwner && pthread_equal(ownerThread, self))) {
+        long long ticket = nextTicket++;
+        while (ticket != currentTicket)
+            pthread_cond_wait(&ownerCondition, &ownerLock);
+        hasOwner = true;
+        ownerThread = self;
+    }
+    pthread_mutex_unlock(&ownerLock);
+}
+
+void ThreadPool::recordException(exception_ptr exception) {
+    // Only the first exception is reported to the parent thread.
+
+    pthread_mutex_lock(&lock);
+    if (!taskException)
+        taskException = exception;
+    pthread_mutex_unlock(&lock);
+}
+
+void ThreadPool::finishAbandonedTask() {
+    pthread_mutex_lock(&ownerLock);
+    bool owned = (hasOwner && pthread_equal(ownerThread, pthread_self()));
+    pthread_mutex_unlock(&ownerLock);
+    if (!owned)
+        return;
+
+    // Let the threads run through any remaining synchronization points until the task is complete.
+
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (waitCount < numThreads)
+            pthread_cond_wait(&endCondition, &lock);
+        bool finished = (finishedCount == numThreads);
+        if (finished)
+            taskException = nullptr;
+        pthread_mutex_unlock(&lock);
+        if (finished)
+            break;
+        resumeThreads();
+    }
+    releaseOwnership();
+}
+
+void ThreadPool::releaseOwnership() {
+    pthread_mutex_lock(&ownerLock);
+    if (hasOwner && pthread_equal(ownerThread, pthread_self())) {
+        hasOwner = false;
+        currentTicket++;
+        pthread_cond_broadcast(&ownerCondition);
+    }
+    pthread_mutex_unlock(&ownerLock);
 }
 
 int ThreadPool::getNumThreads() const {
     return numThreads;
 }
 
+bool ThreadPool::setThreadAffinity(const vector<int>& cores) {
+    if (cores.size() == 0)
+        throw OpenMMException("ThreadPool: No cores specified for thread affinity");
+#if defined(__linux__) && !defined(__ANDROID__)
+    for (int core : cores)
+        if (core < 0 || core >= CPU_SETSIZE)
+            throw OpenMMException("ThreadPool: Illegal core index for thread affinity");
+    for (int i = 0; i < numThreads; i++) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cores[i%cores.size()], &cpuSet);
+        if (pthread_setaffinity_np(thread[i], sizeof(cpuSet), &cpuSet) != 0) {
+            // Let all the threads run anywhere the process is allowed to, rather than leave some of them bound.
+
+            if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+                for (int j = 0; j < i; j++)
+                    pthread_setaffinity_np(thread[j], sizeof(cpuSet), &cpuSet);
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 void ThreadPool::execute(Task& task) {
+    acquireOwnership();
     currentTask = &task;
+    finishedCount = 0;
     resumeThreads();
 }
 
 void ThreadPool::execute(function<void (ThreadPool&, int)> task) {
+    acquireOwnership();
     currentTask = NULL;
     currentFunction = task;
+    finishedCount = 0;
     resumeThreads();
 }
 
+void ThreadPool::execute(TaskGraph& graph) {
+    acquireOwnership();
+    if (graphState == NULL)
+        graphState = new GraphState(numThreads);
+    graphState->start(graph);
+    execute([&] (ThreadPool& pool, int threadIndex) { executeGraph(threadIndex); });
+}
+
+void ThreadPool::executeGraph(int threadIndex) {
+    GraphState& state = *graphState;
+    TaskGraph& graph = *state.graph;
+    while (state.tasksRemaining > 0) {
+        int task;
+        if (!state.pop(threadIndex, task) && !state.steal(threadIndex, task)) {
+            // Other threads are still working on tasks that will make more of them ready.
+
+            state.waitForTask();
+            continue;
+        }
+        // If a task throws an exception, record it and skip the tasks that have not started yet, but
+        // keep counting them down so every thread can leave the graph.
+
+        if (!state.failed) {
+            try {
+                graph.tasks[task](*this, threadIndex);
+            }
+            catch (...) {
+                state.failed = true;
+                recordException(current_exception());
+            }
+        }
+
+        // Queue any tasks that were waiting only for this one.
+
+        for (int dependent : graph.dependents[task])
+            if (--state.remainingDependencies[dependent] == 0)
+                state.push(threadIndex, dependent);
+        state.taskFinished();
+    }
+}
+
+void ThreadPool::parallelFor(int start, int end, function<void (ThreadPool&, int, int, int)> task, int chunkSize) {
+    if (end <= start)
+        return;
+    if (chunkSize <= 0)
+        chunkSize = max(1, (end-start)/(10*numThreads));
+    atomic<int> nextIndex(start);
+    execute([&] (ThreadPool& pool, int threadIndex) {
+        while (true) {
+            int chunkStart = nextIndex.fetch_add(chunkSize);
+            if (chunkStart >= end)
+                break;
+            task(pool, threadIndex, chunkStart, min(chunkStart+chunkSize, end));
+        }
+    });
+    waitForThreads();
+}
+
 void ThreadPool::syncThreads() {
     pthread_mutex_lock(&lock);
     waitCount++;
@@ -128,7 +431,22 @@ void ThreadPool::waitForThreads() {
     pthread_mutex_lock(&lock);
     while (waitCount < numThreads)
         pthread_cond_wait(&endCondition, &lock);
+    bool finished = (finishedCount == numThreads);
+    exception_ptr exception;
+    if (finished) {
+        exception = taskException;
+        taskException = nullptr;
+    }
     pthread_mutex_unlock(&lock);
+
+    // Once the threads have finished the task, let another parent thread use the pool, then report
+    // any exception the task threw.
+
+    if (finished) {
+        releaseOwnership();
+        if (exception)
+            rethrow_exception(exception);
+    }
 }
 
 void ThreadPool::resumeThreads() {
@@ -138,4 +456,23 @@ void ThreadPool::resumeThreads() {
     pthread_mutex_unlock(&lock);
 }
 
+int ThreadPool::TaskGraph::addTask(function<void (ThreadPool&, int)> task, const vector<int>& dependencies) {
+    int index = tasks.size();
+    for (int dependency : dependencies)
+        if (dependency < 0 || dependency >= index)
+            throw OpenMMException("TaskGraph: A task can only depend on tasks that were added before it");
+    tasks.push_back(task);
+    dependents.push_back(vector<int>());
+    numDependencies.push_back(dependencies.size());
+    for (int dependency : dependencies)
+        dependents[dependency].push_back(index);
+    return index;
+}
+
+void ThreadPool::TaskGraph::clear() {
+    tasks.clear();
+    dependents.clear();
+    numDependencies.clear();
+}
+
 } // namespace OpenMM
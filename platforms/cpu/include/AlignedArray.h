@@ -32,6 +32,13 @@
  * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
  * -------------------------------------------------------------------------- */
 
+#include <algorithm>
+#include <cstddef>
+#if defined(__linux__) && !defined(__ANDROID__)
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
 namespace OpenMM {
 
 /**
@@ -45,7 +52,7 @@ public:
     /**
      * Default constructor, to allow AlignedArrays to be used inside collections.
      */
-    AlignedArray() : dataSize(0), baseData(0), data(0) {
+    AlignedArray() : dataSize(0), baseData(0), data(0), mappedBytes(0) {
     }
     /**
      * Create an Aligned array that contains a specified number of elements.
@@ -54,8 +61,7 @@ public:
         allocate(size);
     }
     ~AlignedArray() {
-        if (baseData != 0)
-            delete[] baseData;
+        deallocate();
     }
     /**
      * Get the number of elements in the array.
@@ -67,11 +73,47 @@ public:
      * Change the size of the array.  This may cause all contents to be lost.
      */
     void resize(int size) {
-        if (dataSize == size)
+        if (dataSize == size && mappedBytes == 0)
             return;
-        if (baseData != 0)
-            delete[] baseData;
+        deallocate();
+        allocate(size);
+    }
+    /**
+     * Change the size of the array and fill it with zeros.  On Linux the memory is mapped directly from
+     * the operating system, which only assigns physical pages to the array as they are first written.
+     * Parts of a large array that are never written then take no memory.
+     */
+    void resizeZeroed(int size) {
+        deallocate();
+#if defined(__linux__) && !defined(__ANDROID__)
+        size_t bytes = std::max(sizeof(T), size*sizeof(T));
+        void* memory = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            dataSize = size;
+            mappedBytes = bytes;
+            baseData = (char*) memory;
+            data = (T*) memory;
+            return;
+        }
+#endif
         allocate(size);
+        std::fill(data, data+size, (T) 0);
+    }
+    /**
+     * Return the memory holding elements [start, end) to the operating system.  Those elements must all
+     * be zero, and they still read as zero afterward.  Only whole pages of an array created by
+     * resizeZeroed() are released.  Otherwise this does nothing.
+     */
+    void releasePages(int start, int end) {
+#if defined(__linux__) && !defined(__ANDROID__)
+        if (mappedBytes == 0)
+            return;
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t first = (start*sizeof(T)+pageSize-1)/pageSize*pageSize;
+        size_t last = (end >= dataSize ? mappedBytes : end*sizeof(T)/pageSize*pageSize);
+        if (last > first)
+            madvise(baseData+first, last-first, MADV_DONTNEED);
+#endif
     }
     /**
      * Get a reference to an element of the array.
@@ -88,14 +130,27 @@ public:
 private:
     void allocate(int size) {
         dataSize = size;
+        mappedBytes = 0;
         baseData = new char[size*sizeof(T)+16];
         char* offsetData = baseData+15;
         offsetData -= (long long)offsetData&0xF;
         data = (T*) offsetData;
     }
+    void deallocate() {
+        if (baseData == 0)
+            return;
+#if defined(__linux__) && !defined(__ANDROID__)
+        if (mappedBytes != 0)
+            munmap(baseData, mappedBytes);
+        else
+#endif
+            delete[] baseData;
+        baseData = 0;
+    }
     int dataSize;
     char* baseData;
     T* data;
+    size_t mappedBytes;
 };
 
 } // namespace OpenMM
@@ -32,10 +32,12 @@
  * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
  * -------------------------------------------------------------------------- */
 
+#include "AlignedArray.h"
 #include "ReferenceBondIxn.h"
 #include "windowsExportCpu.h"
 #include "openmm/internal/ThreadPool.h"
 #include <list>
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -49,19 +51,55 @@ public:
     CpuBondForce();
     /**
      * Analyze the set of bonds and decide which to compute with each thread.
+     *
+     * @param deterministic   if true, calculateForce() sums forces in fixed point and energies in bond order,
+     *                        so the results do not depend on the number of threads
      */
-    void initialize(int numAtoms, int numBonds, int numAtomsPerBond, std::vector<std::vector<int> >& bondAtoms, ThreadPool& threads);
+    void initialize(int numAtoms, int numBonds, int numAtomsPerBond, std::vector<std::vector<int> >& bondAtoms, ThreadPool& threads, bool deterministic=false);
     /**
      * Compute the forces from all bonds.
      */
     void calculateForce(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters, std::vector<OpenMM::Vec3>& forces, 
             double* totalEnergy, ReferenceBondIxn& referenceBondIxn);
+    /**
+     * Add tasks to a TaskGraph that compute the forces from all bonds.  Rather than writing to a shared
+     * array, each task adds forces and energy to the buffers belonging to the thread that executes it,
+     * so tasks for many different forces can safely run concurrently.
+     *
+     * @param graph              the TaskGraph to add tasks to
+     * @param threadForces       the force buffer for each thread, with four elements per atom
+     * @param blockUsed          blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block
+     * @param blockSize          the number of atoms in each block
+     * @param threadEnergy       the energy accumulator for each thread, or NULL if energy is not needed
+     * @param referenceBondIxn   the interaction to compute.  It is shared by all tasks.
+     */
+    void addForceTasks(ThreadPool::TaskGraph& graph, std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters,
+            std::vector<AlignedArray<double> >& threadForces, std::vector<std::vector<char> >& blockUsed, int blockSize,
+            std::vector<double>* threadEnergy, std::shared_ptr<ReferenceBondIxn> referenceBondIxn);
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex, std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters,
             std::vector<OpenMM::Vec3>& forces, double* totalEnergy, ReferenceBondIxn& referenceBondIxn);
+    /**
+     * Get the list of bonds that have been assigned to a thread.  No two threads are assigned bonds
+     * that involve the same atom, so they can safely accumulate forces in parallel.
+     */
+    const std::vector<int>& getThreadBonds(int threadIndex) const {
+        return threadBonds[threadIndex];
+    }
+    /**
+     * Get the list of bonds that could not be assigned to any thread.  These must be computed
+     * serially after all threads have finished.
+     */
+    const std::vector<int>& getExtraBonds() const {
+        return extraBonds;
+    }
 private:
+    void calculateDeterministicForce(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters, std::vector<OpenMM::Vec3>& forces,
+            double* totalEnergy, ReferenceBondIxn& referenceBondIxn);
+    void computeDeterministicBonds(const std::vector<int>& bonds, int threadIndex, std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters,
+            bool includeEnergy, ReferenceBondIxn& referenceBondIxn);
     bool canAssignBond(int bond, int thread, std::vector<int>& atomThread);
     void assignBond(int bond, int thread, std::vector<int>& atomThread, std::vector<int>& bondThread, std::vector<std::set<int> >& atomBonds, std::list<int>& candidateBonds);
     int numBonds, numAtomsPerBond;
@@ -69,6 +107,11 @@ private:
     ThreadPool* threads;
     std::vector<std::vector<int> > threadBonds;
     std::vector<int> extraBonds;
+    bool deterministic;
+    int numAtoms;
+    std::vector<long long> fixedForces;
+    std::vector<std::vector<OpenMM::Vec3> > threadScratchForces;
+    std::vector<double> bondEnergy;
 };
 
 } // namespace OpenMM
@@ -0,0 +1,110 @@
+#ifndef OPENMM_CPUCCMA_H_
+#define OPENMM_CPUCCMA_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuSETTLE.h"
+#include "ReferenceCCMAAlgorithm.h"
+#include "windowsExportCpu.h"
+#include "openmm/internal/ThreadPool.h"
+#include <atomic>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class applies CCMA in parallel.  It uses the inverse constraint matrix already computed by a
+ * ReferenceCCMAAlgorithm, and runs each iteration on the platform's ThreadPool.  Optionally it can also
+ * own a CpuSETTLE object for the rigid waters, whose clusters are then processed while threads would
+ * otherwise be waiting at the synchronization points between CCMA iterations.
+ */
+class OPENMM_EXPORT_CPU CpuCCMA : public ReferenceConstraintAlgorithm {
+public:
+    /**
+     * Create a CpuCCMA object.
+     *
+     * @param ccma      the ReferenceCCMAAlgorithm defining the constraints and the inverse constraint matrix
+     * @param threads   the ThreadPool to use for parallelizing computation
+     * @param settle    an optional CpuSETTLE object for constraints that do not involve any of the same atoms.
+     *                  If this is not NULL, this object takes ownership of it.
+     */
+    CpuCCMA(const ReferenceCCMAAlgorithm& ccma, ThreadPool& threads, CpuSETTLE* settle=NULL);
+    ~CpuCCMA();
+
+    /**
+     * Apply the constraint algorithm.
+     * 
+     * @param atomCoordinates  the original atom coordinates
+     * @param atomCoordinatesP the new atom coordinates
+     * @param inverseMasses    1/mass
+     * @param tolerance        the constraint tolerance
+     */
+    void apply(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<OpenMM::Vec3>& atomCoordinatesP, std::vector<double>& inverseMasses, double tolerance);
+
+    /**
+     * Apply the constraint algorithm to velocities.
+     * 
+     * @param atomCoordinates  the atom coordinates
+     * @param atomCoordinatesP the velocities to modify
+     * @param inverseMasses    1/mass
+     * @param tolerance        the constraint tolerance
+     */
+    void applyToVelocities(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<OpenMM::Vec3>& velocities, std::vector<double>& inverseMasses, double tolerance);
+private:
+    void applyConstraints(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<OpenMM::Vec3>& atomCoordinatesP,
+                          std::vector<double>& inverseMasses, bool constrainingVelocities, double tolerance);
+    void threadApplyConstraints(ThreadPool& threads, int threadIndex);
+    void processSettleBlock();
+    ThreadPool& threads;
+    CpuSETTLE* settle;
+    int numConstraints, maxIterations;
+    bool hasInitializedMasses;
+    std::vector<int> atom1, atom2;
+    std::vector<double> distance, reducedMasses, d_ij2, constraintDelta, tempDelta;
+    std::vector<OpenMM::Vec3> r_ij;
+    std::vector<int> matrixRowStart, matrixColIndex;
+    std::vector<double> matrixValue;
+    std::vector<int> constrainedAtoms, atomConstraintStart, atomConstraintIndex;
+    std::vector<int> threadConverged;
+    std::atomic<int> settleCounter;
+    bool finished;
+    // The following variables are used to make information accessible to the individual threads.
+    std::vector<OpenMM::Vec3>* atomCoordinates;
+    std::vector<OpenMM::Vec3>* atomCoordinatesP;
+    std::vector<double>* inverseMasses;
+    bool constrainingVelocities;
+    double tolerance;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUCCMA_H_*/
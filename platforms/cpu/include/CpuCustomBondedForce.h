@@ -0,0 +1,119 @@
+#ifndef OPENMM_CPUCUSTOMBONDEDFORCE_H_
+#define OPENMM_CPUCUSTOMBONDEDFORCE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuBondForce.h"
+#include "windowsExportCpu.h"
+#include "openmm/Vec3.h"
+#include "openmm/internal/ThreadPool.h"
+#include "lepton/ParsedExpression.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes CustomBondForce, CustomAngleForce, and CustomTorsionForce on multiple threads.  The template
+ * argument is the number of atoms in each interaction: 2 for bonds, whose energy depends on the distance r, and 3 or
+ * 4 for angles and torsions, whose energy depends on the angle theta.  Interactions are divided between threads
+ * with CpuBondForce.  Each thread collects its interactions into batches and evaluates the expressions for a whole
+ * batch at once with CompiledVectorExpressions.
+ */
+template <int NUM_ATOMS>
+class OPENMM_EXPORT_CPU CpuCustomBondedForce {
+public:
+    /**
+     * The number of interactions that are evaluated together.
+     */
+    static const int BatchSize = 32;
+    /**
+     * Create a CpuCustomBondedForce.
+     *
+     * @param expression             the expression for the energy of each interaction
+     * @param parameterNames         the names of the per-interaction parameters
+     * @param globalParameterNames   the names of the global parameters
+     * @param energyParamDerivNames  the names of the parameters to compute energy derivatives with respect to
+     * @param threads                the thread pool to use
+     */
+    CpuCustomBondedForce(const Lepton::ParsedExpression& expression, const std::vector<std::string>& parameterNames,
+            const std::vector<std::string>& globalParameterNames, const std::vector<std::string>& energyParamDerivNames, ThreadPool& threads);
+    ~CpuCustomBondedForce();
+    /**
+     * Analyze the set of interactions and decide which to compute with each thread.
+     *
+     * @param numAtoms       the number of atoms in the system
+     * @param bondAtoms      the indices of the atoms in each interaction
+     * @param deterministic  if true, calculateForce() sums forces and energy parameter derivatives in fixed point
+     *                       and energies in interaction order, so the results do not depend on the number of threads
+     */
+    void initialize(int numAtoms, std::vector<std::vector<int> >& bondAtoms, bool deterministic=false);
+    /**
+     * Set the force to use periodic boundary conditions.
+     * 
+     * @param periodicBoxVectors    the vectors defining the periodic box
+     */
+    void setPeriodic(Vec3* periodicBoxVectors);
+    /**
+     * Compute the forces from all interactions.
+     *
+     * @param parameters         the per-interaction parameters of each interaction
+     * @param globalParameters   the values of all global parameters
+     * @param energyParamDerivs  derivatives of the energy with respect to parameters are added to this
+     */
+    void calculateForce(std::vector<Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters, std::vector<Vec3>& forces,
+            double* totalEnergy, const std::map<std::string, double>& globalParameters, std::vector<double>& energyParamDerivs);
+private:
+    class ThreadData;
+    struct Geometry;
+    void computeBonds(int set, ThreadData& data, std::vector<Vec3>& atomCoordinates, std::vector<std::vector<double> >& parameters,
+            std::vector<Vec3>& forces, double* totalEnergy);
+    double computeGeometry(const int* atoms, std::vector<Vec3>& atomCoordinates, Geometry& geometry) const;
+    static void computeBondForces(const Geometry& geometry, double dEdTheta, Vec3* bondForces);
+    ThreadPool& threads;
+    std::vector<ThreadData*> threadData;
+    CpuBondForce bondForce;
+    std::vector<std::vector<int> >* bondAtoms;
+    int numParameters, numDerivs;
+    bool usePeriodic, deterministic;
+    Vec3 boxVectors[3];
+    std::vector<long long> fixedForces;
+    std::vector<double> bondEnergy;
+    // Element i contains the interactions assigned to thread i.  The final element contains the interactions
+    // that could not be assigned to a thread.
+    std::vector<std::vector<int> > setBonds;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUCUSTOMBONDEDFORCE_H_*/
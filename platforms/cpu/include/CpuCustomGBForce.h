@@ -52,6 +52,8 @@ private:
     std::vector<CustomGBForce::ComputationType> valueTypes;
     std::vector<CustomGBForce::ComputationType> energyTypes;
     ThreadPool& threads;
+    std::vector<std::vector<char> >* forceBlockUsed;
+    int forceBlockSize;
     std::vector<ThreadData*> threadData;
     std::vector<double> threadEnergy;
     std::vector<std::vector<std::vector<float> > > dValuedParam;
@@ -234,6 +236,16 @@ public:
 
     void calculateIxn(int numberOfAtoms, float* posq, std::vector<std::vector<double> >& atomParameters, std::map<std::string, double>& globalParameters,
             std::vector<AlignedArray<float> >& threadForce, bool includeForce, bool includeEnergy, double& totalEnergy, double* energyParamDerivs);
+
+    /**
+     * Record which blocks of atoms each thread adds forces to, so that the per-thread force arrays can be
+     * summed over only the blocks that were actually touched.
+     *
+     * @param blockUsed   blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block.
+     *                    If this is NULL, no record is kept.
+     * @param blockSize   the number of atoms in each block
+     */
+    void setForceBlockTracking(std::vector<std::vector<char> >* blockUsed, int blockSize);
 };
 
 class CpuCustomGBForce::ThreadData {
@@ -264,6 +276,7 @@ public:
     std::vector<double> particleValue;
     double x, y, z, r;
     int firstAtom, lastAtom;
+    char* blockUsed;
     // Workspace vectors
     std::vector<float> value0, dVdR1, dVdR2, dVdX, dVdY, dVdZ;
     std::vector<std::vector<float> > dEdV;
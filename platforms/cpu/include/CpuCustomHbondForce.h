@@ -0,0 +1,139 @@
+#ifndef OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
+#define OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceForce.h"
+#include "ReferenceCustomHbondIxn.h"
+#include "windowsExportCpu.h"
+#include "openmm/Vec3.h"
+#include "openmm/internal/ThreadPool.h"
+#include "lepton/ParsedExpression.h"
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes CustomHbondForce on multiple threads.  When a cutoff is used, acceptors are
+ * sorted into a grid of voxels at least as large as the cutoff, so each donor only needs to consider
+ * acceptors in the neighboring voxels.  Donors are divided dynamically between threads, each of which
+ * accumulates forces into its own buffer.
+ */
+class OPENMM_EXPORT_CPU CpuCustomHbondForce {
+public:
+    CpuCustomHbondForce(const std::vector<std::vector<int> >& donorAtoms, const std::vector<std::vector<int> >& acceptorAtoms,
+            const Lepton::ParsedExpression& energyExpression, const std::vector<std::string>& donorParameterNames,
+            const std::vector<std::string>& acceptorParameterNames, const std::map<std::string, std::vector<int> >& distances,
+            const std::map<std::string, std::vector<int> >& angles, const std::map<std::string, std::vector<int> >& dihedrals, ThreadPool& threads);
+    ~CpuCustomHbondForce();
+    /**
+     * Set the force to use a cutoff.
+     *
+     * @param distance    the cutoff distance
+     */
+    void setUseCutoff(double distance);
+    /**
+     * Set the force to use periodic boundary conditions.  This requires that a cutoff has
+     * already been set, and the smallest side of the periodic box is at least twice the cutoff
+     * distance.
+     *
+     * @param periodicBoxVectors    the vectors defining the periodic box
+     */
+    void setPeriodic(Vec3* periodicBoxVectors);
+    /**
+     * Get the list of atoms for each donor group.
+     */
+    const std::vector<std::vector<int> >& getDonorAtoms() const {
+        return donorAtoms;
+    }
+    /**
+     * Get the list of atoms for each acceptor group.
+     */
+    const std::vector<std::vector<int> >& getAcceptorAtoms() const {
+        return acceptorAtoms;
+    }
+    /**
+     * Calculate the interaction.
+     *
+     * @param atomCoordinates    atom coordinates
+     * @param donorParameters    donor parameters values       donorParameters[donorIndex][parameterIndex]
+     * @param acceptorParameters acceptor parameters values    acceptorParameters[acceptorIndex][parameterIndex]
+     * @param exclusions         exclusions[donorIndex] contains the list of excluded acceptors for that donor
+     * @param globalParameters   the values of global parameters
+     * @param forces             force array (forces added)
+     * @param totalEnergy        if not NULL, the energy is added to this
+     */
+    void calculatePairIxn(std::vector<Vec3>& atomCoordinates, std::vector<std::vector<double> >& donorParameters,
+            std::vector<std::vector<double> >& acceptorParameters, std::vector<std::set<int> >& exclusions,
+            const std::map<std::string, double>& globalParameters, std::vector<Vec3>& forces, double* totalEnergy);
+private:
+    /**
+     * Sort the acceptors into voxels based on the positions of their first atoms.
+     */
+    void buildVoxels(std::vector<Vec3>& atomCoordinates);
+    /**
+     * Find the position of an atom in the coordinate system used for voxels.
+     */
+    Vec3 getVoxelPosition(const Vec3& location) const;
+    /**
+     * Find all acceptors that might be within the cutoff distance of a donor.
+     */
+    void findCandidateAcceptors(int donor, std::vector<Vec3>& atomCoordinates, std::vector<int>& acceptors) const;
+    /**
+     * This routine contains the code executed by each thread.
+     */
+    void threadComputeForce(int threadIndex, std::vector<Vec3>& atomCoordinates, std::vector<std::vector<double> >& donorParameters,
+            std::vector<std::vector<double> >& acceptorParameters, std::vector<std::set<int> >& exclusions,
+            const std::map<std::string, double>& globalParameters, bool includeEnergy);
+    std::vector<std::vector<int> > donorAtoms, acceptorAtoms;
+    std::vector<int> allAcceptors;
+    ThreadPool& threads;
+    std::vector<ReferenceCustomHbondIxn*> threadIxn;
+    std::vector<std::vector<Vec3> > threadForce;
+    std::vector<double> threadEnergy;
+    std::atomic<int> atomicCounter;
+    bool cutoff, periodic;
+    double cutoffDistance;
+    Vec3 periodicBoxVectors[3];
+    // The grid of voxels containing acceptors.
+    int nx, ny, nz;
+    Vec3 voxelSize, minPos;
+    std::vector<std::vector<int> > voxels;
+};
+
+} // namespace OpenMM
+
+#endif // OPENMM_CPU_CUSTOM_HBOND_FORCE_H__
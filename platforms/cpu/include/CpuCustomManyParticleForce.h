@@ -55,14 +55,23 @@ private:
     AlignedArray<fvec4> periodicBoxVec4;
     CpuNeighborList* neighborList;
     ThreadPool& threads;
+    std::vector<std::vector<char> >* forceBlockUsed;
+    int forceBlockSize;
     std::vector<std::set<int> > exclusions;
     std::vector<int> particleTypes;
     std::vector<int> orderIndex;
     std::vector<std::vector<int> > particleOrder;
-    std::vector<std::vector<int> > particleNeighbors;
+    std::vector<char> allowedTypePairs;
+    bool useTypePruning;
+    std::vector<int> centralParticleOrder;
+    std::vector<int> cellStart;
+    std::vector<int> neighborStart;
+    std::vector<int> neighborIndices;
+    std::vector<std::vector<std::pair<int, int> > > threadPairs;
     std::vector<ThreadData*> threadData;
     // The following variables are used to make information accessible to the individual threads.
     float* posq;
+    AlignedArray<float>* posqArray;
     std::vector<double>* particleParameters;        
     const std::map<std::string, double>* globalParameters;
     std::vector<AlignedArray<float> >* threadForce;
@@ -74,11 +83,37 @@ private:
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex);
 
+    /**
+     * Build the list of neighbors for each particle.  In UniqueCentralParticle mode the list is symmetric.
+     * Otherwise each pair appears only in the list of the particle with the lower index.
+     */
+    void buildNeighborList();
+
+    /**
+     * Find all pairs of particles within the cutoff using a cell list.  Each thread loops over a subset of
+     * cells and compares it to itself and to half of its neighboring cells, so each pair is found exactly once.
+     * This also sets centralParticleOrder to list the particles in cell order.
+     */
+    void findPairsWithCells();
+
+    /**
+     * Find all pairs of particles within the cutoff using a CpuNeighborList.  This is used for triclinic
+     * boxes, which the cell list does not support.
+     */
+    void findPairsWithNeighborList();
+
+    /**
+     * Get whether two particles could ever appear together in an interaction, based on the type filters.
+     */
+    bool canInteract(int particle1, int particle2) const {
+        return (!useTypePruning || allowedTypePairs[particleTypes[particle1]*numTypes+particleTypes[particle2]]);
+    }
+
     /**
      * This is called recursively to loop over all possible combination of a set of particles and evaluate the
      * interaction for each one.
      */
-    void loopOverInteractions(std::vector<int>& availableParticles, std::vector<int>& particleSet, int loopIndex, int startIndex,
+    void loopOverInteractions(const int* availableParticles, int numAvailable, std::vector<int>& particleSet, int loopIndex, int startIndex,
                               std::vector<double>* particleParameters, float* forces, ThreadData& data, const fvec4& boxSize, const fvec4& invBoxSize);
 
     /**---------------------------------------------------------------------------------------
@@ -150,6 +185,16 @@ public:
      */
     void calculateIxn(AlignedArray<float>& posq, std::vector<std::vector<double> >& particleParameters, const std::map<std::string, double>& globalParameters,
                       std::vector<AlignedArray<float> >& threadForce, bool includeForces, bool includeEnergy, double& energy);
+
+    /**
+     * Record which blocks of atoms each thread adds forces to, so that the per-thread force arrays can be
+     * summed over only the blocks that were actually touched.
+     *
+     * @param blockUsed   blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block.
+     *                    If this is NULL, no record is kept.
+     * @param blockSize   the number of atoms in each block
+     */
+    void setForceBlockTracking(std::vector<std::vector<char> >* blockUsed, int blockSize);
 };
 
 class CpuCustomManyParticleForce::ParticleTermInfo {
@@ -169,6 +214,7 @@ public:
     std::vector<ParticleTermInfo> particleTerms;
     AlignedArray<fvec4> f;
     double energy;
+    char* blockUsed;
     ThreadData(const CustomManyParticleForce& force, Lepton::ParsedExpression& energyExpr);
 };
 
@@ -27,9 +27,9 @@
 
 #include "AlignedArray.h"
 #include "CpuNeighborList.h"
-#include "openmm/internal/CompiledExpressionSet.h"
 #include "openmm/internal/ThreadPool.h"
 #include "openmm/internal/vectorize.h"
+#include "lepton/CompiledVectorExpression.h"
 #include <atomic>
 #include <map>
 #include <set>
@@ -41,15 +41,21 @@ namespace OpenMM {
 class CpuCustomNonbondedForce {
    public:
 
+      /**
+       * The number of interactions that are collected before the expressions are evaluated.  The expressions
+       * passed to the constructor should be created with this width.
+       */
+      static const int BatchSize;
+
       /**---------------------------------------------------------------------------------------
 
          Constructor
 
          --------------------------------------------------------------------------------------- */
 
-       CpuCustomNonbondedForce(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
+       CpuCustomNonbondedForce(const Lepton::CompiledVectorExpression& energyExpression, const Lepton::CompiledVectorExpression& forceExpression,
                                const std::vector<std::string>& parameterNames, const std::vector<std::set<int> >& exclusions,
-                               const std::vector<Lepton::CompiledExpression> energyParamDerivExpressions, ThreadPool& threads);
+                               const std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions, ThreadPool& threads);
 
       /**---------------------------------------------------------------------------------------
 
@@ -72,10 +78,22 @@ class CpuCustomNonbondedForce {
 
       /**---------------------------------------------------------------------------------------
 
-         Restrict the force to a list of interaction groups.
+         Set the force to use a cutoff without a shared neighbor list.  This may only be used
+         together with interaction groups, which build their own neighbor lists.
 
          @param distance            the cutoff distance
-         @param neighbors           the neighbor list to use
+         @param padding             how far beyond the cutoff the interaction group neighbor lists extend
+
+         --------------------------------------------------------------------------------------- */
+
+      void setUseCutoff(double distance, double padding);
+
+      /**---------------------------------------------------------------------------------------
+
+         Restrict the force to a list of interaction groups.  When a cutoff is used, each group
+         gets its own neighbor list built from only its member atoms.
+
+         @param groups              the two sets of atoms making up each group
 
          --------------------------------------------------------------------------------------- */
 
@@ -121,6 +139,16 @@ class CpuCustomNonbondedForce {
     void calculatePairIxn(int numberOfAtoms, float* posq, std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<std::vector<double> >& atomParameters,
                           const std::map<std::string, double>& globalParameters, std::vector<AlignedArray<float> >& threadForce,
                           bool includeForce, bool includeEnergy, double& totalEnergy, double* energyParamDerivs);
+
+      /**
+       * Record which blocks of atoms each thread adds forces to, so that the per-thread force arrays can be
+       * summed over only the blocks that were actually touched.
+       *
+       * @param blockUsed   blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block.
+       *                    If this is NULL, no record is kept.
+       * @param blockSize   the number of atoms in each block
+       */
+    void setForceBlockTracking(std::vector<std::vector<char> >* blockUsed, int blockSize);
 private:
     class ThreadData;
 
@@ -133,12 +161,25 @@ private:
     float recipBoxSize[3];
     Vec3 periodicBoxVectors[3];
     AlignedArray<fvec4> periodicBoxVec4;
-    double cutoffDistance, switchingDistance;
+    double cutoffDistance, switchingDistance, groupListPadding;
     ThreadPool& threads;
     const std::vector<std::set<int> > exclusions;
     std::vector<ThreadData*> threadData;
     std::vector<std::string> paramNames;
+    std::vector<std::pair<std::set<int>, std::set<int> > > groups;
     std::vector<std::pair<int, int> > groupInteractions;
+    std::vector<std::vector<int> > groupAtoms;
+    std::vector<std::vector<char> > groupMembership;
+    std::vector<std::vector<std::set<int> > > groupExclusions;
+    std::vector<CpuNeighborList*> groupNeighborLists;
+    std::vector<std::vector<std::pair<int, int> > > threadGroupPairs;
+    std::vector<int> groupUnionAtoms;
+    std::vector<float> groupListPositions;
+    Vec3 groupListBoxVectors[3];
+    float groupListBuiltPadding;
+    bool groupListsValid;
+    std::vector<std::vector<char> >* forceBlockUsed;
+    int forceBlockSize;
     std::vector<double> threadEnergy;
     // The following variables are used to make information accessible to the individual threads.
     int numberOfAtoms;
@@ -150,13 +191,26 @@ private:
     bool includeForce, includeEnergy;
     std::atomic<int> atomicCounter;
 
+    /**
+     * Expand the interaction groups into an explicit list of every pair of atoms that interacts.
+     * This is used when there is no cutoff.
+     */
+    void createGroupInteractions();
+
+    /**
+     * Rebuild the neighbor lists for the interaction groups if any atom in them has moved
+     * more than half the padding distance since they were last built, or the padding has changed.
+     */
+    void updateGroupNeighborLists();
+
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex);
 
     /**
-     * Calculate the interaction between two atoms.
+     * Add the interaction between two atoms to the current thread's batch.  If they are beyond the cutoff
+     * it is skipped.  Once the batch is full, it is evaluated by calling computeBatch().
      * 
      * @param atom1            the index of the first atom
      * @param atom2            the index of the second atom
@@ -166,7 +220,16 @@ private:
      * @param boxSize          the size of the periodic box
      * @param boxSize          the inverse size of the periodic box
      */
-    void calculateOneIxn(int atom1, int atom2, ThreadData& data, float* forces, double& totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    void addInteraction(int atom1, int atom2, ThreadData& data, float* forces, double& totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+
+    /**
+     * Evaluate all interactions in the current thread's batch, accumulate the forces and energy, and empty the batch.
+     * 
+     * @param data             workspace for the current thread
+     * @param forces           force array (forces added)
+     * @param totalEnergy      total energy
+     */
+    void computeBatch(ThreadData& data, float* forces, double& totalEnergy);
 
     /**
      * Compute the displacement and squared distance between two points, optionally using
@@ -177,15 +240,22 @@ private:
 
 class CpuCustomNonbondedForce::ThreadData {
 public:
-    ThreadData(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression, const std::vector<std::string>& parameterNames,
-            const std::vector<Lepton::CompiledExpression> energyParamDerivExpressions);
-    Lepton::CompiledExpression energyExpression;
-    Lepton::CompiledExpression forceExpression;
-    std::vector<Lepton::CompiledExpression> energyParamDerivExpressions;
-    CompiledExpressionSet expressionSet;
+    ThreadData(const Lepton::CompiledVectorExpression& energyExpression, const Lepton::CompiledVectorExpression& forceExpression, const std::vector<std::string>& parameterNames,
+            const std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions);
+    Lepton::CompiledVectorExpression energyExpression;
+    Lepton::CompiledVectorExpression forceExpression;
+    std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions;
+    // Each of the following holds one element per interaction in the batch (for particleParam, one block of
+    // BatchSize elements for each parameter of each atom).
     std::vector<double> particleParam;
-    double r;
+    std::vector<double> r;
+    std::vector<double> switchValue;
+    std::vector<int> atom1, atom2;
+    AlignedArray<fvec4> deltaR;
+    std::map<std::string, std::vector<double> > globalParamValues;
+    int numInBatch;
     std::vector<double> energyParamDerivs; 
+    char* blockUsed;
 };
 
 } // namespace OpenMM
@@ -26,6 +26,7 @@
 #define OPENMM_CPU_GBSAOBC_FORCE_H__
 
 #include "AlignedArray.h"
+#include "CpuNeighborList.h"
 #include "openmm/internal/ThreadPool.h"
 #include "openmm/internal/vectorize.h"
 #include <atomic>
@@ -46,6 +47,17 @@ public:
      */
     void setUseCutoff(float distance);
 
+    /**
+     * Set the force to use a neighbor list for finding interacting pairs.  This requires that a cutoff
+     * has already been set.  The neighbor list must include all pairs within the cutoff.
+     *
+     * @param neighbors     the neighbor list to use
+     * @param maskedPairs   the pairs of atoms that are masked out as exclusions in the neighbor list.  GBSA
+     *                      interactions are not affected by exclusions, so these pairs are computed separately.
+     *                      maskedPairs[i] contains the indices of all atoms paired with atom i.
+     */
+    void setNeighborList(const CpuNeighborList& neighbors, const std::vector<std::set<int> >& maskedPairs);
+
     /**
      * 
      * Set the force to use periodic boundary conditions.  This requires that a cutoff has
@@ -92,11 +104,26 @@ public:
      */
     void computeForce(const AlignedArray<float>& posq, std::vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads);
 
+    /**
+     * Record which blocks of atoms each thread adds forces to, so that the per-thread force arrays can be
+     * summed over only the blocks that were actually touched.
+     *
+     * @param blockUsed   blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block.
+     *                    If this is NULL, no record is kept.
+     * @param blockSize   the number of atoms in each block
+     */
+    void setForceBlockTracking(std::vector<std::vector<char> >* blockUsed, int blockSize);
+
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeForce(ThreadPool& threads, int threadIndex);
 
+    /**
+     * This routine contains the code executed by each thread when a neighbor list is used.
+     */
+    void threadComputeNeighborListForce(ThreadPool& threads, int threadIndex);
+
 private:
     bool cutoff;
     bool periodic;
@@ -105,6 +132,12 @@ private:
     std::vector<std::pair<float, float> > particleParams;        
     AlignedArray<float> bornRadii;
     std::vector<AlignedArray<float> > threadBornForces;
+    std::vector<AlignedArray<float> > threadBornSums;
+    AlignedArray<float> totalBornForces;
+    const CpuNeighborList* neighborList;
+    const std::vector<std::set<int> >* maskedPairs;
+    std::vector<std::vector<char> >* forceBlockUsed;
+    int forceBlockSize;
     AlignedArray<float> obcChain;
     std::vector<double> threadEnergy;
     std::vector<float> logTable;
@@ -125,6 +158,33 @@ private:
      */
     void getDeltaR(const fvec4& posI, const fvec4& x, const fvec4& y, const fvec4& z, fvec4& dx, fvec4& dy, fvec4& dz, fvec4& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const;
     
+    class AtomGroup;
+
+    /**
+     * Load the positions and parameters of up to four atoms into an AtomGroup.
+     */
+    void loadAtomGroup(const int32_t* atoms, int numAtoms, AtomGroup& group) const;
+
+    /**
+     * Loop over all pairs of atoms in the neighbor list, along with the pairs it masks out as exclusions.
+     * Atoms are processed in groups of up to four.  pairFunction(group, atomJ, include) is called for each
+     * neighbor of a group, where include marks which atoms in the group interact with it.  groupFunction(group)
+     * is called once all neighbors of a group have been processed.
+     */
+    template <class PairFunction, class GroupFunction>
+    void loopOverPairs(ThreadPool& threads, int threadIndex, PairFunction pairFunction, GroupFunction groupFunction);
+
+    /**
+     * Compute the contributions of pairs of atoms to the sums used in calculating Born radii.  Each element
+     * is the contribution from an atom with scaled radius scaledRadiusJ to one with offset radius offsetRadiusI.
+     */
+    fvec4 computeBornSumTerms(const fvec4& r, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, ivec4 include);
+
+    /**
+     * Compute the derivatives of the Born radius sums with respect to distance, divided by distance.
+     */
+    fvec4 computeBornSumDerivs(const fvec4& r, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, ivec4 include);
+
     /**
      * Evaluate log(x) using a lookup table for speed.
      */
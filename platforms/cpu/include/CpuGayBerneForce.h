@@ -90,6 +90,7 @@ private:
     // The following variables are used to make information accessible to the individual threads.
     Vec3 const* positions;
     std::vector<AlignedArray<float> >* threadForce;
+    std::vector<std::vector<char> >* threadForceBlockUsed;
     Vec3* boxVectors;
     std::atomic<int> atomicCounter;
 
@@ -0,0 +1,113 @@
+#ifndef OPENMM_CPUHARMONICBONDFORCE_H_
+#define OPENMM_CPUHARMONICBONDFORCE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuBondForce.h"
+#include "windowsExportCpu.h"
+#include "openmm/Vec3.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace OpenMM {
+
+/**
+ * This class computes HarmonicBondForce on multiple threads.  Bonds are divided between threads
+ * with CpuBondForce, then stored in structure-of-arrays form.  Each thread gathers the displacements
+ * for a batch of bonds, computes them two at a time with SSE2 vectors (one at a time on processors
+ * other than x86), and then scatters the forces.  Everything is done in double precision, like the
+ * Reference platform.
+ */
+class OPENMM_EXPORT_CPU CpuHarmonicBondForce {
+public:
+    CpuHarmonicBondForce();
+    /**
+     * Analyze the set of bonds and decide which to compute with each thread.
+     *
+     * @param numAtoms    the number of atoms in the system
+     * @param bondAtoms   the indices of the two atoms in each bond
+     * @param threads     the thread pool to use
+     * @param deterministic  if true, calculateForce() sums forces in fixed point and energies in bond order,
+     *                       so the results do not depend on the number of threads
+     */
+    void initialize(int numAtoms, std::vector<std::vector<int> >& bondAtoms, ThreadPool& threads, bool deterministic=false);
+    /**
+     * Set the parameters of all bonds.
+     *
+     * @param parameters  for each bond, the equilibrium length and force constant
+     */
+    void setBondParameters(const std::vector<std::vector<double> >& parameters);
+    /**
+     * Set the force to use periodic boundary conditions.
+     * 
+     * @param periodicBoxVectors    the vectors defining the periodic box
+     */
+    void setPeriodic(Vec3* periodicBoxVectors);
+    /**
+     * Compute the forces from all bonds.
+     */
+    void calculateForce(std::vector<Vec3>& atomCoordinates, std::vector<Vec3>& forces, double* totalEnergy);
+    /**
+     * Add tasks to a TaskGraph that compute the forces from all bonds.  Each task adds forces and energy
+     * to the buffers belonging to the thread that executes it.
+     *
+     * @param graph          the TaskGraph to add tasks to
+     * @param threadForces   the force buffer for each thread, with four elements per atom
+     * @param blockUsed      blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block
+     * @param blockSize      the number of atoms in each block
+     * @param threadEnergy   the energy accumulator for each thread, or NULL if energy is not needed
+     */
+    void addForceTasks(ThreadPool::TaskGraph& graph, std::vector<Vec3>& atomCoordinates, std::vector<AlignedArray<double> >& threadForces,
+            std::vector<std::vector<char> >& blockUsed, int blockSize, std::vector<double>* threadEnergy);
+private:
+    static const int BatchSize;
+    /**
+     * Compute the bonds in one set.  addForce(atom1, atom2, f) is called to add f to the force on
+     * atom1 and subtract it from the force on atom2.  It is not called in deterministic mode.
+     */
+    template <class ForceFunction>
+    void computeBonds(int set, std::vector<Vec3>& atomCoordinates, double* totalEnergy, ForceFunction addForce);
+    CpuBondForce bondForce;
+    ThreadPool* threads;
+    bool usePeriodic, deterministic;
+    Vec3 boxVectors[3];
+    std::vector<long long> fixedForces;
+    std::vector<double> bondEnergy;
+    // Element i of each of these contains the bonds assigned to thread i.  The final element
+    // contains the bonds that could not be assigned to a thread.
+    std::vector<std::vector<int> > setBonds, setAtom1, setAtom2;
+    std::vector<std::vector<double> > setLength, setK;
+};
+
+} // namespace OpenMM
+
+#endif /*OPENMM_CPUHARMONICBONDFORCE_H_*/
@@ -33,16 +33,21 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuBondForce.h"
+#include "CpuCustomBondedForce.h"
+#include "CpuCustomDynamics.h"
 #include "CpuCustomGBForce.h"
+#include "CpuCustomHbondForce.h"
 #include "CpuCustomManyParticleForce.h"
 #include "CpuCustomNonbondedForce.h"
 #include "CpuGayBerneForce.h"
 #include "CpuGBSAOBCForce.h"
+#include "CpuHarmonicBondForce.h"
 #include "CpuLangevinDynamics.h"
 #include "CpuLangevinMiddleDynamics.h"
 #include "CpuNeighborList.h"
 #include "CpuNonbondedForce.h"
 #include "CpuPlatform.h"
+#include "ReferenceKernels.h"
 #include "openmm/kernels.h"
 #include "openmm/System.h"
 #include "openmm/internal/CustomNonbondedForceImpl.h"
@@ -51,6 +56,31 @@
 
 namespace OpenMM {
 
+/**
+ * This kernel provides methods for setting and retrieving various state data.  It extends the reference
+ * version to also save the counter of the random number generator used by the Langevin integrators in checkpoints.
+ */
+class CpuUpdateStateDataKernel : public ReferenceUpdateStateDataKernel {
+public:
+    CpuUpdateStateDataKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& cpuData, ReferencePlatform::PlatformData& data) :
+            ReferenceUpdateStateDataKernel(name, platform, data), cpuData(cpuData) {
+    }
+    /**
+     * Create a checkpoint recording the current state of the Context.
+     * 
+     * @param stream    an output stream the checkpoint data should be written to
+     */
+    void createCheckpoint(ContextImpl& context, std::ostream& stream);
+    /**
+     * Load a checkpoint that was written by createCheckpoint().
+     * 
+     * @param stream    an input stream the checkpoint data should be read from
+     */
+    void loadCheckpoint(ContextImpl& context, std::istream& stream);
+private:
+    CpuPlatform::PlatformData& cpuData;
+};
+
 /**
  * This kernel is invoked at the beginning and end of force and energy computations.  It gives the
  * Platform a chance to clear buffers and do other initialization at the beginning, and to do any
@@ -91,9 +121,96 @@ public:
      */
     double finishComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups, bool& valid);
 private:
+    void adjustNeighborListPadding(bool updateEstimates);
     CpuPlatform::PlatformData& data;
     Kernel referenceKernel;
     std::vector<Vec3> lastPositions;
+    std::vector<std::vector<int> > threadMoved;
+    std::vector<double> threadMaxDisplacement2;
+    int stepsSinceRebuild;
+    double buildTimePerVolume, stepsPerPadding, pairTimePerVolume;
+};
+
+/**
+ * This kernel is invoked by HarmonicBondForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcHarmonicBondForceKernel : public CalcHarmonicBondForceKernel {
+public:
+    CpuCalcHarmonicBondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcHarmonicBondForceKernel(name, platform), data(data), usePeriodic(false) {
+    }
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the HarmonicBondForce this kernel will be used for
+     */
+    void initialize(const System& system, const HarmonicBondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the HarmonicBondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const HarmonicBondForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numBonds;
+    std::vector<std::vector<int> > bondIndexArray;
+    std::vector<std::vector<double> > bondParamArray;
+    CpuHarmonicBondForce bondForce;
+    bool usePeriodic;
+};
+
+/**
+ * This kernel is invoked by CustomBondForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomBondForceKernel : public CalcCustomBondForceKernel {
+public:
+    CpuCalcCustomBondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomBondForceKernel(name, platform), data(data), customForce(NULL), usePeriodic(false) {
+    }
+    ~CpuCalcCustomBondForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomBondForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomBondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomBondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomBondForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numBonds;
+    std::vector<std::vector<int> > bondIndexArray;
+    std::vector<std::vector<double> > bondParamArray;
+    CpuCustomBondedForce<2>* customForce;
+    std::vector<std::string> parameterNames, globalParameterNames, energyParamDerivNames;
+    bool usePeriodic;
 };
 
 /**
@@ -136,6 +253,48 @@ private:
     bool usePeriodic;
 };
 
+/**
+ * This kernel is invoked by CustomAngleForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomAngleForceKernel : public CalcCustomAngleForceKernel {
+public:
+    CpuCalcCustomAngleForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomAngleForceKernel(name, platform), data(data), customForce(NULL), usePeriodic(false) {
+    }
+    ~CpuCalcCustomAngleForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomAngleForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomAngleForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomAngleForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomAngleForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numAngles;
+    std::vector<std::vector<int> > angleIndexArray;
+    std::vector<std::vector<double> > angleParamArray;
+    CpuCustomBondedForce<3>* customForce;
+    std::vector<std::string> parameterNames, globalParameterNames, energyParamDerivNames;
+    bool usePeriodic;
+};
+
 /**
  * This kernel is invoked by PeriodicTorsionForce to calculate the forces acting on the system and the energy of the system.
  */
@@ -216,6 +375,48 @@ private:
     bool usePeriodic;
 };
 
+/**
+ * This kernel is invoked by CustomTorsionForce to calculate the forces acting on the system and the energy of the system.
+ */
+class CpuCalcCustomTorsionForceKernel : public CalcCustomTorsionForceKernel {
+public:
+    CpuCalcCustomTorsionForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomTorsionForceKernel(name, platform), data(data), customForce(NULL), usePeriodic(false) {
+    }
+    ~CpuCalcCustomTorsionForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomTorsionForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomTorsionForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomTorsionForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomTorsionForce& force);
+private:
+    CpuPlatform::PlatformData& data;
+    int numTorsions;
+    std::vector<std::vector<int> > torsionIndexArray;
+    std::vector<std::vector<double> > torsionParamArray;
+    CpuCustomBondedForce<4>* customForce;
+    std::vector<std::string> parameterNames, globalParameterNames, energyParamDerivNames;
+    bool usePeriodic;
+};
+
 /**
  * This kernel is invoked by NonbondedForce to calculate the forces acting on the system.
  */
@@ -268,18 +469,35 @@ public:
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
 private:
     class PmeIO;
+    /**
+     * A combination of parameters that is timed while tuning PME.
+     */
+    struct PmeTuningCandidate {
+        int gridSize[3];
+        double alpha, padding, time;
+    };
     void computeParameters(ContextImpl& context, bool offsetsOnly);
+    void startPmeTuning(ContextImpl& context);
+    void tunePmeParameters(ContextImpl& context);
+    void setPmeTuningCandidate(ContextImpl& context, const PmeTuningCandidate& candidate);
+    void recordPmeParameters();
     CpuPlatform::PlatformData& data;
     int numParticles, num14, chargePosqIndex, ljPosqIndex;
     std::vector<std::vector<int> > bonded14IndexArray;
     std::vector<std::vector<double> > bonded14ParamArray;
-    double nonbondedCutoff, switchingDistance, rfDielectric, ewaldAlpha, ewaldDispersionAlpha, ewaldSelfEnergy, dispersionCoefficient;
+    double nonbondedCutoff, switchingDistance, rfDielectric, ewaldAlpha, ewaldDispersionAlpha, ewaldSelfEnergy, dispersionCoefficient, ewaldErrorTolerance;
     int kmax[3], gridSize[3], dispersionGridSize[3];
     bool useSwitchingFunction, exceptionsArePeriodic, useOptimizedPme, hasInitializedPme, hasInitializedDispersionPme, hasParticleOffsets, hasExceptionOffsets;
+    bool pmeGridSpecified, tuningPme, pmeGridTuned;
+    std::vector<PmeTuningCandidate> pmeTuningCandidates;
+    int currentPmeTuningCandidate, pmeTuningStep, pmeTuningRebuilds;
     std::vector<std::set<int> > exclusions;
     std::vector<std::pair<float, float> > particleParams;
     std::vector<float> C6params;
     std::vector<float> charges;
+    // Copies of the parameters above in double precision, used when the precision is "double".
+    std::vector<std::pair<double, double> > doubleParticleParams;
+    std::vector<double> doubleC6params, doubleCharges;
     std::vector<std::array<double, 3> > baseParticleParams, baseExceptionParams;
     std::vector<std::vector<std::tuple<double, double, double, int> > > particleParamOffsets, exceptionParamOffsets;
     std::vector<std::string> paramNames;
@@ -428,6 +646,52 @@ private:
     NonbondedMethod nonbondedMethod;
 };
 
+/**
+ * This kernel is invoked by CustomHbondForce to calculate the forces acting on the system.
+ */
+class CpuCalcCustomHbondForceKernel : public CalcCustomHbondForceKernel {
+public:
+    CpuCalcCustomHbondForceKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) :
+            CalcCustomHbondForceKernel(name, platform), data(data), ixn(NULL) {
+    }
+    ~CpuCalcCustomHbondForceKernel();
+    /**
+     * Initialize the kernel.
+     *
+     * @param system     the System this kernel will be applied to
+     * @param force      the CustomHbondForce this kernel will be used for
+     */
+    void initialize(const System& system, const CustomHbondForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Copy changed parameters over to a context.
+     *
+     * @param context    the context to copy parameters to
+     * @param force      the CustomHbondForce to copy the parameters from
+     */
+    void copyParametersToContext(ContextImpl& context, const CustomHbondForce& force);
+private:
+    void createInteraction(const CustomHbondForce& force);
+    CpuPlatform::PlatformData& data;
+    int numDonors, numAcceptors;
+    bool isPeriodic;
+    std::vector<std::vector<int> > donorParticles, acceptorParticles;
+    std::vector<std::vector<double> > donorParamArray, acceptorParamArray;
+    double nonbondedCutoff;
+    CpuCustomHbondForce* ixn;
+    std::vector<std::set<int> > exclusions;
+    std::vector<std::string> globalParameterNames;
+    std::map<std::string, const TabulatedFunction*> tabulatedFunctions;
+};
+
 /**
  * This kernel is invoked by CustomManyParticleForce to calculate the forces acting on the system and the energy of the system.
  */
@@ -581,7 +845,82 @@ private:
     double prevTemp, prevFriction, prevStepSize;
 };
 
+/**
+ * This kernel is invoked by CustomIntegrator to take one time step.
+ */
+class CpuIntegrateCustomStepKernel : public IntegrateCustomStepKernel {
+public:
+    CpuIntegrateCustomStepKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data) : IntegrateCustomStepKernel(name, platform),
+            data(data), dynamics(0) {
+    }
+    ~CpuIntegrateCustomStepKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param integrator the CustomIntegrator this kernel will be used for
+     */
+    void initialize(const System& system, const CustomIntegrator& integrator);
+    /**
+     * Execute the kernel.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the CustomIntegrator this kernel is being used for
+     * @param forcesAreValid if the context has been modified since the last time step, this will be
+     *                       false to show that cached forces are invalid and must be recalculated.
+     *                       On exit, this should specify whether the cached forces are valid at the
+     *                       end of the step.
+     */
+    void execute(ContextImpl& context, CustomIntegrator& integrator, bool& forcesAreValid);
+    /**
+     * Compute the kinetic energy.
+     * 
+     * @param context    the context in which to execute this kernel
+     * @param integrator the CustomIntegrator this kernel is being used for
+     * @param forcesAreValid if the context has been modified since the last time step, this will be
+     *                       false to show that cached forces are invalid and must be recalculated.
+     *                       On exit, this should specify whether the cached forces are valid at the
+     *                       end of the step.
+     */
+    double computeKineticEnergy(ContextImpl& context, CustomIntegrator& integrator, bool& forcesAreValid);
+    /**
+     * Get the values of all global variables.
+     *
+     * @param context   the context in which to execute this kernel
+     * @param values    on exit, this contains the values
+     */
+    void getGlobalVariables(ContextImpl& context, std::vector<double>& values) const;
+    /**
+     * Set the values of all global variables.
+     *
+     * @param context   the context in which to execute this kernel
+     * @param values    a vector containing the values
+     */
+    void setGlobalVariables(ContextImpl& context, const std::vector<double>& values);
+    /**
+     * Get the values of a per-DOF variable.
+     *
+     * @param context   the context in which to execute this kernel
+     * @param variable  the index of the variable to get
+     * @param values    on exit, this contains the values
+     */
+    void getPerDofVariable(ContextImpl& context, int variable, std::vector<Vec3>& values) const;
+    /**
+     * Set the values of a per-DOF variable.
+     *
+     * @param context   the context in which to execute this kernel
+     * @param variable  the index of the variable to get
+     * @param values    a vector containing the values
+     */
+    void setPerDofVariable(ContextImpl& context, int variable, const std::vector<Vec3>& values);
+private:
+    CpuPlatform::PlatformData& data;
+    CpuCustomDynamics* dynamics;
+    CpuRandom random;
+    std::vector<double> masses, globalValues;
+    std::vector<std::vector<OpenMM::Vec3> > perDofValues; 
+};
+
 } // namespace OpenMM
 
 #endif /*OPENMM_CPUKERNELS_H_*/
-
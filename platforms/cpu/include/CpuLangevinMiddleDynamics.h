@@ -52,6 +52,14 @@ public:
      */
     ~CpuLangevinMiddleDynamics();
 
+    /**
+     * Set the step whose random numbers should be used by the next update.  The noise applied to each
+     * particle is determined by the random number seed, this step, and the particle index.
+     *
+     * @param step    the value returned by CpuRandom::nextStep() for this update
+     */
+    void setRandomStep(long long step);
+
     /**
      * First update step.
      * 
@@ -94,6 +102,8 @@ private:
     OpenMM::ThreadPool& threads;
     OpenMM::CpuRandom& random;
     std::vector<OpenMM_SFMT::SFMT> threadRandom;
+    std::vector<std::vector<float> > threadNoise;
+    long long randomStep;
     // The following variables are used to make information accessible to the individual threads.
     int numberOfAtoms;
     OpenMM::Vec3* atomCoordinates;
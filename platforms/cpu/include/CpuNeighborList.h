@@ -54,6 +54,13 @@ public:
     const std::vector<int32_t>& getSortedAtoms() const;
     const std::vector<int>& getBlockNeighbors(int blockIndex) const;
 
+    /**
+     * Get the neighbors of a block, identified by their positions in the array returned by getSortedAtoms()
+     * rather than by atom index.  Atoms that are close together along the Hilbert curve are close together
+     * in this order, so data stored in it can be accessed with much better locality.
+     */
+    const std::vector<int>& getBlockSortedNeighbors(int blockIndex) const;
+
     /**
      * Bitset for a single block, marking which indexes should be excluded. This data type needs to be big
      * enough to store all the bits for any possible block size.
@@ -62,16 +69,22 @@ public:
 
     const std::vector<BlockExclusionMask>& getBlockExclusions(int blockIndex) const;
 
+    /**
+     * Get the number of times computeNeighborList() has been called.  This can be used to detect when
+     * data derived from the list needs to be rebuilt.
+     */
+    int getBuildCount() const;
+
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeNeighborList(ThreadPool& threads, int threadIndex);
     void runThread(int index);
 private:
-    int blockSize;
+    int blockSize, buildCount;
     std::vector<int> sortedAtoms;
     std::vector<float> sortedPositions;
-    std::vector<std::vector<int> > blockNeighbors;
+    std::vector<std::vector<int> > blockNeighbors, blockSortedNeighbors;
     std::vector<std::vector<BlockExclusionMask> > blockExclusions;
     // The following variables are used to make information accessible to the individual threads.
     float minx, maxx, miny, maxy, minz, maxz;
@@ -65,7 +65,7 @@ class CpuNonbondedForce {
       
          --------------------------------------------------------------------------------------- */
       
-      void setUseCutoff(float distance, const CpuNeighborList& neighbors, float solventDielectric);
+      void setUseCutoff(double distance, const CpuNeighborList& neighbors, double solventDielectric);
 
       /**---------------------------------------------------------------------------------------
       
@@ -75,7 +75,7 @@ class CpuNonbondedForce {
       
          --------------------------------------------------------------------------------------- */
       
-      void setUseSwitchingFunction(float distance);
+      void setUseSwitchingFunction(double distance);
       
       /**---------------------------------------------------------------------------------------
       
@@ -100,7 +100,7 @@ class CpuNonbondedForce {
       
          --------------------------------------------------------------------------------------- */
       
-      void setUseEwald(float alpha, int kmaxx, int kmaxy, int kmaxz);
+      void setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz);
 
      
       /**---------------------------------------------------------------------------------------
@@ -112,7 +112,7 @@ class CpuNonbondedForce {
 
          --------------------------------------------------------------------------------------- */
 
-      void setUsePME(float alpha, int meshSize[3]);
+      void setUsePME(double alpha, int meshSize[3]);
 
       /**---------------------------------------------------------------------------------------
 
@@ -123,7 +123,7 @@ class CpuNonbondedForce {
 
          --------------------------------------------------------------------------------------- */
 
-      void setUseLJPME(float alpha, int meshSize[3]);
+      void setUseLJPME(double alpha, int meshSize[3]);
 
       /**---------------------------------------------------------------------------------------
 
@@ -172,11 +172,65 @@ class CpuNonbondedForce {
       void calculateDirectIxn(int numberOfAtoms, float* posq, const std::vector<Vec3>& atomCoordinates, const std::vector<std::pair<float, float> >& atomParameters,
             const std::vector<float>& C6params, const std::vector<std::set<int> >& exclusions, std::vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads);
 
+      /**
+       * Record which blocks of atoms each thread adds forces to, so that the per-thread force arrays can be
+       * summed over only the blocks that were actually touched.
+       *
+       * @param blockUsed   blockUsed[thread][block] is set to 1 when a thread adds a force to any atom in a block.
+       *                    If this is NULL, no record is kept.
+       * @param blockSize   the number of atoms in each block
+       */
+      void setForceBlockTracking(std::vector<std::vector<char> >* blockUsed, int blockSize);
+
+      /**
+       * Set arrays that forces should be added to in double precision, one for each thread.  When this is set,
+       * the interactions are still computed in single precision, but the forces and energies computed by
+       * calculateDirectIxn() are accumulated in double precision and added to these arrays instead of to the
+       * single precision ones.  Pass NULL to go back to single precision.
+       */
+      void setDoublePrecisionForces(std::vector<AlignedArray<double> >* threadForceDouble);
+
+      /**
+       * Set arrays that forces should be added to in fixed point (see CpuFixedPoint.h), one for each
+       * thread.  When this is set, the forces computed by calculateDirectIxn() are added to these arrays
+       * instead of to the single precision ones, and the energy is summed in an order that does not depend
+       * on the number of threads.  Pass NULL to go back to single precision.
+       */
+      void setFixedPointForces(std::vector<AlignedArray<long long> >* threadForceFixed);
+
+      /**
+       * Set per-atom parameters for computing the interactions in double precision.  When this is set,
+       * calculateDirectIxn() computes every interaction in double precision from atomCoordinates instead of posq,
+       * and adds the forces to the arrays passed to setDoublePrecisionForces() or setFixedPointForces(), one of
+       * which must also be set.  calculateReciprocalIxn() uses these parameters too.  The neighbor list is still
+       * built from posq, which only decides which pairs are considered.  Pass NULL for all of them to go back to
+       * single precision.
+       *
+       * @param atomParameters   atom parameters (sigma/2, 2*sqrt(epsilon))
+       * @param charges          the charge of each atom
+       * @param C6params         C6 parameters for multiplicative representation of dispersion
+       */
+      void setDoublePrecisionParameters(const std::vector<std::pair<double, double> >* atomParameters, const std::vector<double>* charges,
+                                        const std::vector<double>* C6params);
+
+      /**
+       * Set whether each thread should process a fixed range of neighbor list blocks, chosen to give the threads
+       * about the same number of neighbors, instead of taking blocks as they become free.  This is used when
+       * threads are bound to cores, so each one works on the same atoms every step and they stay in its cache
+       * and on its NUMA node.
+       */
+      void setStaticBlockPartition(bool partition);
+
     /**
      * This routine contains the code executed by each thread.
      */
     void threadComputeDirect(ThreadPool& threads, int threadIndex);
 
+    /**
+     * This is used by threadComputeDirect() when the interactions are computed in double precision.
+     */
+    void threadComputeDirectDouble(ThreadPool& threads, int threadIndex);
+
 protected:
         bool cutoff;
         bool useSwitch;
@@ -192,6 +246,11 @@ protected:
         float cutoffDistance, switchingDistance;
         float krf, crf;
         float alphaEwald, alphaDispersionEwald;
+        // The same parameters in double precision, and the per-atom data set by setDoublePrecisionParameters().
+        double cutoffDistanceDouble, switchingDistanceDouble, krfDouble, crfDouble, alphaEwaldDouble, alphaDispersionEwaldDouble;
+        std::pair<double, double> const* doubleAtomParameters;
+        double const* doubleCharges;
+        double const* doubleC6params;
         int numRx, numRy, numRz;
         int meshDim[3], dispersionMeshDim[3];
         std::vector<float> erfcTable, ewaldScaleTable;
@@ -206,6 +265,25 @@ protected:
         float const *C6params;
         std::set<int> const* exclusions;
         std::vector<AlignedArray<float> >* threadForce;
+        std::vector<std::vector<char> >* forceBlockUsed;
+        int forceBlockSize;
+        // Copies of the per-atom data in the neighbor list's Hilbert curve order, which the block kernels use
+        // instead of the arrays above, and per-thread forces accumulated in the same order.
+        AlignedArray<float> sortedPosq;
+        std::vector<std::pair<float, float> > sortedAtomParameters;
+        std::vector<float> sortedC6params;
+        std::vector<AlignedArray<float> > threadSortedForce;
+        std::vector<AlignedArray<double> > threadSortedForceDouble;
+        std::vector<AlignedArray<long long> > threadSortedForceFixed;
+        std::vector<AlignedArray<long long> >* threadForceFixed;
+        std::vector<AlignedArray<double> >* threadForceDouble;
+        std::vector<double> blockEnergy, atomEnergy;
+        std::vector<std::vector<char> > threadSortedBlockUsed;
+        int neighborListBuild;
+        bool staticPartition;
+        // When staticPartition is set, thread i processes the neighbor list blocks from blockPartition[i] up
+        // to blockPartition[i+1].
+        std::vector<int> blockPartition;
         bool includeEnergy;
         float inverseRcut6;
         float inverseRcut6Expterm;
@@ -226,31 +304,84 @@ protected:
          --------------------------------------------------------------------------------------- */
           
       void calculateOneIxn(int atom1, int atom2, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+
+      /**
+       * Calculate the interaction between two atoms in double precision, using the parameters set by
+       * setDoublePrecisionParameters().  Pairs beyond the cutoff are skipped.
+       *
+       * @param atom1            the index of the first atom
+       * @param atom2            the index of the second atom
+       * @param totalEnergy      the energy is added to this.  If it is NULL, the energy is not computed.
+       * @return the force on atom1.  The force on atom2 is its negative.
+       */
+      Vec3 calculateOneIxnDouble(int atom1, int atom2, double* totalEnergy) const;
+
+      /**
+       * This is called from calculateDirectIxn() whenever the neighbor list has been rebuilt since the
+       * previous call.  Subclasses can override it to discard data derived from the list.
+       */
+      virtual void neighborListChanged() {
+      }
+
+      /**
+       * Divide the neighbor list blocks between threads for a static partition.
+       */
+      void computeBlockPartition(int numThreads);
+
+      /**
+       * Copy this thread's share of the positions and parameters into the neighbor list's sorted order.
+       */
+      void gatherSortedAtoms(int threadIndex, int numThreads);
+
+      /**
+       * Add the forces a thread accumulated in sorted order to its force array, and clear them for the next step.
+       */
+      void addSortedForces(int threadIndex, float* forces, char* blockUsed);
             
       /**---------------------------------------------------------------------------------------
       
          Calculate all the interactions for one atom block.
       
          @param blockIndex       the index of the atom block
-         @param forces           force array (forces added)
+         @param forces           force array in the neighbor list's sorted order (forces added)
          @param totalEnergy      total energy
             
          --------------------------------------------------------------------------------------- */
           
       virtual void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+
+      /**
+       * Calculate all the interactions for one atom block, accumulating forces in double precision.
+       */
+      virtual void calculateBlockIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+
+      /**
+       * Calculate all the interactions for one atom block, accumulating forces in fixed point.
+       */
+      virtual void calculateBlockIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
             
       /**---------------------------------------------------------------------------------------
       
          Calculate all the interactions for one atom block.
       
          @param blockIndex       the index of the atom block
-         @param forces           force array (forces added)
+         @param forces           force array in the neighbor list's sorted order (forces added)
          @param totalEnergy      total energy
             
          --------------------------------------------------------------------------------------- */
           
       virtual void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
 
+      /**
+       * Calculate all the interactions for one atom block, accumulating forces in double precision.
+       */
+      virtual void calculateBlockEwaldIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+
+      /**
+       * Calculate all the interactions for one atom block, accumulating forces in fixed point.
+       */
+      virtual void calculateBlockEwaldIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) = 0;
+
       /**
        * Compute the displacement and squared distance between two points, optionally using
        * periodic boundary conditions.
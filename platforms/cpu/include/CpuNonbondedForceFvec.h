@@ -26,22 +26,50 @@
 #define OPENMM_CPU_NONBONDED_FORCE_FVEC_H__
 
 #include "CpuNonbondedForce.h"
+#include "CpuFixedPoint.h"
 #include "openmm/internal/vectorize.h"
 
 #include "SimTKOpenMMUtilities.h"
 
 #include <algorithm>
+#include <map>
+#include <type_traits>
 #include <vector>
 
 namespace OpenMM {
 
 enum BlockType {EWALD, NON_EWALD}; // :TODO: Better name for non-ewald.
+
+/**
+ * Add a force to an element of a force array, which may be in single precision, double precision, or fixed point.
+ */
+static inline void addToForce(float* force, const fvec4& f) {
+    (fvec4(force)+f).store(force);
+}
+
+static inline void addToForce(double* force, const fvec4& f) {
+    force[0] += f[0];
+    force[1] += f[1];
+    force[2] += f[2];
+}
+
+static inline void addToForce(long long* force, const fvec4& f) {
+    force[0] += realToFixedPoint(f[0]);
+    force[1] += realToFixedPoint(f[1]);
+    force[2] += realToFixedPoint(f[2]);
+}
 enum PeriodicType {NoPeriodic, PeriodicPerAtom, PeriodicPerInteraction, PeriodicTriclinic};
 
 /**
  * Generic SIMD implementation of CpuNonbondedForce. The templating allows the same
  * basic code to be reused for any sort of SIMD type, including SSE, AVX, AVX2, or
  * AVX-512.
+ *
+ * Two algorithms are available.  The default one loops over each neighbor of a block one atom at
+ * a time, computing its interactions with all atoms in the block at once.  The cluster pair algorithm
+ * instead groups the neighbors into clusters of consecutive atoms in the neighbor list's sorted order.
+ * The atoms of the block are held in registers, and the positions, parameters, and forces of each
+ * neighboring cluster are loaded and stored once as whole vectors.
  */
 template<typename FVEC>
 class CpuNonbondedForceFvec : public CpuNonbondedForce {
@@ -51,35 +79,82 @@ public:
      */
     static constexpr int blockSize = sizeof(FVEC) / sizeof(float);
 
+    /**
+     * Create a CpuNonbondedForceFvec.
+     *
+     * @param useClusterPairs   if true, use the cluster pair algorithm for interactions in the neighbor list
+     */
+    CpuNonbondedForceFvec(bool useClusterPairs=false) : useClusterPairs(useClusterPairs) {
+    }
+
 protected:
     /**---------------------------------------------------------------------------------------
       Calculate all the interactions for one atom block. These are part of the virtual function interface
       and consequently have names which explicitly call Ewald variant or not.
       They internally call into the generic handler function below.
       @param blockIndex       the index of the atom block
-      @param forces           force array (forces added)
+      @param forces           force array (forces added), in single precision, double precision, or fixed point
       @param totalEnergy      total energy
       --------------------------------------------------------------------------------------- 
       @{
       */
     void calculateBlockIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
     void calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockEwaldIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    void calculateBlockEwaldIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
     /** @} */
 
     /**---------------------------------------------------------------------------------------
       Calculate all the interactions for one atom block. Identical to function prototypes above but
-      with an extra template parameter to choose whether to use Ewald processing or not.
+      with an extra template parameter to choose whether to use Ewald processing or not.  The type of
+      the force array selects whether forces are accumulated in single precision, double precision, or fixed point.
       --------------------------------------------------------------------------------------- */
-    template<BlockType BLOCK_TYPE>
-    void calculateBlockIxnHandler(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
+    template<BlockType BLOCK_TYPE, typename ACCUM>
+    void calculateBlockIxnHandler(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize);
 
     /**
     * Templatized implementation of calculateBlockIxn. It can handle both Ewald and non-ewald interactions
     * through a template parameter since the code is so similar for the two cases. Note also that the
     * floating-point SIMD type is also templated to allow any suitable type to be used.
     */
-    template <int PERIODIC_TYPE, BlockType BLOCK_TYPE>
-    void calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
+    /**
+     * Add the forces accumulated in registers for the atoms of a block to a force array.
+     */
+    template <typename ACCUM>
+    static void addBlockForces(ACCUM* forces, const FVEC& fx, const FVEC& fy, const FVEC& fz) {
+        fvec4 f[blockSize];
+        transpose(fx, fy, fz, 0.0f, f);
+        for (int j = 0; j < blockSize; j++)
+            addToForce(forces+4*j, f[j]);
+    }
+
+    /**
+     * In mixed precision mode, the number of neighbors whose forces may be summed in single
+     * precision before being added to the double precision accumulator.
+     */
+    static const int mixedPrecisionFlushInterval = 16;
+
+    template <int PERIODIC_TYPE, BlockType BLOCK_TYPE, typename ACCUM>
+    void calculateBlockIxnImpl(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
+
+    /**
+     * Cluster pair implementation of calculateBlockIxn.  It computes the same interactions as
+     * calculateBlockIxnImpl() and takes the same arguments.
+     */
+    template <int PERIODIC_TYPE, BlockType BLOCK_TYPE, typename ACCUM>
+    void calculateClusterPairIxnImpl(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter);
+
+    /**
+     * Discard the cluster pairs when the neighbor list changes.
+     */
+    void neighborListChanged();
+
+    /**
+     * Build the list of cluster pairs for one block from the neighbor list.
+     */
+    void buildClusterPairs(int blockIndex);
 
     /**
      * Compute the displacement and squared distance between a collection of points, optionally using
@@ -93,6 +168,18 @@ protected:
      **/
       FVEC approximateFunctionFromTable(const std::vector<float>& table, FVEC x, FVEC inverse) const;
 
+    /**
+     * A block's interactions with one cluster of blockSize consecutive atoms in the sorted order.
+     * Bit j of exclusions[i] is set if atom i of the block should not interact with atom j of the
+     * cluster, either because they are excluded or because the pair is not in the neighbor list.
+     */
+    struct ClusterPair {
+        int cluster;
+        CpuNeighborList::BlockExclusionMask exclusions[blockSize];
+    };
+    bool useClusterPairs;
+    std::vector<std::vector<ClusterPair> > blockClusterPairs;
+    std::vector<char> clusterPairsValid;
 };
 
 /**
@@ -118,14 +205,34 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxn(int blockIndex, float* force
     calculateBlockIxnHandler<BlockType::NON_EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
 }
 
+template<typename FVEC>
+void CpuNonbondedForceFvec<FVEC>::calculateBlockIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+    calculateBlockIxnHandler<BlockType::NON_EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
+}
+
+template<typename FVEC>
+void CpuNonbondedForceFvec<FVEC>::calculateBlockIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+    calculateBlockIxnHandler<BlockType::NON_EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
+}
+
 template<typename FVEC>
 void CpuNonbondedForceFvec<FVEC>::calculateBlockEwaldIxn(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
     calculateBlockIxnHandler<BlockType::EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
 }
 
 template<typename FVEC>
-template<BlockType BLOCK_TYPE>
-void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnHandler(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+void CpuNonbondedForceFvec<FVEC>::calculateBlockEwaldIxn(int blockIndex, double* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+    calculateBlockIxnHandler<BlockType::EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
+}
+
+template<typename FVEC>
+void CpuNonbondedForceFvec<FVEC>::calculateBlockEwaldIxn(int blockIndex, long long* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
+    calculateBlockIxnHandler<BlockType::EWALD>(blockIndex, forces, totalEnergy, boxSize, invBoxSize);
+}
+
+template<typename FVEC>
+template<BlockType BLOCK_TYPE, typename ACCUM>
+void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnHandler(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
     // Determine whether we need to apply periodic boundary conditions.
 
     PeriodicType periodicType;
@@ -138,18 +245,18 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnHandler(int blockIndex, float
         using std::min;
         using std::max;
 
-        const int32_t* blockAtom = &neighborList->getSortedAtoms()[blockSize*blockIndex];
+        const float* blockPosq = &sortedPosq[4*blockSize*blockIndex];
         float minx, maxx, miny, maxy, minz, maxz;
-        minx = maxx = posq[4*blockAtom[0]];
-        miny = maxy = posq[4*blockAtom[0]+1];
-        minz = maxz = posq[4*blockAtom[0]+2];
+        minx = maxx = blockPosq[0];
+        miny = maxy = blockPosq[1];
+        minz = maxz = blockPosq[2];
         for (int i = 1; i < blockSize; i++) {
-            minx = min(minx, posq[4*blockAtom[i]]);
-            maxx = max(maxx, posq[4*blockAtom[i]]);
-            miny = min(miny, posq[4*blockAtom[i]+1]);
-            maxy = max(maxy, posq[4*blockAtom[i]+1]);
-            minz = min(minz, posq[4*blockAtom[i]+2]);
-            maxz = max(maxz, posq[4*blockAtom[i]+2]);
+            minx = min(minx, blockPosq[4*i]);
+            maxx = max(maxx, blockPosq[4*i]);
+            miny = min(miny, blockPosq[4*i+1]);
+            maxy = max(maxy, blockPosq[4*i+1]);
+            minz = min(minz, blockPosq[4*i+2]);
+            maxz = max(maxz, blockPosq[4*i+2]);
         }
         blockCenter = fvec4(0.5f*(minx+maxx), 0.5f*(miny+maxy), 0.5f*(minz+maxz), 0.0f);
         if (!(minx < cutoffDistance || miny < cutoffDistance || minz < cutoffDistance ||
@@ -166,7 +273,17 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnHandler(int blockIndex, float
     }
     
     // Call the appropriate version depending on what calculation is required for periodic boundary conditions.
-    if (periodicType == NoPeriodic)
+    if (useClusterPairs) {
+        if (periodicType == NoPeriodic)
+            calculateClusterPairIxnImpl<NoPeriodic, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        else if (periodicType == PeriodicPerAtom)
+            calculateClusterPairIxnImpl<PeriodicPerAtom, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        else if (periodicType == PeriodicPerInteraction)
+            calculateClusterPairIxnImpl<PeriodicPerInteraction, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+        else if (periodicType == PeriodicTriclinic)
+            calculateClusterPairIxnImpl<PeriodicTriclinic, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
+    }
+    else if (periodicType == NoPeriodic)
         calculateBlockIxnImpl<NoPeriodic, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
     else if (periodicType == PeriodicPerAtom)
         calculateBlockIxnImpl<PeriodicPerAtom, BLOCK_TYPE>(blockIndex, forces, totalEnergy, boxSize, invBoxSize, blockCenter);
@@ -177,16 +294,58 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnHandler(int blockIndex, float
 }
 
 template<typename FVEC>
-template <int PERIODIC_TYPE, BlockType BLOCK_TYPE>
-void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnImpl(int blockIndex, float* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
-    // Load the positions and parameters of the atoms in the block.
+void CpuNonbondedForceFvec<FVEC>::neighborListChanged() {
+    if (useClusterPairs) {
+        blockClusterPairs.resize(neighborList->getNumBlocks());
+        clusterPairsValid.assign(neighborList->getNumBlocks(), 0);
+    }
+}
+
+template<typename FVEC>
+void CpuNonbondedForceFvec<FVEC>::buildClusterPairs(int blockIndex) {
+    // Group the neighbors by the cluster they belong to.  A pair starts with every interaction
+    // skipped, and each neighbor enables the ones its exclusion mask allows.
+
+    const auto& neighbors = neighborList->getBlockSortedNeighbors(blockIndex);
+    const auto& exclusions = neighborList->getBlockExclusions(blockIndex);
+    std::vector<ClusterPair>& pairs = blockClusterPairs[blockIndex];
+    std::map<int, int> pairIndex;
+    pairs.clear();
+    for (int k = 0; k < (int) neighbors.size(); k++) {
+        int cluster = neighbors[k]/blockSize;
+        int indexInCluster = neighbors[k]-cluster*blockSize;
+        auto pair = pairIndex.find(cluster);
+        if (pair == pairIndex.end()) {
+            pair = pairIndex.insert(std::make_pair(cluster, (int) pairs.size())).first;
+            ClusterPair newPair;
+            newPair.cluster = cluster;
+            for (int i = 0; i < blockSize; i++)
+                newPair.exclusions[i] = (1<<blockSize)-1;
+            pairs.push_back(newPair);
+        }
+        ClusterPair& clusterPair = pairs[pair->second];
+        for (int i = 0; i < blockSize; i++)
+            if ((exclusions[k] & (1<<i)) == 0)
+                clusterPair.exclusions[i] &= ~(1<<indexInCluster);
+    }
+    clusterPairsValid[blockIndex] = 1;
+}
 
-    const int32_t* blockAtom = &neighborList->getSortedAtoms()[blockSize * blockIndex];
+template<typename FVEC>
+template <int PERIODIC_TYPE, BlockType BLOCK_TYPE, typename ACCUM>
+void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnImpl(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+    // Load the positions and parameters of the atoms in the block.  All per-atom data is stored in the
+    // neighbor list's sorted order, so the block atoms are contiguous.
+
+    const int firstAtom = blockSize*blockIndex;
+    const float* posq = &sortedPosq[0];
+    const std::pair<float, float>* atomParameters = &sortedAtomParameters[0];
+    const float* C6params = (ljpme ? &sortedC6params[0] : NULL);
     fvec4 blockAtomPosq[blockSize];
     FVEC blockAtomForceX(0.0f), blockAtomForceY(0.0f), blockAtomForceZ(0.0f);
     FVEC blockAtomX, blockAtomY, blockAtomZ, blockAtomCharge;
     for (int i = 0; i < blockSize; i++) {
-        blockAtomPosq[i] = fvec4(posq+4*blockAtom[i]);
+        blockAtomPosq[i] = fvec4(posq+4*(firstAtom+i));
         if (PERIODIC_TYPE == PeriodicPerAtom)
             blockAtomPosq[i] -= floor((blockAtomPosq[i]-blockCenter)*invBoxSize+0.5f)*boxSize; // :TODO: Apply one to blockAtom?
     }
@@ -200,23 +359,32 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnImpl(int blockIndex, float* f
     FVEC blockAtomEpsilon = {};
     for (int i=0; i<blockSize; ++i)
     {
-        ((float*)&blockAtomSigma)[i] = atomParameters[blockAtom[i]].first;
-        ((float*)&blockAtomEpsilon)[i] = atomParameters[blockAtom[i]].second;
+        ((float*)&blockAtomSigma)[i] = atomParameters[firstAtom+i].first;
+        ((float*)&blockAtomEpsilon)[i] = atomParameters[firstAtom+i].second;
     }
 
-    // Ewald needs C6 data gathered from a table. Unused variable for non-ewald.
-    const FVEC C6s = (BLOCK_TYPE == BlockType::EWALD) ? FVEC(C6params, blockAtom) : FVEC();
+    // LJPME needs the C6 parameters of the block atoms. Unused variable otherwise.
+    const FVEC C6s = (BLOCK_TYPE == BlockType::EWALD && ljpme) ? FVEC(C6params+firstAtom) : FVEC();
 
     const bool needPeriodic = (PERIODIC_TYPE == PeriodicPerInteraction || PERIODIC_TYPE == PeriodicTriclinic);
     const float invSwitchingInterval = 1/(cutoffDistance-switchingDistance);
     const FVEC cutoffDistanceSquared = cutoffDistance * cutoffDistance;
 
     // Loop over neighbors for this block.
-    const auto& neighbors = neighborList->getBlockNeighbors(blockIndex);
+    const auto& neighbors = neighborList->getBlockSortedNeighbors(blockIndex);
     const auto& exclusions = neighborList->getBlockExclusions(blockIndex);
     FVEC partialEnergy = {};
+    const bool mixedPrecision = std::is_same<ACCUM, double>::value;
 
     for (int i = 0; i < (int) neighbors.size(); i++) {
+        // In mixed precision, periodically move the block atom forces into the double precision
+        // accumulator so that only a few terms are ever summed in single precision.
+
+        if (mixedPrecision && i > 0 && i%mixedPrecisionFlushInterval == 0) {
+            addBlockForces(forces+4*firstAtom, blockAtomForceX, blockAtomForceY, blockAtomForceZ);
+            blockAtomForceX = blockAtomForceY = blockAtomForceZ = 0.0f;
+        }
+
         // Load the next neighbor.
         
         int atom = neighbors[i];
@@ -297,7 +465,10 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnImpl(int blockIndex, float* f
             }
             energy = blendZero(energy, include);
 
-            partialEnergy += energy;
+            if (mixedPrecision)
+                *totalEnergy += reduceAdd(energy);
+            else
+                partialEnergy += energy;
         }
 
         // Accumulate forces.
@@ -309,19 +480,174 @@ void CpuNonbondedForceFvec<FVEC>::calculateBlockIxnImpl(int blockIndex, float* f
         blockAtomForceY += fy;
         blockAtomForceZ += fz;
 
-        float* const atomForce = forces+4*atom;
-        const fvec4 newAtomForce = fvec4(atomForce) - reduceToVec3(fx, fy, fz);
-        newAtomForce.store(atomForce);
+        addToForce(forces+4*atom, -reduceToVec3(fx, fy, fz));
     }
     
+    if (totalEnergy && !mixedPrecision)
+        *totalEnergy += reduceAdd(partialEnergy);
+
+    // Record the forces on the block atoms.
+    addBlockForces(forces+4*firstAtom, blockAtomForceX, blockAtomForceY, blockAtomForceZ);
+}
+
+template<typename FVEC>
+template <int PERIODIC_TYPE, BlockType BLOCK_TYPE, typename ACCUM>
+void CpuNonbondedForceFvec<FVEC>::calculateClusterPairIxnImpl(int blockIndex, ACCUM* forces, double* totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize, const fvec4& blockCenter) {
+    if (!clusterPairsValid[blockIndex])
+        buildClusterPairs(blockIndex);
+
+    // Load the positions and parameters of the atoms in the block.  Each one is used as a scalar
+    // against all atoms of a cluster.
+
+    const int firstAtom = blockSize*blockIndex;
+    const float* posq = &sortedPosq[0];
+    const std::pair<float, float>* atomParameters = &sortedAtomParameters[0];
+    const float* C6params = (ljpme ? &sortedC6params[0] : NULL);
+    fvec4 blockAtomPos[blockSize];
+    float blockAtomCharge[blockSize], blockAtomSigma[blockSize], blockAtomEpsilon[blockSize], blockAtomC6[blockSize];
+    FVEC blockAtomForceX[blockSize], blockAtomForceY[blockSize], blockAtomForceZ[blockSize];
+    for (int i = 0; i < blockSize; i++) {
+        blockAtomPos[i] = fvec4(posq+4*(firstAtom+i));
+        if (PERIODIC_TYPE == PeriodicPerAtom)
+            blockAtomPos[i] -= floor((blockAtomPos[i]-blockCenter)*invBoxSize+0.5f)*boxSize;
+        blockAtomCharge[i] = ONE_4PI_EPS0*posq[4*(firstAtom+i)+3];
+        blockAtomSigma[i] = atomParameters[firstAtom+i].first;
+        blockAtomEpsilon[i] = atomParameters[firstAtom+i].second;
+        blockAtomC6[i] = (C6params == NULL ? 0.0f : C6params[firstAtom+i]);
+        blockAtomForceX[i] = 0.0f;
+        blockAtomForceY[i] = 0.0f;
+        blockAtomForceZ[i] = 0.0f;
+    }
+    const float invSwitchingInterval = 1/(cutoffDistance-switchingDistance);
+    const FVEC cutoffDistanceSquared = cutoffDistance * cutoffDistance;
+    FVEC partialEnergy = {};
+    const bool mixedPrecision = std::is_same<ACCUM, double>::value;
+
+    // Loop over the clusters this block interacts with.
+
+    for (const ClusterPair& pair : blockClusterPairs[blockIndex]) {
+        // Load the cluster.
+
+        const int firstClusterAtom = blockSize*pair.cluster;
+        fvec4 clusterPosq[blockSize];
+        for (int j = 0; j < blockSize; j++)
+            clusterPosq[j] = fvec4(posq+4*(firstClusterAtom+j));
+        FVEC x, y, z, charge;
+        transpose(clusterPosq, x, y, z, charge);
+        if (PERIODIC_TYPE == PeriodicPerAtom) {
+            x -= floor((x-blockCenter[0])*invBoxSize[0]+0.5f)*boxSize[0];
+            y -= floor((y-blockCenter[1])*invBoxSize[1]+0.5f)*boxSize[1];
+            z -= floor((z-blockCenter[2])*invBoxSize[2]+0.5f)*boxSize[2];
+        }
+        FVEC clusterSigma, clusterEpsilon;
+        for (int j = 0; j < blockSize; j++) {
+            ((float*)&clusterSigma)[j] = atomParameters[firstClusterAtom+j].first;
+            ((float*)&clusterEpsilon)[j] = atomParameters[firstClusterAtom+j].second;
+        }
+        const FVEC clusterC6 = (BLOCK_TYPE == BlockType::EWALD && ljpme) ? FVEC(C6params+firstClusterAtom) : FVEC();
+        FVEC clusterForceX(0.0f), clusterForceY(0.0f), clusterForceZ(0.0f);
+
+        // Compute the interactions of each block atom with the whole cluster.
+
+        for (int i = 0; i < blockSize; i++) {
+            const auto exclNotMask = FVEC::expandBitsToMask(~pair.exclusions[i]);
+            FVEC dx, dy, dz, r2;
+            getDeltaR<PERIODIC_TYPE>(blockAtomPos[i], x, y, z, dx, dy, dz, r2, boxSize, invBoxSize);
+            const auto include = blendZero(r2 < cutoffDistanceSquared, exclNotMask);
+            if (!any(include))
+                continue;
+            const auto inverseR = rsqrt(r2);
+            const auto r = r2*inverseR;
+            FVEC energy, dEdR;
+            if (blockAtomEpsilon[i] != 0.0f) {
+                const auto sig = clusterSigma+blockAtomSigma[i];
+                const auto sig2 = (inverseR*sig)*(inverseR*sig);
+                const auto sig6 = sig2*sig2*sig2;
+                const auto eps = clusterEpsilon*blockAtomEpsilon[i];
+                const auto epsSig6 = eps*sig6;
+                dEdR = epsSig6*(12.0f*sig6 - 6.0f);
+                energy = epsSig6*(sig6-1.0f);
+                if (useSwitch) {
+                    const auto t = blendZero((r-switchingDistance)*invSwitchingInterval, r>switchingDistance);
+                    const auto switchValue = 1+t*t*t*(-10.0f+t*(15.0f-t*6.0f));
+                    const auto switchDeriv = t*t*(-30.0f+t*(60.0f-t*30.0f))*invSwitchingInterval;
+                    dEdR = switchValue*dEdR - energy*switchDeriv*r;
+                    energy *= switchValue;
+                }
+                if (BLOCK_TYPE == BlockType::EWALD && ljpme) {
+                    const auto C6ij = clusterC6*blockAtomC6[i];
+                    const auto inverseR2 = inverseR*inverseR;
+                    const auto mysig2 = sig*sig;
+                    const auto mysig6 = mysig2*mysig2*mysig2;
+                    const auto emult = C6ij*inverseR2*inverseR2*inverseR2*approximateFunctionFromTable(exptermsTable, r, FVEC(exptermsDXInv));
+                    const auto potentialShift = eps*(1.0f-mysig6*inverseRcut6)*mysig6*inverseRcut6 - C6ij*inverseRcut6Expterm;
+                    dEdR += 6.0f*C6ij*inverseR2*inverseR2*inverseR2*approximateFunctionFromTable(dExptermsTable, r, FVEC(exptermsDXInv));
+                    energy += emult + potentialShift;
+                }
+            }
+            else {
+                energy = 0.0f;
+                dEdR = 0.0f;
+            }
+            const auto chargeProd = charge*blockAtomCharge[i];
+            if (BLOCK_TYPE == BlockType::EWALD)
+                dEdR += chargeProd*inverseR*approximateFunctionFromTable(ewaldScaleTable, r, FVEC(ewaldDXInv));
+            else if (cutoff)
+                dEdR += chargeProd*(inverseR-2.0f*krf*r2);
+            else
+                dEdR += chargeProd*inverseR;
+            dEdR *= inverseR*inverseR;
+            if (totalEnergy) {
+                if (BLOCK_TYPE == BlockType::EWALD)
+                    energy += chargeProd*inverseR*approximateFunctionFromTable(erfcTable, alphaEwald*r, FVEC(erfcDXInv));
+                else if (cutoff)
+                    energy += chargeProd*(inverseR+krf*r2-crf);
+                else
+                    energy += chargeProd*inverseR;
+                partialEnergy += blendZero(energy, include);
+            }
+
+            // Accumulate forces.  The cluster's forces stay in registers until all block atoms are done.
+
+            dEdR = blendZero(dEdR, include);
+            const auto fx = dx*dEdR;
+            const auto fy = dy*dEdR;
+            const auto fz = dz*dEdR;
+            clusterForceX += fx;
+            clusterForceY += fy;
+            clusterForceZ += fz;
+            blockAtomForceX[i] += fx;
+            blockAtomForceY[i] += fy;
+            blockAtomForceZ[i] += fz;
+        }
+
+        // Record the forces on the cluster.
+
+        fvec4 f[blockSize];
+        transpose(clusterForceX, clusterForceY, clusterForceZ, 0.0f, f);
+        for (int j = 0; j < blockSize; j++)
+            addToForce(forces+4*(firstClusterAtom+j), f[j]);
+
+        // In mixed precision, move everything into the double precision accumulators after each
+        // cluster so that only a few terms are ever summed in single precision.
+
+        if (mixedPrecision) {
+            if (totalEnergy)
+                *totalEnergy += reduceAdd(partialEnergy);
+            partialEnergy = 0.0f;
+            for (int i = 0; i < blockSize; i++) {
+                addToForce(forces+4*(firstAtom+i), -reduceToVec3(blockAtomForceX[i], blockAtomForceY[i], blockAtomForceZ[i]));
+                blockAtomForceX[i] = blockAtomForceY[i] = blockAtomForceZ[i] = 0.0f;
+            }
+        }
+    }
     if (totalEnergy)
         *totalEnergy += reduceAdd(partialEnergy);
 
     // Record the forces on the block atoms.
-    fvec4 f[blockSize];
-    transpose(blockAtomForceX, blockAtomForceY, blockAtomForceZ, 0.0f, f);
-    for (int j = 0; j < blockSize; j++)
-        (fvec4(forces+4*blockAtom[j])+f[j]).store(forces+4*blockAtom[j]);
+
+    for (int i = 0; i < blockSize; i++)
+        addToForce(forces+4*(firstAtom+i), -reduceToVec3(blockAtomForceX[i], blockAtomForceY[i], blockAtomForceZ[i]));
 }
 
 template<typename FVEC>
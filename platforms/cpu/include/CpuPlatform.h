@@ -39,7 +39,11 @@
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/internal/ThreadPool.h"
 #include "windowsExportCpu.h"
+#include <condition_variable>
+#include <exception>
 #include <map>
+#include <mutex>
+#include <thread>
 
 namespace OpenMM {
     
@@ -50,6 +54,7 @@ namespace OpenMM {
 class OPENMM_EXPORT_CPU CpuPlatform : public ReferencePlatform {
 public:
     class PlatformData;
+    class PlatformSettings;
     CpuPlatform();
     const std::string& getName() const {
         static const std::string name = "CPU";
@@ -69,14 +74,152 @@ public:
         return key;
     }
     /**
-     * This is the name of the parameter for requesting that force computations be deterministic.  Setting
-     * this to "true" DOES NOT GUARANTEE that the forces will actually be fully deterministic, but it does
-     * try to reduce the variation in them at the cost of a small loss in performance.
+     * This is the name of the parameter for requesting that force computations be deterministic.  When it
+     * is "true", the forces and energies from NonbondedForce, HarmonicBondForce, HarmonicAngleForce,
+     * PeriodicTorsionForce, RBTorsionForce, and the custom bonded forces are bitwise identical no matter how
+     * many threads are used: force contributions are summed as 64 bit fixed point values, and energies are
+     * summed in a fixed order.  Other forces are not guaranteed to be fully deterministic, but the variation
+     * in them is reduced.  This costs a small loss in performance.
      */
     static const std::string& CpuDeterministicForces() {
         static const std::string key = "DeterministicForces";
         return key;
     }
+    /**
+     * This is the name of the parameter for requesting that independent bonded forces be computed
+     * concurrently.  When this is "true", the standard bonded forces (harmonic bonds and angles, periodic
+     * and RB torsions) are not computed immediately.  Instead they are queued as tasks that run together
+     * on the thread pool, each thread accumulating into its own buffer, and the buffers are merged once at
+     * the end of the force calculation.  This is ignored if DeterministicForces is "true".
+     */
+    static const std::string& CpuConcurrentForces() {
+        static const std::string key = "ConcurrentForces";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for binding worker threads to CPU cores.  The value may be "none"
+     * (the default) to let the operating system schedule threads freely, "compact" to fill the cores of
+     * each NUMA node in turn, "scatter" to distribute threads round robin between NUMA nodes, or a comma
+     * separated list of core indices.  Only cores the process is allowed to run on are used, and if threads
+     * cannot be bound the value reported for the Context is "none".  When threads are bound, each one allocates
+     * its own force buffer so that the memory is placed on its own NUMA node, and each one computes nonbonded
+     * interactions for a fixed range of atoms so the data it uses stays there.
+     */
+    static const std::string& CpuThreadAffinity() {
+        static const std::string key = "ThreadAffinity";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting the algorithm used for nonbonded interactions in
+     * the neighbor list.  The value may be "Block" (the default) to loop over the neighbors of each block
+     * of atoms one at a time, or "ClusterPair" to process pairs of atom clusters, loading and storing the
+     * data for each neighboring cluster once.  Either one uses the widest vector instructions available.
+     */
+    static const std::string& CpuNonbondedKernel() {
+        static const std::string key = "NonbondedKernel";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for selecting the precision used to compute forces.  The value may be
+     * "single" (the default), "mixed", or "double".  In mixed mode NonbondedForce still computes each interaction in
+     * single precision, but its forces and energies are accumulated in double precision all the way to the total, and
+     * the per-thread force arrays of the other kernels are summed in double precision.  In double mode NonbondedForce
+     * also computes every interaction and reciprocal space in double precision, and the other forces that are normally
+     * computed in single precision (custom nonbonded, GBSA, CustomGB, many particle and Gay-Berne forces) use the
+     * reference implementations.  When DeterministicForces is set, NonbondedForce accumulates forces in fixed point.
+     */
+    static const std::string& CpuPrecision() {
+        static const std::string key = "Precision";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for sharing worker threads between Contexts.  When it is "true", the
+     * Context runs on a ThreadPool that is shared by every Context in the process that sets this property and
+     * uses the same number of threads, as well as by the CPU PME kernels, instead of creating its own.  This
+     * avoids oversubscribing the cores when several simulations run in one process.  Each Context waits its
+     * turn to use the pool, so their computations are interleaved rather than run at the same time.  Setting
+     * ThreadAffinity for one Context affects all of them.  It is ignored if PmeThreads or ConcurrentNeighborList
+     * is set, since a Context then uses two pools at once.
+     */
+    static const std::string& CpuSharedThreadPool() {
+        static const std::string key = "SharedThreadPool";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for dedicating some of the threads to the reciprocal space part of PME.
+     * If it is "0" (the default), reciprocal space is computed after direct space, using all the threads.  If it is
+     * a positive number, that many of the threads specified by the Threads property are placed in a separate
+     * ThreadPool that computes reciprocal space while the others compute direct space, so the two run on disjoint
+     * cores at the same time.  It must be less than the total number of threads.  This only affects the optimized
+     * PME implementation, which requires the CPU PME plugin.
+     */
+    static const std::string& CpuPmeThreads() {
+        static const std::string key = "PmeThreads";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for automatically tuning PME.  If it is "true", the first steps of a
+     * simulation are used to time several choices of Ewald alpha, PME grid size, and neighbor list padding, and
+     * the fastest one is kept for the rest of the simulation.  A coarser grid is always paired with a smaller alpha,
+     * so every choice has the same estimated error as the default one, and the cutoff is never changed.  Only the
+     * padding is tuned if the PME parameters were set explicitly, and the padding is left to AdaptivePadding if
+     * that is also set.
+     * Tuning is disabled when DeterministicForces is set.  The default value is "false".
+     */
+    static const std::string& CpuPmeTuning() {
+        static const std::string key = "PmeTuning";
+        return key;
+    }
+    /**
+     * This is the name of a read-only value reporting the parameters currently used for PME, in the form
+     * "alpha=<alpha> grid=<nx>x<ny>x<nz> padding=<padding>".  When PmeTuning is enabled, it reports the
+     * choice made by the tuner once it finishes.  It is empty if no NonbondedForce uses PME.
+     */
+    static const std::string& CpuPmeParameters() {
+        static const std::string key = "PmeParameters";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for adapting the neighbor list padding to the simulation.  If it is "true",
+     * the platform records how long it takes to build the neighbor list, how many steps pass between rebuilds,
+     * and how long it takes to process the list.  Each time the list is rebuilt, it picks the padding that
+     * minimizes the total time per step, so the padding follows changes in the time step or temperature.  The
+     * default value is "false", which uses a fixed padding.
+     */
+    static const std::string& CpuAdaptivePadding() {
+        static const std::string key = "AdaptivePadding";
+        return key;
+    }
+    /**
+     * This is the name of the parameter for building the neighbor list concurrently with other work.  If it is
+     * "true", the neighbor list is built by a background thread with its own pool of worker threads, while the
+     * Context's ThreadPool computes the forces that do not need the list, such as bonded forces and PME reciprocal
+     * space.  The builder's threads are taken from the ones specified by the Threads property, one for every four
+     * that are not used for PME (and at least one), and they are bound to the cores after the others when
+     * ThreadAffinity is set.  They sleep between builds.  Kernels that use the list wait for it just before they
+     * need it.  This is ignored if only one thread is available, and SharedThreadPool is ignored if this is set.
+     * The default value is "false".
+     */
+    static const std::string& CpuConcurrentNeighborList() {
+        static const std::string key = "ConcurrentNeighborList";
+        return key;
+    }
+    /**
+     * This is the name of a read-only value reporting how far beyond the cutoff the neighbor list currently
+     * extends, in nm.  It is empty until the neighbor list has been built.
+     */
+    static const std::string& CpuNeighborListPadding() {
+        static const std::string key = "NeighborListPadding";
+        return key;
+    }
+    /**
+     * This is the name of a read-only value reporting how many times the neighbor list has been rebuilt.
+     * It can be queried with getPropertyValue(), but it cannot be set when creating a Context.
+     */
+    static const std::string& CpuNeighborListRebuilds() {
+        static const std::string key = "NeighborListRebuilds";
+        return key;
+    }
     /**
      * We cannot use the standard mechanism for platform data, because that is already used by the superclass.
      * Instead, we maintain a table of ContextImpls to PlatformDatas.
@@ -84,26 +227,150 @@ public:
     static PlatformData& getPlatformData(ContextImpl& context);
     static const PlatformData& getPlatformData(const ContextImpl& context);
 private:
+    /**
+     * Parse the properties a Context was created with, using the default value of any that were not specified.
+     */
+    PlatformSettings parseSettings(const std::map<std::string, std::string>& properties) const;
     static std::map<const ContextImpl*, PlatformData*> contextData;
 };
 
+/**
+ * The options selected by the properties of a Context.  Values that depend on each other have already been
+ * reconciled, so for example concurrentForces is false if deterministicForces is true.
+ */
+class CpuPlatform::PlatformSettings {
+public:
+    PlatformSettings() : numThreads(0), numPmeThreads(0), numNeighborListThreads(0), deterministicForces(false), concurrentForces(false), useClusterPairs(false),
+            useSharedThreadPool(false), tunePme(false), adaptivePadding(false), concurrentNeighborList(false), threadAffinity("none"), precision("single") {
+    }
+    /**
+     * The total number of threads, including the numPmeThreads used for PME reciprocal space and the
+     * numNeighborListThreads used to build the neighbor list.  If this is not positive, the ThreadPool picks a default.
+     */
+    int numThreads;
+    int numPmeThreads, numNeighborListThreads;
+    bool deterministicForces, concurrentForces, useClusterPairs, useSharedThreadPool, tunePme, adaptivePadding, concurrentNeighborList;
+    std::string threadAffinity, precision;
+};
+
 class CpuPlatform::PlatformData {
 public:
-    PlatformData(int numParticles, int numThreads, bool deterministicForces);
+    PlatformData(int numParticles, const PlatformSettings& settings);
     ~PlatformData();
     void requestNeighborList(double cutoffDistance, double padding, bool useExclusions, const std::vector<std::set<int> >& exclusionList);
     int requestPosqIndex();
+    /**
+     * Change how far beyond the cutoff the neighbor list extends.  The list is rebuilt the next time
+     * forces are computed.
+     */
+    void setNeighborListPadding(double padding);
+    /**
+     * Build the neighbor list for the positions currently in posq.  If concurrentNeighborList is set, this only
+     * starts the build, which continues in the background.  waitForNeighborList() must be called before the list
+     * is used.
+     */
+    void buildNeighborList(int numParticles, const Vec3* boxVectors);
+    /**
+     * Wait until the neighbor list started by buildNeighborList() is complete.  If building it threw an
+     * exception, this rethrows it.
+     */
+    void waitForNeighborList();
+    /**
+     * This is the body of neighborListBuilder.  It waits for buildNeighborList() to request a build, and runs it.
+     */
+    void runNeighborListBuilder();
+    /**
+     * Record that forces have been added to the per-thread force arrays without recording which blocks
+     * were touched in threadForceBlockUsed.  Every block of every array will then be summed at the end
+     * of the force computation.
+     */
+    void markAllForceBlocksUsed() {
+        allForceBlocksUsed = true;
+    }
+    /**
+     * The per-thread force arrays are summed in blocks of this many atoms.  Only blocks that
+     * a thread has marked as used in threadForceBlockUsed are read when summing them.
+     *
+     * Any kernel that adds forces to threadForce, threadForceFixed, or threadForceDouble must therefore
+     * either set the flag in threadForceBlockUsed for every block it touches, or call markAllForceBlocksUsed()
+     * each time it computes forces.  Forces in blocks that are not marked are silently lost.  In debug builds,
+     * finishComputation() asserts that every block it skips is zero.
+     */
+    static const int ForceBlockSize = 64;
+    /**
+     * The per-thread force arrays are created with AlignedArray::resizeZeroed(), so memory is only assigned
+     * to the parts a thread writes to.  When a thread has not used any block in a group of this many blocks
+     * (one page of threadForce) for ForceReleaseSteps computations, that part of its arrays is released again.
+     */
+    static const int ForceReleaseBlocks = 4;
+    static const int ForceReleaseSteps = 20;
     AlignedArray<float> posq;
     std::vector<AlignedArray<float> > threadForce;
-    ThreadPool threads;
+    /**
+     * When deterministicForces is set, kernels that support it add their forces to these arrays
+     * in fixed point (see CpuFixedPoint.h) instead of to threadForce.  They use the same layout as
+     * threadForce and are tracked by the same threadForceBlockUsed flags.
+     */
+    std::vector<AlignedArray<long long> > threadForceFixed;
+    /**
+     * When the precision is "mixed" or "double" (and deterministicForces is not set), kernels that support it add
+     * their forces to these arrays instead of to threadForce.  They are laid out and tracked the same way.
+     * They are also created when concurrentForces is set, since the bonded forces in deferredForceTasks
+     * are added to them.
+     */
+    std::vector<AlignedArray<double> > threadForceDouble;
+    std::vector<std::vector<char> > threadForceBlockUsed;
+    /**
+     * For each thread and group of ForceReleaseBlocks blocks, the number of computations since the thread
+     * last used a block in the group.  It is ForceReleaseSteps once that part of the arrays has been released.
+     */
+    std::vector<std::vector<unsigned char> > threadForceGroupIdle;
+    std::shared_ptr<ThreadPool> threadPool;
+    ThreadPool& threads;
+    /**
+     * The ThreadPool used for PME reciprocal space.  Unless the PmeThreads property was set, this is the
+     * same as threadPool.
+     */
+    std::shared_ptr<ThreadPool> pmeThreadPool;
     bool isPeriodic;
+    /**
+     * Whether the worker threads were bound to cores by the ThreadAffinity property.
+     */
+    bool threadsBound;
     CpuRandom random;
     std::map<std::string, std::string> propertyValues;
+    std::string precision;
     CpuNeighborList* neighborList;
     double cutoff, paddedCutoff;
-    bool anyExclusions, deterministicForces;
-    int currentPosqIndex, nextPosqIndex;
+    /**
+     * The time spent processing pairs from the neighbor list since it was last built.  Kernels that use the
+     * list add to this, so the padding can be adapted when adaptivePadding is set.
+     */
+    double neighborListPairTime;
+    /**
+     * The time it took to build the neighbor list the last time it was built.
+     */
+    double neighborListBuildTime;
+    /**
+     * When concurrentNeighborList is set, the list is built by neighborListBuilder, a thread that lasts as long as
+     * the Context and runs each build on neighborListThreadPool.  It works from its own copy of the positions,
+     * since other kernels modify posq while it runs.
+     */
+    std::thread neighborListBuilder;
+    std::shared_ptr<ThreadPool> neighborListThreadPool;
+    std::mutex neighborListLock;
+    std::condition_variable neighborListCondition;
+    bool neighborListBuildPending, neighborListBuilderExit;
+    int neighborListNumParticles;
+    float neighborListMaxDistance;
+    std::exception_ptr neighborListException;
+    AlignedArray<float> neighborListPosq;
+    Vec3 neighborListBoxVectors[3];
+    bool anyExclusions, deterministicForces, concurrentForces, useClusterPairs, tunePme, adaptivePadding, concurrentNeighborList, allForceBlocksUsed, forcesPending, neighborListOutdated;
+    int currentPosqIndex, nextPosqIndex, neighborListRebuilds;
     std::vector<std::set<int> > exclusions;
+    ThreadPool::TaskGraph deferredForceTasks;
+    std::vector<double> threadDeferredEnergy;
 };
 
 } // namespace OpenMM
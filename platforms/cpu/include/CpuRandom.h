@@ -48,9 +48,36 @@ public:
     void initialize(int seed, int numThreads);
     float getGaussianRandom(int threadIndex);
     float getUniformRandom(int threadIndex);
+    /**
+     * Generate Gaussian random numbers with a counter-based (Philox4x32-10) generator.  The values depend
+     * only on the seed, the step, and the index, so they do not depend on which thread generates them or how
+     * many threads there are.  This may be called from multiple threads at once.
+     *
+     * @param step    the step to generate values for, typically a value returned by nextStep()
+     * @param start   the first index to generate values for
+     * @param end     one past the last index to generate values for
+     * @param values  on exit, holds 4*(end-start) values, four for each index
+     */
+    void getGaussianRandoms(long long step, int start, int end, float* values) const;
+    /**
+     * Get the step to pass to getGaussianRandoms() for the next set of values, and advance the counter.  The
+     * counter starts at 0 and only ever increases, independent of the integrator's step count, so setting the
+     * step count back does not repeat earlier noise.
+     */
+    long long nextStep();
+    /**
+     * Get the value nextStep() will return next.  This is saved in checkpoints.
+     */
+    long long getStepCounter() const;
+    /**
+     * Set the value nextStep() will return next, when loading a checkpoint.
+     */
+    void setStepCounter(long long step);
 private:
     bool hasInitialized;
     int randomSeed;
+    unsigned int counterSeed;
+    long long stepCounter;
     std::vector<OpenMM_SFMT::SFMT*> threadRandom;
     std::vector<float> nextGaussian;
     std::vector<int> nextGaussianIsValid;
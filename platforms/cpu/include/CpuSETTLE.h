@@ -42,9 +42,16 @@ namespace OpenMM {
 
 /**
  * This class uses multiple ReferenceSETTLEAlgorithm objects to execute the algorithm in parallel.
+ * Each block stores its clusters in structure-of-arrays form and solves LanesPerGroup of them at
+ * once, so the arithmetic for a group of waters can be vectorized.
  */
 class OPENMM_EXPORT_CPU CpuSETTLE : public ReferenceConstraintAlgorithm {
 public:
+    class Block;
+    /**
+     * The number of clusters processed together by a block.
+     */
+    static const int LanesPerGroup;
     CpuSETTLE(const System& system, const ReferenceSETTLEAlgorithm& settle, ThreadPool& threads);
     ~CpuSETTLE();
 
@@ -67,6 +74,21 @@ public:
      * @param tolerance        the constraint tolerance
      */
     void applyToVelocities(std::vector<OpenMM::Vec3>& atomCoordinates, std::vector<OpenMM::Vec3>& velocities, std::vector<double>& inverseMasses, double tolerance);
+
+    /**
+     * Get the number of blocks the clusters are divided into.  Each block can be processed
+     * independently of all others.
+     */
+    int getNumBlocks() const {
+        return threadSettle.size();
+    }
+
+    /**
+     * Get the algorithm object that processes one block of clusters.
+     */
+    ReferenceSETTLEAlgorithm& getBlock(int index) {
+        return *threadSettle[index];
+    }
 private:
     std::vector<ReferenceSETTLEAlgorithm*> threadSettle;
     ThreadPool& threads;
@@ -30,15 +30,18 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuBondForce.h"
+#include "CpuFixedPoint.h"
 #include "openmm/OpenMMException.h"
 
 using namespace OpenMM;
 using namespace std;
 
-CpuBondForce::CpuBondForce() {
+CpuBondForce::CpuBondForce() : deterministic(false) {
 }
 
-void CpuBondForce::initialize(int numAtoms, int numBonds, int numAtomsPerBond, vector<vector<int> >& bondAtoms, ThreadPool& threads) {
+void CpuBondForce::initialize(int numAtoms, int numBonds, int numAtomsPerBond, vector<vector<int> >& bondAtoms, ThreadPool& threads, bool deterministic) {
+    this->numAtoms = numAtoms;
+    this->deterministic = deterministic;
     this->numBonds = numBonds;
     this->numAtomsPerBond = numAtomsPerBond;
     this->bondAtoms = bondAtoms.empty() ? nullptr : bondAtoms.data();
@@ -166,6 +169,11 @@ void CpuBondForce::assignBond(int bond, int thread, vector<int>& atomThread, vec
 
 void CpuBondForce::calculateForce(vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters, vector<Vec3>& forces, 
         double* totalEnergy, ReferenceBondIxn& referenceBondIxn) {
+    if (deterministic) {
+        calculateDeterministicForce(atomCoordinates, parameters, forces, totalEnergy, referenceBondIxn);
+        return;
+    }
+
     // Have the worker threads compute their forces.
     
     vector<double> threadEnergy(threads->getNumThreads(), 0);
@@ -189,6 +197,92 @@ void CpuBondForce::calculateForce(vector<Vec3>& atomCoordinates, vector<vector<d
             *totalEnergy += threadEnergy[i];
 }
 
+void CpuBondForce::calculateDeterministicForce(vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters, vector<Vec3>& forces,
+        double* totalEnergy, ReferenceBondIxn& referenceBondIxn) {
+    // Each bond's forces are converted to fixed point before being summed, and each bond's energy is
+    // recorded separately, so the result does not depend on how bonds were divided between threads.
+
+    int numThreads = threads->getNumThreads();
+    fixedForces.resize(3*numAtoms, 0);
+    threadScratchForces.resize(numThreads);
+    if (totalEnergy != NULL)
+        bondEnergy.resize(numBonds);
+    threads->execute([&] (ThreadPool& threads, int threadIndex) {
+        threadScratchForces[threadIndex].resize(numAtoms);
+        computeDeterministicBonds(threadBonds[threadIndex], threadIndex, atomCoordinates, parameters, totalEnergy != NULL, referenceBondIxn);
+    });
+    threads->waitForThreads();
+    computeDeterministicBonds(extraBonds, 0, atomCoordinates, parameters, totalEnergy != NULL, referenceBondIxn);
+
+    // Convert the sums back to floating point.
+
+    threads->execute([&] (ThreadPool& threads, int threadIndex) {
+        int start = threadIndex*numAtoms/threads.getNumThreads();
+        int end = (threadIndex+1)*numAtoms/threads.getNumThreads();
+        for (int i = start; i < end; i++)
+            for (int j = 0; j < 3; j++) {
+                forces[i][j] += fixedPointToReal(fixedForces[3*i+j]);
+                fixedForces[3*i+j] = 0;
+            }
+    });
+    threads->waitForThreads();
+    if (totalEnergy != NULL)
+        for (int i = 0; i < numBonds; i++)
+            *totalEnergy += bondEnergy[i];
+}
+
+void CpuBondForce::computeDeterministicBonds(const vector<int>& bonds, int threadIndex, vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters,
+        bool includeEnergy, ReferenceBondIxn& referenceBondIxn) {
+    vector<Vec3>& scratch = threadScratchForces[threadIndex];
+    for (int bond : bonds) {
+        double energy = 0.0;
+        referenceBondIxn.calculateBondIxn(bondAtoms[bond], atomCoordinates, parameters[bond], scratch, includeEnergy ? &energy : NULL, NULL);
+        for (int atom : bondAtoms[bond]) {
+            for (int j = 0; j < 3; j++)
+                fixedForces[3*atom+j] += realToFixedPoint(scratch[atom][j]);
+            scratch[atom] = Vec3();
+        }
+        if (includeEnergy)
+            bondEnergy[bond] = energy;
+    }
+}
+
+void CpuBondForce::addForceTasks(ThreadPool::TaskGraph& graph, vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters,
+            vector<AlignedArray<double> >& threadForces, vector<vector<char> >& blockUsed, int blockSize, vector<double>* threadEnergy,
+            shared_ptr<ReferenceBondIxn> referenceBondIxn) {
+    // Create one task for each set of bonds, plus one for the extra bonds.  Each bond is computed on a copy
+    // of just its own atoms, so the only per-atom memory a task touches is the entries it adds forces to.
+
+    for (int set = 0; set <= threadBonds.size(); set++) {
+        if ((set < threadBonds.size() ? threadBonds[set] : extraBonds).size() == 0)
+            continue;
+        graph.addTask([&, set, blockSize, referenceBondIxn, threadEnergy] (ThreadPool& threads, int threadIndex) {
+            const vector<int>& bonds = (set < threadBonds.size() ? threadBonds[set] : extraBonds);
+            double* energy = (threadEnergy == NULL ? NULL : &(*threadEnergy)[threadIndex]);
+            double* forces = &threadForces[threadIndex][0];
+            char* used = &blockUsed[threadIndex][0];
+            vector<int> localAtoms(numAtomsPerBond);
+            vector<Vec3> localCoordinates(numAtomsPerBond), localForces(numAtomsPerBond);
+            for (int i = 0; i < numAtomsPerBond; i++)
+                localAtoms[i] = i;
+            for (int bond : bonds) {
+                const vector<int>& atoms = bondAtoms[bond];
+                for (int i = 0; i < numAtomsPerBond; i++) {
+                    localCoordinates[i] = atomCoordinates[atoms[i]];
+                    localForces[i] = Vec3();
+                }
+                referenceBondIxn->calculateBondIxn(localAtoms, localCoordinates, parameters[bond], localForces, energy, NULL);
+                for (int i = 0; i < numAtomsPerBond; i++) {
+                    int atom = atoms[i];
+                    for (int j = 0; j < 3; j++)
+                        forces[4*atom+j] += localForces[i][j];
+                    used[atom/blockSize] = 1;
+                }
+            }
+        });
+    }
+}
+
 void CpuBondForce::threadComputeForce(ThreadPool& threads, int threadIndex, vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters, vector<Vec3>& forces, 
             double* totalEnergy, ReferenceBondIxn& referenceBondIxn) {
     vector<int>& bonds = threadBonds[threadIndex];
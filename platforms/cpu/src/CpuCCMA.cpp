@@ -0,0 +1,231 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCCMA.h"
+#include <cmath>
+#include <map>
+
+using namespace OpenMM;
+using namespace std;
+
+CpuCCMA::CpuCCMA(const ReferenceCCMAAlgorithm& ccma, ThreadPool& threads, CpuSETTLE* settle) : threads(threads), settle(settle), hasInitializedMasses(false) {
+    numConstraints = ccma.getNumberOfConstraints();
+    maxIterations = ccma.getMaximumNumberOfIterations();
+    atom1.resize(numConstraints);
+    atom2.resize(numConstraints);
+    distance.resize(numConstraints);
+    for (int i = 0; i < numConstraints; i++)
+        ccma.getConstraintParameters(i, atom1[i], atom2[i], distance[i]);
+    reducedMasses.resize(numConstraints);
+    d_ij2.resize(numConstraints);
+    constraintDelta.resize(numConstraints);
+    tempDelta.resize(numConstraints);
+    r_ij.resize(numConstraints);
+    threadConverged.resize(threads.getNumThreads());
+
+    // Store the inverse constraint matrix in compressed row format.
+
+    const vector<vector<pair<int, double> > >& matrix = ccma.getMatrix();
+    for (int i = 0; i < matrix.size(); i++) {
+        matrixRowStart.push_back(matrixValue.size());
+        for (auto& element : matrix[i]) {
+            matrixColIndex.push_back(element.first);
+            matrixValue.push_back(element.second);
+        }
+    }
+    matrixRowStart.push_back(matrixValue.size());
+
+    // Record which constraints involve each atom, so threads can update atoms without conflicting
+    // with each other.  Each atom's constraints are kept in increasing order, so the updates are
+    // applied in exactly the same order as in ReferenceCCMAAlgorithm.
+
+    map<int, vector<int> > atomConstraints;
+    for (int i = 0; i < numConstraints; i++) {
+        atomConstraints[atom1[i]].push_back(i);
+        atomConstraints[atom2[i]].push_back(i);
+    }
+    for (auto& atom : atomConstraints) {
+        constrainedAtoms.push_back(atom.first);
+        atomConstraintStart.push_back(atomConstraintIndex.size());
+        atomConstraintIndex.insert(atomConstraintIndex.end(), atom.second.begin(), atom.second.end());
+    }
+    atomConstraintStart.push_back(atomConstraintIndex.size());
+}
+
+CpuCCMA::~CpuCCMA() {
+    if (settle != NULL)
+        delete settle;
+}
+
+void CpuCCMA::apply(vector<Vec3>& atomCoordinates, vector<Vec3>& atomCoordinatesP, vector<double>& inverseMasses, double tolerance) {
+    applyConstraints(atomCoordinates, atomCoordinatesP, inverseMasses, false, tolerance);
+}
+
+void CpuCCMA::applyToVelocities(vector<Vec3>& atomCoordinates, vector<Vec3>& velocities, vector<double>& inverseMasses, double tolerance) {
+    applyConstraints(atomCoordinates, velocities, inverseMasses, true, tolerance);
+}
+
+void CpuCCMA::applyConstraints(vector<Vec3>& atomCoordinates, vector<Vec3>& atomCoordinatesP,
+                               vector<double>& inverseMasses, bool constrainingVelocities, double tolerance) {
+    if (!hasInitializedMasses) {
+        hasInitializedMasses = true;
+        for (int i = 0; i < numConstraints; i++)
+            reducedMasses[i] = 0.5/(inverseMasses[atom1[i]] + inverseMasses[atom2[i]]);
+    }
+
+    // Record the parameters for the threads.
+
+    this->atomCoordinates = &atomCoordinates;
+    this->atomCoordinatesP = &atomCoordinatesP;
+    this->inverseMasses = &inverseMasses;
+    this->constrainingVelocities = constrainingVelocities;
+    this->tolerance = tolerance;
+    settleCounter = 0;
+    finished = false;
+
+    // Signal the threads to start running.  Each iteration has three synchronization points: after
+    // computing the constraint deltas (when we check for convergence), after multiplying by the
+    // matrix, and after updating the atom positions.
+
+    threads.execute([&] (ThreadPool& threads, int threadIndex) { threadApplyConstraints(threads, threadIndex); });
+    int iterations = 0;
+    while (true) {
+        threads.waitForThreads();
+        int numConverged = 0;
+        for (int converged : threadConverged)
+            numConverged += converged;
+        if (numConverged == numConstraints || iterations == maxIterations)
+            finished = true;
+        threads.resumeThreads();
+        if (finished)
+            break;
+        iterations++;
+        threads.waitForThreads();
+        threads.resumeThreads();
+        threads.waitForThreads();
+        threads.resumeThreads();
+    }
+    threads.waitForThreads();
+}
+
+void CpuCCMA::threadApplyConstraints(ThreadPool& threads, int threadIndex) {
+    int numThreads = threads.getNumThreads();
+    int start = threadIndex*numConstraints/numThreads;
+    int end = (threadIndex+1)*numConstraints/numThreads;
+    int numAtoms = constrainedAtoms.size();
+    int atomStart = threadIndex*numAtoms/numThreads;
+    int atomEnd = (threadIndex+1)*numAtoms/numThreads;
+    vector<Vec3>& pos = *atomCoordinates;
+    vector<Vec3>& posP = *atomCoordinatesP;
+    vector<double>& invMass = *inverseMasses;
+    double lowerTol = 1-2*tolerance+tolerance*tolerance;
+    double upperTol = 1+2*tolerance+tolerance*tolerance;
+    for (int i = start; i < end; i++) {
+        r_ij[i] = pos[atom1[i]] - pos[atom2[i]];
+        d_ij2[i] = r_ij[i].dot(r_ij[i]);
+    }
+    while (true) {
+        // Compute the constraint deltas and count how many constraints have converged.
+
+        int numConverged = 0;
+        for (int i = start; i < end; i++) {
+            Vec3 rp_ij = posP[atom1[i]] - posP[atom2[i]];
+            if (constrainingVelocities) {
+                double rrpr = rp_ij.dot(r_ij[i]);
+                constraintDelta[i] = -2*reducedMasses[i]*rrpr/d_ij2[i];
+                if (fabs(constraintDelta[i]) <= tolerance)
+                    numConverged++;
+            }
+            else {
+                double rp2  = rp_ij.dot(rp_ij);
+                double dist2 = distance[i]*distance[i];
+                double diff = dist2 - rp2;
+                double rrpr = rp_ij.dot(r_ij[i]);
+                constraintDelta[i] = reducedMasses[i]*diff/rrpr;
+                if (rp2 >= lowerTol*dist2 && rp2 <= upperTol*dist2)
+                    numConverged++;
+            }
+        }
+        threadConverged[threadIndex] = numConverged;
+        processSettleBlock();
+        threads.syncThreads();
+        if (finished)
+            break;
+
+        // Multiply by the inverse constraint matrix.
+
+        for (int i = start; i < end; i++) {
+            double sum = 0.0;
+            for (int j = matrixRowStart[i]; j < matrixRowStart[i+1]; j++)
+                sum += matrixValue[j]*constraintDelta[matrixColIndex[j]];
+            tempDelta[i] = sum;
+        }
+        processSettleBlock();
+        threads.syncThreads();
+
+        // Update the atom positions.
+
+        for (int i = atomStart; i < atomEnd; i++) {
+            int atom = constrainedAtoms[i];
+            for (int j = atomConstraintStart[i]; j < atomConstraintStart[i+1]; j++) {
+                int constraint = atomConstraintIndex[j];
+                Vec3 dr = r_ij[constraint]*tempDelta[constraint];
+                if (atom1[constraint] == atom)
+                    posP[atom] += dr*invMass[atom];
+                else
+                    posP[atom] -= dr*invMass[atom];
+            }
+        }
+        processSettleBlock();
+        threads.syncThreads();
+    }
+
+    // Process any SETTLE clusters that were not handled during the iterations.
+
+    if (settle != NULL)
+        while (settleCounter < settle->getNumBlocks())
+            processSettleBlock();
+}
+
+void CpuCCMA::processSettleBlock() {
+    // SETTLE and CCMA never involve the same atoms, so blocks of SETTLE clusters can be processed
+    // at any point during the CCMA iterations.
+
+    if (settle == NULL)
+        return;
+    int block = settleCounter++;
+    if (block >= settle->getNumBlocks())
+        return;
+    if (constrainingVelocities)
+        settle->getBlock(block).applyToVelocities(*atomCoordinates, *atomCoordinatesP, *inverseMasses, tolerance);
+    else
+        settle->getBlock(block).apply(*atomCoordinates, *atomCoordinatesP, *inverseMasses, tolerance);
+}
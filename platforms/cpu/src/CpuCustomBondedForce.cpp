@@ -0,0 +1,356 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomBondedForce.h"
+#include "CpuFixedPoint.h"
+#include "ReferenceBondIxn.h"
+#include "ReferenceForce.h"
+#include "lepton/CompiledVectorExpression.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+template <int NUM_ATOMS>
+const int CpuCustomBondedForce<NUM_ATOMS>::BatchSize;
+
+/**
+ * The geometric quantities computed for one interaction that are needed to apply its forces.
+ */
+template <int NUM_ATOMS>
+struct CpuCustomBondedForce<NUM_ATOMS>::Geometry {
+    double deltaR[3][ReferenceForce::LastDeltaRIndex];
+    double crossProduct[2][3];
+    double rp;
+};
+
+template <int NUM_ATOMS>
+class CpuCustomBondedForce<NUM_ATOMS>::ThreadData {
+public:
+    ThreadData(const Lepton::CompiledVectorExpression& energyExpression, const Lepton::CompiledVectorExpression& forceExpression,
+            const vector<Lepton::CompiledVectorExpression>& energyParamDerivExpressions, const string& coordinateName,
+            const vector<string>& parameterNames, const vector<string>& globalParameterNames) :
+            energyExpression(energyExpression), forceExpression(forceExpression), energyParamDerivExpressions(energyParamDerivExpressions) {
+        // Unused elements at the end of a partial batch keep their previous values, so start them with values
+        // the expressions can be evaluated for.
+
+        coordinate.resize(BatchSize, 1.0);
+        parameters.resize(parameterNames.size()*BatchSize, 0.0);
+        geometry.resize(BatchSize);
+        energyParamDerivs.resize(energyParamDerivExpressions.size());
+        fixedDerivs.resize(energyParamDerivExpressions.size());
+        map<string, double*> variableLocations;
+        variableLocations[coordinateName] = &coordinate[0];
+        for (int i = 0; i < parameterNames.size(); i++)
+            variableLocations[parameterNames[i]] = &parameters[i*BatchSize];
+        for (auto& name : globalParameterNames) {
+            globalValues[name].resize(BatchSize, 0.0);
+            variableLocations[name] = &globalValues[name][0];
+        }
+        this->energyExpression.setVariableLocations(variableLocations);
+        this->forceExpression.setVariableLocations(variableLocations);
+        for (auto& expression : this->energyParamDerivExpressions)
+            expression.setVariableLocations(variableLocations);
+    }
+    Lepton::CompiledVectorExpression energyExpression;
+    Lepton::CompiledVectorExpression forceExpression;
+    vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions;
+    // Each of these holds one element per interaction in the batch (for parameters, one block of BatchSize elements
+    // for each parameter).
+    vector<double> coordinate, parameters;
+    map<string, vector<double> > globalValues;
+    vector<Geometry> geometry;
+    double energy;
+    vector<double> energyParamDerivs;
+    vector<long long> fixedDerivs;
+};
+
+template <int NUM_ATOMS>
+CpuCustomBondedForce<NUM_ATOMS>::CpuCustomBondedForce(const Lepton::ParsedExpression& expression, const vector<string>& parameterNames,
+            const vector<string>& globalParameterNames, const vector<string>& energyParamDerivNames, ThreadPool& threads) :
+            threads(threads), bondAtoms(NULL), numParameters(parameterNames.size()), numDerivs(energyParamDerivNames.size()), usePeriodic(false), deterministic(false) {
+    string coordinateName = (NUM_ATOMS == 2 ? "r" : "theta");
+    Lepton::CompiledVectorExpression energyExpression = expression.createCompiledVectorExpression(BatchSize);
+    Lepton::CompiledVectorExpression forceExpression = expression.differentiate(coordinateName).createCompiledVectorExpression(BatchSize);
+    vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions;
+    for (auto& name : energyParamDerivNames)
+        energyParamDerivExpressions.push_back(expression.differentiate(name).createCompiledVectorExpression(BatchSize));
+
+    // Each thread gets its own copy of the compiled expressions.
+
+    for (int i = 0; i < threads.getNumThreads(); i++)
+        threadData.push_back(new ThreadData(energyExpression, forceExpression, energyParamDerivExpressions, coordinateName, parameterNames, globalParameterNames));
+}
+
+template <int NUM_ATOMS>
+CpuCustomBondedForce<NUM_ATOMS>::~CpuCustomBondedForce() {
+    for (auto data : threadData)
+        delete data;
+}
+
+template <int NUM_ATOMS>
+void CpuCustomBondedForce<NUM_ATOMS>::initialize(int numAtoms, vector<vector<int> >& bondAtoms, bool deterministic) {
+    this->bondAtoms = &bondAtoms;
+    this->deterministic = deterministic;
+    int numBonds = bondAtoms.size();
+    if (deterministic) {
+        fixedForces.resize(3*numAtoms, 0);
+        bondEnergy.resize(numBonds);
+    }
+    bondForce.initialize(numAtoms, numBonds, NUM_ATOMS, bondAtoms, threads);
+    int numThreads = threads.getNumThreads();
+    setBonds.resize(numThreads+1);
+    for (int i = 0; i <= numThreads; i++)
+        setBonds[i] = (i < numThreads ? bondForce.getThreadBonds(i) : bondForce.getExtraBonds());
+}
+
+template <int NUM_ATOMS>
+void CpuCustomBondedForce<NUM_ATOMS>::setPeriodic(Vec3* periodicBoxVectors) {
+    usePeriodic = true;
+    boxVectors[0] = periodicBoxVectors[0];
+    boxVectors[1] = periodicBoxVectors[1];
+    boxVectors[2] = periodicBoxVectors[2];
+}
+
+template <int NUM_ATOMS>
+void CpuCustomBondedForce<NUM_ATOMS>::calculateForce(vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters, vector<Vec3>& forces,
+            double* totalEnergy, const map<string, double>& globalParameters, vector<double>& energyParamDerivs) {
+    for (auto data : threadData) {
+        for (auto& param : globalParameters) {
+            auto values = data->globalValues.find(param.first);
+            if (values != data->globalValues.end())
+                fill(values->second.begin(), values->second.end(), param.second);
+        }
+        data->energy = 0.0;
+        fill(data->energyParamDerivs.begin(), data->energyParamDerivs.end(), 0.0);
+        fill(data->fixedDerivs.begin(), data->fixedDerivs.end(), 0);
+    }
+
+    // Have the worker threads compute their forces.
+
+    int numThreads = threads.getNumThreads();
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        computeBonds(threadIndex, *threadData[threadIndex], atomCoordinates, parameters, forces, totalEnergy);
+    });
+    threads.waitForThreads();
+
+    // Compute any "extra" interactions.
+
+    computeBonds(numThreads, *threadData[0], atomCoordinates, parameters, forces, totalEnergy);
+    if (deterministic) {
+        // Convert the fixed point forces and derivatives back to floating point, and sum the energies in
+        // interaction order.
+
+        int numAtoms = fixedForces.size()/3;
+        threads.execute([&] (ThreadPool& threads, int threadIndex) {
+            int start = threadIndex*numAtoms/threads.getNumThreads();
+            int end = (threadIndex+1)*numAtoms/threads.getNumThreads();
+            for (int i = start; i < end; i++)
+                for (int j = 0; j < 3; j++) {
+                    forces[i][j] += fixedPointToReal(fixedForces[3*i+j]);
+                    fixedForces[3*i+j] = 0;
+                }
+        });
+        threads.waitForThreads();
+        if (totalEnergy != NULL)
+            for (double e : bondEnergy)
+                *totalEnergy += e;
+        for (int i = 0; i < numDerivs; i++) {
+            long long sum = 0;
+            for (auto data : threadData)
+                sum += data->fixedDerivs[i];
+            energyParamDerivs[i] += fixedPointToReal(sum);
+        }
+        return;
+    }
+
+    // Compute the total energy and derivatives.
+
+    for (auto data : threadData) {
+        if (totalEnergy != NULL)
+            *totalEnergy += data->energy;
+        for (int i = 0; i < numDerivs; i++)
+            energyParamDerivs[i] += data->energyParamDerivs[i];
+    }
+}
+
+template <int NUM_ATOMS>
+void CpuCustomBondedForce<NUM_ATOMS>::computeBonds(int set, ThreadData& data, vector<Vec3>& atomCoordinates, vector<vector<double> >& parameters,
+            vector<Vec3>& forces, double* totalEnergy) {
+    const vector<int>& bonds = setBonds[set];
+    int numBonds = bonds.size();
+    bool includeEnergy = (totalEnergy != NULL);
+    Vec3 bondForces[NUM_ATOMS];
+    for (int start = 0; start < numBonds; start += BatchSize) {
+        // Compute the geometry of each interaction in the batch and record its variables.
+
+        int batchSize = min(BatchSize, numBonds-start);
+        for (int i = 0; i < batchSize; i++) {
+            int bond = bonds[start+i];
+            data.coordinate[i] = computeGeometry(&(*bondAtoms)[bond][0], atomCoordinates, data.geometry[i]);
+            for (int j = 0; j < numParameters; j++)
+                data.parameters[j*BatchSize+i] = parameters[bond][j];
+        }
+
+        // Evaluate the expressions for the whole batch, then apply the forces.
+
+        const double* dEdTheta = data.forceExpression.evaluate();
+        const double* energy = (includeEnergy ? data.energyExpression.evaluate() : NULL);
+        for (int i = 0; i < batchSize; i++) {
+            int bond = bonds[start+i];
+            const vector<int>& atoms = (*bondAtoms)[bond];
+            computeBondForces(data.geometry[i], dEdTheta[i], bondForces);
+            if (deterministic) {
+                for (int j = 0; j < NUM_ATOMS; j++)
+                    for (int k = 0; k < 3; k++)
+                        fixedForces[3*atoms[j]+k] += realToFixedPoint(bondForces[j][k]);
+                if (includeEnergy)
+                    bondEnergy[bond] = energy[i];
+            }
+            else {
+                for (int j = 0; j < NUM_ATOMS; j++)
+                    forces[atoms[j]] += bondForces[j];
+                if (includeEnergy)
+                    data.energy += energy[i];
+            }
+        }
+        for (int j = 0; j < numDerivs; j++) {
+            const double* derivs = data.energyParamDerivExpressions[j].evaluate();
+            for (int i = 0; i < batchSize; i++) {
+                if (deterministic)
+                    data.fixedDerivs[j] += realToFixedPoint(derivs[i]);
+                else
+                    data.energyParamDerivs[j] += derivs[i];
+            }
+        }
+    }
+}
+
+template <>
+double CpuCustomBondedForce<2>::computeGeometry(const int* atoms, vector<Vec3>& atomCoordinates, Geometry& geometry) const {
+    double* deltaR = geometry.deltaR[0];
+    if (usePeriodic)
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[0]], atomCoordinates[atoms[1]], boxVectors, deltaR);
+    else
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[0]], atomCoordinates[atoms[1]], deltaR);
+    return deltaR[ReferenceForce::RIndex];
+}
+
+template <>
+void CpuCustomBondedForce<2>::computeBondForces(const Geometry& geometry, double dEdR, Vec3* bondForces) {
+    const double* deltaR = geometry.deltaR[0];
+    double r = deltaR[ReferenceForce::RIndex];
+    double scale = (r > 0 ? dEdR/r : 0.0);
+    bondForces[0] = Vec3(deltaR[ReferenceForce::XIndex], deltaR[ReferenceForce::YIndex], deltaR[ReferenceForce::ZIndex])*scale;
+    bondForces[1] = -bondForces[0];
+}
+
+template <>
+double CpuCustomBondedForce<3>::computeGeometry(const int* atoms, vector<Vec3>& atomCoordinates, Geometry& geometry) const {
+    double (&deltaR)[3][ReferenceForce::LastDeltaRIndex] = geometry.deltaR;
+    if (usePeriodic) {
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[0]], atomCoordinates[atoms[1]], boxVectors, deltaR[0]);
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[2]], atomCoordinates[atoms[1]], boxVectors, deltaR[1]);
+    }
+    else {
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[0]], atomCoordinates[atoms[1]], deltaR[0]);
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[2]], atomCoordinates[atoms[1]], deltaR[1]);
+    }
+    Vec3 v1(deltaR[0][0], deltaR[0][1], deltaR[0][2]);
+    Vec3 v2(deltaR[1][0], deltaR[1][1], deltaR[1][2]);
+    Vec3 p = v1.cross(v2);
+    for (int i = 0; i < 3; i++)
+        geometry.crossProduct[0][i] = p[i];
+    geometry.rp = max(sqrt(p.dot(p)), 1.0e-06);
+    double cosine = v1.dot(v2)/sqrt(deltaR[0][ReferenceForce::R2Index]*deltaR[1][ReferenceForce::R2Index]);
+    if (cosine >= 1.0)
+        return 0.0;
+    if (cosine <= -1.0)
+        return M_PI;
+    return acos(cosine);
+}
+
+template <>
+void CpuCustomBondedForce<3>::computeBondForces(const Geometry& geometry, double dEdTheta, Vec3* bondForces) {
+    const double (&deltaR)[3][ReferenceForce::LastDeltaRIndex] = geometry.deltaR;
+    Vec3 v1(deltaR[0][0], deltaR[0][1], deltaR[0][2]);
+    Vec3 v2(deltaR[1][0], deltaR[1][1], deltaR[1][2]);
+    Vec3 p(geometry.crossProduct[0][0], geometry.crossProduct[0][1], geometry.crossProduct[0][2]);
+    double termA = dEdTheta/(deltaR[0][ReferenceForce::R2Index]*geometry.rp);
+    double termC = -dEdTheta/(deltaR[1][ReferenceForce::R2Index]*geometry.rp);
+    bondForces[0] = v1.cross(p)*termA;
+    bondForces[2] = v2.cross(p)*termC;
+    bondForces[1] = -(bondForces[0]+bondForces[2]);
+}
+
+template <>
+double CpuCustomBondedForce<4>::computeGeometry(const int* atoms, vector<Vec3>& atomCoordinates, Geometry& geometry) const {
+    double (&deltaR)[3][ReferenceForce::LastDeltaRIndex] = geometry.deltaR;
+    if (usePeriodic) {
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[1]], atomCoordinates[atoms[0]], boxVectors, deltaR[0]);
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[1]], atomCoordinates[atoms[2]], boxVectors, deltaR[1]);
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[atoms[3]], atomCoordinates[atoms[2]], boxVectors, deltaR[2]);
+    }
+    else {
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[1]], atomCoordinates[atoms[0]], deltaR[0]);
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[1]], atomCoordinates[atoms[2]], deltaR[1]);
+        ReferenceForce::getDeltaR(atomCoordinates[atoms[3]], atomCoordinates[atoms[2]], deltaR[2]);
+    }
+    double* crossProduct[2] = {geometry.crossProduct[0], geometry.crossProduct[1]};
+    double dotDihedral, signOfAngle;
+    return ReferenceBondIxn::getDihedralAngleBetweenThreeVectors(deltaR[0], deltaR[1], deltaR[2], crossProduct, &dotDihedral, deltaR[0], &signOfAngle, 1);
+}
+
+template <>
+void CpuCustomBondedForce<4>::computeBondForces(const Geometry& geometry, double dEdTheta, Vec3* bondForces) {
+    const double (&deltaR)[3][ReferenceForce::LastDeltaRIndex] = geometry.deltaR;
+    Vec3 v1(deltaR[0][0], deltaR[0][1], deltaR[0][2]);
+    Vec3 v2(deltaR[1][0], deltaR[1][1], deltaR[1][2]);
+    Vec3 v3(deltaR[2][0], deltaR[2][1], deltaR[2][2]);
+    Vec3 cross1(geometry.crossProduct[0][0], geometry.crossProduct[0][1], geometry.crossProduct[0][2]);
+    Vec3 cross2(geometry.crossProduct[1][0], geometry.crossProduct[1][1], geometry.crossProduct[1][2]);
+    double normBC = deltaR[1][ReferenceForce::RIndex];
+    double r2BC = deltaR[1][ReferenceForce::R2Index];
+    Vec3 internalF0 = cross1*(-dEdTheta*normBC/cross1.dot(cross1));
+    Vec3 internalF3 = cross2*(dEdTheta*normBC/cross2.dot(cross2));
+    Vec3 s = internalF0*(v1.dot(v2)/r2BC) - internalF3*(v3.dot(v2)/r2BC);
+    bondForces[0] = internalF0;
+    bondForces[1] = s-internalF0;
+    bondForces[2] = -(internalF3+s);
+    bondForces[3] = internalF3;
+}
+
+namespace OpenMM {
+template class CpuCustomBondedForce<2>;
+template class CpuCustomBondedForce<3>;
+template class CpuCustomBondedForce<4>;
+}
@@ -0,0 +1,178 @@
+
+/* Portions copyright (c) 2026 Stanford University and Simbios.
+ * Authors: Peter Eastman
+ * Contributors: 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CpuCustomDynamics.h"
+#include "SimTKOpenMMUtilities.h"
+#include <sstream>
+
+using namespace OpenMM;
+using namespace Lepton;
+using namespace std;
+
+class CpuCustomDynamics::ThreadData {
+public:
+    double x, v, m, f, uniform, gaussian;
+    vector<double> perDofVariable;
+    vector<CompiledExpression> expressions;
+};
+
+CpuCustomDynamics::CpuCustomDynamics(int numberOfAtoms, const CustomIntegrator& integrator, ThreadPool& threads, CpuRandom& random) :
+           ReferenceCustomDynamics(numberOfAtoms, integrator), threads(threads), random(random) {
+    for (int i = 0; i < threads.getNumThreads(); i++)
+        threadData.push_back(new ThreadData());
+    threadSum.resize(threads.getNumThreads());
+}
+
+CpuCustomDynamics::~CpuCustomDynamics() {
+    for (ThreadData* data : threadData)
+        delete data;
+}
+
+void CpuCustomDynamics::initialize(ContextImpl& context, vector<double>& masses, map<string, double>& globals) {
+    ReferenceCustomDynamics::initialize(context, masses, globals);
+
+    // Find all the expressions that get evaluated for every degree of freedom.
+
+    vector<CompiledExpression*> perDofExpressions;
+    for (int i = 0; i < stepType.size(); i++)
+        if ((stepType[i] == CustomIntegrator::ComputePerDof || stepType[i] == CustomIntegrator::ComputeSum) && stepVectorExpressions[i].size() == 0)
+            perDofExpressions.push_back(&stepExpressions[i][0]);
+    perDofExpressions.push_back(&kineticEnergyExpression);
+    expressionIndex.clear();
+    expressionUsesUniform.clear();
+    expressionUsesGaussian.clear();
+    for (int i = 0; i < perDofExpressions.size(); i++) {
+        const set<string>& variables = perDofExpressions[i]->getVariables();
+        expressionIndex[perDofExpressions[i]] = i;
+        expressionUsesUniform.push_back(variables.find("uniform") != variables.end());
+        expressionUsesGaussian.push_back(variables.find("gaussian") != variables.end());
+    }
+
+    // Create a copy of each expression for every thread.  Per-DOF inputs point to storage owned by
+    // the thread, while everything else (global variables, energy) is read from the original expression.
+
+    for (ThreadData* data : threadData) {
+        data->perDofVariable.resize(integrator.getNumPerDofVariables());
+        map<string, double*> threadLocations;
+        threadLocations["x"] = &data->x;
+        threadLocations["v"] = &data->v;
+        threadLocations["m"] = &data->m;
+        threadLocations["f"] = &data->f;
+        threadLocations["uniform"] = &data->uniform;
+        threadLocations["gaussian"] = &data->gaussian;
+        for (int i = 0; i < integrator.getNumPerDofVariables(); i++)
+            threadLocations[integrator.getPerDofVariableName(i)] = &data->perDofVariable[i];
+        for (int i = 0; i < 32; i++) {
+            stringstream fname;
+            fname << "f" << i;
+            threadLocations[fname.str()] = &data->f;
+        }
+        data->expressions.resize(perDofExpressions.size());
+        for (int i = 0; i < perDofExpressions.size(); i++) {
+            map<string, double*> locations;
+            for (const string& name : perDofExpressions[i]->getVariables()) {
+                if (threadLocations.find(name) != threadLocations.end())
+                    locations[name] = threadLocations[name];
+                else
+                    locations[name] = &perDofExpressions[i]->getVariableReference(name);
+            }
+            data->expressions[i] = *perDofExpressions[i];
+            data->expressions[i].setVariableLocations(locations);
+        }
+    }
+}
+
+void CpuCustomDynamics::computePerDof(int numberOfAtoms, vector<Vec3>& results, const vector<Vec3>& atomCoordinates,
+              const vector<Vec3>& velocities, const vector<Vec3>& forces, const vector<double>& masses,
+              const vector<vector<Vec3> >& perDof, const CompiledExpression& expression) {
+    auto index = expressionIndex.find(&expression);
+    if (index == expressionIndex.end()) {
+        ReferenceCustomDynamics::computePerDof(numberOfAtoms, results, atomCoordinates, velocities, forces, masses, perDof, expression);
+        return;
+    }
+
+    // Record the parameters for the threads.
+
+    this->numberOfAtoms = numberOfAtoms;
+    this->results = &results[0];
+    this->atomCoordinates = &atomCoordinates[0];
+    this->velocities = &velocities[0];
+    this->forces = &forces[0];
+    this->masses = &masses[0];
+    this->perDof = &perDof;
+
+    // Signal the threads to start running and wait for them to finish.
+
+    int exprIndex = index->second;
+    threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputePerDof(threadIndex, exprIndex); });
+    threads.waitForThreads();
+}
+
+void CpuCustomDynamics::threadComputePerDof(int threadIndex, int expressionIndex) {
+    int start = threadIndex*numberOfAtoms/threads.getNumThreads();
+    int end = (threadIndex+1)*numberOfAtoms/threads.getNumThreads();
+    ThreadData& data = *threadData[threadIndex];
+    const CompiledExpression& expression = data.expressions[expressionIndex];
+    bool useUniform = expressionUsesUniform[expressionIndex];
+    bool useGaussian = expressionUsesGaussian[expressionIndex];
+    int numPerDof = perDof->size();
+    for (int i = start; i < end; i++) {
+        if (masses[i] != 0.0) {
+            data.m = masses[i];
+            for (int j = 0; j < 3; j++) {
+                data.x = atomCoordinates[i][j];
+                data.v = velocities[i][j];
+                data.f = forces[i][j];
+                if (useUniform)
+                    data.uniform = random.getUniformRandom(threadIndex);
+                if (useGaussian)
+                    data.gaussian = random.getGaussianRandom(threadIndex);
+                for (int k = 0; k < numPerDof; k++)
+                    data.perDofVariable[k] = (*perDof)[k][i][j];
+                results[i][j] = expression.evaluate();
+            }
+        }
+    }
+}
+
+double CpuCustomDynamics::computeSum(int numberOfAtoms, const vector<Vec3>& values, const vector<double>& masses) {
+    // Each thread sums a contiguous block of atoms, and the partial sums are added in a fixed order
+    // so the result does not depend on thread scheduling.
+
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        int start = threadIndex*numberOfAtoms/threads.getNumThreads();
+        int end = (threadIndex+1)*numberOfAtoms/threads.getNumThreads();
+        double sum = 0.0;
+        for (int i = start; i < end; i++)
+            if (masses[i] != 0.0)
+                sum += values[i][0]+values[i][1]+values[i][2];
+        threadSum[threadIndex] = sum;
+    });
+    threads.waitForThreads();
+    double sum = 0.0;
+    for (double partial : threadSum)
+        sum += partial;
+    return sum;
+}
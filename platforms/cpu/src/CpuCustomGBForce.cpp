@@ -48,6 +48,7 @@ CpuCustomGBForce::ThreadData::ThreadData(int numAtoms, int numThreads, int threa
             energyGradientExpressions(energyGradientExpressions), energyParamDerivExpressions(energyParamDerivExpressions) {
     firstAtom = (threadIndex*(long long) numAtoms)/numThreads;
     lastAtom = ((threadIndex+1)*(long long) numAtoms)/numThreads;
+    blockUsed = NULL;
     map<string, double*> variableLocations;
     variableLocations["x"] = &x;
     variableLocations["y"] = &y;
@@ -138,7 +139,7 @@ CpuCustomGBForce::CpuCustomGBForce(int numAtoms, const std::vector<std::set<int>
                      const vector<CustomGBForce::ComputationType>& energyTypes,
                      const vector<string>& parameterNames, ThreadPool& threads) :
             exclusions(exclusions), cutoff(false), periodic(false), valueTypes(valueTypes), energyTypes(energyTypes), numValues(valueNames.size()),
-            numParams(parameterNames.size()), threads(threads) {
+            numParams(parameterNames.size()), threads(threads), forceBlockUsed(NULL), forceBlockSize(0) {
     for (int i = 0; i < threads.getNumThreads(); i++)
         threadData.push_back(new ThreadData(numAtoms, threads.getNumThreads(), i, valueExpressions, valueDerivExpressions, valueGradientExpressions,
                 valueParamDerivExpressions, valueNames, energyExpressions, energyDerivExpressions, energyGradientExpressions, energyParamDerivExpressions, parameterNames));
@@ -243,6 +244,11 @@ void CpuCustomGBForce::calculateIxn(int numberOfAtoms, float* posq, vector<vecto
                 energyParamDerivs[j] += threadData[i]->energyParamDerivs[j];
 }
 
+void CpuCustomGBForce::setForceBlockTracking(vector<vector<char> >* blockUsed, int blockSize) {
+    forceBlockUsed = blockUsed;
+    forceBlockSize = blockSize;
+}
+
 void CpuCustomGBForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     // Compute this thread's subset of interactions.
 
@@ -250,6 +256,7 @@ void CpuCustomGBForce::threadComputeForce(ThreadPool& threads, int threadIndex)
     double& energy = threadEnergy[threadIndex];
     float* forces = &(*threadForce)[threadIndex][0];
     ThreadData& data = *threadData[threadIndex];
+    data.blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
     fvec4 boxSize(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2], 0);
     fvec4 invBoxSize((1/periodicBoxSize[0]), (1/periodicBoxSize[1]), (1/periodicBoxSize[2]), 0);
     for (auto& param : *globalParameters)
@@ -438,6 +445,8 @@ void CpuCustomGBForce::calculateSingleParticleEnergyTerm(int index, ThreadData&
         forces[4*i+0] -= (float) data.energyGradientExpressions[index][0].evaluate();
         forces[4*i+1] -= (float) data.energyGradientExpressions[index][1].evaluate();
         forces[4*i+2] -= (float) data.energyGradientExpressions[index][2].evaluate();
+        if (data.blockUsed != NULL)
+            data.blockUsed[i/forceBlockSize] = 1;
         
         // Compute derivatives with respect to parameters.
         
@@ -522,6 +531,10 @@ void CpuCustomGBForce::calculateOnePairEnergyTerm(int index, int atom1, int atom
     fvec4 result = deltaR*dEdR;
     (fvec4(forces+4*atom1)-result).store(forces+4*atom1);
     (fvec4(forces+4*atom2)+result).store(forces+4*atom2);
+    if (data.blockUsed != NULL) {
+        data.blockUsed[atom1/forceBlockSize] = 1;
+        data.blockUsed[atom2/forceBlockSize] = 1;
+    }
     for (int i = 0; i < (int) values.size(); i++) {
         data.dEdV[i][atom1] += (float) data.energyDerivExpressions[index][2*i+1].evaluate();
         data.dEdV[i][atom2] += (float) data.energyDerivExpressions[index][2*i+2].evaluate();
@@ -600,6 +613,8 @@ void CpuCustomGBForce::calculateChainRuleForces(ThreadData& data, int numAtoms,
             forces[4*i+1] -= dEdV[j][i]*data.dVdY[j];
             forces[4*i+2] -= dEdV[j][i]*data.dVdZ[j];
         }
+        if (data.blockUsed != NULL)
+            data.blockUsed[i/forceBlockSize] = 1;
     }
         
     // Compute chain rule terms for derivatives with respect to parameters.
@@ -663,6 +678,10 @@ void CpuCustomGBForce::calculateOnePairChainRule(int atom1, int atom2, ThreadDat
     }
     (fvec4(forces+4*atom1)+f1).store(forces+4*atom1);
     (fvec4(forces+4*atom2)+f2).store(forces+4*atom2);
+    if (data.blockUsed != NULL) {
+        data.blockUsed[atom1/forceBlockSize] = 1;
+        data.blockUsed[atom2/forceBlockSize] = 1;
+    }
 }
 
 void CpuCustomGBForce::getDeltaR(const fvec4& posI, const fvec4& posJ, fvec4& deltaR, float& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const {
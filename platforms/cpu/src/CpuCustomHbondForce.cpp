@@ -0,0 +1,246 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuCustomHbondForce.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * The maximum number of voxels along each axis.  Voxels can always be made larger than the cutoff,
+ * so this just limits the memory used by very large or sparse systems.
+ */
+static const int MAX_VOXELS_PER_AXIS = 64;
+
+CpuCustomHbondForce::CpuCustomHbondForce(const vector<vector<int> >& donorAtoms, const vector<vector<int> >& acceptorAtoms,
+            const Lepton::ParsedExpression& energyExpression, const vector<string>& donorParameterNames,
+            const vector<string>& acceptorParameterNames, const map<string, vector<int> >& distances,
+            const map<string, vector<int> >& angles, const map<string, vector<int> >& dihedrals, ThreadPool& threads) :
+            donorAtoms(donorAtoms), acceptorAtoms(acceptorAtoms), threads(threads), cutoff(false), periodic(false) {
+    int numThreads = threads.getNumThreads();
+    for (int i = 0; i < numThreads; i++)
+        threadIxn.push_back(new ReferenceCustomHbondIxn(donorAtoms, acceptorAtoms, energyExpression, donorParameterNames,
+                acceptorParameterNames, distances, angles, dihedrals));
+    threadForce.resize(numThreads);
+    threadEnergy.resize(numThreads);
+}
+
+CpuCustomHbondForce::~CpuCustomHbondForce() {
+    for (auto ixn : threadIxn)
+        delete ixn;
+}
+
+void CpuCustomHbondForce::setUseCutoff(double distance) {
+    cutoff = true;
+    cutoffDistance = distance;
+    for (auto ixn : threadIxn)
+        ixn->setUseCutoff(distance);
+}
+
+void CpuCustomHbondForce::setPeriodic(Vec3* periodicBoxVectors) {
+    periodic = true;
+    this->periodicBoxVectors[0] = periodicBoxVectors[0];
+    this->periodicBoxVectors[1] = periodicBoxVectors[1];
+    this->periodicBoxVectors[2] = periodicBoxVectors[2];
+    for (auto ixn : threadIxn)
+        ixn->setPeriodic(periodicBoxVectors);
+}
+
+void CpuCustomHbondForce::calculatePairIxn(vector<Vec3>& atomCoordinates, vector<vector<double> >& donorParameters,
+            vector<vector<double> >& acceptorParameters, vector<set<int> >& exclusions,
+            const map<string, double>& globalParameters, vector<Vec3>& forces, double* totalEnergy) {
+    if (cutoff)
+        buildVoxels(atomCoordinates);
+    else if (allAcceptors.size() != acceptorAtoms.size()) {
+        allAcceptors.resize(acceptorAtoms.size());
+        for (int i = 0; i < allAcceptors.size(); i++)
+            allAcceptors[i] = i;
+    }
+    
+    // Have the worker threads compute their forces.
+    
+    int numAtoms = atomCoordinates.size();
+    for (auto& f : threadForce)
+        f.resize(numAtoms);
+    atomicCounter = 0;
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        threadComputeForce(threadIndex, atomCoordinates, donorParameters, acceptorParameters, exclusions, globalParameters, totalEnergy != NULL);
+    });
+    threads.waitForThreads();
+    
+    // Sum the forces from all the threads.
+    
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        int numThreads = threads.getNumThreads();
+        int start = threadIndex*numAtoms/numThreads;
+        int end = (threadIndex+1)*numAtoms/numThreads;
+        for (int i = 0; i < numThreads; i++)
+            for (int j = start; j < end; j++)
+                forces[j] += threadForce[i][j];
+    });
+    threads.waitForThreads();
+    if (totalEnergy != NULL)
+        for (double energy : threadEnergy)
+            *totalEnergy += energy;
+}
+
+void CpuCustomHbondForce::threadComputeForce(int threadIndex, vector<Vec3>& atomCoordinates, vector<vector<double> >& donorParameters,
+            vector<vector<double> >& acceptorParameters, vector<set<int> >& exclusions,
+            const map<string, double>& globalParameters, bool includeEnergy) {
+    vector<Vec3>& forces = threadForce[threadIndex];
+    for (auto& f : forces)
+        f = Vec3();
+    threadEnergy[threadIndex] = 0;
+    double* energy = (includeEnergy ? &threadEnergy[threadIndex] : NULL);
+    ReferenceCustomHbondIxn& ixn = *threadIxn[threadIndex];
+    map<string, double> variables = globalParameters;
+    vector<int> candidates;
+    int numDonors = donorAtoms.size();
+    while (true) {
+        int donor = atomicCounter++;
+        if (donor >= numDonors)
+            break;
+        if (cutoff) {
+            findCandidateAcceptors(donor, atomCoordinates, candidates);
+            ixn.calculateDonorIxn(donor, candidates, atomCoordinates, donorParameters, acceptorParameters, exclusions[donor], variables, forces, energy);
+        }
+        else
+            ixn.calculateDonorIxn(donor, allAcceptors, atomCoordinates, donorParameters, acceptorParameters, exclusions[donor], variables, forces, energy);
+    }
+}
+
+Vec3 CpuCustomHbondForce::getVoxelPosition(const Vec3& location) const {
+    Vec3 r = location;
+    if (periodic) {
+        r -= periodicBoxVectors[2]*floor(r[2]/periodicBoxVectors[2][2]);
+        r -= periodicBoxVectors[1]*floor(r[1]/periodicBoxVectors[1][1]);
+        r -= periodicBoxVectors[0]*floor(r[0]/periodicBoxVectors[0][0]);
+        return r;
+    }
+    return r-minPos;
+}
+
+void CpuCustomHbondForce::buildVoxels(vector<Vec3>& atomCoordinates) {
+    int numAcceptors = acceptorAtoms.size();
+    int numVoxels[3];
+    if (periodic) {
+        for (int i = 0; i < 3; i++) {
+            numVoxels[i] = max(1, min(MAX_VOXELS_PER_AXIS, (int) floor(periodicBoxVectors[i][i]/cutoffDistance)));
+            voxelSize[i] = periodicBoxVectors[i][i]/numVoxels[i];
+        }
+    }
+    else {
+        // Find the bounding box of the acceptors.
+        
+        Vec3 maxPos;
+        if (numAcceptors > 0)
+            minPos = maxPos = atomCoordinates[acceptorAtoms[0][0]];
+        for (int i = 1; i < numAcceptors; i++) {
+            const Vec3& pos = atomCoordinates[acceptorAtoms[i][0]];
+            for (int j = 0; j < 3; j++) {
+                minPos[j] = min(minPos[j], pos[j]);
+                maxPos[j] = max(maxPos[j], pos[j]);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            double width = maxPos[i]-minPos[i];
+            numVoxels[i] = max(1, min(MAX_VOXELS_PER_AXIS, (int) floor(width/cutoffDistance)));
+            voxelSize[i] = max(cutoffDistance, width/numVoxels[i]);
+        }
+    }
+    nx = numVoxels[0];
+    ny = numVoxels[1];
+    nz = numVoxels[2];
+    voxels.resize(nx*ny*nz);
+    for (auto& voxel : voxels)
+        voxel.clear();
+    
+    // Add the acceptors to the voxels.
+    
+    for (int i = 0; i < numAcceptors; i++) {
+        Vec3 pos = getVoxelPosition(atomCoordinates[acceptorAtoms[i][0]]);
+        int x = max(0, min(nx-1, (int) floor(pos[0]/voxelSize[0])));
+        int y = max(0, min(ny-1, (int) floor(pos[1]/voxelSize[1])));
+        int z = max(0, min(nz-1, (int) floor(pos[2]/voxelSize[2])));
+        voxels[(x*ny+y)*nz+z].push_back(i);
+    }
+}
+
+void CpuCustomHbondForce::findCandidateAcceptors(int donor, vector<Vec3>& atomCoordinates, vector<int>& acceptors) const {
+    // Voxels are at least as large as the cutoff, so we only need to search the adjacent ones.
+    
+    acceptors.clear();
+    Vec3 pos = getVoxelPosition(atomCoordinates[donorAtoms[donor][0]]);
+    int centerx = (int) floor(pos[0]/voxelSize[0]);
+    int centery = (int) floor(pos[1]/voxelSize[1]);
+    int centerz = (int) floor(pos[2]/voxelSize[2]);
+    if (!periodic) {
+        for (int x = max(0, centerx-1); x <= min(nx-1, centerx+1); x++)
+            for (int y = max(0, centery-1); y <= min(ny-1, centery+1); y++)
+                for (int z = max(0, centerz-1); z <= min(nz-1, centerz+1); z++) {
+                    const vector<int>& voxel = voxels[(x*ny+y)*nz+z];
+                    acceptors.insert(acceptors.end(), voxel.begin(), voxel.end());
+                }
+        return;
+    }
+    
+    // With periodic boundary conditions, wrap around the edges of the box.  For triclinic boxes,
+    // crossing a boundary along one axis shifts the range of voxels to search along the others.
+
+    centerx = max(0, min(nx-1, centerx));
+    centery = max(0, min(ny-1, centery));
+    centerz = max(0, min(nz-1, centerz));
+    int minz = centerz-1;
+    int maxz = min(centerz+1, minz+nz-1);
+    for (int z = minz; z <= maxz; z++) {
+        int boxz = (int) floor((float) z/nz);
+        double yoffset = boxz*periodicBoxVectors[2][1]/voxelSize[1];
+        int miny = centery-1-(int) ceil(yoffset);
+        int maxy = centery+1-(int) floor(yoffset);
+        maxy = min(maxy, miny+ny-1);
+        for (int y = miny; y <= maxy; y++) {
+            int boxy = (int) floor((float) y/ny);
+            double xoffset = (boxy*periodicBoxVectors[1][0]+boxz*periodicBoxVectors[2][0])/voxelSize[0];
+            int minx = centerx-1-(int) ceil(xoffset);
+            int maxx = centerx+1-(int) floor(xoffset);
+            maxx = min(maxx, minx+nx-1);
+            for (int x = minx; x <= maxx; x++) {
+                int vx = (x%nx+nx)%nx;
+                int vy = (y%ny+ny)%ny;
+                int vz = (z%nz+nz)%nz;
+                const vector<int>& voxel = voxels[(vx*ny+vy)*nz+vz];
+                acceptors.insert(acceptors.end(), voxel.begin(), voxel.end());
+            }
+        }
+    }
+}
@@ -37,7 +37,7 @@ using namespace OpenMM;
 using namespace std;
 
 CpuCustomManyParticleForce::CpuCustomManyParticleForce(const CustomManyParticleForce& force, ThreadPool& threads) :
-            threads(threads), useCutoff(false), usePeriodic(false), neighborList(NULL) {
+            useCutoff(false), usePeriodic(false), neighborList(NULL), threads(threads), forceBlockUsed(NULL), forceBlockSize(0) {
     numParticles = force.getNumParticles();
     numParticlesPerSet = force.getNumParticlesPerSet();
     numPerParticleParameters = force.getNumPerParticleParameters();
@@ -81,6 +81,31 @@ CpuCustomManyParticleForce::CpuCustomManyParticleForce(const CustomManyParticleF
     // Record information about type filters.
     
     CustomManyParticleForceImpl::buildFilterArrays(force, numTypes, particleTypes, orderIndex, particleOrder);
+
+    // Find which pairs of types can ever appear in the same interaction.  This lets us discard pairs
+    // of particles before expanding them into full sets.
+
+    useTypePruning = false;
+    if (particleOrder.size() > 1) {
+        allowedTypePairs.resize(numTypes*numTypes, 0);
+        for (int index = 0; index < (int) orderIndex.size(); index++) {
+            if (orderIndex[index] == -1)
+                continue;
+            vector<int> types(numParticlesPerSet);
+            int temp = index;
+            for (int j = 0; j < numParticlesPerSet; j++) {
+                types[j] = temp%numTypes;
+                temp /= numTypes;
+            }
+            for (int j = 0; j < numParticlesPerSet; j++)
+                for (int k = 0; k < numParticlesPerSet; k++)
+                    if (j != k)
+                        allowedTypePairs[types[j]*numTypes+types[k]] = 1;
+        }
+        for (char allowed : allowedTypePairs)
+            if (!allowed)
+                useTypePruning = true;
+    }
 }
 
 CpuCustomManyParticleForce::~CpuCustomManyParticleForce() {
@@ -96,38 +121,20 @@ void CpuCustomManyParticleForce::calculateIxn(AlignedArray<float>& posq, vector<
     // Record the parameters for the threads.
     
     this->posq = &posq[0];
+    this->posqArray = &posq;
     this->particleParameters = &particleParameters[0];
     this->globalParameters = &globalParameters;
     this->threadForce = &threadForce;
     this->includeForces = includeForces;
     this->includeEnergy = includeEnergy;
-    atomicCounter = 0;
-    if (useCutoff) {
-        // Construct a neighbor list.  We use CpuNeighborList to do this, but then copy the result
-        // into a new data structure.  This is needed because in UniqueCentralParticle mode, the
-        // the neighbor list needs to include symmetric pairs.
-        
-        particleNeighbors.resize(numParticles);
+    if (useCutoff)
+        buildNeighborList();
+    else if (centralParticleOrder.size() != numParticles) {
+        centralParticleOrder.resize(numParticles);
         for (int i = 0; i < numParticles; i++)
-            particleNeighbors[i].clear();
-        neighborList->computeNeighborList(numParticles, posq, exclusions, periodicBoxVectors, usePeriodic, cutoffDistance, threads);
-        for (int blockIndex = 0; blockIndex < neighborList->getNumBlocks(); blockIndex++) {
-            const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
-            const auto& exclusions = neighborList->getBlockExclusions(blockIndex);
-            int numNeighbors = neighbors.size();
-            for (int i = 0; i < 4; i++) {
-                int p1 = neighborList->getSortedAtoms()[4*blockIndex+i];
-                for (int j = 0; j < numNeighbors; j++) {
-                    if ((exclusions[j] & (1<<i)) == 0) {
-                        int p2 = neighbors[j];
-                        particleNeighbors[p1].push_back(p2);
-                        if (centralParticleMode)
-                            particleNeighbors[p2].push_back(p1);
-                    }
-                }
-            }
-        }
+            centralParticleOrder[i] = i;
     }
+    atomicCounter = 0;
     
     // Signal the threads to start running and wait for them to finish.
     
@@ -143,6 +150,11 @@ void CpuCustomManyParticleForce::calculateIxn(AlignedArray<float>& posq, vector<
     }
 }
 
+void CpuCustomManyParticleForce::setForceBlockTracking(vector<vector<char> >* blockUsed, int blockSize) {
+    forceBlockUsed = blockUsed;
+    forceBlockSize = blockSize;
+}
+
 void CpuCustomManyParticleForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     vector<int> particleIndices(numParticlesPerSet);
     fvec4 boxSize(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2], 0);
@@ -150,34 +162,220 @@ void CpuCustomManyParticleForce::threadComputeForce(ThreadPool& threads, int thr
     float* forces = &(*threadForce)[threadIndex][0];
     ThreadData& data = *threadData[threadIndex];
     data.energy = 0;
+    data.blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
     for (auto& param : *globalParameters)
         data.expressionSet.setVariable(data.expressionSet.getVariableIndex(param.first), param.second);
+    const int chunkSize = 16;
     if (useCutoff) {
-        // Loop over interactions from the neighbor list.
+        // Loop over interactions from the neighbor list.  Central particles are handed out in small chunks,
+        // in cell order so that each chunk works on particles that are close together.
         
         while (true) {
-            int i = atomicCounter++;
-            if (i >= numParticles)
+            int start = atomicCounter.fetch_add(chunkSize);
+            if (start >= numParticles)
                 break;
-            particleIndices[0] = i;
-            loopOverInteractions(particleNeighbors[i], particleIndices, 1, 0, particleParameters, forces, data, boxSize, invBoxSize);
+            int end = min(start+chunkSize, numParticles);
+            for (int k = start; k < end; k++) {
+                int i = centralParticleOrder[k];
+                particleIndices[0] = i;
+                const int* neighbors = neighborIndices.data()+neighborStart[i];
+                int numNeighbors = neighborStart[i+1]-neighborStart[i];
+                loopOverInteractions(neighbors, numNeighbors, particleIndices, 1, 0, particleParameters, forces, data, boxSize, invBoxSize);
+            }
         }
     }
     else {
         // Loop over all possible sets of particles.
         
-        vector<int> particles(numParticles);
-        for (int i = 0; i < numParticles; i++)
-            particles[i] = i;
         while (true) {
-            int i = atomicCounter++;
-            if (i >= numParticles)
+            int start = atomicCounter.fetch_add(chunkSize);
+            if (start >= numParticles)
                 break;
-            particleIndices[0] = i;
-            int startIndex = (centralParticleMode ? 0 : i+1);
-            loopOverInteractions(particles, particleIndices, 1, startIndex, particleParameters, forces, data, boxSize, invBoxSize);
+            int end = min(start+chunkSize, numParticles);
+            for (int i = start; i < end; i++) {
+                particleIndices[0] = i;
+                int startIndex = (centralParticleMode ? 0 : i+1);
+                loopOverInteractions(centralParticleOrder.data(), numParticles, particleIndices, 1, startIndex, particleParameters, forces, data, boxSize, invBoxSize);
+            }
+        }
+    }
+}
+
+void CpuCustomManyParticleForce::buildNeighborList() {
+    int numThreads = threads.getNumThreads();
+    threadPairs.resize(numThreads);
+    for (auto& pairs : threadPairs)
+        pairs.clear();
+    if (usePeriodic && triclinic)
+        findPairsWithNeighborList();
+    else
+        findPairsWithCells();
+
+    // Convert the pairs into a compact list of neighbors for each particle.
+
+    neighborStart.assign(numParticles+1, 0);
+    for (auto& pairs : threadPairs)
+        for (auto& pair : pairs) {
+            neighborStart[pair.first+1]++;
+            if (centralParticleMode)
+                neighborStart[pair.second+1]++;
+        }
+    for (int i = 0; i < numParticles; i++)
+        neighborStart[i+1] += neighborStart[i];
+    neighborIndices.resize(neighborStart[numParticles]);
+    vector<int> nextIndex(neighborStart.begin(), neighborStart.end()-1);
+    for (auto& pairs : threadPairs)
+        for (auto& pair : pairs) {
+            neighborIndices[nextIndex[pair.first]++] = pair.second;
+            if (centralParticleMode)
+                neighborIndices[nextIndex[pair.second]++] = pair.first;
+        }
+}
+
+void CpuCustomManyParticleForce::findPairsWithCells() {
+    // Decide on the size of the grid.  Every cell is at least as wide as the cutoff, so interacting
+    // particles are always in the same cell or adjacent ones.
+
+    Vec3 origin, size;
+    if (usePeriodic)
+        size = Vec3(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2]);
+    else {
+        Vec3 minPos(posq[0], posq[1], posq[2]), maxPos = minPos;
+        for (int i = 1; i < numParticles; i++)
+            for (int j = 0; j < 3; j++) {
+                minPos[j] = min(minPos[j], (double) posq[4*i+j]);
+                maxPos[j] = max(maxPos[j], (double) posq[4*i+j]);
+            }
+        origin = minPos;
+        size = maxPos-minPos;
+    }
+    int numCells[3];
+    for (int i = 0; i < 3; i++) {
+        numCells[i] = max(1, (int) (size[i]/cutoffDistance));
+        if (usePeriodic && numCells[i] < 3)
+            numCells[i] = 1; // With fewer than three cells, neighbors on both sides would be the same cell.
+    }
+    while ((long long) numCells[0]*numCells[1]*numCells[2] > 8LL*numParticles+8) {
+        int largest = (numCells[0] >= numCells[1] && numCells[0] >= numCells[2] ? 0 : (numCells[1] >= numCells[2] ? 1 : 2));
+        numCells[largest] = max(1, numCells[largest]/2);
+        if (usePeriodic && numCells[largest] < 3)
+            numCells[largest] = 1;
+    }
+    int totalCells = numCells[0]*numCells[1]*numCells[2];
+
+    // Sort the particles into cells.
+
+    vector<int> particleCell(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        int cell[3];
+        for (int j = 0; j < 3; j++) {
+            double x = posq[4*i+j]-origin[j];
+            if (usePeriodic)
+                x -= floor(x/size[j])*size[j];
+            cell[j] = (size[j] > 0 ? (int) (x*numCells[j]/size[j]) : 0);
+            cell[j] = min(max(cell[j], 0), numCells[j]-1);
         }
+        particleCell[i] = cell[0]+numCells[0]*(cell[1]+numCells[1]*cell[2]);
     }
+    cellStart.assign(totalCells+1, 0);
+    for (int i = 0; i < numParticles; i++)
+        cellStart[particleCell[i]+1]++;
+    for (int i = 0; i < totalCells; i++)
+        cellStart[i+1] += cellStart[i];
+    centralParticleOrder.resize(numParticles);
+    vector<int> nextIndex(cellStart.begin(), cellStart.end()-1);
+    for (int i = 0; i < numParticles; i++)
+        centralParticleOrder[nextIndex[particleCell[i]]++] = i;
+
+    // Each cell is compared to itself and the 13 neighbors in the forward half of its shell.
+
+    vector<int> offsets;
+    for (int dz = -1; dz <= 1; dz++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++) {
+                if (dz < 0 || (dz == 0 && dy < 0) || (dz == 0 && dy == 0 && dx <= 0))
+                    continue;
+                if ((dx != 0 && numCells[0] == 1) || (dy != 0 && numCells[1] == 1) || (dz != 0 && numCells[2] == 1))
+                    continue;
+                offsets.push_back(dx);
+                offsets.push_back(dy);
+                offsets.push_back(dz);
+            }
+    int numOffsets = offsets.size()/3;
+    float cutoff2 = (float) (cutoffDistance*cutoffDistance);
+    atomicCounter = 0;
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        vector<pair<int, int> >& pairs = threadPairs[threadIndex];
+        fvec4 boxSize(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2], 0);
+        fvec4 invBoxSize(recipBoxSize[0], recipBoxSize[1], recipBoxSize[2], 0);
+        auto addPair = [&] (int p1, int p2) {
+            if (!canInteract(p1, p2))
+                return;
+            fvec4 deltaR;
+            float r2;
+            computeDelta(fvec4(posq+4*p1), fvec4(posq+4*p2), deltaR, r2, boxSize, invBoxSize);
+            if (r2 >= cutoff2)
+                return;
+            if (exclusions[p1].size() > 0 && exclusions[p1].find(p2) != exclusions[p1].end())
+                return;
+            pairs.push_back(make_pair(min(p1, p2), max(p1, p2)));
+        };
+        while (true) {
+            int cell = atomicCounter++;
+            if (cell >= totalCells)
+                break;
+            int x = cell%numCells[0];
+            int y = (cell/numCells[0])%numCells[1];
+            int z = cell/(numCells[0]*numCells[1]);
+            for (int i = cellStart[cell]; i < cellStart[cell+1]; i++)
+                for (int j = i+1; j < cellStart[cell+1]; j++)
+                    addPair(centralParticleOrder[i], centralParticleOrder[j]);
+            for (int k = 0; k < numOffsets; k++) {
+                int nx = x+offsets[3*k], ny = y+offsets[3*k+1], nz = z+offsets[3*k+2];
+                if (usePeriodic) {
+                    nx = (nx+numCells[0])%numCells[0];
+                    ny = (ny+numCells[1])%numCells[1];
+                    nz = (nz+numCells[2])%numCells[2];
+                }
+                else if (nx < 0 || nx >= numCells[0] || ny < 0 || ny >= numCells[1] || nz < 0 || nz >= numCells[2])
+                    continue;
+                int neighbor = nx+numCells[0]*(ny+numCells[1]*nz);
+                for (int i = cellStart[cell]; i < cellStart[cell+1]; i++)
+                    for (int j = cellStart[neighbor]; j < cellStart[neighbor+1]; j++)
+                        addPair(centralParticleOrder[i], centralParticleOrder[j]);
+            }
+        }
+    });
+    threads.waitForThreads();
+}
+
+void CpuCustomManyParticleForce::findPairsWithNeighborList() {
+    neighborList->computeNeighborList(numParticles, *posqArray, exclusions, periodicBoxVectors, usePeriodic, cutoffDistance, threads);
+    atomicCounter = 0;
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        vector<pair<int, int> >& pairs = threadPairs[threadIndex];
+        const int blockSize = neighborList->getBlockSize();
+        while (true) {
+            int blockIndex = atomicCounter++;
+            if (blockIndex >= neighborList->getNumBlocks())
+                break;
+            const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+            const auto& blockExclusions = neighborList->getBlockExclusions(blockIndex);
+            int numInBlock = min(blockSize, numParticles-blockSize*blockIndex);
+            for (int i = 0; i < numInBlock; i++) {
+                int p1 = neighborList->getSortedAtoms()[blockSize*blockIndex+i];
+                for (int j = 0; j < (int) neighbors.size(); j++) {
+                    int p2 = neighbors[j];
+                    if ((blockExclusions[j] & (1<<i)) == 0 && canInteract(p1, p2))
+                        pairs.push_back(make_pair(min(p1, p2), max(p1, p2)));
+                }
+            }
+        }
+    });
+    threads.waitForThreads();
+    centralParticleOrder.resize(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        centralParticleOrder[i] = i;
 }
 
 void CpuCustomManyParticleForce::setUseCutoff(double distance) {
@@ -209,18 +407,19 @@ void CpuCustomManyParticleForce::setPeriodic(Vec3* periodicBoxVectors) {
                  periodicBoxVectors[2][0] != 0.0 || periodicBoxVectors[2][1] != 0.0);
 }
 
-void CpuCustomManyParticleForce::loopOverInteractions(vector<int>& availableParticles, vector<int>& particleSet, int loopIndex, int startIndex,
+void CpuCustomManyParticleForce::loopOverInteractions(const int* availableParticles, int numAvailable, vector<int>& particleSet, int loopIndex, int startIndex,
                                                       vector<double>* particleParameters, float* forces, ThreadData& data, const fvec4& boxSize, const fvec4& invBoxSize) {
-    int numParticles = availableParticles.size();
     double cutoff2 = cutoffDistance*cutoffDistance;
     int checkRange = (centralParticleMode ? 1 : loopIndex);
-    for (int i = startIndex; i < numParticles; i++) {
+    for (int i = startIndex; i < numAvailable; i++) {
         int particle = availableParticles[i];
         
         // Check whether this particle can actually participate in interactions with the others found so far.
         
         bool include = true;
-        if (useCutoff) {
+        for (int j = 0; j < loopIndex && include; j++)
+            include &= canInteract(particle, particleSet[j]);
+        if (useCutoff && include) {
             fvec4 deltaR;
             fvec4 pos1(posq+4*particle);
             float r2;
@@ -239,7 +438,7 @@ void CpuCustomManyParticleForce::loopOverInteractions(vector<int>& availablePart
             if (loopIndex == numParticlesPerSet-1)
                 calculateOneIxn(particleSet, particleParameters, forces, data, boxSize, invBoxSize);
             else
-                loopOverInteractions(availableParticles, particleSet, loopIndex+1, i+1, particleParameters, forces, data, boxSize, invBoxSize);
+                loopOverInteractions(availableParticles, numAvailable, particleSet, loopIndex+1, i+1, particleParameters, forces, data, boxSize, invBoxSize);
         }
     }
 }
@@ -294,6 +493,8 @@ void CpuCustomManyParticleForce::calculateOneIxn(vector<int>& particleSet, vecto
         for (int i = 0; i < numParticlesPerSet; i++) {
             int index = permutedParticles[i];
             (fvec4(forces+4*index)+f[i]).store(forces+4*index);
+            if (data.blockUsed != NULL)
+                data.blockUsed[index/forceBlockSize] = 1;
         }
     }
 
@@ -324,7 +525,7 @@ CpuCustomManyParticleForce::ParticleTermInfo::ParticleTermInfo(const string& nam
     variableIndex = data.expressionSet.getVariableIndex(name);
 }
 
-CpuCustomManyParticleForce::ThreadData::ThreadData(const CustomManyParticleForce& force, Lepton::ParsedExpression& energyExpr) {
+CpuCustomManyParticleForce::ThreadData::ThreadData(const CustomManyParticleForce& force, Lepton::ParsedExpression& energyExpr) : blockUsed(NULL) {
     int numParticlesPerSet = force.getNumParticlesPerSet();
     int numPerParticleParameters = force.getNumPerParticleParameters();
     particleParamIndices.resize(numParticlesPerSet);
@@ -32,34 +32,54 @@
 using namespace OpenMM;
 using namespace std;
 
-CpuCustomNonbondedForce::ThreadData::ThreadData(const Lepton::CompiledExpression& energyExpression, const Lepton::CompiledExpression& forceExpression,
-            const vector<string>& parameterNames, const std::vector<Lepton::CompiledExpression> energyParamDerivExpressions) :
-            energyExpression(energyExpression), forceExpression(forceExpression), energyParamDerivExpressions(energyParamDerivExpressions) {
+const int CpuCustomNonbondedForce::BatchSize = 32;
+
+/**
+ * Return how much vectorisation is supported for host platform.
+ */
+int getVecBlockSize();
+
+CpuCustomNonbondedForce::ThreadData::ThreadData(const Lepton::CompiledVectorExpression& energyExpression, const Lepton::CompiledVectorExpression& forceExpression,
+            const vector<string>& parameterNames, const std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions) :
+            energyExpression(energyExpression), forceExpression(forceExpression), energyParamDerivExpressions(energyParamDerivExpressions), numInBatch(0), blockUsed(NULL) {
+    r.resize(BatchSize, 1.0);
+    switchValue.resize(BatchSize);
+    atom1.resize(BatchSize);
+    atom2.resize(BatchSize);
+    deltaR.resize(BatchSize);
     map<string, double*> variableLocations;
-    variableLocations["r"] = &r;
-    particleParam.resize(2*parameterNames.size());
+    variableLocations["r"] = &r[0];
+    particleParam.resize(2*parameterNames.size()*BatchSize, 0.0);
     for (int i = 0; i < (int) parameterNames.size(); i++) {
         for (int j = 0; j < 2; j++) {
             stringstream name;
             name << parameterNames[i] << (j+1);
-            variableLocations[name.str()] = &particleParam[i*2+j];
+            variableLocations[name.str()] = &particleParam[(i*2+j)*BatchSize];
         }
     }
+
+    // Any other variable is a global parameter, which has the same value for every interaction in the batch.
+
+    vector<Lepton::CompiledVectorExpression*> expressions;
+    expressions.push_back(&this->energyExpression);
+    expressions.push_back(&this->forceExpression);
+    for (auto& expression : this->energyParamDerivExpressions)
+        expressions.push_back(&expression);
+    for (auto expression : expressions)
+        for (auto& name : expression->getVariables())
+            if (variableLocations.find(name) == variableLocations.end()) {
+                globalParamValues[name].resize(BatchSize, 0.0);
+                variableLocations[name] = &globalParamValues[name][0];
+            }
     energyParamDerivs.resize(energyParamDerivExpressions.size());
-    this->energyExpression.setVariableLocations(variableLocations);
-    this->forceExpression.setVariableLocations(variableLocations);
-    expressionSet.registerExpression(this->energyExpression);
-    expressionSet.registerExpression(this->forceExpression);
-    for (auto& expression : this->energyParamDerivExpressions) {
-        expression.setVariableLocations(variableLocations);
-        expressionSet.registerExpression(expression);
-    }
+    for (auto expression : expressions)
+        expression->setVariableLocations(variableLocations);
 }
 
-CpuCustomNonbondedForce::CpuCustomNonbondedForce(const Lepton::CompiledExpression& energyExpression,
-            const Lepton::CompiledExpression& forceExpression, const vector<string>& parameterNames, const vector<set<int> >& exclusions,
-            const std::vector<Lepton::CompiledExpression> energyParamDerivExpressions, ThreadPool& threads) :
-            cutoff(false), useSwitch(false), periodic(false), useInteractionGroups(false), paramNames(parameterNames), exclusions(exclusions), threads(threads) {
+CpuCustomNonbondedForce::CpuCustomNonbondedForce(const Lepton::CompiledVectorExpression& energyExpression,
+            const Lepton::CompiledVectorExpression& forceExpression, const vector<string>& parameterNames, const vector<set<int> >& exclusions,
+            const std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions, ThreadPool& threads) :
+            cutoff(false), useSwitch(false), periodic(false), useInteractionGroups(false), threads(threads), exclusions(exclusions), paramNames(parameterNames), groupListsValid(false), forceBlockUsed(NULL), forceBlockSize(0) {
     for (int i = 0; i < threads.getNumThreads(); i++)
         threadData.push_back(new ThreadData(energyExpression, forceExpression, parameterNames, energyParamDerivExpressions));
 }
@@ -67,6 +87,8 @@ CpuCustomNonbondedForce::CpuCustomNonbondedForce(const Lepton::CompiledExpressio
 CpuCustomNonbondedForce::~CpuCustomNonbondedForce() {
     for (auto data : threadData)
         delete data;
+    for (auto list : groupNeighborLists)
+        delete list;
 }
 
 void CpuCustomNonbondedForce::setUseCutoff(double distance, const CpuNeighborList& neighbors) {
@@ -75,8 +97,52 @@ void CpuCustomNonbondedForce::setUseCutoff(double distance, const CpuNeighborLis
     neighborList = &neighbors;
   }
 
+void CpuCustomNonbondedForce::setUseCutoff(double distance, double padding) {
+    cutoff = true;
+    cutoffDistance = distance;
+    groupListPadding = padding;
+    neighborList = NULL;
+}
+
 void CpuCustomNonbondedForce::setInteractionGroups(const vector<pair<set<int>, set<int> > >& groups) {
     useInteractionGroups = true;
+    this->groups = groups;
+
+    // For each group, record the atoms it contains, which set(s) each one belongs to, and the
+    // exclusions between them in terms of their indices within the group.
+
+    set<int> allAtoms;
+    for (auto& group : groups) {
+        set<int> atoms = group.first;
+        atoms.insert(group.second.begin(), group.second.end());
+        groupAtoms.push_back(vector<int>(atoms.begin(), atoms.end()));
+        const vector<int>& atomList = groupAtoms.back();
+        map<int, int> localIndex;
+        for (int i = 0; i < (int) atomList.size(); i++)
+            localIndex[atomList[i]] = i;
+        vector<char> membership(atomList.size(), 0);
+        vector<set<int> > localExclusions(atomList.size());
+        for (int i = 0; i < (int) atomList.size(); i++) {
+            int atom = atomList[i];
+            if (group.first.find(atom) != group.first.end())
+                membership[i] |= 1;
+            if (group.second.find(atom) != group.second.end())
+                membership[i] |= 2;
+            for (int excluded : exclusions[atom]) {
+                auto local = localIndex.find(excluded);
+                if (local != localIndex.end())
+                    localExclusions[i].insert(local->second);
+            }
+        }
+        groupMembership.push_back(membership);
+        groupExclusions.push_back(localExclusions);
+        allAtoms.insert(atoms.begin(), atoms.end());
+    }
+    groupUnionAtoms = vector<int>(allAtoms.begin(), allAtoms.end());
+    groupListsValid = false;
+}
+
+void CpuCustomNonbondedForce::createGroupInteractions() {
     for (auto& group : groups) {
         const set<int>& set1 = group.first;
         const set<int>& set2 = group.second;
@@ -92,6 +158,111 @@ void CpuCustomNonbondedForce::setInteractionGroups(const vector<pair<set<int>, s
     }
 }
 
+void CpuCustomNonbondedForce::updateGroupNeighborLists() {
+    // The lists include every pair within the cutoff plus a padding distance, so they only need
+    // to be rebuilt once some atom has moved more than half the padding since the last build, or
+    // the periodic box has changed.  The padding is chosen by the platform, so it may also change
+    // between steps.
+
+    float padding = (float) groupListPadding;
+    bool needRebuild = (!groupListsValid || padding != groupListBuiltPadding);
+    if (periodic)
+        for (int i = 0; i < 3; i++)
+            if (periodicBoxVectors[i] != groupListBoxVectors[i])
+                needRebuild = true;
+    if (!needRebuild) {
+        float maxDisplacement2 = 0.25f*padding*padding;
+        int numUnionAtoms = groupUnionAtoms.size();
+        atomic<bool> moved(false);
+        threads.execute([&] (ThreadPool& threads, int threadIndex) {
+            int start = threadIndex*numUnionAtoms/threads.getNumThreads();
+            int end = (threadIndex+1)*numUnionAtoms/threads.getNumThreads();
+            for (int i = start; i < end && !moved; i++) {
+                int atom = groupUnionAtoms[i];
+                float dx = posq[4*atom]-groupListPositions[3*i];
+                float dy = posq[4*atom+1]-groupListPositions[3*i+1];
+                float dz = posq[4*atom+2]-groupListPositions[3*i+2];
+                if (dx*dx+dy*dy+dz*dz > maxDisplacement2)
+                    moved = true;
+            }
+        });
+        threads.waitForThreads();
+        needRebuild = moved;
+    }
+    if (!needRebuild)
+        return;
+
+    // Build a neighbor list for each group containing only its own atoms, then extract the pairs
+    // that actually interact: one atom must be in each set.
+
+    int numThreads = threads.getNumThreads();
+    threadGroupPairs.resize(numThreads);
+    for (auto& pairs : threadGroupPairs)
+        pairs.clear();
+    AlignedArray<float> groupPosq;
+    for (int group = 0; group < (int) groupAtoms.size(); group++) {
+        const vector<int>& atoms = groupAtoms[group];
+        const vector<char>& membership = groupMembership[group];
+        int numAtoms = atoms.size();
+        if (numAtoms == 0)
+            continue;
+        if (group >= (int) groupNeighborLists.size())
+            groupNeighborLists.push_back(new CpuNeighborList(getVecBlockSize()));
+        CpuNeighborList& list = *groupNeighborLists[group];
+        groupPosq.resize(4*numAtoms);
+        for (int i = 0; i < numAtoms; i++)
+            for (int j = 0; j < 4; j++)
+                groupPosq[4*i+j] = posq[4*atoms[i]+j];
+        list.computeNeighborList(numAtoms, groupPosq, groupExclusions[group], periodicBoxVectors, periodic, cutoffDistance+padding, threads);
+        atomicCounter = 0;
+        threads.execute([&] (ThreadPool& threads, int threadIndex) {
+            vector<pair<int, int> >& pairs = threadGroupPairs[threadIndex];
+            const int blockSize = list.getBlockSize();
+            while (true) {
+                int blockIndex = atomicCounter++;
+                if (blockIndex >= list.getNumBlocks())
+                    break;
+                const int32_t* blockAtom = &list.getSortedAtoms()[blockSize*blockIndex];
+                int numInBlock = min(blockSize, numAtoms-blockSize*blockIndex);
+                const vector<int>& neighbors = list.getBlockNeighbors(blockIndex);
+                const auto& blockExclusions = list.getBlockExclusions(blockIndex);
+                for (int i = 0; i < (int) neighbors.size(); i++) {
+                    int first = neighbors[i];
+                    for (int k = 0; k < numInBlock; k++) {
+                        if ((blockExclusions[i] & (1<<k)) != 0)
+                            continue;
+                        // Put the atom from the first set first, as the energy may not be symmetric.  If
+                        // both atoms are in both sets, use the same order as when there is no cutoff.
+
+                        int second = blockAtom[k];
+                        int atom1 = atoms[first], atom2 = atoms[second];
+                        bool forward = ((membership[first]&1) && (membership[second]&2));
+                        bool backward = ((membership[first]&2) && (membership[second]&1));
+                        if (forward && backward)
+                            pairs.push_back(make_pair(min(atom1, atom2), max(atom1, atom2)));
+                        else if (forward)
+                            pairs.push_back(make_pair(atom1, atom2));
+                        else if (backward)
+                            pairs.push_back(make_pair(atom2, atom1));
+                    }
+                }
+            }
+        });
+        threads.waitForThreads();
+    }
+
+    // Record the positions the lists were built from.
+
+    groupListPositions.resize(3*groupUnionAtoms.size());
+    for (int i = 0; i < (int) groupUnionAtoms.size(); i++)
+        for (int j = 0; j < 3; j++)
+            groupListPositions[3*i+j] = posq[4*groupUnionAtoms[i]+j];
+    for (int i = 0; i < 3; i++)
+        groupListBoxVectors[i] = periodicBoxVectors[i];
+    groupListBuiltPadding = padding;
+    groupListsValid = true;
+}
+
 void CpuCustomNonbondedForce::setUseSwitchingFunction(double distance) {
     useSwitch = true;
     switchingDistance = distance;
@@ -133,6 +304,12 @@ void CpuCustomNonbondedForce::calculatePairIxn(int numberOfAtoms, float* posq, v
     this->includeForce = includeForce;
     this->includeEnergy = includeEnergy;
     threadEnergy.resize(threads.getNumThreads());
+    if (useInteractionGroups) {
+        if (cutoff)
+            updateGroupNeighborLists();
+        else if (groupInteractions.size() == 0)
+            createGroupInteractions();
+    }
     atomicCounter = 0;
     
     // Signal the threads to start running and wait for them to finish.
@@ -156,6 +333,11 @@ void CpuCustomNonbondedForce::calculatePairIxn(int numberOfAtoms, float* posq, v
             energyParamDerivs[j] += threadData[i]->energyParamDerivs[j];
 }
 
+void CpuCustomNonbondedForce::setForceBlockTracking(vector<vector<char> >* blockUsed, int blockSize) {
+    forceBlockUsed = blockUsed;
+    forceBlockSize = blockSize;
+}
+
 void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     // Compute this thread's subset of interactions.
 
@@ -164,13 +346,25 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
     double& energy = threadEnergy[threadIndex];
     float* forces = &(*threadForce)[threadIndex][0];
     ThreadData& data = *threadData[threadIndex];
-    for (auto& param : *globalParameters)
-        data.expressionSet.setVariable(data.expressionSet.getVariableIndex(param.first), param.second);
+    data.blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
+    for (auto& param : *globalParameters) {
+        auto values = data.globalParamValues.find(param.first);
+        if (values != data.globalParamValues.end())
+            for (double& value : values->second)
+                value = param.second;
+    }
     for (auto& deriv : data.energyParamDerivs)
         deriv = 0.0;
     fvec4 boxSize(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2], 0);
     fvec4 invBoxSize(recipBoxSize[0], recipBoxSize[1], recipBoxSize[2], 0);
-    if (useInteractionGroups) {
+    if (useInteractionGroups && cutoff) {
+        // The user has specified interaction groups, so compute only the requested interactions
+        // that this thread found in the groups' neighbor lists.
+
+        for (auto& pair : threadGroupPairs[threadIndex])
+            addInteraction(pair.first, pair.second, data, forces, energy, boxSize, invBoxSize);
+    }
+    else if (useInteractionGroups) {
         // The user has specified interaction groups, so compute only the requested interactions.
         
         int start = threadIndex*groupInteractions.size()/numThreads;
@@ -178,11 +372,7 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
         for (int i = start; i < end; i++) {
             int atom1 = groupInteractions[i].first;
             int atom2 = groupInteractions[i].second;
-            for (int j = 0; j < (int) paramNames.size(); j++) {
-                data.particleParam[j*2] = atomParameters[atom1][j];
-                data.particleParam[j*2+1] = atomParameters[atom2][j];
-            }
-            calculateOneIxn(atom1, atom2, data, forces, energy, boxSize, invBoxSize);
+            addInteraction(atom1, atom2, data, forces, energy, boxSize, invBoxSize);
         }
     }
     else if (cutoff) {
@@ -198,16 +388,9 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
             const auto& exclusions = neighborList->getBlockExclusions(blockIndex);
             for (int i = 0; i < (int) neighbors.size(); i++) {
                 int first = neighbors[i];
-                for (int j = 0; j < (int) paramNames.size(); j++)
-                    data.particleParam[j*2] = atomParameters[first][j];
-                for (int k = 0; k < blockSize; k++) {
-                    if ((exclusions[i] & (1<<k)) == 0) {
-                        int second = blockAtom[k];
-                        for (int j = 0; j < (int) paramNames.size(); j++)
-                            data.particleParam[j*2+1] = atomParameters[second][j];
-                        calculateOneIxn(first, second, data, forces, energy, boxSize, invBoxSize);
-                    }
-                }
+                for (int k = 0; k < blockSize; k++)
+                    if ((exclusions[i] & (1<<k)) == 0)
+                        addInteraction(first, blockAtom[k], data, forces, energy, boxSize, invBoxSize);
             }
         }
     }
@@ -219,19 +402,18 @@ void CpuCustomNonbondedForce::threadComputeForce(ThreadPool& threads, int thread
             if (ii >= numberOfAtoms)
                 break;
             for (int jj = ii+1; jj < numberOfAtoms; jj++) {
-                if (exclusions[jj].find(ii) == exclusions[jj].end()) {
-                    for (int j = 0; j < (int) paramNames.size(); j++) {
-                        data.particleParam[j*2] = atomParameters[ii][j];
-                        data.particleParam[j*2+1] = atomParameters[jj][j];
-                    }
-                    calculateOneIxn(ii, jj, data, forces, energy, boxSize, invBoxSize);
-                }
+                if (exclusions[jj].find(ii) == exclusions[jj].end())
+                    addInteraction(ii, jj, data, forces, energy, boxSize, invBoxSize);
             }
         }
     }
+
+    // Evaluate whatever is left in the final, partially filled batch.
+
+    computeBatch(data, forces, energy);
 }
 
-void CpuCustomNonbondedForce::calculateOneIxn(int ii, int jj, ThreadData& data, 
+void CpuCustomNonbondedForce::addInteraction(int ii, int jj, ThreadData& data, 
         float* forces, double& totalEnergy, const fvec4& boxSize, const fvec4& invBoxSize) {
     // Get deltaR, R2, and R between 2 atoms
 
@@ -242,37 +424,74 @@ void CpuCustomNonbondedForce::calculateOneIxn(int ii, int jj, ThreadData& data,
     getDeltaR(posI, posJ, deltaR, r2, boxSize, invBoxSize);
     if (cutoff && r2 >= cutoffDistance*cutoffDistance)
         return;
-    float r = sqrtf(r2);
-    data.r = r;
+
+    // Record it in the batch.
+
+    int index = data.numInBatch++;
+    data.atom1[index] = ii;
+    data.atom2[index] = jj;
+    data.deltaR[index] = deltaR;
+    data.r[index] = sqrtf(r2);
+    for (int j = 0; j < (int) paramNames.size(); j++) {
+        data.particleParam[(j*2)*BatchSize+index] = atomParameters[ii][j];
+        data.particleParam[(j*2+1)*BatchSize+index] = atomParameters[jj][j];
+    }
+    if (data.numInBatch == BatchSize)
+        computeBatch(data, forces, totalEnergy);
+}
+
+void CpuCustomNonbondedForce::computeBatch(ThreadData& data, float* forces, double& totalEnergy) {
+    int numInBatch = data.numInBatch;
+    if (numInBatch == 0)
+        return;
+    data.numInBatch = 0;
+
+    // Evaluate the expressions for every interaction in the batch at once.
+
+    const double* forceValues = (includeForce ? data.forceExpression.evaluate() : NULL);
+    const double* energyValues = (includeEnergy || useSwitch ? data.energyExpression.evaluate() : NULL);
 
     // accumulate forces
 
-    double dEdR = (includeForce ? data.forceExpression.evaluate()/r : 0.0);
-    double energy = 0.0;
-    if (includeEnergy || (useSwitch && r > switchingDistance))
-        energy = data.energyExpression.evaluate();
-    double switchValue = 1.0;
-    if (useSwitch) {
-        if (r > switchingDistance) {
-            double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
-            switchValue = 1+t*t*t*(-10+t*(15-t*6));
-            double switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
-            dEdR = switchValue*dEdR + energy*switchDeriv/r;
-            energy *= switchValue;
+    for (int k = 0; k < numInBatch; k++) {
+        double r = data.r[k];
+        double dEdR = (includeForce ? forceValues[k]/r : 0.0);
+        double energy = 0.0;
+        if (includeEnergy || (useSwitch && r > switchingDistance))
+            energy = energyValues[k];
+        double switchValue = 1.0;
+        if (useSwitch) {
+            if (r > switchingDistance) {
+                double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
+                switchValue = 1+t*t*t*(-10+t*(15-t*6));
+                double switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
+                dEdR = switchValue*dEdR + energy*switchDeriv/r;
+                energy *= switchValue;
+            }
+        }
+        data.switchValue[k] = switchValue;
+        int ii = data.atom1[k];
+        int jj = data.atom2[k];
+        fvec4 result = data.deltaR[k]*dEdR;
+        (fvec4(forces+4*ii)+result).store(forces+4*ii);
+        (fvec4(forces+4*jj)-result).store(forces+4*jj);
+        if (data.blockUsed != NULL) {
+            data.blockUsed[ii/forceBlockSize] = 1;
+            data.blockUsed[jj/forceBlockSize] = 1;
         }
-    }
-    fvec4 result = deltaR*dEdR;
-    (fvec4(forces+4*ii)+result).store(forces+4*ii);
-    (fvec4(forces+4*jj)-result).store(forces+4*jj);
 
-    // accumulate energies
+        // accumulate energies
 
-    totalEnergy += energy;
+        totalEnergy += energy;
+    }
     
     // Accumulate energy derivatives.
 
-    for (int i = 0; i < data.energyParamDerivExpressions.size(); i++)
-        data.energyParamDerivs[i] += switchValue*data.energyParamDerivExpressions[i].evaluate();
+    for (int i = 0; i < data.energyParamDerivExpressions.size(); i++) {
+        const double* derivValues = data.energyParamDerivExpressions[i].evaluate();
+        for (int k = 0; k < numInBatch; k++)
+            data.energyParamDerivs[i] += data.switchValue[k]*derivValues[k];
+    }
 }
 
 void CpuCustomNonbondedForce::getDeltaR(const fvec4& posI, const fvec4& posJ, fvec4& deltaR, float& r2, const fvec4& boxSize, const fvec4& invBoxSize) const {
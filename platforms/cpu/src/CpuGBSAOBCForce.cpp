@@ -31,11 +31,24 @@
 using namespace std;
 using namespace OpenMM;
 
+/**
+ * This holds the positions and parameters of a group of up to four atoms, along with values that
+ * are accumulated while looping over their neighbors.
+ */
+class CpuGBSAOBCForce::AtomGroup {
+public:
+    int index[4];
+    int numAtoms;
+    ivec4 mask;
+    fvec4 x, y, z, charge, offsetRadius, scaledRadius, bornRadius, bornForce;
+    fvec4 forceX, forceY, forceZ, sum;
+};
+
 const int CpuGBSAOBCForce::NUM_TABLE_POINTS = 4096;
 const float CpuGBSAOBCForce::TABLE_MIN = 0.25f;
 const float CpuGBSAOBCForce::TABLE_MAX = 1.5f;
 
-CpuGBSAOBCForce::CpuGBSAOBCForce() : cutoff(false), periodic(false) {
+CpuGBSAOBCForce::CpuGBSAOBCForce() : cutoff(false), periodic(false), neighborList(NULL), maskedPairs(NULL), forceBlockUsed(NULL), forceBlockSize(0) {
     logDX = (TABLE_MAX-TABLE_MIN)/NUM_TABLE_POINTS;
     logDXInv = 1.0f/logDX;
     logTable.resize(NUM_TABLE_POINTS+4);
@@ -50,6 +63,11 @@ void CpuGBSAOBCForce::setUseCutoff(float distance) {
     cutoffDistance = distance;
 }
 
+void CpuGBSAOBCForce::setNeighborList(const CpuNeighborList& neighbors, const vector<set<int> >& maskedPairs) {
+    neighborList = &neighbors;
+    this->maskedPairs = (maskedPairs.size() == 0 ? NULL : &maskedPairs);
+}
+
 void CpuGBSAOBCForce::setPeriodic(float* periodicBoxSize) {
     periodic = true;
     this->periodicBoxSize[0] = periodicBoxSize[0];
@@ -77,9 +95,11 @@ void CpuGBSAOBCForce::setParticleParameters(const std::vector<std::pair<float, f
     particleParams = params;
     bornRadii.resize(params.size()+3);
     obcChain.resize(params.size()+3);
+    totalBornForces.resize(params.size()+3);
     for (int i = bornRadii.size()-3; i < bornRadii.size(); i++) {
         bornRadii[i] = 0;
         obcChain[i] = 0;
+        totalBornForces[i] = 0;
     }
 }
 
@@ -98,17 +118,38 @@ void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<Align
     // Signal the threads to start running and wait for them to finish.
     
     atomicCounter = 0;
-    threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputeForce(threads, threadIndex); });
-    threads.waitForThreads(); // Compute Born radii
-    atomicCounter = 0;
-    threads.resumeThreads();
-    threads.waitForThreads(); // Compute surface area term
-    atomicCounter = 0;
-    threads.resumeThreads();
-    threads.waitForThreads(); // First loop
-    atomicCounter = 0;
-    threads.resumeThreads();
-    threads.waitForThreads(); // Second loop
+    if (neighborList != NULL) {
+        threadBornSums.resize(numThreads);
+        for (int i = 0; i < numThreads; i++)
+            threadBornSums[i].resize(particleParams.size()+3);
+        threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputeNeighborListForce(threads, threadIndex); });
+        threads.waitForThreads(); // Accumulate Born radius sums
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // Compute Born radii and surface area term
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // First loop
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // Sum Born forces
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // Second loop
+    }
+    else {
+        threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputeForce(threads, threadIndex); });
+        threads.waitForThreads(); // Compute Born radii
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // Compute surface area term
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // First loop
+        atomicCounter = 0;
+        threads.resumeThreads();
+        threads.waitForThreads(); // Second loop
+    }
     
     // Combine the energies from all the threads.
     
@@ -120,6 +161,11 @@ void CpuGBSAOBCForce::computeForce(const AlignedArray<float>& posq, vector<Align
     }
 }
 
+void CpuGBSAOBCForce::setForceBlockTracking(vector<vector<char> >* blockUsed, int blockSize) {
+    forceBlockUsed = blockUsed;
+    forceBlockSize = blockSize;
+}
+
 void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     int numParticles = particleParams.size();
     int numThreads = threads.getNumThreads();
@@ -231,6 +277,7 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
     // First loop of Born energy computation.
 
     float* forces = &(*threadForce)[threadIndex][0];
+    char* blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
     float preFactor;
     if (soluteDielectric != 0.0f && solventDielectric != 0.0f)
         preFactor = ONE_4PI_EPS0*((1.0f/solventDielectric) - (1.0f/soluteDielectric));
@@ -290,6 +337,8 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             blockAtomForceZ -= fz;
             blockAtomBornForce += dGpol_dalpha2_ij*bornRadii[atomJ];
             float* atomForce = forces+4*atomJ;
+            if (blockUsed != NULL)
+                blockUsed[atomJ/forceBlockSize] = 1;
             fvec4 one(1.0f);
             atomForce[0] += dot4(fx, one);
             atomForce[1] += dot4(fy, one);
@@ -307,6 +356,8 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
         for (int i = 0; i < numInBlock; i++) {
             int atomIndex = blockStart+i;
             (fvec4(forces+4*atomIndex)+f[i]).store(forces+4*atomIndex);
+            if (blockUsed != NULL)
+                blockUsed[atomIndex/forceBlockSize] = 1;
             bornForces[atomIndex] += blockAtomBornForce[i];
         }
     }
@@ -377,6 +428,8 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
             blockAtomForceY += fy;
             blockAtomForceZ += fz;
             float* atomForce = forces+4*atomJ;
+            if (blockUsed != NULL)
+                blockUsed[atomJ/forceBlockSize] = 1;
             fvec4 one(1.0f);
             atomForce[0] -= dot4(fx, one);
             atomForce[1] -= dot4(fy, one);
@@ -387,11 +440,305 @@ void CpuGBSAOBCForce::threadComputeForce(ThreadPool& threads, int threadIndex) {
         for (int i = 0; i < numInBlock; i++) {
             int atomIndex = blockStart+i;
             (fvec4(forces+4*atomIndex)+f[i]).store(forces+4*atomIndex);
+            if (blockUsed != NULL)
+                blockUsed[atomIndex/forceBlockSize] = 1;
         }
     }
     threadEnergy[threadIndex] = energy;
 }
 
+void CpuGBSAOBCForce::threadComputeNeighborListForce(ThreadPool& threads, int threadIndex) {
+    int numParticles = particleParams.size();
+    int numThreads = threads.getNumThreads();
+    const float dielectricOffset = 0.009;
+    const float alphaObc = 1.0f;
+    const float betaObc = 0.8f;
+    const float gammaObc = 4.85f;
+    const float cutoff2 = cutoffDistance*cutoffDistance;
+    fvec4 boxSize(periodicBoxSize[0], periodicBoxSize[1], periodicBoxSize[2], 0);
+    fvec4 invBoxSize((1/periodicBoxSize[0]), (1/periodicBoxSize[1]), (1/periodicBoxSize[2]), 0);
+    fvec4 one(1.0f);
+    int start = (threadIndex*numParticles)/numThreads;
+    int end = ((threadIndex+1)*numParticles)/numThreads;
+
+    // Accumulate the sums used to compute Born radii.  Each pair contributes to the sums for both atoms.
+
+    AlignedArray<float>& bornSums = threadBornSums[threadIndex];
+    for (int i = 0; i < numParticles; i++)
+        bornSums[i] = 0.0f;
+    loopOverPairs(threads, threadIndex, [&] (AtomGroup& group, int atomJ, ivec4 include) {
+        fvec4 posJ(posq+4*atomJ);
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(posJ, group.x, group.y, group.z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        include = include & (r2 < cutoff2);
+        if (!any(include))
+            return;
+        fvec4 r = sqrt(r2);
+        group.sum += computeBornSumTerms(r, group.offsetRadius, particleParams[atomJ].second, include);
+        bornSums[atomJ] += dot4(computeBornSumTerms(r, particleParams[atomJ].first, group.scaledRadius, include), one);
+    },
+    [&] (AtomGroup& group) {
+        for (int i = 0; i < group.numAtoms; i++)
+            bornSums[group.index[i]] += group.sum[i];
+    });
+    threads.syncThreads();
+
+    // Compute the Born radii and the ACE surface area term for this thread's atoms.
+
+    const float probeRadius = 0.14f;
+    double energy = 0.0;
+    AlignedArray<float>& bornForces = threadBornForces[threadIndex];
+    for (int i = 0; i < numParticles; i++)
+        bornForces[i] = 0.0f;
+    for (int atomI = start; atomI < end; atomI++) {
+        float sum = 0.0f;
+        for (int i = 0; i < numThreads; i++)
+            sum += threadBornSums[i][atomI];
+        float offsetRadiusI = particleParams[atomI].first;
+        sum *= 0.5f*offsetRadiusI;
+        float sum2 = sum*sum;
+        float sum3 = sum*sum2;
+        float tanhSum = tanh(alphaObc*sum - betaObc*sum2 + gammaObc*sum3);
+        float radiusI = offsetRadiusI + dielectricOffset;
+        bornRadii[atomI] = 1.0f/(1.0f/offsetRadiusI - tanhSum/radiusI);
+        obcChain[atomI] = offsetRadiusI*(alphaObc - 2.0f*betaObc*sum + 3.0f*gammaObc*sum2);
+        obcChain[atomI] = (1.0f - tanhSum*tanhSum)*obcChain[atomI]/radiusI;
+        if (bornRadii[atomI] > 0) {
+            float r = radiusI + probeRadius;
+            float ratio6 = powf(radiusI/bornRadii[atomI], 6.0f);
+            float saTerm = surfaceAreaFactor*r*r*ratio6;
+            energy += saTerm;
+            bornForces[atomI] = -6.0f*saTerm/bornRadii[atomI];
+        }
+    }
+    threads.syncThreads();
+
+    // First loop of Born energy computation.  Start with the self interaction of each atom.
+
+    float* forces = &(*threadForce)[threadIndex][0];
+    char* blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
+    float preFactor;
+    if (soluteDielectric != 0.0f && solventDielectric != 0.0f)
+        preFactor = ONE_4PI_EPS0*((1.0f/solventDielectric) - (1.0f/soluteDielectric));
+    else
+        preFactor = 0.0f;
+    for (int atomI = start; atomI < end; atomI++) {
+        float Gpol = preFactor*posq[4*atomI+3]*posq[4*atomI+3]/bornRadii[atomI];
+        energy += 0.5f*Gpol;
+        bornForces[atomI] -= 0.5f*Gpol/bornRadii[atomI];
+    }
+    loopOverPairs(threads, threadIndex, [&] (AtomGroup& group, int atomJ, ivec4 include) {
+        fvec4 posJ(posq+4*atomJ);
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(posJ, group.x, group.y, group.z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        include = include & (r2 < cutoff2);
+        if (!any(include))
+            return;
+        fvec4 partialChargeI = preFactor*group.charge;
+        fvec4 alpha2_ij = group.bornRadius*bornRadii[atomJ];
+        fvec4 D_ij = r2/(4.0f*alpha2_ij);
+        fvec4 expTerm = exp(-D_ij);
+        fvec4 denominator2 = r2 + alpha2_ij*expTerm;
+        fvec4 denominator = sqrt(denominator2);
+        fvec4 Gpol = (partialChargeI*posJ[3])/denominator;
+        fvec4 dGpol_dr = -Gpol*(1.0f - 0.25f*expTerm)/denominator2;
+        fvec4 dGpol_dalpha2_ij = -0.5f*Gpol*expTerm*(1.0f + D_ij)/denominator2;
+        dGpol_dr = blend(0.0f, dGpol_dr, include);
+        dGpol_dalpha2_ij = blend(0.0f, dGpol_dalpha2_ij, include);
+        fvec4 fx = dx*dGpol_dr;
+        fvec4 fy = dy*dGpol_dr;
+        fvec4 fz = dz*dGpol_dr;
+        group.forceX -= fx;
+        group.forceY -= fy;
+        group.forceZ -= fz;
+        group.sum += dGpol_dalpha2_ij*bornRadii[atomJ];
+        float* atomForce = forces+4*atomJ;
+        if (blockUsed != NULL)
+            blockUsed[atomJ/forceBlockSize] = 1;
+        atomForce[0] += dot4(fx, one);
+        atomForce[1] += dot4(fy, one);
+        atomForce[2] += dot4(fz, one);
+        fvec4 termEnergy = Gpol;
+        if (cutoff)
+            termEnergy -= partialChargeI*posJ[3]/cutoffDistance;
+        energy += dot4(blend(0.0f, termEnergy, include), one);
+        bornForces[atomJ] += dot4(dGpol_dalpha2_ij, group.bornRadius);
+    },
+    [&] (AtomGroup& group) {
+        fvec4 f[4] = {group.forceX, group.forceY, group.forceZ, 0.0f};
+        transpose(f[0], f[1], f[2], f[3]);
+        for (int i = 0; i < group.numAtoms; i++) {
+            int atomIndex = group.index[i];
+            (fvec4(forces+4*atomIndex)+f[i]).store(forces+4*atomIndex);
+            if (blockUsed != NULL)
+                blockUsed[atomIndex/forceBlockSize] = 1;
+            bornForces[atomIndex] += group.sum[i];
+        }
+    });
+    threads.syncThreads();
+
+    // Sum the Born forces from all threads and apply the chain rule factors.
+
+    for (int atomI = start; atomI < end; atomI++) {
+        float bornForce = 0.0f;
+        for (int i = 0; i < numThreads; i++)
+            bornForce += threadBornForces[i][atomI];
+        totalBornForces[atomI] = bornForce*bornRadii[atomI]*bornRadii[atomI]*obcChain[atomI];
+    }
+    threads.syncThreads();
+
+    // Second loop of Born energy computation.
+
+    loopOverPairs(threads, threadIndex, [&] (AtomGroup& group, int atomJ, ivec4 include) {
+        fvec4 posJ(posq+4*atomJ);
+        fvec4 dx, dy, dz, r2;
+        getDeltaR(posJ, group.x, group.y, group.z, dx, dy, dz, r2, periodic, boxSize, invBoxSize);
+        include = include & (r2 < cutoff2);
+        if (!any(include))
+            return;
+        fvec4 r = sqrt(r2);
+        fvec4 de = group.bornForce*computeBornSumDerivs(r, group.offsetRadius, particleParams[atomJ].second, include) +
+                totalBornForces[atomJ]*computeBornSumDerivs(r, particleParams[atomJ].first, group.scaledRadius, include);
+        fvec4 fx = dx*de;
+        fvec4 fy = dy*de;
+        fvec4 fz = dz*de;
+        group.forceX += fx;
+        group.forceY += fy;
+        group.forceZ += fz;
+        float* atomForce = forces+4*atomJ;
+        if (blockUsed != NULL)
+            blockUsed[atomJ/forceBlockSize] = 1;
+        atomForce[0] -= dot4(fx, one);
+        atomForce[1] -= dot4(fy, one);
+        atomForce[2] -= dot4(fz, one);
+    },
+    [&] (AtomGroup& group) {
+        fvec4 f[4] = {group.forceX, group.forceY, group.forceZ, 0.0f};
+        transpose(f[0], f[1], f[2], f[3]);
+        for (int i = 0; i < group.numAtoms; i++) {
+            int atomIndex = group.index[i];
+            (fvec4(forces+4*atomIndex)+f[i]).store(forces+4*atomIndex);
+            if (blockUsed != NULL)
+                blockUsed[atomIndex/forceBlockSize] = 1;
+        }
+    });
+    threadEnergy[threadIndex] = energy;
+}
+
+void CpuGBSAOBCForce::loadAtomGroup(const int32_t* atoms, int numAtoms, AtomGroup& group) const {
+    int numParticles = particleParams.size();
+    float x[4], y[4], z[4], charge[4], offsetRadius[4], scaledRadius[4], bornRadius[4], bornForce[4];
+    int mask[4];
+    group.numAtoms = numAtoms;
+    for (int i = 0; i < 4; i++) {
+        if (i < numAtoms) {
+            int atom = atoms[i];
+            group.index[i] = atom;
+            x[i] = posq[4*atom];
+            y[i] = posq[4*atom+1];
+            z[i] = posq[4*atom+2];
+            charge[i] = posq[4*atom+3];
+            offsetRadius[i] = particleParams[atom].first;
+            scaledRadius[i] = particleParams[atom].second;
+            bornRadius[i] = bornRadii[atom];
+            bornForce[i] = totalBornForces[atom];
+            mask[i] = 0xFFFFFFFF;
+        }
+        else {
+            group.index[i] = numParticles;
+            x[i] = y[i] = z[i] = charge[i] = scaledRadius[i] = bornForce[i] = 0.0f;
+            offsetRadius[i] = bornRadius[i] = 1.0f;
+            mask[i] = 0;
+        }
+    }
+    group.x = fvec4(x);
+    group.y = fvec4(y);
+    group.z = fvec4(z);
+    group.charge = fvec4(charge);
+    group.offsetRadius = fvec4(offsetRadius);
+    group.scaledRadius = fvec4(scaledRadius);
+    group.bornRadius = fvec4(bornRadius);
+    group.bornForce = fvec4(bornForce);
+    group.mask = ivec4(mask);
+    group.forceX = group.forceY = group.forceZ = group.sum = fvec4(0.0f);
+}
+
+template <class PairFunction, class GroupFunction>
+void CpuGBSAOBCForce::loopOverPairs(ThreadPool& threads, int threadIndex, PairFunction pairFunction, GroupFunction groupFunction) {
+    // Process the pairs in the neighbor list.  Threads take blocks as they become free.
+
+    int numParticles = particleParams.size();
+    const int blockSize = neighborList->getBlockSize();
+    const vector<int32_t>& sortedAtoms = neighborList->getSortedAtoms();
+    const ivec4 bits(1, 2, 4, 8);
+    AtomGroup group;
+    while (true) {
+        int blockIndex = atomicCounter++;
+        if (blockIndex >= neighborList->getNumBlocks())
+            break;
+        int firstIndex = blockSize*blockIndex;
+        int atomsInBlock = min(blockSize, numParticles-firstIndex);
+        const vector<int>& neighbors = neighborList->getBlockNeighbors(blockIndex);
+        const auto& blockExclusions = neighborList->getBlockExclusions(blockIndex);
+        for (int first = 0; first < atomsInBlock; first += 4) {
+            loadAtomGroup(&sortedAtoms[firstIndex+first], min(4, atomsInBlock-first), group);
+            for (int i = 0; i < (int) neighbors.size(); i++) {
+                ivec4 include = group.mask & ((ivec4(blockExclusions[i]>>first) & bits) == ivec4(0));
+                if (any(include))
+                    pairFunction(group, neighbors[i], include);
+            }
+            groupFunction(group);
+        }
+    }
+
+    // The neighbor list omits excluded pairs, but they still interact through GBSA.  Each thread
+    // processes the excluded pairs for its own range of atoms.
+
+    if (maskedPairs != NULL) {
+        int numThreads = threads.getNumThreads();
+        int start = (threadIndex*numParticles)/numThreads;
+        int end = ((threadIndex+1)*numParticles)/numThreads;
+        for (int atomI = start; atomI < end; atomI++) {
+            const set<int>& pairs = (*maskedPairs)[atomI];
+            if (pairs.upper_bound(atomI) == pairs.end())
+                continue;
+            int32_t index = atomI;
+            loadAtomGroup(&index, 1, group);
+            for (auto atomJ = pairs.upper_bound(atomI); atomJ != pairs.end(); ++atomJ)
+                pairFunction(group, *atomJ, group.mask);
+            groupFunction(group);
+        }
+    }
+}
+
+fvec4 CpuGBSAOBCForce::computeBornSumTerms(const fvec4& r, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, ivec4 include) {
+    fvec4 rScaledRadiusJ = r + scaledRadiusJ;
+    include = include & (offsetRadiusI < rScaledRadiusJ);
+    fvec4 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec4 u_ij = 1.0f/rScaledRadiusJ;
+    fvec4 l_ij2 = l_ij*l_ij;
+    fvec4 u_ij2 = u_ij*u_ij;
+    fvec4 rInverse = 1.0f/r;
+    fvec4 logRatio = fastLog(u_ij/l_ij);
+    fvec4 term = l_ij - u_ij + 0.25f*r*(u_ij2 - l_ij2) + (0.5f*rInverse*logRatio) + (0.25f*scaledRadiusJ*scaledRadiusJ*rInverse)*(l_ij2 - u_ij2);
+    term += blend(0.0f, 2.0f*(1.0f/offsetRadiusI-l_ij), offsetRadiusI < scaledRadiusJ-r);
+    return blend(0.0f, term, include);
+}
+
+fvec4 CpuGBSAOBCForce::computeBornSumDerivs(const fvec4& r, const fvec4& offsetRadiusI, const fvec4& scaledRadiusJ, ivec4 include) {
+    fvec4 rScaledRadiusJ = r + scaledRadiusJ;
+    include = include & (offsetRadiusI < rScaledRadiusJ);
+    fvec4 l_ij = 1.0f/max(offsetRadiusI, abs(r-scaledRadiusJ));
+    fvec4 u_ij = 1.0f/rScaledRadiusJ;
+    fvec4 l_ij2 = l_ij*l_ij;
+    fvec4 u_ij2 = u_ij*u_ij;
+    fvec4 rInverse = 1.0f/r;
+    fvec4 r2Inverse = rInverse*rInverse;
+    fvec4 logRatio = fastLog(u_ij/l_ij);
+    fvec4 t3 = 0.125f*(1.0f + scaledRadiusJ*scaledRadiusJ*r2Inverse)*(l_ij2 - u_ij2) + 0.25f*logRatio*r2Inverse;
+    return blend(0.0f, t3*rInverse, include);
+}
+
 void CpuGBSAOBCForce::getDeltaR(const fvec4& posI, const fvec4& x, const fvec4& y, const fvec4& z, fvec4& dx, fvec4& dy, fvec4& dz, fvec4& r2, bool periodic, const fvec4& boxSize, const fvec4& invBoxSize) const {
     dx = x-posI[0];
     dy = y-posI[1];
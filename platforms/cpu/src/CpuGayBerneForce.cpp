@@ -116,6 +116,7 @@ double CpuGayBerneForce::calculateForce(const vector<Vec3>& positions, std::vect
     int numThreads = threads.getNumThreads();
     this->positions = &positions[0];
     this->threadForce = &threadForce;
+    this->threadForceBlockUsed = &data.threadForceBlockUsed;
     this->boxVectors = boxVectors;
     threadEnergy.resize(numThreads);
     threadTorque.resize(numThreads);
@@ -123,6 +124,7 @@ double CpuGayBerneForce::calculateForce(const vector<Vec3>& positions, std::vect
     
     // Signal the threads to compute the pairwise interactions.
     
+    data.waitForNeighborList();
     threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputeForce(threads, threadIndex, data.neighborList); });
     threads.waitForThreads();
     
@@ -149,6 +151,8 @@ void CpuGayBerneForce::threadComputeForce(ThreadPool& threads, int threadIndex,
     int numThreads = threads.getNumThreads();
     threadEnergy[threadIndex] = 0;
     float* forces = &(*threadForce)[threadIndex][0];
+    char* blockUsed = &(*threadForceBlockUsed)[threadIndex][0];
+    const int forceBlockSize = CpuPlatform::PlatformData::ForceBlockSize;
     vector<Vec3>& torques = threadTorque[threadIndex];
     torques.resize(numParticles);
     for (int i = 0; i < numParticles; i++)
@@ -172,6 +176,8 @@ void CpuGayBerneForce::threadComputeForce(ThreadPool& threads, int threadIndex,
                 double sigma = particles[i].sigmaOver2+particles[j].sigmaOver2;
                 double epsilon = particles[i].sqrtEpsilon*particles[j].sqrtEpsilon;
                 energy += computeOneInteraction(i, j, sigma, epsilon, positions, forces, torques, boxVectors);
+                blockUsed[i/forceBlockSize] = 1;
+                blockUsed[j/forceBlockSize] = 1;
             }
         }
     }
@@ -196,6 +202,8 @@ void CpuGayBerneForce::threadComputeForce(ThreadPool& threads, int threadIndex,
                         double sigma = particles[first].sigmaOver2+particles[second].sigmaOver2;
                         double epsilon = particles[first].sqrtEpsilon*particles[second].sqrtEpsilon;
                         energy += computeOneInteraction(first, second, sigma, epsilon, positions, forces, torques, boxVectors);
+                        blockUsed[first/forceBlockSize] = 1;
+                        blockUsed[second/forceBlockSize] = 1;
                     }
                 }
             }
@@ -215,6 +223,8 @@ void CpuGayBerneForce::threadComputeForce(ThreadPool& threads, int threadIndex,
         for (int i = start; i < end; i++) {
             ExceptionInfo& e = exceptions[i];
             energy += computeOneInteraction(e.particle1, e.particle2, e.sigma, e.epsilon, positions, forces, torques, boxVectors);
+            blockUsed[e.particle1/forceBlockSize] = 1;
+            blockUsed[e.particle2/forceBlockSize] = 1;
         }
     }
     threadEnergy[threadIndex] = energy;
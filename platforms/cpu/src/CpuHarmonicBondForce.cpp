@@ -0,0 +1,239 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuHarmonicBondForce.h"
+#include "CpuFixedPoint.h"
+#include "ReferenceForce.h"
+#include <cmath>
+#if !defined(__ARM__) && !defined(__ARM64__) && !defined(__PPC__)
+    #include <emmintrin.h>
+#endif
+
+using namespace OpenMM;
+using namespace std;
+
+const int CpuHarmonicBondForce::BatchSize = 64;
+
+CpuHarmonicBondForce::CpuHarmonicBondForce() : usePeriodic(false), deterministic(false) {
+}
+
+void CpuHarmonicBondForce::initialize(int numAtoms, vector<vector<int> >& bondAtoms, ThreadPool& threads, bool deterministic) {
+    this->threads = &threads;
+    this->deterministic = deterministic;
+    int numBonds = bondAtoms.size();
+    if (deterministic) {
+        fixedForces.resize(3*numAtoms, 0);
+        bondEnergy.resize(numBonds);
+    }
+    bondForce.initialize(numAtoms, numBonds, 2, bondAtoms, threads);
+    
+    // Record the bonds in each set in the order they will be processed.
+    
+    int numThreads = threads.getNumThreads();
+    setBonds.resize(numThreads+1);
+    setAtom1.resize(numThreads+1);
+    setAtom2.resize(numThreads+1);
+    setLength.resize(numThreads+1);
+    setK.resize(numThreads+1);
+    for (int i = 0; i <= numThreads; i++) {
+        setBonds[i] = (i < numThreads ? bondForce.getThreadBonds(i) : bondForce.getExtraBonds());
+        int size = setBonds[i].size();
+        setAtom1[i].resize(size);
+        setAtom2[i].resize(size);
+        for (int j = 0; j < size; j++) {
+            setAtom1[i][j] = bondAtoms[setBonds[i][j]][0];
+            setAtom2[i][j] = bondAtoms[setBonds[i][j]][1];
+        }
+        setLength[i].resize(size);
+        setK[i].resize(size);
+    }
+}
+
+void CpuHarmonicBondForce::setBondParameters(const vector<vector<double> >& parameters) {
+    for (int i = 0; i < setBonds.size(); i++)
+        for (int j = 0; j < setBonds[i].size(); j++) {
+            int bond = setBonds[i][j];
+            setLength[i][j] = parameters[bond][0];
+            setK[i][j] = parameters[bond][1];
+        }
+}
+
+void CpuHarmonicBondForce::setPeriodic(Vec3* periodicBoxVectors) {
+    usePeriodic = true;
+    boxVectors[0] = periodicBoxVectors[0];
+    boxVectors[1] = periodicBoxVectors[1];
+    boxVectors[2] = periodicBoxVectors[2];
+}
+
+void CpuHarmonicBondForce::calculateForce(vector<Vec3>& atomCoordinates, vector<Vec3>& forces, double* totalEnergy) {
+    // Have the worker threads compute their forces.
+    
+    int numThreads = threads->getNumThreads();
+    vector<double> threadEnergy(numThreads, 0);
+    auto addForce = [&] (int atom1, int atom2, const Vec3& f) {
+        forces[atom1] += f;
+        forces[atom2] -= f;
+    };
+    threads->execute([&] (ThreadPool& threads, int threadIndex) {
+        double* energy = (totalEnergy == NULL ? NULL : &threadEnergy[threadIndex]);
+        computeBonds(threadIndex, atomCoordinates, energy, addForce);
+    });
+    threads->waitForThreads();
+    
+    // Compute any "extra" bonds.
+    
+    computeBonds(numThreads, atomCoordinates, totalEnergy, addForce);
+    if (deterministic) {
+        // Convert the fixed point forces back to floating point, and sum the energies in bond order.
+
+        int numAtoms = fixedForces.size()/3;
+        threads->execute([&] (ThreadPool& threads, int threadIndex) {
+            int start = threadIndex*numAtoms/threads.getNumThreads();
+            int end = (threadIndex+1)*numAtoms/threads.getNumThreads();
+            for (int i = start; i < end; i++)
+                for (int j = 0; j < 3; j++) {
+                    forces[i][j] += fixedPointToReal(fixedForces[3*i+j]);
+                    fixedForces[3*i+j] = 0;
+                }
+        });
+        threads->waitForThreads();
+        if (totalEnergy != NULL)
+            for (double e : bondEnergy)
+                *totalEnergy += e;
+        return;
+    }
+
+    // Compute the total energy.
+    
+    if (totalEnergy != NULL)
+        for (int i = 0; i < numThreads; i++)
+            *totalEnergy += threadEnergy[i];
+}
+
+void CpuHarmonicBondForce::addForceTasks(ThreadPool::TaskGraph& graph, vector<Vec3>& atomCoordinates, vector<AlignedArray<double> >& threadForces,
+            vector<vector<char> >& blockUsed, int blockSize, vector<double>* threadEnergy) {
+    for (int set = 0; set < setAtom1.size(); set++) {
+        if (setAtom1[set].size() == 0)
+            continue;
+        graph.addTask([&, set, blockSize, threadEnergy] (ThreadPool& threads, int threadIndex) {
+            double* energy = (threadEnergy == NULL ? NULL : &(*threadEnergy)[threadIndex]);
+            double* forces = &threadForces[threadIndex][0];
+            char* used = &blockUsed[threadIndex][0];
+            computeBonds(set, atomCoordinates, energy, [&] (int atom1, int atom2, const Vec3& f) {
+                for (int j = 0; j < 3; j++) {
+                    forces[4*atom1+j] += f[j];
+                    forces[4*atom2+j] -= f[j];
+                }
+                used[atom1/blockSize] = 1;
+                used[atom2/blockSize] = 1;
+            });
+        });
+    }
+}
+
+template <class ForceFunction>
+void CpuHarmonicBondForce::computeBonds(int set, vector<Vec3>& atomCoordinates, double* totalEnergy, ForceFunction addForce) {
+    const int* atom1 = setAtom1[set].data();
+    const int* atom2 = setAtom2[set].data();
+    const double* length = setLength[set].data();
+    const double* k = setK[set].data();
+    int numBonds = setAtom1[set].size();
+    double dx[BatchSize], dy[BatchSize], dz[BatchSize], scale[BatchSize], bondEnergies[BatchSize];
+    double energy = 0.0;
+    for (int start = 0; start < numBonds; start += BatchSize) {
+        // Gather the displacements for a batch of bonds.
+
+        int batchSize = min(BatchSize, numBonds-start);
+        for (int i = 0; i < batchSize; i++) {
+            const Vec3& pos1 = atomCoordinates[atom1[start+i]];
+            const Vec3& pos2 = atomCoordinates[atom2[start+i]];
+            Vec3 delta = (usePeriodic ? ReferenceForce::getDeltaRPeriodic(pos1, pos2, boxVectors) : pos2-pos1);
+            dx[i] = delta[0];
+            dy[i] = delta[1];
+            dz[i] = delta[2];
+        }
+
+        // Compute the force and energy of every bond in the batch.  Compilers will not vectorize this loop
+        // on their own, since sqrt() may set errno and the division is conditional, so on x86 process two
+        // bonds at a time with SSE2.  Lanes with r == 0 are masked to a scale of 0.
+
+        int i = 0;
+#if !defined(__ARM__) && !defined(__ARM64__) && !defined(__PPC__)
+        __m128d zero = _mm_setzero_pd();
+        __m128d half = _mm_set1_pd(0.5);
+        for (; i+1 < batchSize; i += 2) {
+            __m128d x = _mm_loadu_pd(dx+i);
+            __m128d y = _mm_loadu_pd(dy+i);
+            __m128d z = _mm_loadu_pd(dz+i);
+            __m128d r = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)), _mm_mul_pd(z, z)));
+            __m128d deltaIdeal = _mm_sub_pd(r, _mm_loadu_pd(length+start+i));
+            __m128d dEdR = _mm_mul_pd(_mm_loadu_pd(k+start+i), deltaIdeal);
+            _mm_storeu_pd(scale+i, _mm_and_pd(_mm_cmpgt_pd(r, zero), _mm_div_pd(dEdR, r)));
+            _mm_storeu_pd(bondEnergies+i, _mm_mul_pd(_mm_mul_pd(half, dEdR), deltaIdeal));
+        }
+#endif
+        for (; i < batchSize; i++) {
+            double r = sqrt(dx[i]*dx[i] + dy[i]*dy[i] + dz[i]*dz[i]);
+            double deltaIdeal = r-length[start+i];
+            double dEdR = k[start+i]*deltaIdeal;
+            scale[i] = (r > 0.0 ? dEdR/r : 0.0);
+            bondEnergies[i] = 0.5*dEdR*deltaIdeal;
+        }
+        if (deterministic) {
+            // Record each bond's energy, and add its forces in fixed point.
+
+            if (totalEnergy != NULL)
+                for (int i = 0; i < batchSize; i++)
+                    bondEnergy[setBonds[set][start+i]] = bondEnergies[i];
+            for (int i = 0; i < batchSize; i++) {
+                Vec3 f(dx[i]*scale[i], dy[i]*scale[i], dz[i]*scale[i]);
+                for (int j = 0; j < 3; j++) {
+                    long long fixed = realToFixedPoint(f[j]);
+                    fixedForces[3*atom1[start+i]+j] += fixed;
+                    fixedForces[3*atom2[start+i]+j] -= fixed;
+                }
+            }
+            continue;
+        }
+        if (totalEnergy != NULL)
+            for (int i = 0; i < batchSize; i++)
+                energy += bondEnergies[i];
+
+        // Accumulate the forces.
+
+        for (int i = 0; i < batchSize; i++) {
+            Vec3 f(dx[i]*scale[i], dy[i]*scale[i], dz[i]*scale[i]);
+            addForce(atom1[start+i], atom2[start+i], f);
+        }
+    }
+    if (totalEnergy != NULL)
+        *totalEnergy += energy;
+}
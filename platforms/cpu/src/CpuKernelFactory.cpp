@@ -32,6 +32,7 @@
 #include "CpuKernelFactory.h"
 #include "CpuKernels.h"
 #include "CpuPlatform.h"
+#include "ReferenceKernelFactory.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/OpenMMException.h"
 
@@ -39,18 +40,37 @@ using namespace OpenMM;
 
 KernelImpl* CpuKernelFactory::createKernelImpl(std::string name, const Platform& platform, ContextImpl& context) const {
     CpuPlatform::PlatformData& data = CpuPlatform::getPlatformData(context);
+    if (data.precision == "double") {
+        // These kernels compute their interactions in single precision, so use the reference implementations instead.
+
+        if (name == CalcCustomNonbondedForceKernel::Name() || name == CalcCustomManyParticleForceKernel::Name() ||
+                name == CalcGBSAOBCForceKernel::Name() || name == CalcCustomGBForceKernel::Name() || name == CalcGayBerneForceKernel::Name())
+            return ReferenceKernelFactory().createKernelImpl(name, platform, context);
+    }
     if (name == CalcForcesAndEnergyKernel::Name())
         return new CpuCalcForcesAndEnergyKernel(name, platform, data, context);
+    if (name == UpdateStateDataKernel::Name())
+        return new CpuUpdateStateDataKernel(name, platform, data, *reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData()));
+    if (name == CalcHarmonicBondForceKernel::Name())
+        return new CpuCalcHarmonicBondForceKernel(name, platform, data);
     if (name == CalcHarmonicAngleForceKernel::Name())
         return new CpuCalcHarmonicAngleForceKernel(name, platform, data);
     if (name == CalcPeriodicTorsionForceKernel::Name())
         return new CpuCalcPeriodicTorsionForceKernel(name, platform, data);
     if (name == CalcRBTorsionForceKernel::Name())
         return new CpuCalcRBTorsionForceKernel(name, platform, data);
+    if (name == CalcCustomBondForceKernel::Name())
+        return new CpuCalcCustomBondForceKernel(name, platform, data);
+    if (name == CalcCustomAngleForceKernel::Name())
+        return new CpuCalcCustomAngleForceKernel(name, platform, data);
+    if (name == CalcCustomTorsionForceKernel::Name())
+        return new CpuCalcCustomTorsionForceKernel(name, platform, data);
     if (name == CalcNonbondedForceKernel::Name())
         return new CpuCalcNonbondedForceKernel(name, platform, data);
     if (name == CalcCustomNonbondedForceKernel::Name())
         return new CpuCalcCustomNonbondedForceKernel(name, platform, data);
+    if (name == CalcCustomHbondForceKernel::Name())
+        return new CpuCalcCustomHbondForceKernel(name, platform, data);
     if (name == CalcCustomManyParticleForceKernel::Name())
         return new CpuCalcCustomManyParticleForceKernel(name, platform, data);
     if (name == CalcGBSAOBCForceKernel::Name())
@@ -63,5 +83,7 @@ KernelImpl* CpuKernelFactory::createKernelImpl(std::string name, const Platform&
         return new CpuIntegrateLangevinStepKernel(name, platform, data);
     if (name == IntegrateLangevinMiddleStepKernel::Name())
         return new CpuIntegrateLangevinMiddleStepKernel(name, platform, data);
+    if (name == IntegrateCustomStepKernel::Name())
+        return new CpuIntegrateCustomStepKernel(name, platform, data);
     throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '") + name + "'").c_str());
 }
@@ -30,6 +30,7 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuKernels.h"
+#include "CpuFixedPoint.h"
 #include "ReferenceAngleBondIxn.h"
 #include "ReferenceBondForce.h"
 #include "ReferenceConstraints.h"
@@ -39,18 +40,26 @@
 #include "ReferenceProperDihedralBond.h"
 #include "ReferenceRbDihedralBond.h"
 #include "ReferenceTabulatedFunction.h"
+#include "SimTKOpenMMUtilities.h"
 #include "openmm/Context.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/Vec3.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/CustomHbondForceImpl.h"
 #include "openmm/internal/NonbondedForceImpl.h"
+#include "openmm/internal/timer.h"
 #include "openmm/internal/vectorize.h"
 #include "openmm/serialization/XmlSerializer.h"
 #include "lepton/CompiledExpression.h"
+#include "lepton/CompiledVectorExpression.h"
 #include "lepton/CustomFunction.h"
 #include "lepton/Operation.h"
 #include "lepton/Parser.h"
+#include <atomic>
+#include <cassert>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include "lepton/ParsedExpression.h"
 
 using namespace OpenMM;
@@ -152,25 +161,58 @@ static void copyChargesToPosq(ContextImpl& context, const vector<float>& charges
 }
 
 CpuCalcForcesAndEnergyKernel::CpuCalcForcesAndEnergyKernel(std::string name, const Platform& platform, CpuPlatform::PlatformData& data, ContextImpl& context) :
-        CalcForcesAndEnergyKernel(name, platform), data(data) {
+        CalcForcesAndEnergyKernel(name, platform), data(data), stepsSinceRebuild(0), buildTimePerVolume(0.0), stepsPerPadding(0.0), pairTimePerVolume(0.0) {
     // Create a Reference platform version of this kernel.
     
     ReferenceKernelFactory referenceFactory;
     referenceKernel = Kernel(referenceFactory.createKernelImpl(name, platform, context));
 }
 
+/**
+ * The version of the data CpuUpdateStateDataKernel adds to checkpoints.  Checkpoints written before it
+ * existed contain only the Reference platform's data.
+ */
+static const int CpuCheckpointVersion = 1;
+
+void CpuUpdateStateDataKernel::createCheckpoint(ContextImpl& context, ostream& stream) {
+    ReferenceUpdateStateDataKernel::createCheckpoint(context, stream);
+    int version = CpuCheckpointVersion;
+    stream.write((char*) &version, sizeof(int));
+    long long step = cpuData.random.getStepCounter();
+    stream.write((char*) &step, sizeof(long long));
+}
+
+void CpuUpdateStateDataKernel::loadCheckpoint(ContextImpl& context, istream& stream) {
+    ReferenceUpdateStateDataKernel::loadCheckpoint(context, stream);
+    int version;
+    long long step;
+    stream.read((char*) &version, sizeof(int));
+    stream.read((char*) &step, sizeof(long long));
+    if (!stream || version != CpuCheckpointVersion)
+        throw OpenMMException("loadCheckpoint: Checkpoint does not contain the CPU platform's random number state.  It may have been created by an older version of OpenMM.");
+    cpuData.random.setStepCounter(step);
+}
+
 void CpuCalcForcesAndEnergyKernel::initialize(const System& system) {
     referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().initialize(system);
     lastPositions.resize(system.getNumParticles(), Vec3(1e10, 1e10, 1e10));
+    threadMoved.resize(data.threads.getNumThreads());
+    threadMaxDisplacement2.resize(data.threads.getNumThreads());
 }
 
 void CpuCalcForcesAndEnergyKernel::beginComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups) {
     referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().beginComputation(context, includeForce, includeEnergy, groups);
+    data.deferredForceTasks.clear();
     
     // Convert positions to single precision and clear the forces.
 
     int numParticles = context.getSystem().getNumParticles();
     bool positionsValid = true;
+    double padding = data.paddedCutoff-data.cutoff;
+    double closeCutoff2 = 0.25*padding*padding;
+    double farCutoff2 = 0.5*padding*padding;
+    int maxNumMoved = numParticles/10;
+    bool clearForces = data.forcesPending;
     data.threads.execute([&] (ThreadPool& threads, int threadIndex) {
         // Convert the positions to single precision and apply periodic boundary conditions
 
@@ -219,87 +261,447 @@ void CpuCalcForcesAndEnergyKernel::beginComputation(ContextImpl& context, bool i
             if (posq[i] != posq[i] || posq[i+1] != posq[i+1] || posq[i+2] != posq[i+2])
                 positionsValid = false;
 
-        // Clear the forces.
+        // Find how far each particle has moved since the neighbor list was built.  Each thread
+        // records the largest displacement in its range, and the particles that have moved far enough
+        // that we need to check for missing pairs.
 
-        fvec4 zero(0.0f);
-        for (int j = 0; j < numParticles; j++)
-            zero.store(&data.threadForce[threadIndex][j*4]);
+        if (data.neighborList != NULL) {
+            vector<int>& moved = threadMoved[threadIndex];
+            moved.clear();
+            double maxDist2 = 0.0;
+            for (int i = start; i < end; i++) {
+                Vec3 delta = posData[i]-lastPositions[i];
+                double dist2 = delta.dot(delta);
+                if (dist2 > closeCutoff2 && moved.size() <= maxNumMoved)
+                    moved.push_back(i);
+                if (dist2 > maxDist2)
+                    maxDist2 = dist2;
+            }
+            threadMaxDisplacement2[threadIndex] = maxDist2;
+        }
+
+        // The force arrays are normally cleared as they are summed in finishComputation().  If the
+        // previous computation never finished, clear them now.
+
+        if (clearForces) {
+            fvec4 zero(0.0f);
+            vector<char>& blockUsed = data.threadForceBlockUsed[threadIndex];
+            const int blockSize = CpuPlatform::PlatformData::ForceBlockSize;
+            for (int block = 0; block < blockUsed.size(); block++) {
+                if (!blockUsed[block] && !data.allForceBlocksUsed)
+                    continue;
+                int start = block*blockSize;
+                int end = min(start+blockSize, numParticles);
+                for (int j = start; j < end; j++)
+                    zero.store(&data.threadForce[threadIndex][j*4]);
+                if (data.deterministicForces) {
+                    AlignedArray<long long>& fixed = data.threadForceFixed[threadIndex];
+                    for (int j = 4*start; j < 4*end; j++)
+                        fixed[j] = 0;
+                }
+                else if (!data.threadForceDouble.empty()) {
+                    AlignedArray<double>& f = data.threadForceDouble[threadIndex];
+                    for (int j = 4*start; j < 4*end; j++)
+                        f[j] = 0.0;
+                }
+                blockUsed[block] = 0;
+            }
+        }
     });
     data.threads.waitForThreads();
+    data.allForceBlocksUsed = false;
+    data.forcesPending = true;
     if (!positionsValid)
         throw OpenMMException("Particle coordinate is nan");
 
     // Determine whether we need to recompute the neighbor list.
         
     if (data.neighborList != NULL) {
-        double padding = data.paddedCutoff-data.cutoff;;
-        bool needRecompute = false;
-        double closeCutoff2 = 0.25*padding*padding;
-        double farCutoff2 = 0.5*padding*padding;
-        int maxNumMoved = numParticles/10;
-        vector<int> moved;
-        vector<Vec3>& posData = extractPositions(context);
-        for (int i = 0; i < numParticles; i++) {
-            Vec3 delta = posData[i]-lastPositions[i];
-            double dist2 = delta.dot(delta);
-            if (dist2 > closeCutoff2) {
-                moved.push_back(i);
-                if (dist2 > farCutoff2 || moved.size() > maxNumMoved) {
-                    needRecompute = true;
-                    break;
-                }
-            }
+        bool needRecompute = data.neighborListOutdated;
+        int numMoved = 0;
+        for (int i = 0; i < threadMoved.size(); i++) {
+            if (threadMaxDisplacement2[i] > farCutoff2)
+                needRecompute = true;
+            numMoved += threadMoved[i].size();
         }
-        if (!needRecompute && moved.size() > 0) {
+        if (numMoved > maxNumMoved)
+            needRecompute = true;
+        vector<Vec3>& posData = extractPositions(context);
+        if (!needRecompute && numMoved > 0) {
             // Some particles have moved further than half the padding distance.  Look for pairs
             // that are missing from the neighbor list.
 
-            int numMoved = moved.size();
+            vector<int> moved;
+            for (auto& threadList : threadMoved)
+                moved.insert(moved.end(), threadList.begin(), threadList.end());
             double cutoff2 = data.cutoff*data.cutoff;
             double paddedCutoff2 = data.paddedCutoff*data.paddedCutoff;
-            for (int i = 1; i < numMoved && !needRecompute; i++)
-                for (int j = 0; j < i; j++) {
-                    Vec3 delta = posData[moved[i]]-posData[moved[j]];
-                    if (delta.dot(delta) < cutoff2) {
-                        // These particles should interact.  See if they are in the neighbor list.
-                        
-                        Vec3 oldDelta = lastPositions[moved[i]]-lastPositions[moved[j]];
-                        if (oldDelta.dot(oldDelta) > paddedCutoff2) {
-                            needRecompute = true;
-                            break;
+            atomic<bool> missingPair(false);
+            data.threads.execute([&] (ThreadPool& threads, int threadIndex) {
+                for (int i = threadIndex+1; i < numMoved && !missingPair; i += threads.getNumThreads())
+                    for (int j = 0; j < i; j++) {
+                        Vec3 delta = posData[moved[i]]-posData[moved[j]];
+                        if (delta.dot(delta) < cutoff2) {
+                            // These particles should interact.  See if they are in the neighbor list.
+
+                            Vec3 oldDelta = lastPositions[moved[i]]-lastPositions[moved[j]];
+                            if (oldDelta.dot(oldDelta) > paddedCutoff2) {
+                                missingPair = true;
+                                break;
+                            }
                         }
                     }
-                }
+            });
+            data.threads.waitForThreads();
+            needRecompute = missingPair;
         }
         if (needRecompute) {
-            data.neighborList->computeNeighborList(numParticles, data.posq, data.exclusions, extractBoxVectors(context), data.isPeriodic, data.paddedCutoff, data.threads);
-            lastPositions = posData;
+            if (data.adaptivePadding)
+                adjustNeighborListPadding(!data.neighborListOutdated);
+            data.buildNeighborList(numParticles, extractBoxVectors(context));
+            data.threads.execute([&] (ThreadPool& threads, int threadIndex) {
+                int start = threadIndex*numParticles/threads.getNumThreads();
+                int end = (threadIndex+1)*numParticles/threads.getNumThreads();
+                for (int i = start; i < end; i++)
+                    lastPositions[i] = posData[i];
+            });
+            data.threads.waitForThreads();
+            stepsSinceRebuild = 0;
+            data.neighborListPairTime = 0.0;
+            data.neighborListOutdated = false;
+            data.neighborListRebuilds++;
+            stringstream rebuilds, padding;
+            rebuilds << data.neighborListRebuilds;
+            padding << data.paddedCutoff-data.cutoff;
+            data.propertyValues[CpuPlatform::CpuNeighborListRebuilds()] = rebuilds.str();
+            data.propertyValues[CpuPlatform::CpuNeighborListPadding()] = padding.str();
         }
+        stepsSinceRebuild++;
     }
 }
 
+void CpuCalcForcesAndEnergyKernel::adjustNeighborListPadding(bool updateEstimates) {
+    // The model assumes that the time to build and to process the list are both proportional to the volume
+    // of a sphere of radius cutoff+padding, and that the number of steps between rebuilds is proportional
+    // to the padding.  The estimates are stored in that normalized form so they stay valid when the padding
+    // changes.  Rebuilds that were forced by something other than particle motion do not tell us how long
+    // the list lasts, so they are only used for the build time.
+
+    double cutoff = data.cutoff;
+    double padding = data.paddedCutoff-cutoff;
+    double volume = pow(data.paddedCutoff, 3);
+    if (data.neighborListBuildTime > 0.0) {
+        double buildTime = data.neighborListBuildTime/volume;
+        buildTimePerVolume = (buildTimePerVolume == 0.0 ? buildTime : 0.7*buildTimePerVolume+0.3*buildTime);
+    }
+    if (updateEstimates && stepsSinceRebuild > 0 && padding > 0) {
+        double steps = stepsSinceRebuild/padding;
+        double pairTime = data.neighborListPairTime/(stepsSinceRebuild*volume);
+        if (stepsPerPadding == 0.0) {
+            stepsPerPadding = steps;
+            pairTimePerVolume = pairTime;
+        }
+        else {
+            stepsPerPadding = 0.7*stepsPerPadding+0.3*steps;
+            pairTimePerVolume = 0.7*pairTimePerVolume+0.3*pairTime;
+        }
+    }
+    if (stepsPerPadding == 0.0 || buildTimePerVolume == 0.0)
+        return;
+
+    // Find the padding that minimizes the time per step.  Only let it change gradually, so a few noisy
+    // timings cannot move it far.
+
+    double bestPadding = padding, bestTime = 0.0;
+    for (int i = 5; i <= 60; i++) {
+        double p = 0.01*i*cutoff;
+        double v = pow(cutoff+p, 3);
+        double time = buildTimePerVolume*v/(stepsPerPadding*p) + pairTimePerVolume*v;
+        if (i == 5 || time < bestTime) {
+            bestPadding = p;
+            bestTime = time;
+        }
+    }
+    bestPadding = max(0.8*padding, min(1.25*padding, bestPadding));
+    data.paddedCutoff = cutoff+bestPadding;
+}
+
+#ifndef NDEBUG
+/**
+ * Check that a block of a thread's force arrays is zero.  This is used to catch kernels that add forces
+ * without marking the blocks they touched, since those forces would be skipped when summing.
+ */
+static bool isForceBlockClear(const CpuPlatform::PlatformData& data, int thread, int block, int numParticles) {
+    int start = 4*block*CpuPlatform::PlatformData::ForceBlockSize;
+    int end = 4*min((block+1)*CpuPlatform::PlatformData::ForceBlockSize, numParticles);
+    for (int i = start; i < end; i++) {
+        if (data.threadForce[thread][i] != 0.0f)
+            return false;
+        if (data.deterministicForces && data.threadForceFixed[thread][i] != 0)
+            return false;
+        if (!data.threadForceDouble.empty() && data.threadForceDouble[thread][i] != 0.0)
+            return false;
+    }
+    return true;
+}
+#endif
+
 double CpuCalcForcesAndEnergyKernel::finishComputation(ContextImpl& context, bool includeForce, bool includeEnergy, int groups, bool& valid) {
+    // If no kernel needed the neighbor list, it might still be building.
+
+    data.waitForNeighborList();
+
+    // If any forces were deferred, compute them now.  They all run together on the thread pool, and add
+    // their forces to threadForceDouble so they are summed along with everything else.
+
+    bool anyDeferred = (data.deferredForceTasks.getNumTasks() > 0);
+    if (anyDeferred) {
+        data.threads.execute(data.deferredForceTasks);
+        data.threads.waitForThreads();
+    }
+
     // Sum the forces from all the threads.
     
     data.threads.execute([&] (ThreadPool& threads, int threadIndex) {
-        // Sum the contributions to forces that have been calculated by different threads.
+        // Sum the contributions to forces that have been calculated by different threads.  Each thread
+        // handles a range of blocks, and only reads the arrays of threads that marked a block as used.
+        // The arrays are cleared as they are read, so they are ready for the next computation.  The
+        // ranges are made of whole release groups, so each thread can also release the parts of other
+        // threads' arrays in its range that have not been used recently.
         
         int numParticles = context.getSystem().getNumParticles();
         int numThreads = threads.getNumThreads();
-        int start = threadIndex*numParticles/numThreads;
-        int end = (threadIndex+1)*numParticles/numThreads;
+        const int blockSize = CpuPlatform::PlatformData::ForceBlockSize;
+        const int groupBlocks = CpuPlatform::PlatformData::ForceReleaseBlocks;
+        const int releaseSteps = CpuPlatform::PlatformData::ForceReleaseSteps;
+        int numBlocks = (numParticles+blockSize-1)/blockSize;
+        int numGroups = (numBlocks+groupBlocks-1)/groupBlocks;
+        int startBlock = min(numBlocks, threadIndex*numGroups/numThreads*groupBlocks);
+        int endBlock = min(numBlocks, (threadIndex+1)*numGroups/numThreads*groupBlocks);
         vector<Vec3>& forceData = extractForces(context);
-        for (int i = start; i < end; i++) {
-            fvec4 f(0.0f);
-            for (int j = 0; j < numThreads; j++)
-                f += fvec4(&data.threadForce[j][4*i]);
-            forceData[i][0] += f[0];
-            forceData[i][1] += f[1];
-            forceData[i][2] += f[2];
+        vector<int> blockThreads;
+        vector<char> groupUsed(numThreads);
+        fvec4 zero(0.0f);
+        for (int block = startBlock; block < endBlock; block++) {
+            if (block%groupBlocks == 0)
+                fill(groupUsed.begin(), groupUsed.end(), 0);
+            blockThreads.clear();
+            for (int j = 0; j < numThreads; j++) {
+                char& used = data.threadForceBlockUsed[j][block];
+                if (used || data.allForceBlocksUsed) {
+                    blockThreads.push_back(j);
+                    groupUsed[j] = 1;
+                }
+                else
+                    assert(isForceBlockClear(data, j, block, numParticles));
+                used = 0;
+            }
+            int start = block*blockSize;
+            int end = min(start+blockSize, numParticles);
+            if (blockThreads.size() > 0) {
+                if (!data.threadForceDouble.empty()) {
+                    // Sum both sets of arrays in double precision.
+
+                    for (int i = start; i < end; i++)
+                        for (int j : blockThreads) {
+                            float* threadForce = &data.threadForce[j][4*i];
+                            double* threadForceDouble = &data.threadForceDouble[j][4*i];
+                            for (int k = 0; k < 3; k++) {
+                                forceData[i][k] += threadForce[k] + threadForceDouble[k];
+                                threadForceDouble[k] = 0.0;
+                            }
+                            zero.store(threadForce);
+                        }
+                }
+                else {
+                    for (int i = start; i < end; i++) {
+                        fvec4 f(0.0f);
+                        for (int j : blockThreads) {
+                            float* threadForce = &data.threadForce[j][4*i];
+                            f += fvec4(threadForce);
+                            zero.store(threadForce);
+                        }
+                        forceData[i][0] += f[0];
+                        forceData[i][1] += f[1];
+                        forceData[i][2] += f[2];
+                    }
+                }
+                if (data.deterministicForces) {
+                    // Sum the fixed point forces.  The result is exact, so it does not depend on how
+                    // the contributions were divided between threads.
+
+                    for (int i = start; i < end; i++) {
+                        long long fixed[3] = {0, 0, 0};
+                        for (int j : blockThreads) {
+                            long long* threadForce = &data.threadForceFixed[j][4*i];
+                            for (int k = 0; k < 3; k++) {
+                                fixed[k] += threadForce[k];
+                                threadForce[k] = 0;
+                            }
+                        }
+                        for (int k = 0; k < 3; k++)
+                            forceData[i][k] += fixedPointToReal(fixed[k]);
+                    }
+                }
+            }
+            if (block%groupBlocks == groupBlocks-1 || block == numBlocks-1) {
+                // This is the end of a group.  Release it in the arrays of threads that have not used it for a while.
+
+                int group = block/groupBlocks;
+                int groupStart = 4*group*groupBlocks*blockSize;
+                int groupEnd = 4*min((group+1)*groupBlocks*blockSize, numParticles);
+                for (int j = 0; j < numThreads; j++) {
+                    unsigned char& idle = data.threadForceGroupIdle[j][group];
+                    if (groupUsed[j])
+                        idle = 0;
+                    else if (idle < releaseSteps && ++idle == releaseSteps) {
+                        data.threadForce[j].releasePages(groupStart, groupEnd);
+                        if (data.deterministicForces)
+                            data.threadForceFixed[j].releasePages(groupStart, groupEnd);
+                        if (!data.threadForceDouble.empty())
+                            data.threadForceDouble[j].releasePages(groupStart, groupEnd);
+                    }
+                }
+            }
         }
     });
+    data.forcesPending = false;
     data.threads.waitForThreads();
-    return referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().finishComputation(context, includeForce, includeEnergy, groups, valid);
+    double energy = 0.0;
+    if (anyDeferred) {
+        for (double& e : data.threadDeferredEnergy) {
+            energy += e;
+            e = 0.0;
+        }
+        data.deferredForceTasks.clear();
+    }
+    return energy+referenceKernel.getAs<ReferenceCalcForcesAndEnergyKernel>().finishComputation(context, includeForce, includeEnergy, groups, valid);
+}
+
+void CpuCalcHarmonicBondForceKernel::initialize(const System& system, const HarmonicBondForce& force) {
+    numBonds = force.getNumBonds();
+    bondIndexArray.resize(numBonds, vector<int>(2));
+    bondParamArray.resize(numBonds, vector<double>(2));
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        double length, k;
+        force.getBondParameters(i, particle1, particle2, length, k);
+        bondIndexArray[i][0] = particle1;
+        bondIndexArray[i][1] = particle2;
+        bondParamArray[i][0] = length;
+        bondParamArray[i][1] = k;
+    }
+    bondForce.initialize(system.getNumParticles(), bondIndexArray, data.threads, data.deterministicForces);
+    bondForce.setBondParameters(bondParamArray);
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+}
+
+double CpuCalcHarmonicBondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& forceData = extractForces(context);
+    double energy = 0;
+    if (usePeriodic)
+        bondForce.setPeriodic(extractBoxVectors(context));
+    if (data.concurrentForces) {
+        bondForce.addForceTasks(data.deferredForceTasks, posData, data.threadForceDouble, data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize, includeEnergy ? &data.threadDeferredEnergy : NULL);
+        return 0.0;
+    }
+    bondForce.calculateForce(posData, forceData, includeEnergy ? &energy : NULL);
+    return energy;
+}
+
+void CpuCalcHarmonicBondForceKernel::copyParametersToContext(ContextImpl& context, const HarmonicBondForce& force) {
+    if (numBonds != force.getNumBonds())
+        throw OpenMMException("updateParametersInContext: The number of bonds has changed");
+
+    // Record the values.
+
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        double length, k;
+        force.getBondParameters(i, particle1, particle2, length, k);
+        if (particle1 != bondIndexArray[i][0] || particle2 != bondIndexArray[i][1])
+            throw OpenMMException("updateParametersInContext: The set of particles in a bond has changed");
+        bondParamArray[i][0] = length;
+        bondParamArray[i][1] = k;
+    }
+    bondForce.setBondParameters(bondParamArray);
+}
+
+CpuCalcCustomBondForceKernel::~CpuCalcCustomBondForceKernel() {
+    if (customForce != NULL)
+        delete customForce;
+}
+
+void CpuCalcCustomBondForceKernel::initialize(const System& system, const CustomBondForce& force) {
+    numBonds = force.getNumBonds();
+    int numParameters = force.getNumPerBondParameters();
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+
+    // Build the arrays.
+
+    bondIndexArray.resize(numBonds, vector<int>(2));
+    bondParamArray.resize(numBonds, vector<double>(numParameters));
+    vector<double> params;
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        force.getBondParameters(i, particle1, particle2, params);
+        bondIndexArray[i][0] = particle1;
+        bondIndexArray[i][1] = particle2;
+        for (int j = 0; j < numParameters; j++)
+            bondParamArray[i][j] = params[j];
+    }
+    // Parse the expression used to calculate the force.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerBondParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        energyParamDerivNames.push_back(force.getEnergyParameterDerivativeName(i));
+    set<string> variables;
+    variables.insert("r");
+    variables.insert(parameterNames.begin(), parameterNames.end());
+    variables.insert(globalParameterNames.begin(), globalParameterNames.end());
+    validateVariables(expression.getRootNode(), variables);
+    customForce = new CpuCustomBondedForce<2>(expression, parameterNames, globalParameterNames, energyParamDerivNames, data.threads);
+    customForce->initialize(system.getNumParticles(), bondIndexArray, data.deterministicForces);
+}
+
+double CpuCalcCustomBondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& forceData = extractForces(context);
+    double energy = 0;
+    map<string, double> globalParameters;
+    for (auto& name : globalParameterNames)
+        globalParameters[name] = context.getParameter(name);
+    if (usePeriodic)
+        customForce->setPeriodic(extractBoxVectors(context));
+    vector<double> energyParamDerivValues(energyParamDerivNames.size(), 0.0);
+    customForce->calculateForce(posData, bondParamArray, forceData, includeEnergy ? &energy : NULL, globalParameters, energyParamDerivValues);
+    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
+    for (int i = 0; i < energyParamDerivNames.size(); i++)
+        energyParamDerivs[energyParamDerivNames[i]] += energyParamDerivValues[i];
+    return energy;
+}
+
+void CpuCalcCustomBondForceKernel::copyParametersToContext(ContextImpl& context, const CustomBondForce& force) {
+    if (numBonds != force.getNumBonds())
+        throw OpenMMException("updateParametersInContext: The number of bonds has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerBondParameters();
+    vector<double> params;
+    for (int i = 0; i < numBonds; ++i) {
+        int particle1, particle2;
+        force.getBondParameters(i, particle1, particle2, params);
+        if (particle1 != bondIndexArray[i][0] || particle2 != bondIndexArray[i][1])
+            throw OpenMMException("updateParametersInContext: The set of particles in a bond has changed");
+        for (int j = 0; j < numParameters; j++)
+            bondParamArray[i][j] = params[j];
+    }
 }
 
 void CpuCalcHarmonicAngleForceKernel::initialize(const System& system, const HarmonicAngleForce& force) {
@@ -316,7 +718,7 @@ void CpuCalcHarmonicAngleForceKernel::initialize(const System& system, const Har
         angleParamArray[i][0] = angle;
         angleParamArray[i][1] = k;
     }
-    bondForce.initialize(system.getNumParticles(), numAngles, 3, angleIndexArray, data.threads);
+    bondForce.initialize(system.getNumParticles(), numAngles, 3, angleIndexArray, data.threads, data.deterministicForces);
     usePeriodic = force.usesPeriodicBoundaryConditions();
 }
 
@@ -324,6 +726,13 @@ double CpuCalcHarmonicAngleForceKernel::execute(ContextImpl& context, bool inclu
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
     double energy = 0;
+    if (data.concurrentForces) {
+        shared_ptr<ReferenceAngleBondIxn> ixn = make_shared<ReferenceAngleBondIxn>();
+        if (usePeriodic)
+            ixn->setPeriodic(extractBoxVectors(context));
+        bondForce.addForceTasks(data.deferredForceTasks, posData, angleParamArray, data.threadForceDouble, data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize, includeEnergy ? &data.threadDeferredEnergy : NULL, ixn);
+        return 0.0;
+    }
     ReferenceAngleBondIxn angleBond;
     if (usePeriodic)
         angleBond.setPeriodic(extractBoxVectors(context));
@@ -348,6 +757,83 @@ void CpuCalcHarmonicAngleForceKernel::copyParametersToContext(ContextImpl& conte
     }
 }
 
+CpuCalcCustomAngleForceKernel::~CpuCalcCustomAngleForceKernel() {
+    if (customForce != NULL)
+        delete customForce;
+}
+
+void CpuCalcCustomAngleForceKernel::initialize(const System& system, const CustomAngleForce& force) {
+    numAngles = force.getNumAngles();
+    int numParameters = force.getNumPerAngleParameters();
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+
+    // Build the arrays.
+
+    angleIndexArray.resize(numAngles, vector<int>(3));
+    angleParamArray.resize(numAngles, vector<double>(numParameters));
+    vector<double> params;
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        force.getAngleParameters(i, particle1, particle2, particle3, params);
+        angleIndexArray[i][0] = particle1;
+        angleIndexArray[i][1] = particle2;
+        angleIndexArray[i][2] = particle3;
+        for (int j = 0; j < numParameters; j++)
+            angleParamArray[i][j] = params[j];
+    }
+    // Parse the expression used to calculate the force.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerAngleParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        energyParamDerivNames.push_back(force.getEnergyParameterDerivativeName(i));
+    set<string> variables;
+    variables.insert("theta");
+    variables.insert(parameterNames.begin(), parameterNames.end());
+    variables.insert(globalParameterNames.begin(), globalParameterNames.end());
+    validateVariables(expression.getRootNode(), variables);
+    customForce = new CpuCustomBondedForce<3>(expression, parameterNames, globalParameterNames, energyParamDerivNames, data.threads);
+    customForce->initialize(system.getNumParticles(), angleIndexArray, data.deterministicForces);
+}
+
+double CpuCalcCustomAngleForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& forceData = extractForces(context);
+    double energy = 0;
+    map<string, double> globalParameters;
+    for (auto& name : globalParameterNames)
+        globalParameters[name] = context.getParameter(name);
+    if (usePeriodic)
+        customForce->setPeriodic(extractBoxVectors(context));
+    vector<double> energyParamDerivValues(energyParamDerivNames.size(), 0.0);
+    customForce->calculateForce(posData, angleParamArray, forceData, includeEnergy ? &energy : NULL, globalParameters, energyParamDerivValues);
+    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
+    for (int i = 0; i < energyParamDerivNames.size(); i++)
+        energyParamDerivs[energyParamDerivNames[i]] += energyParamDerivValues[i];
+    return energy;
+}
+
+void CpuCalcCustomAngleForceKernel::copyParametersToContext(ContextImpl& context, const CustomAngleForce& force) {
+    if (numAngles != force.getNumAngles())
+        throw OpenMMException("updateParametersInContext: The number of angles has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerAngleParameters();
+    vector<double> params;
+    for (int i = 0; i < numAngles; ++i) {
+        int particle1, particle2, particle3;
+        force.getAngleParameters(i, particle1, particle2, particle3, params);
+        if (particle1 != angleIndexArray[i][0] || particle2 != angleIndexArray[i][1] || particle3 != angleIndexArray[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in an angle has changed");
+        for (int j = 0; j < numParameters; j++)
+            angleParamArray[i][j] = params[j];
+    }
+}
+
 void CpuCalcPeriodicTorsionForceKernel::initialize(const System& system, const PeriodicTorsionForce& force) {
     numTorsions = force.getNumTorsions();
     torsionIndexArray.resize(numTorsions, vector<int>(4));
@@ -364,7 +850,7 @@ void CpuCalcPeriodicTorsionForceKernel::initialize(const System& system, const P
         torsionParamArray[i][1] = phase;
         torsionParamArray[i][2] = periodicity;
     }
-    bondForce.initialize(system.getNumParticles(), numTorsions, 4, torsionIndexArray, data.threads);
+    bondForce.initialize(system.getNumParticles(), numTorsions, 4, torsionIndexArray, data.threads, data.deterministicForces);
     usePeriodic = force.usesPeriodicBoundaryConditions();
 }
 
@@ -372,6 +858,13 @@ double CpuCalcPeriodicTorsionForceKernel::execute(ContextImpl& context, bool inc
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
     double energy = 0;
+    if (data.concurrentForces) {
+        shared_ptr<ReferenceProperDihedralBond> ixn = make_shared<ReferenceProperDihedralBond>();
+        if (usePeriodic)
+            ixn->setPeriodic(extractBoxVectors(context));
+        bondForce.addForceTasks(data.deferredForceTasks, posData, torsionParamArray, data.threadForceDouble, data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize, includeEnergy ? &data.threadDeferredEnergy : NULL, ixn);
+        return 0.0;
+    }
     ReferenceProperDihedralBond periodicTorsionBond;
     if (usePeriodic)
         periodicTorsionBond.setPeriodic(extractBoxVectors(context));
@@ -416,7 +909,7 @@ void CpuCalcRBTorsionForceKernel::initialize(const System& system, const RBTorsi
         torsionParamArray[i][4] = c4;
         torsionParamArray[i][5] = c5;
     }
-    bondForce.initialize(system.getNumParticles(), numTorsions, 4, torsionIndexArray, data.threads);
+    bondForce.initialize(system.getNumParticles(), numTorsions, 4, torsionIndexArray, data.threads, data.deterministicForces);
     usePeriodic = force.usesPeriodicBoundaryConditions();
 }
 
@@ -424,6 +917,13 @@ double CpuCalcRBTorsionForceKernel::execute(ContextImpl& context, bool includeFo
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
     double energy = 0;
+    if (data.concurrentForces) {
+        shared_ptr<ReferenceRbDihedralBond> ixn = make_shared<ReferenceRbDihedralBond>();
+        if (usePeriodic)
+            ixn->setPeriodic(extractBoxVectors(context));
+        bondForce.addForceTasks(data.deferredForceTasks, posData, torsionParamArray, data.threadForceDouble, data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize, includeEnergy ? &data.threadDeferredEnergy : NULL, ixn);
+        return 0.0;
+    }
     ReferenceRbDihedralBond rbTorsionBond;
     if (usePeriodic)
         rbTorsionBond.setPeriodic(extractBoxVectors(context));
@@ -452,6 +952,84 @@ void CpuCalcRBTorsionForceKernel::copyParametersToContext(ContextImpl& context,
     }
 }
 
+CpuCalcCustomTorsionForceKernel::~CpuCalcCustomTorsionForceKernel() {
+    if (customForce != NULL)
+        delete customForce;
+}
+
+void CpuCalcCustomTorsionForceKernel::initialize(const System& system, const CustomTorsionForce& force) {
+    numTorsions = force.getNumTorsions();
+    int numParameters = force.getNumPerTorsionParameters();
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+
+    // Build the arrays.
+
+    torsionIndexArray.resize(numTorsions, vector<int>(4));
+    torsionParamArray.resize(numTorsions, vector<double>(numParameters));
+    vector<double> params;
+    for (int i = 0; i < numTorsions; ++i) {
+        int particle1, particle2, particle3, particle4;
+        force.getTorsionParameters(i, particle1, particle2, particle3, particle4, params);
+        torsionIndexArray[i][0] = particle1;
+        torsionIndexArray[i][1] = particle2;
+        torsionIndexArray[i][2] = particle3;
+        torsionIndexArray[i][3] = particle4;
+        for (int j = 0; j < numParameters; j++)
+            torsionParamArray[i][j] = params[j];
+    }
+    // Parse the expression used to calculate the force.
+
+    Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction()).optimize();
+    for (int i = 0; i < numParameters; i++)
+        parameterNames.push_back(force.getPerTorsionParameterName(i));
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        energyParamDerivNames.push_back(force.getEnergyParameterDerivativeName(i));
+    set<string> variables;
+    variables.insert("theta");
+    variables.insert(parameterNames.begin(), parameterNames.end());
+    variables.insert(globalParameterNames.begin(), globalParameterNames.end());
+    validateVariables(expression.getRootNode(), variables);
+    customForce = new CpuCustomBondedForce<4>(expression, parameterNames, globalParameterNames, energyParamDerivNames, data.threads);
+    customForce->initialize(system.getNumParticles(), torsionIndexArray, data.deterministicForces);
+}
+
+double CpuCalcCustomTorsionForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& forceData = extractForces(context);
+    double energy = 0;
+    map<string, double> globalParameters;
+    for (auto& name : globalParameterNames)
+        globalParameters[name] = context.getParameter(name);
+    if (usePeriodic)
+        customForce->setPeriodic(extractBoxVectors(context));
+    vector<double> energyParamDerivValues(energyParamDerivNames.size(), 0.0);
+    customForce->calculateForce(posData, torsionParamArray, forceData, includeEnergy ? &energy : NULL, globalParameters, energyParamDerivValues);
+    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
+    for (int i = 0; i < energyParamDerivNames.size(); i++)
+        energyParamDerivs[energyParamDerivNames[i]] += energyParamDerivValues[i];
+    return energy;
+}
+
+void CpuCalcCustomTorsionForceKernel::copyParametersToContext(ContextImpl& context, const CustomTorsionForce& force) {
+    if (numTorsions != force.getNumTorsions())
+        throw OpenMMException("updateParametersInContext: The number of torsions has changed");
+
+    // Record the values.
+
+    int numParameters = force.getNumPerTorsionParameters();
+    vector<double> params;
+    for (int i = 0; i < numTorsions; ++i) {
+        int particle1, particle2, particle3, particle4;
+        force.getTorsionParameters(i, particle1, particle2, particle3, particle4, params);
+        if (particle1 != torsionIndexArray[i][0] || particle2 != torsionIndexArray[i][1] || particle3 != torsionIndexArray[i][2] || particle4 != torsionIndexArray[i][3])
+            throw OpenMMException("updateParametersInContext: The set of particles in a torsion has changed");
+        for (int j = 0; j < numParameters; j++)
+            torsionParamArray[i][j] = params[j];
+    }
+}
+
 class CpuCalcNonbondedForceKernel::PmeIO : public CalcPmeReciprocalForceKernel::IO {
 public:
     PmeIO(float* posq, float* force, int numParticles) : posq(posq), force(force), numParticles(numParticles) {
@@ -472,11 +1050,17 @@ private:
     int numParticles;
 };
 
-CpuNonbondedForce* createCpuNonbondedForceVec();
+CpuNonbondedForce* createCpuNonbondedForceVec(bool useClusterPairs);
 
 CpuCalcNonbondedForceKernel::CpuCalcNonbondedForceKernel(string name, const Platform& platform, CpuPlatform::PlatformData& data) : CalcNonbondedForceKernel(name, platform),
-        data(data), hasInitializedPme(false), hasInitializedDispersionPme(false), nonbonded(NULL) {
-    nonbonded = createCpuNonbondedForceVec();
+        data(data), hasInitializedPme(false), hasInitializedDispersionPme(false), pmeGridSpecified(false), tuningPme(false), nonbonded(NULL) {
+    nonbonded = createCpuNonbondedForceVec(data.useClusterPairs);
+    if (data.deterministicForces)
+        nonbonded->setFixedPointForces(&data.threadForceFixed);
+    else if (data.precision == "mixed" || data.precision == "double")
+        nonbonded->setDoublePrecisionForces(&data.threadForceDouble);
+    nonbonded->setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
+    nonbonded->setStaticBlockPartition(data.threadsBound);
 }
 
 CpuCalcNonbondedForceKernel::~CpuCalcNonbondedForceKernel() {
@@ -522,6 +1106,12 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
     particleParams.resize(numParticles);
     charges.resize(numParticles);
     C6params.resize(numParticles);
+    if (data.precision == "double") {
+        doubleParticleParams.resize(numParticles);
+        doubleCharges.resize(numParticles);
+        doubleC6params.resize(numParticles);
+        nonbonded->setDoublePrecisionParameters(&doubleParticleParams, &doubleCharges, &doubleC6params);
+    }
     baseParticleParams.resize(numParticles);
     for (int i = 0; i < numParticles; ++i)
        force.getParticleParameters(i, baseParticleParams[i][0], baseParticleParams[i][1], baseParticleParams[i][2]);
@@ -535,7 +1125,7 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
         bonded14IndexArray[i][0] = particle1;
         bonded14IndexArray[i][1] = particle2;
     }
-    bondForce.initialize(system.getNumParticles(), num14, 2, bonded14IndexArray, data.threads);
+    bondForce.initialize(system.getNumParticles(), num14, 2, bonded14IndexArray, data.threads, data.deterministicForces);
     
     // Record information about parameter offsets.
     
@@ -593,8 +1183,11 @@ void CpuCalcNonbondedForceKernel::initialize(const System& system, const Nonbond
     }
     else if (nonbondedMethod == PME) {
         double alpha;
+        force.getPMEParameters(alpha, gridSize[0], gridSize[1], gridSize[2]);
+        pmeGridSpecified = (alpha != 0.0);
         NonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSize[0], gridSize[1], gridSize[2], false);
         ewaldAlpha = alpha;
+        ewaldErrorTolerance = force.getEwaldErrorTolerance();
     }
     else if (nonbondedMethod == LJPME) {
         double alpha;
@@ -622,13 +1215,15 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
         useOptimizedPme = false;
         computeParameters(context, false);
         if (nonbondedMethod == PME) {
-            // If available, use the optimized PME implementation.
+            // If available, use the optimized PME implementation.  It works in single precision, so in double
+            // precision mode the reference implementation in CpuNonbondedForce is used instead.
 
             vector<string> kernelNames;
             kernelNames.push_back("CalcPmeReciprocalForce");
-            useOptimizedPme = getPlatform().supportsKernels(kernelNames);
+            useOptimizedPme = (getPlatform().supportsKernels(kernelNames) && data.precision != "double");
             if (useOptimizedPme) {
                 optimizedPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), context);
+                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setThreadPool(data.pmeThreadPool);
                 optimizedPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, ewaldAlpha, data.deterministicForces);
             }
         }
@@ -638,16 +1233,24 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
             vector<string> kernelNames;
             kernelNames.push_back("CalcPmeReciprocalForce");
             kernelNames.push_back("CalcDispersionPmeReciprocalForce");
-            useOptimizedPme = getPlatform().supportsKernels(kernelNames);
+            useOptimizedPme = (getPlatform().supportsKernels(kernelNames) && data.precision != "double");
             if (useOptimizedPme) {
                 optimizedPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), context);
+                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setThreadPool(data.pmeThreadPool);
                 optimizedPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, ewaldAlpha, data.deterministicForces);
                 optimizedDispersionPme = getPlatform().createKernel(CalcDispersionPmeReciprocalForceKernel::Name(), context);
+                optimizedDispersionPme.getAs<CalcDispersionPmeReciprocalForceKernel>().setThreadPool(data.pmeThreadPool);
                 optimizedDispersionPme.getAs<CalcDispersionPmeReciprocalForceKernel>().initialize(dispersionGridSize[0], dispersionGridSize[1],
                                                                                                   dispersionGridSize[2], numParticles, ewaldDispersionAlpha, data.deterministicForces);
             }
         }
+        if (nonbondedMethod == PME || nonbondedMethod == LJPME)
+            recordPmeParameters();
+        if (nonbondedMethod == PME && data.tunePme && !data.deterministicForces)
+            startPmeTuning(context);
     }
+    if (tuningPme && includeDirect && includeReciprocal)
+        tunePmeParameters(context);
     computeParameters(context, true);
     copyChargesToPosq(context, charges, chargePosqIndex);
     AlignedArray<float>& posq = data.posq;
@@ -679,13 +1282,24 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
         nonbonded->setUseLJPME(ewaldDispersionAlpha, dispersionGridSize);
     }
     double nonbondedEnergy = 0;
-    if (includeDirect)
-        nonbonded->calculateDirectIxn(numParticles, &posq[0], posData, particleParams, C6params, exclusions, data.threadForce, includeEnergy ? &nonbondedEnergy : NULL, data.threads);
-    if (includeReciprocal) {
+    PmeIO io(&posq[0], &data.threadForce[0][0], numParticles);
+    Vec3 periodicBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
+    bool overlapPme = (includeDirect && includeReciprocal && useOptimizedPme && data.pmeThreadPool != data.threadPool);
+    bool timeForTuning = (tuningPme && includeDirect && includeReciprocal && pmeTuningStep > 1);
+    double tuningStartTime = (timeForTuning ? getCurrentTime() : 0.0);
+    if (overlapPme) {
+        // Reciprocal space runs on its own threads, so start it now and let it overlap direct space.  The
+        // forces are only added to threadForce[0] by finishComputation(), after direct space is done with it.
+
+        optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
+    }
+    ThreadPool::CompletionGuard pmeGuard(*data.pmeThreadPool);
+    auto computeReciprocal = [&] () {
         if (useOptimizedPme) {
-            PmeIO io(&posq[0], &data.threadForce[0][0], numParticles);
-            Vec3 periodicBoxVectors[3] = {boxVectors[0], boxVectors[1], boxVectors[2]};
-            optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
+            vector<char>& blockUsed = data.threadForceBlockUsed[0];
+            fill(blockUsed.begin(), blockUsed.end(), 1);
+            if (!overlapPme)
+                optimizedPme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, periodicBoxVectors, includeEnergy);
             nonbondedEnergy += optimizedPme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
             if (nonbondedMethod == LJPME) {
                 copyChargesToPosq(context, C6params, ljPosqIndex);
@@ -695,7 +1309,26 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
         }
         else
             nonbonded->calculateReciprocalIxn(numParticles, &posq[0], posData, particleParams, C6params, exclusions, forceData, includeEnergy ? &nonbondedEnergy : NULL);
+    };
+
+    // If the neighbor list is being built in the background and reciprocal space shares the Context's threads, it
+    // cannot overlap direct space, but it can overlap the build.  Compute it before waiting for the list.
+
+    bool reciprocalFirst = (includeDirect && includeReciprocal && useOptimizedPme && !overlapPme && data.concurrentNeighborList);
+    if (reciprocalFirst) {
+        computeReciprocal();
+        copyChargesToPosq(context, charges, chargePosqIndex);
+    }
+    if (includeDirect) {
+        data.waitForNeighborList();
+        double startTime = getCurrentTime();
+        nonbonded->calculateDirectIxn(numParticles, &posq[0], posData, particleParams, C6params, exclusions, data.threadForce, includeEnergy ? &nonbondedEnergy : NULL, data.threads);
+        data.neighborListPairTime += getCurrentTime()-startTime;
     }
+    if (includeReciprocal && !reciprocalFirst)
+        computeReciprocal();
+    if (timeForTuning)
+        pmeTuningCandidates[currentPmeTuningCandidate].time += getCurrentTime()-tuningStartTime;
     energy += nonbondedEnergy;
     if (includeDirect) {
         ReferenceLJCoulomb14 nonbonded14;
@@ -710,6 +1343,158 @@ double CpuCalcNonbondedForceKernel::execute(ContextImpl& context, bool includeFo
     return energy;
 }
 
+/**
+ * Find the smallest grid dimension that is at least as large as minimum and has no prime factors larger than 5.
+ */
+static int findFFTDimension(int minimum) {
+    for (int size = minimum; ; size++) {
+        int remainder = size;
+        for (int factor = 2; factor <= 5; factor++)
+            while (remainder%factor == 0)
+                remainder /= factor;
+        if (remainder == 1)
+            return size;
+    }
+}
+
+/**
+ * Estimate the error in PME with a given alpha and grid.  This inverts the formulas in
+ * NonbondedForceImpl::calcPMEParameters(), which picks alpha so the direct space error equals the tolerance, and
+ * then the grid so the reciprocal space error does too.  The result is the sum of the two.
+ */
+static double estimatePmeError(double alpha, double cutoff, const int gridSize[3], const Vec3* boxVectors) {
+    double directError = 0.5*exp(-alpha*alpha*cutoff*cutoff);
+    double reciprocalError = 0.0;
+    for (int i = 0; i < 3; i++)
+        reciprocalError = max(reciprocalError, pow(2*alpha*boxVectors[i][i]/(3*gridSize[i]), 5.0));
+    return directError+reciprocalError;
+}
+
+void CpuCalcNonbondedForceKernel::startPmeTuning(ContextImpl& context) {
+    // The first candidate is the default parameters.  They make the direct and reciprocal space errors equal, but
+    // that is not necessarily the cheapest way to reach the same total error.  The direct space work is set by the
+    // cutoff, which is never changed, so the work can only be reduced by using a coarser grid.  For each coarser
+    // grid we look for the alpha that minimizes the estimated error, keep the pair if that is within the total
+    // error allowed by the tolerance, and stop once it is not.
+
+    PmeTuningCandidate defaultCandidate;
+    for (int i = 0; i < 3; i++)
+        defaultCandidate.gridSize[i] = gridSize[i];
+    defaultCandidate.alpha = ewaldAlpha;
+    defaultCandidate.padding = data.paddedCutoff-data.cutoff;
+    defaultCandidate.time = 0.0;
+    pmeTuningCandidates.push_back(defaultCandidate);
+    if (!pmeGridSpecified) {
+        Vec3* boxVectors = extractBoxVectors(context);
+        double targetError = 2*ewaldErrorTolerance;
+        for (double scale : {0.95, 0.9, 0.85, 0.8}) {
+            PmeTuningCandidate candidate = defaultCandidate;
+            for (int i = 0; i < 3; i++)
+                candidate.gridSize[i] = min(gridSize[i], findFFTDimension(max(6, (int) ceil(scale*gridSize[i]))));
+            PmeTuningCandidate& last = pmeTuningCandidates.back();
+            if (candidate.gridSize[0] == last.gridSize[0] && candidate.gridSize[1] == last.gridSize[1] && candidate.gridSize[2] == last.gridSize[2])
+                continue;
+
+            // The error is a convex function of alpha, so find the alpha that minimizes it by golden section search.
+
+            const double ratio = 0.5*(sqrt(5.0)-1);
+            double low = 0.5*ewaldAlpha, high = 1.5*ewaldAlpha;
+            for (int iteration = 0; iteration < 50; iteration++) {
+                double alpha1 = high-ratio*(high-low);
+                double alpha2 = low+ratio*(high-low);
+                if (estimatePmeError(alpha1, nonbondedCutoff, candidate.gridSize, boxVectors) < estimatePmeError(alpha2, nonbondedCutoff, candidate.gridSize, boxVectors))
+                    high = alpha2;
+                else
+                    low = alpha1;
+            }
+            candidate.alpha = 0.5*(low+high);
+            if (estimatePmeError(candidate.alpha, nonbondedCutoff, candidate.gridSize, boxVectors) > targetError)
+                break;
+            pmeTuningCandidates.push_back(candidate);
+        }
+    }
+    tuningPme = true;
+    pmeGridTuned = false;
+    currentPmeTuningCandidate = 0;
+    pmeTuningStep = 0;
+    pmeTuningRebuilds = 0;
+}
+
+void CpuCalcNonbondedForceKernel::tunePmeParameters(ContextImpl& context) {
+    // This is called at the start of each step.  execute() adds the time spent on direct and reciprocal space
+    // (including waiting for the neighbor list) to the current candidate.  The first step with a new candidate is
+    // not counted, since it includes setting up the PME kernel and rebuilding the neighbor list for the new padding.
+    // Unless ConcurrentNeighborList is set, the neighbor list is built in beginComputation(), outside the timed
+    // region, so its cost is added separately when the candidate is finished.  Otherwise a small padding would
+    // always look cheaper, since the extra rebuilds it causes would not be counted.
+
+    const int stepsPerCandidate = 10;
+    if (++pmeTuningStep == 2)
+        pmeTuningRebuilds = data.neighborListRebuilds;
+    if (pmeTuningStep <= stepsPerCandidate+1)
+        return;
+    pmeTuningStep = 1;
+    if (!data.concurrentNeighborList) {
+        // Charge the candidate for every rebuild during the timed steps, each taking as long as the last one.  If
+        // there were none, the list lasted at least that long, so charge one build spread over those steps.
+
+        int rebuilds = data.neighborListRebuilds-pmeTuningRebuilds;
+        double buildTime = data.neighborListBuildTime;
+        pmeTuningCandidates[currentPmeTuningCandidate].time += (rebuilds > 0 ? rebuilds*buildTime : buildTime*stepsPerCandidate/(stepsPerCandidate+1));
+    }
+    if (++currentPmeTuningCandidate == pmeTuningCandidates.size()) {
+        int best = 0;
+        for (int i = 1; i < pmeTuningCandidates.size(); i++)
+            if (pmeTuningCandidates[i].time < pmeTuningCandidates[best].time)
+                best = i;
+        PmeTuningCandidate bestCandidate = pmeTuningCandidates[best];
+        if (pmeGridTuned || data.adaptivePadding) {
+            // When the padding is adapted automatically, it is left alone here.
+
+            tuningPme = false;
+            setPmeTuningCandidate(context, bestCandidate);
+            return;
+        }
+
+        // Now try less and more padding with the fastest grid.  A smaller padding makes the neighbor list shorter
+        // but it needs to be rebuilt more often.
+
+        pmeGridTuned = true;
+        for (double scale : {0.6, 1.6}) {
+            PmeTuningCandidate candidate = bestCandidate;
+            candidate.padding *= scale;
+            candidate.time = 0.0;
+            pmeTuningCandidates.push_back(candidate);
+        }
+    }
+    setPmeTuningCandidate(context, pmeTuningCandidates[currentPmeTuningCandidate]);
+}
+
+void CpuCalcNonbondedForceKernel::setPmeTuningCandidate(ContextImpl& context, const PmeTuningCandidate& candidate) {
+    if (candidate.alpha != ewaldAlpha || candidate.gridSize[0] != gridSize[0] || candidate.gridSize[1] != gridSize[1] || candidate.gridSize[2] != gridSize[2]) {
+        // The self energy is proportional to alpha.
+
+        ewaldSelfEnergy *= candidate.alpha/ewaldAlpha;
+        ewaldAlpha = candidate.alpha;
+        for (int i = 0; i < 3; i++)
+            gridSize[i] = candidate.gridSize[i];
+        if (useOptimizedPme) {
+            optimizedPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), context);
+            optimizedPme.getAs<CalcPmeReciprocalForceKernel>().setThreadPool(data.pmeThreadPool);
+            optimizedPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSize[0], gridSize[1], gridSize[2], numParticles, ewaldAlpha, data.deterministicForces);
+        }
+    }
+    if (!data.adaptivePadding)
+        data.setNeighborListPadding(candidate.padding);
+    recordPmeParameters();
+}
+
+void CpuCalcNonbondedForceKernel::recordPmeParameters() {
+    stringstream parameters;
+    parameters << "alpha=" << ewaldAlpha << " grid=" << gridSize[0] << "x" << gridSize[1] << "x" << gridSize[2] << " padding=" << data.paddedCutoff-data.cutoff;
+    data.propertyValues[CpuPlatform::CpuPmeParameters()] = parameters.str();
+}
+
 void CpuCalcNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const NonbondedForce& force) {
     if (force.getNumParticles() != numParticles)
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
@@ -809,6 +1594,11 @@ void CpuCalcNonbondedForceKernel::computeParameters(ContextImpl& context, bool o
             charges[i] = (float) charge;
             particleParams[i] = make_pair((float) (0.5*sigma), (float) (2.0*sqrt(epsilon)));
             C6params[i] = 8.0*pow(particleParams[i].first, 3.0) * particleParams[i].second;
+            if (data.precision == "double") {
+                doubleCharges[i] = charge;
+                doubleParticleParams[i] = make_pair(0.5*sigma, 2.0*sqrt(epsilon));
+                doubleC6params[i] = 8.0*pow(doubleParticleParams[i].first, 3.0) * doubleParticleParams[i].second;
+            }
             sumSquaredCharges += charge*charge;
         }
         if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
@@ -877,7 +1667,11 @@ void CpuCalcCustomNonbondedForceKernel::initialize(const System& system, const C
     if (nonbondedMethod == NoCutoff)
         useSwitchingFunction = false;
     else {
-        data.requestNeighborList(nonbondedCutoff, 0.25*nonbondedCutoff, true, exclusions);
+        // With interaction groups, every interaction comes from the groups' own neighbor lists, so the full
+        // list is only needed if some other force requests it.
+
+        if (force.getNumInteractionGroups() == 0)
+            data.requestNeighborList(nonbondedCutoff, 0.25*nonbondedCutoff, true, exclusions);
         useSwitchingFunction = force.getUseSwitchingFunction();
         switchingDistance = force.getSwitchingDistance();
     }
@@ -922,19 +1716,20 @@ void CpuCalcCustomNonbondedForceKernel::createInteraction(const CustomNonbondedF
     // Parse the various expressions used to calculate the force.
 
     Lepton::ParsedExpression expression = Lepton::Parser::parse(force.getEnergyFunction(), functions).optimize();
-    Lepton::CompiledExpression energyExpression = expression.createCompiledExpression();
-    Lepton::CompiledExpression forceExpression = expression.differentiate("r").createCompiledExpression();
+    int width = CpuCustomNonbondedForce::BatchSize;
+    Lepton::CompiledVectorExpression energyExpression = expression.createCompiledVectorExpression(width);
+    Lepton::CompiledVectorExpression forceExpression = expression.differentiate("r").createCompiledVectorExpression(width);
     for (int i = 0; i < force.getNumPerParticleParameters(); i++)
         parameterNames.push_back(force.getPerParticleParameterName(i));
     for (int i = 0; i < force.getNumGlobalParameters(); i++) {
         globalParameterNames.push_back(force.getGlobalParameterName(i));
         globalParamValues[force.getGlobalParameterName(i)] = force.getGlobalParameterDefaultValue(i);
     }
-    std::vector<Lepton::CompiledExpression> energyParamDerivExpressions;
+    std::vector<Lepton::CompiledVectorExpression> energyParamDerivExpressions;
     for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++) {
         string param = force.getEnergyParameterDerivativeName(i);
         energyParamDerivNames.push_back(param);
-        energyParamDerivExpressions.push_back(expression.differentiate(param).createCompiledExpression());
+        energyParamDerivExpressions.push_back(expression.differentiate(param).createCompiledVectorExpression(width));
     }
     set<string> variables;
     variables.insert("r");
@@ -953,6 +1748,7 @@ void CpuCalcCustomNonbondedForceKernel::createInteraction(const CustomNonbondedF
     // Create the object that computes the interaction.
 
     nonbonded = new CpuCustomNonbondedForce(energyExpression, forceExpression, parameterNames, exclusions, energyParamDerivExpressions, data.threads);
+    nonbonded->setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
     if (interactionGroups.size() > 0)
         nonbonded->setInteractionGroups(interactionGroups);
 }
@@ -963,8 +1759,17 @@ double CpuCalcCustomNonbondedForceKernel::execute(ContextImpl& context, bool inc
     Vec3* boxVectors = extractBoxVectors(context);
     double energy = 0;
     bool periodic = (nonbondedMethod == CutoffPeriodic);
-    if (nonbondedMethod != NoCutoff)
-        nonbonded->setUseCutoff(nonbondedCutoff, *data.neighborList);
+    if (nonbondedMethod != NoCutoff) {
+        if (interactionGroups.size() > 0) {
+            // Use the same padding as the shared neighbor list, so the interaction group lists follow AdaptivePadding
+            // and PmeTuning.  If no other force requested that list, use the padding it would have had.
+
+            double padding = (data.neighborList != NULL ? data.paddedCutoff-data.cutoff : 0.25*nonbondedCutoff);
+            nonbonded->setUseCutoff(nonbondedCutoff, padding);
+        }
+        else
+            nonbonded->setUseCutoff(nonbondedCutoff, *data.neighborList);
+    }
     if (periodic) {
         double minAllowedSize = 2*nonbondedCutoff;
         if (boxVectors[0][0] < minAllowedSize || boxVectors[1][1] < minAllowedSize || boxVectors[2][2] < minAllowedSize)
@@ -981,7 +1786,11 @@ double CpuCalcCustomNonbondedForceKernel::execute(ContextImpl& context, bool inc
     if (useSwitchingFunction)
         nonbonded->setUseSwitchingFunction(switchingDistance);
     vector<double> energyParamDerivValues(energyParamDerivNames.size()+1, 0.0);
+    data.waitForNeighborList();
+    double startTime = getCurrentTime();
     nonbonded->calculatePairIxn(numParticles, &data.posq[0], posData, particleParamArray, globalParamValues, data.threadForce, includeForces, includeEnergy, energy, &energyParamDerivValues[0]);
+    if (nonbondedMethod != NoCutoff && interactionGroups.size() == 0)
+        data.neighborListPairTime += getCurrentTime()-startTime;
     map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
     for (int i = 0; i < energyParamDerivNames.size(); i++)
         energyParamDerivs[energyParamDerivNames[i]] += energyParamDerivValues[i];
@@ -1062,8 +1871,13 @@ void CpuCalcGBSAOBCForceKernel::initialize(const System& system, const GBSAOBCFo
     obc.setSolventDielectric((float) force.getSolventDielectric());
     obc.setSoluteDielectric((float) force.getSoluteDielectric());
     obc.setSurfaceAreaEnergy((float) force.getSurfaceAreaEnergy());
-    if (force.getNonbondedMethod() != GBSAOBCForce::NoCutoff)
-        obc.setUseCutoff((float) force.getCutoffDistance());
+    obc.setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
+    if (force.getNonbondedMethod() != GBSAOBCForce::NoCutoff) {
+        double cutoff = force.getCutoffDistance();
+        obc.setUseCutoff((float) cutoff);
+        data.requestNeighborList(cutoff, 0.25*cutoff, false, vector<set<int> >(numParticles));
+        obc.setNeighborList(*data.neighborList, data.exclusions);
+    }
     data.isPeriodic |= (force.getNonbondedMethod() == GBSAOBCForce::CutoffPeriodic);
 }
 
@@ -1075,6 +1889,7 @@ double CpuCalcGBSAOBCForceKernel::execute(ContextImpl& context, bool includeForc
         obc.setPeriodic(floatBoxSize);
     }
     double energy = 0.0;
+    data.waitForNeighborList();
     obc.computeForce(data.posq, data.threadForce, includeEnergy ? &energy : NULL, data.threads);
     return energy;
 }
@@ -1253,6 +2068,7 @@ void CpuCalcCustomGBForceKernel::createInteraction(const CustomGBForce& force) {
     ixn = new CpuCustomGBForce(numParticles, exclusions, valueExpressions, valueDerivExpressions, valueGradientExpressions, valueParamDerivExpressions,
         valueNames, valueTypes, energyExpressions, energyDerivExpressions, energyGradientExpressions, energyParamDerivExpressions, energyTypes,
         particleParameterNames, data.threads);
+    ixn->setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
 }
 
 double CpuCalcCustomGBForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
@@ -1309,6 +2125,152 @@ void CpuCalcCustomGBForceKernel::copyParametersToContext(ContextImpl& context, c
     }
 }
 
+CpuCalcCustomHbondForceKernel::~CpuCalcCustomHbondForceKernel() {
+    if (ixn != NULL)
+        delete ixn;
+    for (auto& function : tabulatedFunctions)
+        delete function.second;
+}
+
+void CpuCalcCustomHbondForceKernel::initialize(const System& system, const CustomHbondForce& force) {
+
+    // Record the exclusions.
+
+    numDonors = force.getNumDonors();
+    numAcceptors = force.getNumAcceptors();
+    exclusions.resize(numDonors);
+    for (int i = 0; i < force.getNumExclusions(); i++) {
+        int donor, acceptor;
+        force.getExclusionParticles(i, donor, acceptor);
+        exclusions[donor].insert(acceptor);
+    }
+
+    // Build the arrays.
+
+    donorParticles.resize(numDonors);
+    donorParamArray.resize(numDonors);
+    for (int i = 0; i < numDonors; ++i) {
+        int d1, d2, d3;
+        force.getDonorParameters(i, d1, d2, d3, donorParamArray[i]);
+        donorParticles[i].push_back(d1);
+        donorParticles[i].push_back(d2);
+        donorParticles[i].push_back(d3);
+    }
+    acceptorParticles.resize(numAcceptors);
+    acceptorParamArray.resize(numAcceptors);
+    for (int i = 0; i < numAcceptors; ++i) {
+        int a1, a2, a3;
+        force.getAcceptorParameters(i, a1, a2, a3, acceptorParamArray[i]);
+        acceptorParticles[i].push_back(a1);
+        acceptorParticles[i].push_back(a2);
+        acceptorParticles[i].push_back(a3);
+    }
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParameterNames.push_back(force.getGlobalParameterName(i));
+    nonbondedCutoff = force.getCutoffDistance();
+
+    // Record the tabulated functions for future reference.
+
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++)
+        tabulatedFunctions[force.getTabulatedFunctionName(i)] = XmlSerializer::clone(force.getTabulatedFunction(i));
+
+    // Create the interaction.
+    
+    createInteraction(force);
+}
+
+void CpuCalcCustomHbondForceKernel::createInteraction(const CustomHbondForce& force) {
+    // Create custom functions for the tabulated functions.
+
+    map<string, Lepton::CustomFunction*> functions;
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++)
+        functions[force.getTabulatedFunctionName(i)] = createReferenceTabulatedFunction(force.getTabulatedFunction(i));
+
+    // Parse the expression and create the object used to calculate the interaction.
+
+    map<string, vector<int> > distances;
+    map<string, vector<int> > angles;
+    map<string, vector<int> > dihedrals;
+    Lepton::ParsedExpression energyExpression = CustomHbondForceImpl::prepareExpression(force, functions, distances, angles, dihedrals);
+    vector<string> donorParameterNames;
+    vector<string> acceptorParameterNames;
+    for (int i = 0; i < force.getNumPerDonorParameters(); i++)
+        donorParameterNames.push_back(force.getPerDonorParameterName(i));
+    for (int i = 0; i < force.getNumPerAcceptorParameters(); i++)
+        acceptorParameterNames.push_back(force.getPerAcceptorParameterName(i));
+    ixn = new CpuCustomHbondForce(donorParticles, acceptorParticles, energyExpression, donorParameterNames, acceptorParameterNames, distances, angles, dihedrals, data.threads);
+    NonbondedMethod nonbondedMethod = CalcCustomHbondForceKernel::NonbondedMethod(force.getNonbondedMethod());
+    isPeriodic = (nonbondedMethod == CutoffPeriodic);
+    if (nonbondedMethod != NoCutoff)
+        ixn->setUseCutoff(nonbondedCutoff);
+
+    // Delete the custom functions.
+
+    for (auto& function : functions)
+        delete function.second;
+}
+
+double CpuCalcCustomHbondForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& forceData = extractForces(context);
+    if (isPeriodic)
+        ixn->setPeriodic(extractBoxVectors(context));
+    double energy = 0;
+    map<string, double> globalParameters;
+    for (auto& name : globalParameterNames)
+        globalParameters[name] = context.getParameter(name);
+    ixn->calculatePairIxn(posData, donorParamArray, acceptorParamArray, exclusions, globalParameters, forceData, includeEnergy ? &energy : NULL);
+    return energy;
+}
+
+void CpuCalcCustomHbondForceKernel::copyParametersToContext(ContextImpl& context, const CustomHbondForce& force) {
+    if (numDonors != force.getNumDonors())
+        throw OpenMMException("updateParametersInContext: The number of donors has changed");
+    if (numAcceptors != force.getNumAcceptors())
+        throw OpenMMException("updateParametersInContext: The number of acceptors has changed");
+
+    // Record the values.
+
+    vector<double> parameters;
+    int numDonorParameters = force.getNumPerDonorParameters();
+    const vector<vector<int> >& donorAtoms = ixn->getDonorAtoms();
+    for (int i = 0; i < numDonors; ++i) {
+        int d1, d2, d3;
+        force.getDonorParameters(i, d1, d2, d3, parameters);
+        if (d1 != donorAtoms[i][0] || d2 != donorAtoms[i][1] || d3 != donorAtoms[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in a donor group has changed");
+        for (int j = 0; j < numDonorParameters; j++)
+            donorParamArray[i][j] = parameters[j];
+    }
+    int numAcceptorParameters = force.getNumPerAcceptorParameters();
+    const vector<vector<int> >& acceptorAtoms = ixn->getAcceptorAtoms();
+    for (int i = 0; i < numAcceptors; ++i) {
+        int a1, a2, a3;
+        force.getAcceptorParameters(i, a1, a2, a3, parameters);
+        if (a1 != acceptorAtoms[i][0] || a2 != acceptorAtoms[i][1] || a3 != acceptorAtoms[i][2])
+            throw OpenMMException("updateParametersInContext: The set of particles in an acceptor group has changed");
+        for (int j = 0; j < numAcceptorParameters; j++)
+            acceptorParamArray[i][j] = parameters[j];
+    }
+
+    // See if any tabulated functions have changed.
+
+    bool changed = false;
+    for (int i = 0; i < force.getNumTabulatedFunctions(); i++) {
+        string name = force.getTabulatedFunctionName(i);
+        if (force.getTabulatedFunction(i) != *tabulatedFunctions[name]) {
+            delete tabulatedFunctions[name];
+            tabulatedFunctions[name] = XmlSerializer::clone(force.getTabulatedFunction(i));
+            changed = true;
+        }
+    }
+    if (changed) {
+        delete ixn;
+        ixn = NULL;
+        createInteraction(force);
+    }
+}
+
 CpuCalcCustomManyParticleForceKernel::~CpuCalcCustomManyParticleForceKernel() {
     if (ixn != NULL)
         delete ixn;
@@ -1335,6 +2297,7 @@ void CpuCalcCustomManyParticleForceKernel::initialize(const System& system, cons
     // Create the interaction.
 
     ixn = new CpuCustomManyParticleForce(force, data.threads);
+    ixn->setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
     nonbondedMethod = CalcCustomManyParticleForceKernel::NonbondedMethod(force.getNonbondedMethod());
     cutoffDistance = force.getCutoffDistance();
     data.isPeriodic |= (nonbondedMethod == CutoffPeriodic);
@@ -1386,6 +2349,7 @@ void CpuCalcCustomManyParticleForceKernel::copyParametersToContext(ContextImpl&
         delete ixn;
         ixn = NULL;
         ixn = new CpuCustomManyParticleForce(force, data.threads);
+        ixn->setForceBlockTracking(&data.threadForceBlockUsed, CpuPlatform::PlatformData::ForceBlockSize);
     }
 }
 
@@ -1444,6 +2408,7 @@ void CpuIntegrateLangevinStepKernel::execute(ContextImpl& context, const Langevi
         prevFriction = friction;
         prevStepSize = stepSize;
     }
+    dynamics->setRandomStep(data.random.nextStep());
     dynamics->update(context.getSystem(), posData, velData, forceData, masses, integrator.getConstraintTolerance());
     ReferencePlatform::PlatformData* refData = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
     refData->time += stepSize;
@@ -1484,6 +2449,7 @@ void CpuIntegrateLangevinMiddleStepKernel::execute(ContextImpl& context, const L
         prevFriction = friction;
         prevStepSize = stepSize;
     }
+    dynamics->setRandomStep(data.random.nextStep());
     dynamics->update(context, posData, velData, masses, integrator.getConstraintTolerance());
     ReferencePlatform::PlatformData* refData = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
     refData->time += stepSize;
@@ -1493,3 +2459,90 @@ void CpuIntegrateLangevinMiddleStepKernel::execute(ContextImpl& context, const L
 double CpuIntegrateLangevinMiddleStepKernel::computeKineticEnergy(ContextImpl& context, const LangevinMiddleIntegrator& integrator) {
     return computeShiftedKineticEnergy(context, masses, 0.0);
 }
+
+CpuIntegrateCustomStepKernel::~CpuIntegrateCustomStepKernel() {
+    if (dynamics)
+        delete dynamics;
+}
+
+void CpuIntegrateCustomStepKernel::initialize(const System& system, const CustomIntegrator& integrator) {
+    int numParticles = system.getNumParticles();
+    masses.resize(numParticles);
+    for (int i = 0; i < numParticles; ++i)
+        masses[i] = system.getParticleMass(i);
+    perDofValues.resize(integrator.getNumPerDofVariables());
+    for (auto& values : perDofValues)
+        values.resize(numParticles);
+
+    // Create the computation objects.  Per-DOF random numbers come from a multithreaded generator of our
+    // own, so other integrators in a CompoundIntegrator can use different seeds.  Global ones are generated
+    // serially as on the Reference platform.
+
+    dynamics = new CpuCustomDynamics(system.getNumParticles(), integrator, data.threads, random);
+    random.initialize(integrator.getRandomNumberSeed(), data.threads.getNumThreads());
+    SimTKOpenMMUtilities::setRandomNumberSeed((unsigned int) integrator.getRandomNumberSeed());
+}
+
+void CpuIntegrateCustomStepKernel::execute(ContextImpl& context, CustomIntegrator& integrator, bool& forcesAreValid) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& velData = extractVelocities(context);
+    vector<Vec3>& forceData = extractForces(context);
+    
+    // Record global variables.
+    
+    map<string, double> globals;
+    globals["dt"] = integrator.getStepSize();
+    for (int i = 0; i < integrator.getNumGlobalVariables(); i++)
+        globals[integrator.getGlobalVariableName(i)] = globalValues[i];
+    
+    // Execute the step.
+    
+    dynamics->setReferenceConstraintAlgorithm(&extractConstraints(context));
+    dynamics->update(context, context.getSystem().getNumParticles(), posData, velData, forceData, masses, globals, perDofValues, forcesAreValid, integrator.getConstraintTolerance());
+    
+    // Record changed global variables.
+    
+    integrator.setStepSize(globals["dt"]);
+    for (int i = 0; i < (int) globalValues.size(); i++)
+        globalValues[i] = globals[integrator.getGlobalVariableName(i)];
+    ReferencePlatform::PlatformData* refData = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    refData->time += dynamics->getDeltaT();
+    refData->stepCount++;
+}
+
+double CpuIntegrateCustomStepKernel::computeKineticEnergy(ContextImpl& context, CustomIntegrator& integrator, bool& forcesAreValid) {
+    vector<Vec3>& posData = extractPositions(context);
+    vector<Vec3>& velData = extractVelocities(context);
+    vector<Vec3>& forceData = extractForces(context);
+    
+    // Record global variables.
+    
+    map<string, double> globals;
+    globals["dt"] = integrator.getStepSize();
+    for (int i = 0; i < integrator.getNumGlobalVariables(); i++)
+        globals[integrator.getGlobalVariableName(i)] = globalValues[i];
+    
+    // Compute the kinetic energy.
+    
+    return dynamics->computeKineticEnergy(context, context.getSystem().getNumParticles(), posData, velData, forceData, masses, globals, perDofValues, forcesAreValid);
+}
+
+void CpuIntegrateCustomStepKernel::getGlobalVariables(ContextImpl& context, vector<double>& values) const {
+    values = globalValues;
+}
+
+void CpuIntegrateCustomStepKernel::setGlobalVariables(ContextImpl& context, const vector<double>& values) {
+    globalValues = values;
+}
+
+void CpuIntegrateCustomStepKernel::getPerDofVariable(ContextImpl& context, int variable, vector<Vec3>& values) const {
+    values.resize(perDofValues[variable].size());
+    for (int i = 0; i < (int) values.size(); i++)
+        values[i] = perDofValues[variable][i];
+}
+
+void CpuIntegrateCustomStepKernel::setPerDofVariable(ContextImpl& context, int variable, const vector<Vec3>& values) {
+    perDofValues[variable].resize(values.size());
+    for (int i = 0; i < (int) values.size(); i++)
+        perDofValues[variable][i] = values[i];
+}
@@ -30,12 +30,17 @@ using namespace OpenMM;
 using namespace std;
 
 CpuLangevinDynamics::CpuLangevinDynamics(int numberOfAtoms, double deltaT, double friction, double temperature, ThreadPool& threads, CpuRandom& random) : 
-           ReferenceStochasticDynamics(numberOfAtoms, deltaT, friction, temperature), threads(threads), random(random) {
+           ReferenceStochasticDynamics(numberOfAtoms, deltaT, friction, temperature), threads(threads), random(random), randomStep(0) {
+    threadNoise.resize(threads.getNumThreads());
 }
 
 CpuLangevinDynamics::~CpuLangevinDynamics() {
 }
 
+void CpuLangevinDynamics::setRandomStep(long long step) {
+    randomStep = step;
+}
+
 void CpuLangevinDynamics::updatePart1(int numberOfAtoms, vector<Vec3>& atomCoordinates, vector<Vec3>& velocities,
                                       vector<Vec3>& forces, vector<double>& inverseMasses, vector<Vec3>& xPrime) {
     // Record the parameters for the threads.
@@ -95,11 +100,15 @@ void CpuLangevinDynamics::threadUpdate1(int threadIndex) {
     const double noisescale = sqrt(kT*(1-vscale*vscale));
     int start = threadIndex*numberOfAtoms/threads.getNumThreads();
     int end = (threadIndex+1)*numberOfAtoms/threads.getNumThreads();
+    vector<float>& noiseValues = threadNoise[threadIndex];
+    noiseValues.resize(4*(end-start));
+    random.getGaussianRandoms(randomStep, start, end, noiseValues.data());
 
     for (int i = start; i < end; i++) {
         if (inverseMasses[i] != 0.0) {
             double sqrtInvMass = sqrt(inverseMasses[i]);
-            Vec3 noise(random.getGaussianRandom(threadIndex), random.getGaussianRandom(threadIndex), random.getGaussianRandom(threadIndex));
+            const float* particleNoise = &noiseValues[4*(i-start)];
+            Vec3 noise(particleNoise[0], particleNoise[1], particleNoise[2]);
             velocities[i]  = velocities[i]*vscale + forces[i]*(fscale*inverseMasses[i]) + noise*(noisescale*sqrtInvMass);
         }
    }
@@ -29,12 +29,17 @@ using namespace OpenMM;
 using namespace std;
 
 CpuLangevinMiddleDynamics::CpuLangevinMiddleDynamics(int numberOfAtoms, double deltaT, double friction, double temperature, ThreadPool& threads, CpuRandom& random) : 
-           ReferenceLangevinMiddleDynamics(numberOfAtoms, deltaT, friction, temperature), threads(threads), random(random) {
+           ReferenceLangevinMiddleDynamics(numberOfAtoms, deltaT, friction, temperature), threads(threads), random(random), randomStep(0) {
+    threadNoise.resize(threads.getNumThreads());
 }
 
 CpuLangevinMiddleDynamics::~CpuLangevinMiddleDynamics() {
 }
 
+void CpuLangevinMiddleDynamics::setRandomStep(long long step) {
+    randomStep = step;
+}
+
 void CpuLangevinMiddleDynamics::updatePart1(int numberOfAtoms, vector<Vec3>& velocities, vector<Vec3>& forces, vector<double>& inverseMasses) {
     // Record the parameters for the threads.
     
@@ -98,11 +103,15 @@ void CpuLangevinMiddleDynamics::threadUpdate2(int threadIndex) {
     const double noisescale = sqrt(1-vscale*vscale);
     int start = threadIndex*numberOfAtoms/threads.getNumThreads();
     int end = (threadIndex+1)*numberOfAtoms/threads.getNumThreads();
+    vector<float>& noiseValues = threadNoise[threadIndex];
+    noiseValues.resize(4*(end-start));
+    random.getGaussianRandoms(randomStep, start, end, noiseValues.data());
 
     for (int i = start; i < end; i++) {
         if (inverseMasses[i] != 0.0) {
             xPrime[i] = atomCoordinates[i] + velocities[i]*halfdt;
-            Vec3 noise(random.getGaussianRandom(threadIndex), random.getGaussianRandom(threadIndex), random.getGaussianRandom(threadIndex));
+            const float* particleNoise = &noiseValues[4*(i-start)];
+            Vec3 noise(particleNoise[0], particleNoise[1], particleNoise[2]);
             velocities[i] = vscale*velocities[i] + noisescale*sqrt(kT*inverseMasses[i])*noise;
             xPrime[i] = xPrime[i] + velocities[i]*halfdt;
             oldx[i] = xPrime[i];
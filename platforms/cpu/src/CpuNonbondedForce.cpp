@@ -26,6 +26,7 @@
 
 #include "SimTKOpenMMUtilities.h"
 #include "CpuNonbondedForce.h"
+#include "CpuFixedPoint.h"
 #include "ReferenceForce.h"
 #include "ReferencePME.h"
 #include <algorithm>
@@ -39,6 +40,7 @@ using namespace std;
 using namespace OpenMM;
 
 const float CpuNonbondedForce::TWO_OVER_SQRT_PI = (float) (2/sqrt(PI_M));
+static const double TWO_OVER_SQRT_PI_DOUBLE = 2/sqrt(PI_M);
 const int CpuNonbondedForce::NUM_TABLE_POINTS = 2048;
 
 /**---------------------------------------------------------------------------------------
@@ -48,7 +50,8 @@ const int CpuNonbondedForce::NUM_TABLE_POINTS = 2048;
    --------------------------------------------------------------------------------------- */
 
 CpuNonbondedForce::CpuNonbondedForce() : cutoff(false), useSwitch(false), periodic(false), periodicExceptions(false), ewald(false), pme(false), ljpme(false), tableIsValid(false), expTableIsValid(false),
-    cutoffDistance(0.0f), alphaDispersionEwald(0.0f), alphaEwald(0.0f) {
+    cutoffDistance(0.0f), alphaDispersionEwald(0.0f), alphaEwald(0.0f), cutoffDistanceDouble(0.0), switchingDistanceDouble(0.0), krfDouble(0.0), crfDouble(0.0),
+    alphaEwaldDouble(0.0), alphaDispersionEwaldDouble(0.0), doubleAtomParameters(NULL), doubleCharges(NULL), doubleC6params(NULL), forceBlockUsed(NULL), forceBlockSize(0), threadForceFixed(NULL), threadForceDouble(NULL), neighborListBuild(-1), staticPartition(false) {
 }
 
 CpuNonbondedForce::~CpuNonbondedForce() {
@@ -64,15 +67,18 @@ CpuNonbondedForce::~CpuNonbondedForce() {
 
      --------------------------------------------------------------------------------------- */
 
-void CpuNonbondedForce::setUseCutoff(float distance, const CpuNeighborList& neighbors, float solventDielectric) {
-    if (distance != cutoffDistance)
+void CpuNonbondedForce::setUseCutoff(double distance, const CpuNeighborList& neighbors, double solventDielectric) {
+    if ((float) distance != cutoffDistance)
         tableIsValid = false;
     cutoff = true;
     cutoffDistance = distance;
+    cutoffDistanceDouble = distance;
     inverseRcut6 = pow(cutoffDistance, -6);
     neighborList = &neighbors;
     krf = pow(cutoffDistance, -3.0f)*(solventDielectric-1.0)/(2.0*solventDielectric+1.0);
     crf = (1.0/cutoffDistance)*(3.0*solventDielectric)/(2.0*solventDielectric+1.0);
+    krfDouble = pow(distance, -3.0)*(solventDielectric-1.0)/(2.0*solventDielectric+1.0);
+    crfDouble = (1.0/distance)*(3.0*solventDielectric)/(2.0*solventDielectric+1.0);
     if(alphaDispersionEwald != 0.0f){
         // We set this here, in case setUseCutoff is called after the dispersion alpha is set.
         double dalphaR = alphaDispersionEwald*cutoffDistance;
@@ -93,9 +99,10 @@ void CpuNonbondedForce::setUseCutoff(float distance, const CpuNeighborList& neig
 
    --------------------------------------------------------------------------------------- */
 
-void CpuNonbondedForce::setUseSwitchingFunction(float distance) {
+void CpuNonbondedForce::setUseSwitchingFunction(double distance) {
     useSwitch = true;
     switchingDistance = distance;
+    switchingDistanceDouble = distance;
 }
 
 /**---------------------------------------------------------------------------------------
@@ -141,10 +148,11 @@ void CpuNonbondedForce::setPeriodic(Vec3* periodicBoxVectors) {
 
      --------------------------------------------------------------------------------------- */
 
-void CpuNonbondedForce::setUseEwald(float alpha, int kmaxx, int kmaxy, int kmaxz) {
-    if (alpha != alphaEwald)
+void CpuNonbondedForce::setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz) {
+    if ((float) alpha != alphaEwald)
         tableIsValid = false;
     alphaEwald = alpha;
+    alphaEwaldDouble = alpha;
     numRx = kmaxx;
     numRy = kmaxy;
     numRz = kmaxz;
@@ -161,10 +169,11 @@ void CpuNonbondedForce::setUseEwald(float alpha, int kmaxx, int kmaxy, int kmaxz
 
      --------------------------------------------------------------------------------------- */
 
-void CpuNonbondedForce::setUsePME(float alpha, int meshSize[3]) {
-    if (alpha != alphaEwald)
+void CpuNonbondedForce::setUsePME(double alpha, int meshSize[3]) {
+    if ((float) alpha != alphaEwald)
         tableIsValid = false;
     alphaEwald = alpha;
+    alphaEwaldDouble = alpha;
     meshDim[0] = meshSize[0];
     meshDim[1] = meshSize[1];
     meshDim[2] = meshSize[2];
@@ -182,10 +191,11 @@ void CpuNonbondedForce::setUsePME(float alpha, int meshSize[3]) {
 
      --------------------------------------------------------------------------------------- */
 
-void CpuNonbondedForce::setUseLJPME(float alpha, int meshSize[3]) {
-    if (alpha != alphaDispersionEwald)
+void CpuNonbondedForce::setUseLJPME(double alpha, int meshSize[3]) {
+    if ((float) alpha != alphaDispersionEwald)
         expTableIsValid = false;
     alphaDispersionEwald = alpha;
+    alphaDispersionEwaldDouble = alpha;
     dispersionMeshDim[0] = meshSize[0];
     dispersionMeshDim[1] = meshSize[1];
     dispersionMeshDim[2] = meshSize[2];
@@ -243,24 +253,116 @@ void CpuNonbondedForce::tabulateExpTerms() {
     }
 }
 
+/**
+ * Compute the reciprocal space part of Ewald summation, in either single or double precision.
+ *
+ * @param posq    the coordinates and charge of each atom, four elements per atom
+ */
+template <class REAL>
+static void calculateEwaldReciprocalIxn(int numberOfAtoms, const REAL* posq, const Vec3* periodicBoxVectors, REAL alphaEwald,
+                                        int numRx, int numRy, int numRz, vector<Vec3>& forces, double* totalEnergy) {
+    typedef std::complex<REAL> d_complex;
+
+    static const REAL epsilon      =  1.0;
+
+    int kmax                       = max(numRx, max(numRy,numRz));
+    REAL factorEwald               = -1 / (4*alphaEwald*alphaEwald);
+    REAL TWO_PI                    = 2.0 * PI_M;
+    REAL recipCoeff                = (REAL)(ONE_4PI_EPS0*4*PI_M/(periodicBoxVectors[0][0] * periodicBoxVectors[1][1] * periodicBoxVectors[2][2]) /epsilon);
+
+    // setup reciprocal box
+
+    REAL recipBoxSize[3] = {(REAL) (TWO_PI/periodicBoxVectors[0][0]), (REAL) (TWO_PI/periodicBoxVectors[1][1]), (REAL) (TWO_PI/periodicBoxVectors[2][2])};
+
+
+    // setup K-vectors
+
+#define EIR(x, y, z) eir[(x)*numberOfAtoms*3+(y)*3+z]
+    vector<d_complex> eir(kmax*numberOfAtoms*3);
+    vector<d_complex> tab_xy(numberOfAtoms);
+    vector<d_complex> tab_qxyz(numberOfAtoms);
+
+    for (int i = 0; (i < numberOfAtoms); i++) {
+        const REAL* pos = posq+4*i;
+        for (int m = 0; (m < 3); m++)
+            EIR(0, i, m) = d_complex(1,0);
+
+        for (int m=0; (m<3); m++)
+            EIR(1, i, m) = d_complex(cos(pos[m]*recipBoxSize[m]),
+                                     sin(pos[m]*recipBoxSize[m]));
+
+        for (int j=2; (j<kmax); j++)
+            for (int m=0; (m<3); m++)
+                EIR(j, i, m) = EIR(j-1, i, m) * EIR(1, i, m);
+    }
+
+    // calculate reciprocal space energy and forces
+
+    int lowry = 0;
+    int lowrz = 1;
+
+    for (int rx = 0; rx < numRx; rx++) {
+        REAL kx = rx * recipBoxSize[0];
+        for (int ry = lowry; ry < numRy; ry++) {
+            REAL ky = ry * recipBoxSize[1];
+            if (ry >= 0) {
+                for (int n = 0; n < numberOfAtoms; n++)
+                    tab_xy[n] = EIR(rx, n, 0) * EIR(ry, n, 1);
+            }
+            else {
+                for (int n = 0; n < numberOfAtoms; n++)
+                    tab_xy[n]= EIR(rx, n, 0) * conj (EIR(-ry, n, 1));
+            }
+            for (int rz = lowrz; rz < numRz; rz++) {
+                if (rz >= 0) {
+                    for (int n = 0; n < numberOfAtoms; n++)
+                        tab_qxyz[n] = posq[4*n+3] * (tab_xy[n] * EIR(rz, n, 2));
+                }
+                else {
+                    for (int n = 0; n < numberOfAtoms; n++)
+                        tab_qxyz[n] = posq[4*n+3] * (tab_xy[n] * conj(EIR(-rz, n, 2)));
+                }
+                REAL cs = 0;
+                REAL ss = 0;
+
+                for (int n = 0; n < numberOfAtoms; n++) {
+                    cs += tab_qxyz[n].real();
+                    ss += tab_qxyz[n].imag();
+                }
+
+                REAL kz = rz * recipBoxSize[2];
+                REAL k2 = kx * kx + ky * ky + kz * kz;
+                REAL ak = exp(k2*factorEwald) / k2;
+
+                for (int n = 0; n < numberOfAtoms; n++) {
+                    REAL force = ak * (cs * tab_qxyz[n].imag() - ss * tab_qxyz[n].real());
+                    forces[n][0] += 2 * recipCoeff * force * kx;
+                    forces[n][1] += 2 * recipCoeff * force * ky;
+                    forces[n][2] += 2 * recipCoeff * force * kz;
+                }
+
+                if (totalEnergy)
+                    *totalEnergy += recipCoeff * ak * (cs * cs + ss * ss);
+
+                lowrz = 1 - numRz;
+            }
+            lowry = 1 - numRy;
+        }
+    }
+}
+
 void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, const vector<Vec3>& atomCoordinates,
                                                const vector<pair<float, float> >& atomParameters, const vector<float> &C6params, const vector<set<int> >& exclusions,
                                                vector<Vec3>& forces, double* totalEnergy) const {
-    typedef std::complex<float> d_complex;
-
-    static const float epsilon     =  1.0;
-
-    int kmax                       = (ewald ? max(numRx, max(numRy,numRz)) : 0);
-    float factorEwald              = -1 / (4*alphaEwald*alphaEwald);
-    float TWO_PI                   = 2.0 * PI_M;
-    float recipCoeff               = (float)(ONE_4PI_EPS0*4*PI_M/(periodicBoxVectors[0][0] * periodicBoxVectors[1][1] * periodicBoxVectors[2][2]) /epsilon);
+    // When the interactions are computed in double precision, so is reciprocal space.
 
+    bool useDouble = (doubleCharges != NULL);
     if (pme) {
         pme_t pmedata;
-        pme_init(&pmedata, alphaEwald, numberOfAtoms, meshDim, 5, 1);
+        pme_init(&pmedata, (useDouble ? alphaEwaldDouble : alphaEwald), numberOfAtoms, meshDim, 5, 1);
         vector<double> charges(numberOfAtoms);
         for (int i = 0; i < numberOfAtoms; i++)
-            charges[i] = posq[4*i+3];
+            charges[i] = (useDouble ? doubleCharges[i] : posq[4*i+3]);
         double recipEnergy = 0.0;
         pme_exec(pmedata, atomCoordinates, forces, charges, periodicBoxVectors, &recipEnergy);
         if (totalEnergy)
@@ -269,11 +371,11 @@ void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, c
 
         if (ljpme) {
             // Dispersion reciprocal space terms
-            pme_init(&pmedata,alphaDispersionEwald,numberOfAtoms,dispersionMeshDim,5,1);
+            pme_init(&pmedata,(useDouble ? alphaDispersionEwaldDouble : alphaDispersionEwald),numberOfAtoms,dispersionMeshDim,5,1);
 
             std::vector<Vec3> dpmeforces;
             for (int i = 0; i < numberOfAtoms; i++){
-                charges[i] = C6params[i];
+                charges[i] = (useDouble ? doubleC6params[i] : C6params[i]);
                 dpmeforces.push_back(Vec3());
             }
             double recipDispersionEnergy = 0.0;
@@ -294,90 +396,20 @@ void CpuNonbondedForce::calculateReciprocalIxn(int numberOfAtoms, float* posq, c
     // Ewald method
 
     else if (ewald) {
-
-        // setup reciprocal box
-
-        float recipBoxSize[3] = {(float) (TWO_PI/periodicBoxVectors[0][0]), (float) (TWO_PI/periodicBoxVectors[1][1]), (float) (TWO_PI/periodicBoxVectors[2][2])};
-
-
-        // setup K-vectors
-
-#define EIR(x, y, z) eir[(x)*numberOfAtoms*3+(y)*3+z]
-        vector<d_complex> eir(kmax*numberOfAtoms*3);
-        vector<d_complex> tab_xy(numberOfAtoms);
-        vector<d_complex> tab_qxyz(numberOfAtoms);
-
-        for (int i = 0; (i < numberOfAtoms); i++) {
-            float* pos = posq+4*i;
-            for (int m = 0; (m < 3); m++)
-                EIR(0, i, m) = d_complex(1,0);
-
-            for (int m=0; (m<3); m++)
-                EIR(1, i, m) = d_complex(cos(pos[m]*recipBoxSize[m]),
-                                         sin(pos[m]*recipBoxSize[m]));
-
-            for (int j=2; (j<kmax); j++)
-                for (int m=0; (m<3); m++)
-                    EIR(j, i, m) = EIR(j-1, i, m) * EIR(1, i, m);
-        }
-
-        // calculate reciprocal space energy and forces
-
-        int lowry = 0;
-        int lowrz = 1;
-
-        for (int rx = 0; rx < numRx; rx++) {
-            float kx = rx * recipBoxSize[0];
-            for (int ry = lowry; ry < numRy; ry++) {
-                float ky = ry * recipBoxSize[1];
-                if (ry >= 0) {
-                    for (int n = 0; n < numberOfAtoms; n++)
-                        tab_xy[n] = EIR(rx, n, 0) * EIR(ry, n, 1);
-                }
-                else {
-                    for (int n = 0; n < numberOfAtoms; n++)
-                        tab_xy[n]= EIR(rx, n, 0) * conj (EIR(-ry, n, 1));
-                }
-                for (int rz = lowrz; rz < numRz; rz++) {
-                    if (rz >= 0) {
-                        for (int n = 0; n < numberOfAtoms; n++)
-                            tab_qxyz[n] = posq[4*n+3] * (tab_xy[n] * EIR(rz, n, 2));
-                    }
-                    else {
-                        for (int n = 0; n < numberOfAtoms; n++)
-                            tab_qxyz[n] = posq[4*n+3] * (tab_xy[n] * conj(EIR(-rz, n, 2)));
-                    }
-                    float cs = 0.0f;
-                    float ss = 0.0f;
-
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        cs += tab_qxyz[n].real();
-                        ss += tab_qxyz[n].imag();
-                    }
-
-                    float kz = rz * recipBoxSize[2];
-                    float k2 = kx * kx + ky * ky + kz * kz;
-                    float ak = exp(k2*factorEwald) / k2;
-
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        float force = ak * (cs * tab_qxyz[n].imag() - ss * tab_qxyz[n].real());
-                        forces[n][0] += 2 * recipCoeff * force * kx;
-                        forces[n][1] += 2 * recipCoeff * force * ky;
-                        forces[n][2] += 2 * recipCoeff * force * kz;
-                    }
-
-                    if (totalEnergy)
-                        *totalEnergy += recipCoeff * ak * (cs * cs + ss * ss);
-
-                    lowrz = 1 - numRz;
-                }
-                lowry = 1 - numRy;
+        if (useDouble) {
+            vector<double> posqDouble(4*numberOfAtoms);
+            for (int i = 0; i < numberOfAtoms; i++) {
+                for (int j = 0; j < 3; j++)
+                    posqDouble[4*i+j] = atomCoordinates[i][j];
+                posqDouble[4*i+3] = doubleCharges[i];
             }
+            calculateEwaldReciprocalIxn(numberOfAtoms, &posqDouble[0], periodicBoxVectors, alphaEwaldDouble, numRx, numRy, numRz, forces, totalEnergy);
         }
+        else
+            calculateEwaldReciprocalIxn(numberOfAtoms, posq, periodicBoxVectors, alphaEwald, numRx, numRy, numRz, forces, totalEnergy);
     }
 }
 
-
 void CpuNonbondedForce::calculateDirectIxn(int numberOfAtoms, float* posq, const vector<Vec3>& atomCoordinates, const vector<pair<float, float> >& atomParameters,
                                            const vector<float>& C6params, const vector<set<int> >& exclusions, vector<AlignedArray<float> >& threadForce, double* totalEnergy, ThreadPool& threads) {
     // Record the parameters for the threads.
@@ -391,12 +423,51 @@ void CpuNonbondedForce::calculateDirectIxn(int numberOfAtoms, float* posq, const
     this->threadForce = &threadForce;
     includeEnergy = (totalEnergy != NULL);
     threadEnergy.resize(threads.getNumThreads());
+    if (threadSortedForce.size() != threads.getNumThreads()) {
+        threadSortedForce.clear();
+        threadSortedForce.resize(threads.getNumThreads());
+        threadSortedForceDouble.clear();
+        threadSortedForceDouble.resize(threads.getNumThreads());
+        threadSortedForceFixed.clear();
+        threadSortedForceFixed.resize(threads.getNumThreads());
+        threadSortedBlockUsed.resize(threads.getNumThreads());
+    }
+    if (cutoff) {
+        int numSorted = neighborList->getSortedAtoms().size();
+        sortedPosq.resize(4*numSorted);
+        sortedAtomParameters.resize(numSorted);
+        if (ljpme)
+            sortedC6params.resize(numSorted);
+        if (neighborList->getBuildCount() != neighborListBuild) {
+            neighborListBuild = neighborList->getBuildCount();
+            neighborListChanged();
+            blockPartition.clear();
+        }
+        if (staticPartition && blockPartition.size() != threads.getNumThreads()+1)
+            computeBlockPartition(threads.getNumThreads());
+    }
+    if (threadForceFixed != NULL && includeEnergy) {
+        // Each block of the neighbor list and each atom records its own energy, so they can be summed
+        // in a fixed order.
+
+        blockEnergy.resize(cutoff ? neighborList->getNumBlocks() : 0);
+        atomEnergy.resize(numberOfAtoms);
+        fill(blockEnergy.begin(), blockEnergy.end(), 0.0);
+        fill(atomEnergy.begin(), atomEnergy.end(), 0.0);
+    }
     atomicCounter = 0;
     
     // Signal the threads to start running and wait for them to finish.
     
     threads.execute([&] (ThreadPool& threads, int threadIndex) { threadComputeDirect(threads, threadIndex); });
     threads.waitForThreads();
+
+    // With a cutoff, the threads first copy the atom data into sorted order and then wait until all of them are done.
+
+    if (cutoff) {
+        threads.resumeThreads();
+        threads.waitForThreads();
+    }
     
     // Signal the threads to subtract the exclusions.
     
@@ -413,27 +484,168 @@ void CpuNonbondedForce::calculateDirectIxn(int numberOfAtoms, float* posq, const
         int numThreads = threads.getNumThreads();
         for (int i = 0; i < numThreads; i++)
             directEnergy += threadEnergy[i];
+        if (threadForceFixed != NULL) {
+            for (double e : blockEnergy)
+                directEnergy += e;
+            for (double e : atomEnergy)
+                directEnergy += e;
+        }
         *totalEnergy += directEnergy;
     }
 }
 
+void CpuNonbondedForce::setForceBlockTracking(vector<vector<char> >* blockUsed, int blockSize) {
+    forceBlockUsed = blockUsed;
+    forceBlockSize = blockSize;
+}
+
+void CpuNonbondedForce::setDoublePrecisionForces(vector<AlignedArray<double> >* threadForceDouble) {
+    this->threadForceDouble = threadForceDouble;
+}
+
+void CpuNonbondedForce::setStaticBlockPartition(bool partition) {
+    staticPartition = partition;
+    blockPartition.clear();
+}
+
+void CpuNonbondedForce::computeBlockPartition(int numThreads) {
+    // Divide the blocks into contiguous ranges with about the same number of neighbors in each.
+
+    int numBlocks = neighborList->getNumBlocks();
+    long long totalWork = 0;
+    for (int block = 0; block < numBlocks; block++)
+        totalWork += neighborList->getBlockSortedNeighbors(block).size()+1;
+    blockPartition.resize(numThreads+1);
+    blockPartition[0] = 0;
+    long long work = 0;
+    int block = 0;
+    for (int i = 1; i < numThreads; i++) {
+        while (block < numBlocks && work < i*totalWork/numThreads)
+            work += neighborList->getBlockSortedNeighbors(block++).size()+1;
+        blockPartition[i] = block;
+    }
+    blockPartition[numThreads] = numBlocks;
+}
+
+void CpuNonbondedForce::setFixedPointForces(vector<AlignedArray<long long> >* threadForceFixed) {
+    this->threadForceFixed = threadForceFixed;
+}
+
+void CpuNonbondedForce::setDoublePrecisionParameters(const vector<pair<double, double> >* atomParameters, const vector<double>* charges, const vector<double>* C6params) {
+    doubleAtomParameters = (atomParameters == NULL ? NULL : &(*atomParameters)[0]);
+    doubleCharges = (charges == NULL ? NULL : &(*charges)[0]);
+    doubleC6params = (C6params == NULL ? NULL : &(*C6params)[0]);
+}
+
+/**
+ * Get a thread's buffer for accumulating forces in sorted order, making sure it has the right size.
+ * The buffer is left filled with zeros after every computation, so it only needs to be cleared
+ * when it is allocated.  Memory is only assigned to the parts the thread actually writes to.
+ */
+template <class T>
+static T* getSortedForceBuffer(AlignedArray<T>& buffer, int size) {
+    if (buffer.size() != size)
+        buffer.resizeZeroed(size);
+    return &buffer[0];
+}
+
 void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex) {
+    if (doubleAtomParameters != NULL) {
+        threadComputeDirectDouble(threads, threadIndex);
+        return;
+    }
+
     // Compute this thread's subset of interactions.
 
     int numThreads = threads.getNumThreads();
     threadEnergy[threadIndex] = 0;
     double* energyPtr = (includeEnergy ? &threadEnergy[threadIndex] : NULL);
     float* forces = &(*threadForce)[threadIndex][0];
+    long long* fixedForces = (threadForceFixed == NULL ? NULL : &(*threadForceFixed)[threadIndex][0]);
+    double* doubleForces = (threadForceDouble == NULL ? NULL : &(*threadForceDouble)[threadIndex][0]);
+    char* blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
+    auto markNeighborBlock = [&] (int block) {
+        // Record every sorted block this neighbor list block added a force to.
+
+        vector<char>& sortedBlockUsed = threadSortedBlockUsed[threadIndex];
+        int neighborBlockSize = neighborList->getBlockSize();
+        sortedBlockUsed[block] = 1;
+        for (int index : neighborList->getBlockSortedNeighbors(block))
+            sortedBlockUsed[index/neighborBlockSize] = 1;
+    };
+    auto addForce = [&] (int atom, const fvec4& f) {
+        if (fixedForces != NULL)
+            for (int k = 0; k < 3; k++)
+                fixedForces[4*atom+k] += realToFixedPoint(f[k]);
+        else if (doubleForces != NULL)
+            for (int k = 0; k < 3; k++)
+                doubleForces[4*atom+k] += f[k];
+        else
+            (fvec4(forces+4*atom)+f).store(forces+4*atom);
+    };
     fvec4 boxSize(periodicBoxVectors[0][0], periodicBoxVectors[1][1], periodicBoxVectors[2][2], 0);
     fvec4 invBoxSize(recipBoxSize[0], recipBoxSize[1], recipBoxSize[2], 0);
+    float* sortedForces = NULL;
+    double* sortedForcesDouble = NULL;
+    long long* sortedForcesFixed = NULL;
+    auto computeBlock = [&] (int block, bool ewaldBlock) {
+        // When forces are deterministic, each block records its own energy.
+
+        double* blockEnergyPtr = energyPtr;
+        if (fixedForces != NULL && includeEnergy)
+            blockEnergyPtr = &blockEnergy[block];
+        if (sortedForcesFixed != NULL) {
+            if (ewaldBlock)
+                calculateBlockEwaldIxn(block, sortedForcesFixed, blockEnergyPtr, boxSize, invBoxSize);
+            else
+                calculateBlockIxn(block, sortedForcesFixed, blockEnergyPtr, boxSize, invBoxSize);
+        }
+        else if (sortedForcesDouble != NULL) {
+            if (ewaldBlock)
+                calculateBlockEwaldIxn(block, sortedForcesDouble, blockEnergyPtr, boxSize, invBoxSize);
+            else
+                calculateBlockIxn(block, sortedForcesDouble, blockEnergyPtr, boxSize, invBoxSize);
+        }
+        else {
+            if (ewaldBlock)
+                calculateBlockEwaldIxn(block, sortedForces, blockEnergyPtr, boxSize, invBoxSize);
+            else
+                calculateBlockIxn(block, sortedForces, blockEnergyPtr, boxSize, invBoxSize);
+        }
+        markNeighborBlock(block);
+    };
+    int partitionBlock = (staticPartition && cutoff ? blockPartition[threadIndex] : 0);
+    auto getNextBlock = [&] () {
+        // When threads are bound to cores, each one processes its own range of blocks, the same ones it
+        // copied the atom data for.  Otherwise they take blocks as they become free.
+
+        if (staticPartition)
+            return (partitionBlock < blockPartition[threadIndex+1] ? partitionBlock++ : neighborList->getNumBlocks());
+        return atomicCounter++;
+    };
+    if (cutoff) {
+        // The block kernels work on copies of the atom data in the neighbor list's order.
+
+        int numSorted = neighborList->getSortedAtoms().size();
+        if (fixedForces != NULL)
+            sortedForcesFixed = getSortedForceBuffer(threadSortedForceFixed[threadIndex], 4*numSorted);
+        else if (doubleForces != NULL)
+            sortedForcesDouble = getSortedForceBuffer(threadSortedForceDouble[threadIndex], 4*numSorted);
+        else
+            sortedForces = getSortedForceBuffer(threadSortedForce[threadIndex], 4*numSorted);
+        threadSortedBlockUsed[threadIndex].resize(neighborList->getNumBlocks(), 0);
+        gatherSortedAtoms(threadIndex, numThreads);
+        threads.syncThreads();
+    }
     if (ewald || pme || ljpme) {
         // Compute the interactions from the neighbor list.
         while (true) {
-            int nextBlock = atomicCounter++;
+            int nextBlock = getNextBlock();
             if (nextBlock >= neighborList->getNumBlocks())
                 break;
-            calculateBlockEwaldIxn(nextBlock, forces, energyPtr, boxSize, invBoxSize);
+            computeBlock(nextBlock, true);
         }
+        addSortedForces(threadIndex, forces, blockUsed);
 
         // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
 
@@ -445,6 +657,13 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
                 break;
             int end = min(start+groupSize, numberOfAtoms);
             for (int i = start; i < end; i++) {
+                double& exclusionEnergy = (fixedForces != NULL && includeEnergy ? atomEnergy[i] : threadEnergy[threadIndex]);
+                if (blockUsed != NULL) {
+                    blockUsed[i/forceBlockSize] = 1;
+                    for (int excluded : exclusions[i])
+                        if (excluded > i)
+                            blockUsed[excluded/forceBlockSize] = 1;
+                }
                 fvec4 posI((float) atomCoordinates[i][0], (float) atomCoordinates[i][1], (float) atomCoordinates[i][2], 0.0f);
                 float scaledChargeI = (float) (ONE_4PI_EPS0*posq[4*i+3]);
                 for (int excluded : exclusions[i]) {
@@ -463,23 +682,23 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
                             float dEdR = chargeProdOverR*inverseR*inverseR;
                             dEdR = dEdR * (erfAlphaR-TWO_OVER_SQRT_PI*alphaR*(float)exp(-alphaR*alphaR));
                             fvec4 result = deltaR*dEdR;
-                            (fvec4(forces+4*i)-result).store(forces+4*i);
-                            (fvec4(forces+4*j)+result).store(forces+4*j);
+                            addForce(i, -result);
+                            addForce(j, result);
                             if (includeEnergy)
-                                threadEnergy[threadIndex] -= chargeProdOverR*erfAlphaR;
+                                exclusionEnergy -= chargeProdOverR*erfAlphaR;
                         }
                         else if (includeEnergy)
-                            threadEnergy[threadIndex] -= alphaEwald*TWO_OVER_SQRT_PI*scaledChargeI*posq[4*j+3];
+                            exclusionEnergy -= alphaEwald*TWO_OVER_SQRT_PI*scaledChargeI*posq[4*j+3];
                         if (ljpme) {
                             float C6ij = C6params[i]*C6params[j];
                             float inverseR2 = 1.0f/r2;
                             float emult = C6ij*inverseR2*inverseR2*inverseR2*exptermsApprox(r);
                             if(includeEnergy)
-                                threadEnergy[threadIndex] += emult;
+                                exclusionEnergy += emult;
                             float dEdR = -6.0f*C6ij*inverseR2*inverseR2*inverseR2*inverseR2*dExptermsApprox(r);
                             fvec4 result = deltaR*dEdR;
-                            (fvec4(forces+4*i)-result).store(forces+4*i);
-                            (fvec4(forces+4*j)+result).store(forces+4*j);
+                            addForce(i, -result);
+                            addForce(j, result);
                         }
                     }
                 }
@@ -490,11 +709,12 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
         // Compute the interactions from the neighbor list.
 
         while (true) {
-            int nextBlock = atomicCounter++;
+            int nextBlock = getNextBlock();
             if (nextBlock >= neighborList->getNumBlocks())
                 break;
-            calculateBlockIxn(nextBlock, forces, energyPtr, boxSize, invBoxSize);
+            computeBlock(nextBlock, false);
         }
+        addSortedForces(threadIndex, forces, blockUsed);
     }
     else {
         // Loop over all atom pairs
@@ -503,9 +723,302 @@ void CpuNonbondedForce::threadComputeDirect(ThreadPool& threads, int threadIndex
             int i = atomicCounter++;
             if (i >= numberOfAtoms)
                 break;
+            if (blockUsed != NULL)
+                for (int block = i/forceBlockSize; block <= (numberOfAtoms-1)/forceBlockSize; block++)
+                    blockUsed[block] = 1;
+            if (fixedForces == NULL && doubleForces == NULL) {
+                for (int j = i+1; j < numberOfAtoms; j++)
+                    if (exclusions[j].find(i) == exclusions[j].end())
+                        calculateOneIxn(i, j, forces, energyPtr, boxSize, invBoxSize);
+            }
+            else if (fixedForces != NULL) {
+                // Compute the row in single precision, then convert it to fixed point.  Every element
+                // except the first holds a single interaction, and the first is summed in a fixed order.
+
+                float* rowForces = getSortedForceBuffer(threadSortedForce[threadIndex], 4*numberOfAtoms);
+                double* rowEnergy = (includeEnergy ? &atomEnergy[i] : NULL);
+                for (int j = i+1; j < numberOfAtoms; j++)
+                    if (exclusions[j].find(i) == exclusions[j].end())
+                        calculateOneIxn(i, j, rowForces, rowEnergy, boxSize, invBoxSize);
+                for (int j = i; j < numberOfAtoms; j++) {
+                    addForce(j, fvec4(rowForces+4*j));
+                    fvec4(0.0f).store(rowForces+4*j);
+                }
+            }
+            else {
+                // Compute the row in single precision, moving the force on the first atom into a double
+                // precision sum after every interaction.
+
+                float* rowForces = getSortedForceBuffer(threadSortedForce[threadIndex], 4*numberOfAtoms);
+                fvec4 zero(0.0f);
+                for (int j = i+1; j < numberOfAtoms; j++)
+                    if (exclusions[j].find(i) == exclusions[j].end()) {
+                        calculateOneIxn(i, j, rowForces, energyPtr, boxSize, invBoxSize);
+                        for (int k = 0; k < 3; k++)
+                            doubleForces[4*i+k] += rowForces[4*i+k];
+                        zero.store(rowForces+4*i);
+                    }
+                for (int j = i+1; j < numberOfAtoms; j++) {
+                    addForce(j, fvec4(rowForces+4*j));
+                    fvec4(0.0f).store(rowForces+4*j);
+                }
+            }
+        }
+    }
+}
+
+void CpuNonbondedForce::threadComputeDirectDouble(ThreadPool& threads, int threadIndex) {
+    // This goes through the same steps as threadComputeDirect(), stopping at the same points to wait for the
+    // other threads, but every interaction is computed in double precision from the original coordinates.  The
+    // neighbor list is only used to find the pairs.
+
+    threadEnergy[threadIndex] = 0;
+    double* energyPtr = (includeEnergy ? &threadEnergy[threadIndex] : NULL);
+    long long* fixedForces = (threadForceFixed == NULL ? NULL : &(*threadForceFixed)[threadIndex][0]);
+    double* doubleForces = (threadForceDouble == NULL ? NULL : &(*threadForceDouble)[threadIndex][0]);
+    char* blockUsed = (forceBlockUsed == NULL ? NULL : &(*forceBlockUsed)[threadIndex][0]);
+    auto addForce = [&] (int atom, const Vec3& f) {
+        if (fixedForces != NULL)
+            for (int k = 0; k < 3; k++)
+                fixedForces[4*atom+k] += realToFixedPoint(f[k]);
+        else
+            for (int k = 0; k < 3; k++)
+                doubleForces[4*atom+k] += f[k];
+        if (blockUsed != NULL)
+            blockUsed[atom/forceBlockSize] = 1;
+    };
+    int partitionBlock = (staticPartition && cutoff ? blockPartition[threadIndex] : 0);
+    auto getNextBlock = [&] () {
+        if (staticPartition)
+            return (partitionBlock < blockPartition[threadIndex+1] ? partitionBlock++ : neighborList->getNumBlocks());
+        return atomicCounter++;
+    };
+    if (cutoff) {
+        // Compute the interactions from the neighbor list.  There is no sorted data to gather, but wait for the
+        // other threads anyway, since calculateDirectIxn() expects it.
+
+        threads.syncThreads();
+        int blockSize = neighborList->getBlockSize();
+        const vector<int32_t>& sortedAtoms = neighborList->getSortedAtoms();
+        while (true) {
+            int block = getNextBlock();
+            if (block >= neighborList->getNumBlocks())
+                break;
+            double* blockEnergyPtr = (fixedForces != NULL && includeEnergy ? &blockEnergy[block] : energyPtr);
+            const vector<int>& neighbors = neighborList->getBlockNeighbors(block);
+            const vector<CpuNeighborList::BlockExclusionMask>& blockExclusions = neighborList->getBlockExclusions(block);
+            for (int i = 0; i < (int) neighbors.size(); i++) {
+                int atom2 = neighbors[i];
+                for (int k = 0; k < blockSize; k++) {
+                    if ((blockExclusions[i]>>k) & 1)
+                        continue;
+                    int atom1 = sortedAtoms[block*blockSize+k];
+                    Vec3 f = calculateOneIxnDouble(atom1, atom2, blockEnergyPtr);
+                    addForce(atom1, f);
+                    addForce(atom2, -f);
+                }
+            }
+        }
+    }
+    else {
+        // Loop over all atom pairs.
+
+        while (true) {
+            int i = atomicCounter++;
+            if (i >= numberOfAtoms)
+                break;
+            double* rowEnergyPtr = (fixedForces != NULL && includeEnergy ? &atomEnergy[i] : energyPtr);
             for (int j = i+1; j < numberOfAtoms; j++)
-                if (exclusions[j].find(i) == exclusions[j].end())
-                    calculateOneIxn(i, j, forces, energyPtr, boxSize, invBoxSize);
+                if (exclusions[j].find(i) == exclusions[j].end()) {
+                    Vec3 f = calculateOneIxnDouble(i, j, rowEnergyPtr);
+                    addForce(i, f);
+                    addForce(j, -f);
+                }
+        }
+    }
+    if (ewald || pme) {
+        // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
+
+        threads.syncThreads();
+        double alphaEwald = alphaEwaldDouble;
+        double dalpha2 = alphaDispersionEwaldDouble*alphaDispersionEwaldDouble;
+        const int groupSize = max(1, numberOfAtoms/(10*threads.getNumThreads()));
+        while (true) {
+            int start = atomicCounter.fetch_add(groupSize);
+            if (start >= numberOfAtoms)
+                break;
+            int end = min(start+groupSize, numberOfAtoms);
+            for (int i = start; i < end; i++) {
+                double& exclusionEnergy = (fixedForces != NULL && includeEnergy ? atomEnergy[i] : threadEnergy[threadIndex]);
+                for (int j : exclusions[i]) {
+                    if (j <= i)
+                        continue;
+                    Vec3 deltaR;
+                    if (periodicExceptions)
+                        deltaR = ReferenceForce::getDeltaRPeriodic(atomCoordinates[j], atomCoordinates[i], periodicBoxVectors);
+                    else
+                        deltaR = ReferenceForce::getDeltaR(atomCoordinates[j], atomCoordinates[i]);
+                    double r2 = deltaR.dot(deltaR);
+                    double r = sqrt(r2);
+                    double alphaR = alphaEwald*r;
+                    double erfAlphaR = erf(alphaR);
+                    double chargeProd = ONE_4PI_EPS0*doubleCharges[i]*doubleCharges[j];
+                    if (erfAlphaR > 1e-6) {
+                        double inverseR = 1/r;
+                        double dEdR = chargeProd*inverseR*inverseR*inverseR;
+                        dEdR = dEdR * (erfAlphaR-TWO_OVER_SQRT_PI_DOUBLE*alphaR*exp(-alphaR*alphaR));
+                        Vec3 result = deltaR*dEdR;
+                        addForce(i, -result);
+                        addForce(j, result);
+                        if (includeEnergy)
+                            exclusionEnergy -= chargeProd*inverseR*erfAlphaR;
+                    }
+                    else if (includeEnergy)
+                        exclusionEnergy -= alphaEwald*TWO_OVER_SQRT_PI_DOUBLE*chargeProd;
+                    if (ljpme) {
+                        double C6ij = doubleC6params[i]*doubleC6params[j];
+                        double inverseR2 = 1/r2;
+                        double dar2 = dalpha2*r2;
+                        double dar4 = dar2*dar2;
+                        double dar6 = dar4*dar2;
+                        double expterm = exp(-dar2);
+                        double emult = C6ij*inverseR2*inverseR2*inverseR2*(1.0-expterm*(1.0+dar2+0.5*dar4));
+                        if (includeEnergy)
+                            exclusionEnergy += emult;
+                        double dEdR = -6.0*C6ij*inverseR2*inverseR2*inverseR2*inverseR2*(1.0-expterm*(1.0+dar2+0.5*dar4+dar6/6.0));
+                        Vec3 result = deltaR*dEdR;
+                        addForce(i, -result);
+                        addForce(j, result);
+                    }
+                }
+            }
+        }
+    }
+}
+
+Vec3 CpuNonbondedForce::calculateOneIxnDouble(int atom1, int atom2, double* totalEnergy) const {
+    Vec3 deltaR;
+    if (periodic)
+        deltaR = ReferenceForce::getDeltaRPeriodic(atomCoordinates[atom2], atomCoordinates[atom1], periodicBoxVectors);
+    else
+        deltaR = ReferenceForce::getDeltaR(atomCoordinates[atom2], atomCoordinates[atom1]);
+    double r2 = deltaR.dot(deltaR);
+    if (cutoff && r2 >= cutoffDistanceDouble*cutoffDistanceDouble)
+        return Vec3();
+    double r = sqrt(r2);
+    double inverseR = 1/r;
+    double switchValue = 1, switchDeriv = 0;
+    if (useSwitch && r > switchingDistanceDouble) {
+        double t = (r-switchingDistanceDouble)/(cutoffDistanceDouble-switchingDistanceDouble);
+        switchValue = 1+t*t*t*(-10+t*(15-t*6));
+        switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistanceDouble-switchingDistanceDouble);
+    }
+    double sig = doubleAtomParameters[atom1].first + doubleAtomParameters[atom2].first;
+    double sig2 = inverseR*sig;
+    sig2 *= sig2;
+    double sig6 = sig2*sig2*sig2;
+    double eps = doubleAtomParameters[atom1].second*doubleAtomParameters[atom2].second;
+    double dEdR = switchValue*eps*(12.0*sig6 - 6.0)*sig6;
+    double energy = eps*(sig6-1.0)*sig6;
+    if (useSwitch) {
+        dEdR -= energy*switchDeriv*r;
+        energy *= switchValue;
+    }
+    if (ljpme) {
+        // The direct space part of the dispersion interaction, with the same potential shift as the
+        // single precision kernels.
+
+        double C6ij = doubleC6params[atom1]*doubleC6params[atom2];
+        double inverseR2 = inverseR*inverseR;
+        double dalphaR2 = alphaDispersionEwaldDouble*alphaDispersionEwaldDouble*r2;
+        double dar4 = dalphaR2*dalphaR2;
+        double dar6 = dar4*dalphaR2;
+        double expterm = exp(-dalphaR2);
+        double inverseRcut6 = pow(cutoffDistanceDouble, -6.0);
+        double dalphaRcut2 = alphaDispersionEwaldDouble*alphaDispersionEwaldDouble*cutoffDistanceDouble*cutoffDistanceDouble;
+        double inverseRcut6Expterm = inverseRcut6*(1.0-exp(-dalphaRcut2)*(1.0+dalphaRcut2+0.5*dalphaRcut2*dalphaRcut2));
+        double mysig2 = sig*sig;
+        double mysig6 = mysig2*mysig2*mysig2;
+        double emult = C6ij*inverseR2*inverseR2*inverseR2*(1.0-expterm*(1.0+dalphaR2+0.5*dar4));
+        double potentialShift = eps*(1.0-mysig6*inverseRcut6)*mysig6*inverseRcut6 - C6ij*inverseRcut6Expterm;
+        dEdR += 6.0*C6ij*inverseR2*inverseR2*inverseR2*(1.0-expterm*(1.0+dalphaR2+0.5*dar4+dar6/6.0));
+        energy += emult + potentialShift;
+    }
+    double chargeProd = ONE_4PI_EPS0*doubleCharges[atom1]*doubleCharges[atom2];
+    if (ewald || pme) {
+        double alphaR = alphaEwaldDouble*r;
+        double erfcAlphaR = erfc(alphaR);
+        dEdR += chargeProd*inverseR*(erfcAlphaR+TWO_OVER_SQRT_PI_DOUBLE*alphaR*exp(-alphaR*alphaR));
+        energy += chargeProd*inverseR*erfcAlphaR;
+    }
+    else if (cutoff) {
+        dEdR += chargeProd*(inverseR-2.0*krfDouble*r2);
+        energy += chargeProd*(inverseR+krfDouble*r2-crfDouble);
+    }
+    else {
+        dEdR += chargeProd*inverseR;
+        energy += chargeProd*inverseR;
+    }
+    dEdR *= inverseR*inverseR;
+    if (totalEnergy != NULL)
+        *totalEnergy += energy;
+    return deltaR*dEdR;
+}
+
+void CpuNonbondedForce::gatherSortedAtoms(int threadIndex, int numThreads) {
+    const vector<int32_t>& sortedAtoms = neighborList->getSortedAtoms();
+    int numSorted = sortedAtoms.size();
+    int start, end;
+    if (staticPartition) {
+        start = blockPartition[threadIndex]*neighborList->getBlockSize();
+        end = blockPartition[threadIndex+1]*neighborList->getBlockSize();
+    }
+    else {
+        start = threadIndex*numSorted/numThreads;
+        end = (threadIndex+1)*numSorted/numThreads;
+    }
+    for (int i = start; i < end; i++) {
+        int atom = sortedAtoms[i];
+        fvec4(posq+4*atom).store(&sortedPosq[4*i]);
+        sortedAtomParameters[i] = atomParameters[atom];
+        if (ljpme)
+            sortedC6params[i] = C6params[atom];
+    }
+}
+
+void CpuNonbondedForce::addSortedForces(int threadIndex, float* forces, char* blockUsed) {
+    long long* fixedForces = (threadForceFixed == NULL ? NULL : &(*threadForceFixed)[threadIndex][0]);
+    const vector<int32_t>& sortedAtoms = neighborList->getSortedAtoms();
+    int neighborBlockSize = neighborList->getBlockSize();
+    vector<char>& sortedBlockUsed = threadSortedBlockUsed[threadIndex];
+    for (int block = 0; block < (int) sortedBlockUsed.size(); block++) {
+        if (!sortedBlockUsed[block])
+            continue;
+        sortedBlockUsed[block] = 0;
+        for (int i = block*neighborBlockSize; i < (block+1)*neighborBlockSize; i++) {
+            int atom = sortedAtoms[i];
+            if (fixedForces != NULL) {
+                long long* f = &threadSortedForceFixed[threadIndex][4*i];
+                for (int k = 0; k < 3; k++) {
+                    fixedForces[4*atom+k] += f[k];
+                    f[k] = 0;
+                }
+            }
+            else if (threadForceDouble != NULL) {
+                double* f = &threadSortedForceDouble[threadIndex][4*i];
+                double* doubleForces = &(*threadForceDouble)[threadIndex][4*atom];
+                for (int k = 0; k < 3; k++) {
+                    doubleForces[k] += f[k];
+                    f[k] = 0.0;
+                }
+            }
+            else {
+                float* sortedForces = &threadSortedForce[threadIndex][0];
+                (fvec4(forces+4*atom)+fvec4(sortedForces+4*i)).store(forces+4*atom);
+                fvec4(0.0f).store(sortedForces+4*i);
+            }
+            if (blockUsed != NULL)
+                blockUsed[atom/forceBlockSize] = 1;
         }
     }
 }
@@ -40,8 +40,8 @@ bool isAvxSupported() {
     return false;
 }
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx() {
-    return new OpenMM::CpuNonbondedForceFvec<fvec8>();
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx(bool useClusterPairs) {
+    return new OpenMM::CpuNonbondedForceFvec<fvec8>(useClusterPairs);
 }
 
 #else
@@ -49,7 +49,7 @@ bool isAvxSupported() {
     return false;
 }
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx() {
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx(bool useClusterPairs) {
    throw OpenMM::OpenMMException("Internal error: OpenMM was compiled without AVX support");
 }
 #endif
@@ -28,8 +28,8 @@
 #ifdef __AVX2__
 
 #include "openmm/internal/vectorizeAvx2.h"
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2() {
-    return new OpenMM::CpuNonbondedForceFvec<fvecAvx2>();
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2(bool useClusterPairs) {
+    return new OpenMM::CpuNonbondedForceFvec<fvecAvx2>(useClusterPairs);
 }
 
 #else
@@ -38,7 +38,7 @@ bool isAvx2Supported() {
     return false;
 }
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2() {
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2(bool useClusterPairs) {
    throw OpenMM::OpenMMException("Internal error: OpenMM was compiled without AVX2 support");
 }
 #endif
@@ -24,22 +24,22 @@
 
 #include "CpuNonbondedForceFvec.h"
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec4();
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx();
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2();
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec4(bool useClusterPairs);
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx(bool useClusterPairs);
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceAvx2(bool useClusterPairs);
 
 bool isAvxSupported();
 bool isAvx2Supported();
 
 #include <iostream>
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec() {
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec(bool useClusterPairs) {
     if (isAvx2Supported())
-        return createCpuNonbondedForceAvx2();
+        return createCpuNonbondedForceAvx2(useClusterPairs);
     else if (isAvxSupported())
-        return createCpuNonbondedForceAvx();
+        return createCpuNonbondedForceAvx(useClusterPairs);
     else
-        return createCpuNonbondedForceVec4();
+        return createCpuNonbondedForceVec4(useClusterPairs);
 }
 
 int getVecBlockSize() {
@@ -26,7 +26,7 @@
 
 // Very minimal file. It exists purely to be able to compile it in SIMD-4.
 
-OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec4()   {
-    return new OpenMM::CpuNonbondedForceFvec<fvec4>();
+OpenMM::CpuNonbondedForce* createCpuNonbondedForceVec4(bool useClusterPairs)   {
+    return new OpenMM::CpuNonbondedForceFvec<fvec4>(useClusterPairs);
 }
 
@@ -30,16 +30,22 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuPlatform.h"
+#include "CpuCCMA.h"
 #include "CpuKernelFactory.h"
 #include "CpuKernels.h"
 #include "CpuSETTLE.h"
 #include "ReferenceConstraints.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/hardware.h"
+#include "openmm/internal/timer.h"
 #include "openmm/internal/vectorize.h"
 #include <algorithm>
+#include <fstream>
 #include <sstream>
 #include <stdlib.h>
+#if defined(__linux__) && !defined(__ANDROID__)
+    #include <sched.h>
+#endif
 
 using namespace OpenMM;
 using namespace std;
@@ -59,24 +65,158 @@ extern "C" OPENMM_EXPORT_CPU void registerPlatforms() {
 #endif
 
 map<const ContextImpl*, CpuPlatform::PlatformData*> CpuPlatform::contextData;
+const int CpuPlatform::PlatformData::ForceBlockSize;
+const int CpuPlatform::PlatformData::ForceReleaseBlocks;
+const int CpuPlatform::PlatformData::ForceReleaseSteps;
+
+/**
+ * Get the logical cores belonging to each NUMA node.  If the topology cannot be determined,
+ * all cores are assumed to belong to a single node.
+ */
+static vector<vector<int> > getNumaNodeCores() {
+    vector<vector<int> > nodeCores;
+#if defined(__linux__) && !defined(__ANDROID__)
+    for (int node = 0; ; node++) {
+        stringstream filename;
+        filename << "/sys/devices/system/node/node" << node << "/cpulist";
+        ifstream file(filename.str().c_str());
+        if (!file.is_open())
+            break;
+
+        // The file contains a list of ranges, such as "0-7,16-23".
+
+        vector<int> cores;
+        string range;
+        while (getline(file, range, ',')) {
+            int first, last;
+            char dash;
+            stringstream rangeStream(range);
+            if (!(rangeStream >> first))
+                continue;
+            if (!(rangeStream >> dash >> last))
+                last = first;
+            for (int i = first; i <= last; i++)
+                cores.push_back(i);
+        }
+        if (cores.size() > 0)
+            nodeCores.push_back(cores);
+    }
+#endif
+    if (nodeCores.size() == 0) {
+        nodeCores.resize(1);
+        for (int i = 0; i < getNumProcessors(); i++)
+            nodeCores[0].push_back(i);
+    }
+    return nodeCores;
+}
+
+/**
+ * Get the cores this process is allowed to run on, for example as restricted by taskset or a batch
+ * scheduler.  If this cannot be determined, all cores are assumed to be allowed.
+ */
+static set<int> getAllowedCores() {
+    set<int> allowed;
+#if defined(__linux__) && !defined(__ANDROID__)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &cpuSet))
+                allowed.insert(i);
+        return allowed;
+    }
+#endif
+    for (int i = 0; i < getNumProcessors(); i++)
+        allowed.insert(i);
+    return allowed;
+}
+
+/**
+ * Select the cores to bind threads to, based on the value of the ThreadAffinity property.  Only cores the
+ * process is allowed to run on are used.  If none of them are, this returns an empty list and threads are
+ * left unbound.
+ */
+static vector<int> selectThreadCores(const string& affinity) {
+    vector<int> cores;
+    set<int> allowed = getAllowedCores();
+    if (affinity == "compact" || affinity == "scatter") {
+        vector<vector<int> > nodeCores = getNumaNodeCores();
+        for (auto& node : nodeCores) {
+            vector<int> allowedNodeCores;
+            for (int core : node)
+                if (allowed.find(core) != allowed.end())
+                    allowedNodeCores.push_back(core);
+            node = allowedNodeCores;
+        }
+        if (affinity == "compact") {
+            for (auto& node : nodeCores)
+                cores.insert(cores.end(), node.begin(), node.end());
+        }
+        else {
+            for (int i = 0; cores.size() < allowed.size(); i++) {
+                bool anyAdded = false;
+                for (auto& node : nodeCores)
+                    if (i < node.size()) {
+                        cores.push_back(node[i]);
+                        anyAdded = true;
+                    }
+                if (!anyAdded)
+                    break;
+            }
+        }
+        return cores;
+    }
+    stringstream list(affinity);
+    string core;
+    while (getline(list, core, ',')) {
+        int index;
+        stringstream coreStream(core);
+        if (!(coreStream >> index) || index < 0)
+            throw OpenMMException("Illegal value for "+CpuPlatform::CpuThreadAffinity()+": "+affinity);
+        cores.push_back(index);
+    }
+    if (cores.size() == 0)
+        throw OpenMMException("Illegal value for "+CpuPlatform::CpuThreadAffinity()+": "+affinity);
+    vector<int> allowedCores;
+    for (int core : cores)
+        if (allowed.find(core) != allowed.end())
+            allowedCores.push_back(core);
+    return allowedCores;
+}
 
 CpuPlatform::CpuPlatform() {
     deprecatedPropertyReplacements["CpuThreads"] = CpuThreads();
     CpuKernelFactory* factory = new CpuKernelFactory();
     registerKernelFactory(CalcForcesAndEnergyKernel::Name(), factory);
+    registerKernelFactory(UpdateStateDataKernel::Name(), factory);
+    registerKernelFactory(CalcHarmonicBondForceKernel::Name(), factory);
     registerKernelFactory(CalcHarmonicAngleForceKernel::Name(), factory);
     registerKernelFactory(CalcPeriodicTorsionForceKernel::Name(), factory);
     registerKernelFactory(CalcRBTorsionForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomBondForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomAngleForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomTorsionForceKernel::Name(), factory);
     registerKernelFactory(CalcNonbondedForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomNonbondedForceKernel::Name(), factory);
+    registerKernelFactory(CalcCustomHbondForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomManyParticleForceKernel::Name(), factory);
     registerKernelFactory(CalcGBSAOBCForceKernel::Name(), factory);
     registerKernelFactory(CalcCustomGBForceKernel::Name(), factory);
     registerKernelFactory(CalcGayBerneForceKernel::Name(), factory);
     registerKernelFactory(IntegrateLangevinStepKernel::Name(), factory);
     registerKernelFactory(IntegrateLangevinMiddleStepKernel::Name(), factory);
+    registerKernelFactory(IntegrateCustomStepKernel::Name(), factory);
     platformProperties.push_back(CpuThreads());
     platformProperties.push_back(CpuDeterministicForces());
+    platformProperties.push_back(CpuConcurrentForces());
+    platformProperties.push_back(CpuThreadAffinity());
+    platformProperties.push_back(CpuNonbondedKernel());
+    platformProperties.push_back(CpuPrecision());
+    platformProperties.push_back(CpuSharedThreadPool());
+    platformProperties.push_back(CpuPmeThreads());
+    platformProperties.push_back(CpuPmeTuning());
+    platformProperties.push_back(CpuAdaptivePadding());
+    platformProperties.push_back(CpuConcurrentNeighborList());
     int threads = getNumProcessors();
     char* threadsEnv = getenv("OPENMM_CPU_THREADS");
     if (threadsEnv != NULL)
@@ -85,6 +225,15 @@ CpuPlatform::CpuPlatform() {
     defaultThreads << threads;
     setPropertyDefaultValue(CpuThreads(), defaultThreads.str());
     setPropertyDefaultValue(CpuDeterministicForces(), "false");
+    setPropertyDefaultValue(CpuConcurrentForces(), "false");
+    setPropertyDefaultValue(CpuThreadAffinity(), "none");
+    setPropertyDefaultValue(CpuNonbondedKernel(), "Block");
+    setPropertyDefaultValue(CpuPrecision(), "single");
+    setPropertyDefaultValue(CpuSharedThreadPool(), "false");
+    setPropertyDefaultValue(CpuPmeThreads(), "0");
+    setPropertyDefaultValue(CpuPmeTuning(), "false");
+    setPropertyDefaultValue(CpuAdaptivePadding(), "false");
+    setPropertyDefaultValue(CpuConcurrentNeighborList(), "false");
 }
 
 const string& CpuPlatform::getPropertyValue(const Context& context, const string& property) const {
@@ -104,31 +253,85 @@ double CpuPlatform::getSpeed() const {
 }
 
 bool CpuPlatform::supportsDoublePrecision() const {
-    return false;
+    return true;
 }
 
 bool CpuPlatform::isProcessorSupported() {
     return isVec4Supported();
 }
 
+CpuPlatform::PlatformSettings CpuPlatform::parseSettings(const map<string, string>& properties) const {
+    auto getValue = [&] (const string& name) {
+        string value = (properties.find(name) == properties.end() ? getPropertyDefaultValue(name) : properties.find(name)->second);
+        transform(value.begin(), value.end(), value.begin(), ::tolower);
+        return value;
+    };
+    PlatformSettings settings;
+    stringstream(getValue(CpuThreads())) >> settings.numThreads;
+    settings.deterministicForces = (getValue(CpuDeterministicForces()) == "true");
+    settings.concurrentForces = (getValue(CpuConcurrentForces()) == "true" && !settings.deterministicForces);
+    settings.threadAffinity = getValue(CpuThreadAffinity());
+    string nonbondedKernelValue = getValue(CpuNonbondedKernel());
+    if (nonbondedKernelValue != "block" && nonbondedKernelValue != "clusterpair")
+        throw OpenMMException("Illegal value for "+CpuNonbondedKernel()+": "+nonbondedKernelValue);
+    settings.useClusterPairs = (nonbondedKernelValue == "clusterpair");
+    settings.precision = getValue(CpuPrecision());
+    if (settings.precision != "single" && settings.precision != "mixed" && settings.precision != "double")
+        throw OpenMMException("Illegal value for "+CpuPrecision()+": "+settings.precision);
+    settings.useSharedThreadPool = (getValue(CpuSharedThreadPool()) == "true");
+    string pmeThreadsValue = getValue(CpuPmeThreads());
+    int numPmeThreads;
+    if (!(stringstream(pmeThreadsValue) >> numPmeThreads) || numPmeThreads < 0 || (numPmeThreads > 0 && numPmeThreads >= (settings.numThreads > 0 ? settings.numThreads : getNumProcessors())))
+        throw OpenMMException("Illegal value for "+CpuPmeThreads()+": "+pmeThreadsValue);
+    settings.numPmeThreads = numPmeThreads;
+
+    // A Context with separate PME threads holds one pool while it waits for the other.  If those pools were
+    // shared, two Contexts that split their threads differently could each hold the pool the other needs.
+
+    if (numPmeThreads > 0)
+        settings.useSharedThreadPool = false;
+    if (numPmeThreads > 0 && settings.numThreads <= 0)
+        settings.numThreads = getNumProcessors();
+    settings.tunePme = (getValue(CpuPmeTuning()) == "true");
+    settings.adaptivePadding = (getValue(CpuAdaptivePadding()) == "true");
+    settings.concurrentNeighborList = (getValue(CpuConcurrentNeighborList()) == "true");
+    if (settings.concurrentNeighborList) {
+        // The builder's threads come out of the same budget, so the Context never runs more threads than
+        // requested.  With a single thread left there is nothing to build it on.
+
+        if (settings.numThreads <= 0)
+            settings.numThreads = getNumProcessors();
+        int availableThreads = settings.numThreads-numPmeThreads;
+        if (availableThreads < 2)
+            settings.concurrentNeighborList = false;
+        else {
+            settings.numNeighborListThreads = max(1, availableThreads/4);
+            settings.useSharedThreadPool = false;
+        }
+    }
+    return settings;
+}
+
 void CpuPlatform::contextCreated(ContextImpl& context, const map<string, string>& properties) const {
     ReferencePlatform::contextCreated(context, properties);
-    const string& threadsPropValue = (properties.find(CpuThreads()) == properties.end() ?
-            getPropertyDefaultValue(CpuThreads()) : properties.find(CpuThreads())->second);
-    string deterministicForcesValue = (properties.find(CpuDeterministicForces()) == properties.end() ?
-            getPropertyDefaultValue(CpuDeterministicForces()) : properties.find(CpuDeterministicForces())->second);
-    int numThreads;
-    stringstream(threadsPropValue) >> numThreads;
-    transform(deterministicForcesValue.begin(), deterministicForcesValue.end(), deterministicForcesValue.begin(), ::tolower);
-    bool deterministicForces = (deterministicForcesValue == "true");
-    PlatformData* data = new PlatformData(context.getSystem().getNumParticles(), numThreads, deterministicForces);
+    PlatformData* data = new PlatformData(context.getSystem().getNumParticles(), parseSettings(properties));
     contextData[&context] = data;
     ReferenceConstraints& constraints = *(ReferenceConstraints*) reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData())->constraints;
+    CpuSETTLE* parallelSettle = NULL;
     if (constraints.settle != NULL) {
-        CpuSETTLE* parallelSettle = new CpuSETTLE(context.getSystem(), *(ReferenceSETTLEAlgorithm*) constraints.settle, data->threads);
+        parallelSettle = new CpuSETTLE(context.getSystem(), *(ReferenceSETTLEAlgorithm*) constraints.settle, data->threads);
         delete constraints.settle;
         constraints.settle = parallelSettle;
     }
+    if (constraints.ccma != NULL) {
+        // If there are also SETTLE clusters, CpuCCMA takes ownership of them and processes them
+        // while it iterates.
+
+        CpuCCMA* parallelCCMA = new CpuCCMA(*(ReferenceCCMAAlgorithm*) constraints.ccma, data->threads, parallelSettle);
+        delete constraints.ccma;
+        constraints.ccma = parallelCCMA;
+        constraints.settle = NULL;
+    }
 }
 
 void CpuPlatform::contextDestroyed(ContextImpl& context) const {
@@ -147,20 +350,122 @@ const CpuPlatform::PlatformData& CpuPlatform::getPlatformData(const ContextImpl&
     return *contextData[&context];
 }
 
-CpuPlatform::PlatformData::PlatformData(int numParticles, int numThreads, bool deterministicForces) : posq(4*numParticles), threads(numThreads),
-        deterministicForces(deterministicForces), neighborList(NULL), cutoff(0.0), paddedCutoff(0.0), anyExclusions(false), currentPosqIndex(-1), nextPosqIndex(0) {
-    numThreads = threads.getNumThreads();
+/**
+ * Create a ThreadPool for a Context, or get the shared one if the SharedThreadPool property is set.
+ */
+static shared_ptr<ThreadPool> createThreadPool(int numThreads, bool useSharedThreadPool) {
+    if (useSharedThreadPool)
+        return ThreadPool::getSharedPool(numThreads);
+    return make_shared<ThreadPool>(numThreads);
+}
+
+CpuPlatform::PlatformData::PlatformData(int numParticles, const PlatformSettings& settings) : posq(4*numParticles),
+        threadPool(createThreadPool(settings.numThreads-settings.numPmeThreads-settings.numNeighborListThreads, settings.useSharedThreadPool)), threads(*threadPool), precision(settings.precision),
+        neighborList(NULL), cutoff(0.0), paddedCutoff(0.0), neighborListPairTime(0.0), neighborListBuildTime(0.0), neighborListBuildPending(false), neighborListBuilderExit(false),
+        anyExclusions(false), deterministicForces(settings.deterministicForces), concurrentForces(settings.concurrentForces), useClusterPairs(settings.useClusterPairs), tunePme(settings.tunePme),
+        adaptivePadding(settings.adaptivePadding), concurrentNeighborList(settings.concurrentNeighborList), allForceBlocksUsed(false), forcesPending(false), neighborListOutdated(false),
+        currentPosqIndex(-1), nextPosqIndex(0), neighborListRebuilds(0) {
+    int numThreads = threads.getNumThreads();
+    int numPmeThreads = settings.numPmeThreads;
+    int numNeighborListThreads = settings.numNeighborListThreads;
+    const string& threadAffinity = settings.threadAffinity;
+    pmeThreadPool = (numPmeThreads > 0 ? createThreadPool(numPmeThreads, settings.useSharedThreadPool) : threadPool);
+    if (concurrentNeighborList)
+        neighborListThreadPool = make_shared<ThreadPool>(numNeighborListThreads);
+    threadsBound = false;
+    if (threadAffinity != "none" && threadAffinity != "") {
+        // If the threads cannot be bound, fall back to letting them run anywhere.
+
+        vector<int> cores = selectThreadCores(threadAffinity);
+        if (cores.size() > 0)
+            threadsBound = threads.setThreadAffinity(cores);
+        if (threadsBound && numPmeThreads > 0) {
+            // Bind the PME threads to the cores after the ones used for direct space.
+
+            vector<int> pmeCores;
+            for (int i = 0; i < numPmeThreads; i++)
+                pmeCores.push_back(cores[(numThreads+i)%cores.size()]);
+            pmeThreadPool->setThreadAffinity(pmeCores);
+        }
+        if (threadsBound && numNeighborListThreads > 0) {
+            // The neighbor list builder's threads come after those.
+
+            vector<int> neighborListCores;
+            for (int i = 0; i < numNeighborListThreads; i++)
+                neighborListCores.push_back(cores[(numThreads+numPmeThreads+i)%cores.size()]);
+            neighborListThreadPool->setThreadAffinity(neighborListCores);
+        }
+    }
+
+    // The force arrays are mapped but not touched here.  Memory is only assigned to a page when a thread
+    // first writes to it, so each thread only uses memory for the atoms it actually computes forces on,
+    // and the operating system places it on the NUMA node of that thread.
+
+    int numBlocks = (numParticles+ForceBlockSize-1)/ForceBlockSize;
+    int numGroups = (numBlocks+ForceReleaseBlocks-1)/ForceReleaseBlocks;
     threadForce.resize(numThreads);
+    threadForceBlockUsed.resize(numThreads, vector<char>(numBlocks, 0));
+    threadForceGroupIdle.resize(numThreads, vector<unsigned char>(numGroups, ForceReleaseSteps));
     for (int i = 0; i < numThreads; i++)
-        threadForce[i].resize(4*numParticles);
+        threadForce[i].resizeZeroed(4*numParticles);
+    if (deterministicForces) {
+        threadForceFixed.resize(numThreads);
+        for (int i = 0; i < numThreads; i++)
+            threadForceFixed[i].resizeZeroed(4*numParticles);
+    }
+    else if (precision == "mixed" || precision == "double" || concurrentForces) {
+        threadForceDouble.resize(numThreads);
+        for (int i = 0; i < numThreads; i++)
+            threadForceDouble[i].resizeZeroed(4*numParticles);
+    }
+    if (concurrentNeighborList) {
+        // The builder has its own workers, so the build can run at the same time as work on the main pool.
+
+        neighborListPosq.resize(4*numParticles);
+        neighborListBuilder = thread(&PlatformData::runNeighborListBuilder, this);
+    }
+    if (concurrentForces)
+        threadDeferredEnergy.resize(numThreads, 0.0);
+
+    // Each thread initializes the block of positions it converts in beginComputation(), so when
+    // threads are bound that memory is local to the thread.
+
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        int start = threadIndex*numParticles/numThreads;
+        int end = (threadIndex+1)*numParticles/numThreads;
+        for (int i = 4*start; i < 4*end; i++)
+            posq[i] = 0.0f;
+    });
+    threads.waitForThreads();
     isPeriodic = false;
-    stringstream threadsProperty;
-    threadsProperty << numThreads;
+    stringstream threadsProperty, pmeThreadsProperty;
+    threadsProperty << numThreads+numPmeThreads+numNeighborListThreads;
+    pmeThreadsProperty << numPmeThreads;
     propertyValues[CpuThreads()] = threadsProperty.str();
+    propertyValues[CpuPmeThreads()] = pmeThreadsProperty.str();
     propertyValues[CpuDeterministicForces()] = deterministicForces ? "true" : "false";
+    propertyValues[CpuConcurrentForces()] = concurrentForces ? "true" : "false";
+    propertyValues[CpuThreadAffinity()] = threadsBound ? threadAffinity : "none";
+    propertyValues[CpuNonbondedKernel()] = useClusterPairs ? "ClusterPair" : "Block";
+    propertyValues[CpuPrecision()] = precision;
+    propertyValues[CpuSharedThreadPool()] = settings.useSharedThreadPool ? "true" : "false";
+    propertyValues[CpuPmeTuning()] = tunePme ? "true" : "false";
+    propertyValues[CpuPmeParameters()] = "";
+    propertyValues[CpuAdaptivePadding()] = adaptivePadding ? "true" : "false";
+    propertyValues[CpuConcurrentNeighborList()] = concurrentNeighborList ? "true" : "false";
+    propertyValues[CpuNeighborListPadding()] = "";
+    propertyValues[CpuNeighborListRebuilds()] = "0";
 }
 
 CpuPlatform::PlatformData::~PlatformData() {
+    if (neighborListBuilder.joinable()) {
+        {
+            lock_guard<mutex> lock(neighborListLock);
+            neighborListBuilderExit = true;
+        }
+        neighborListCondition.notify_all();
+        neighborListBuilder.join();
+    }
     if (neighborList != NULL)
         delete neighborList;
 }
@@ -189,6 +494,71 @@ void CpuPlatform::PlatformData::requestNeighborList(double cutoffDistance, doubl
         exclusions = exclusionList;
 }
 
+void CpuPlatform::PlatformData::setNeighborListPadding(double padding) {
+    paddedCutoff = cutoff+padding;
+    neighborListOutdated = true;
+}
+
+void CpuPlatform::PlatformData::buildNeighborList(int numParticles, const Vec3* boxVectors) {
+    waitForNeighborList();
+    if (!concurrentNeighborList) {
+        double startTime = getCurrentTime();
+        neighborList->computeNeighborList(numParticles, posq, exclusions, boxVectors, isPeriodic, paddedCutoff, threads);
+        neighborListBuildTime = getCurrentTime()-startTime;
+        return;
+    }
+    for (int i = 0; i < 4*numParticles; i++)
+        neighborListPosq[i] = posq[i];
+    for (int i = 0; i < 3; i++)
+        neighborListBoxVectors[i] = boxVectors[i];
+    {
+        lock_guard<mutex> lock(neighborListLock);
+        neighborListNumParticles = numParticles;
+        neighborListMaxDistance = paddedCutoff;
+        neighborListBuildPending = true;
+    }
+    neighborListCondition.notify_all();
+}
+
+void CpuPlatform::PlatformData::waitForNeighborList() {
+    if (!concurrentNeighborList)
+        return;
+    unique_lock<mutex> lock(neighborListLock);
+    while (neighborListBuildPending)
+        neighborListCondition.wait(lock);
+    if (neighborListException) {
+        exception_ptr exception = neighborListException;
+        neighborListException = nullptr;
+        rethrow_exception(exception);
+    }
+}
+
+void CpuPlatform::PlatformData::runNeighborListBuilder() {
+    unique_lock<mutex> lock(neighborListLock);
+    while (true) {
+        while (!neighborListBuildPending && !neighborListBuilderExit)
+            neighborListCondition.wait(lock);
+        if (neighborListBuilderExit)
+            return;
+
+        // Build the list without holding the lock, on the builder's own pool so it does not wait for the
+        // kernels running on the Context's pool.
+
+        lock.unlock();
+        try {
+            double startTime = getCurrentTime();
+            neighborList->computeNeighborList(neighborListNumParticles, neighborListPosq, exclusions, neighborListBoxVectors, isPeriodic, neighborListMaxDistance, *neighborListThreadPool);
+            neighborListBuildTime = getCurrentTime()-startTime;
+        }
+        catch (...) {
+            neighborListException = current_exception();
+        }
+        lock.lock();
+        neighborListBuildPending = false;
+        neighborListCondition.notify_all();
+    }
+}
+
 int CpuPlatform::PlatformData::requestPosqIndex() {
     return nextPosqIndex++;
 }
\ No newline at end of file
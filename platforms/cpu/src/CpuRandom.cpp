@@ -25,12 +25,14 @@
 #include "CpuRandom.h"
 #include "openmm/internal/OSRngSeed.h"
 #include "openmm/OpenMMException.h"
+#include "openmm/internal/vectorize.h"
 #include <cmath>
+#include <cstdint>
 
 using namespace std;
 using namespace OpenMM;
 
-CpuRandom::CpuRandom() : hasInitialized(false) {
+CpuRandom::CpuRandom() : hasInitialized(false), stepCounter(0) {
 }
 
 CpuRandom::~CpuRandom() {
@@ -57,6 +59,7 @@ void CpuRandom::initialize(int seed, int numThreads) {
     unsigned int r = (unsigned int) seed;
     if (r == 0)
         r = (unsigned int) osrngseed();
+    counterSeed = r;
     for (int i = 0; i < numThreads; i++) {
         r = (1664525*r + 1013904223) & 0xFFFFFFFF;
         threadRandom[i] = new OpenMM_SFMT::SFMT();
@@ -87,3 +90,98 @@ float CpuRandom::getGaussianRandom(int threadIndex) {
 float CpuRandom::getUniformRandom(int threadIndex) {
     return genrand_real2(*threadRandom[threadIndex]);
 }
+
+/**
+ * Apply the Philox4x32-10 bijection to four counters at once.  On entry, c0-c3 hold the four words
+ * of each counter.  On exit, they hold the corresponding random words.
+ */
+static void philox4x32(uint32_t c0[4], uint32_t c1[4], uint32_t c2[4], uint32_t c3[4], uint32_t key0, uint32_t key1) {
+    const uint32_t m0 = 0xD2511F53, m1 = 0xCD9E8D57;
+    const uint32_t w0 = 0x9E3779B9, w1 = 0xBB67AE85;
+    for (int round = 0; round < 10; round++) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t p0 = (uint64_t) m0*c0[lane];
+            uint64_t p1 = (uint64_t) m1*c2[lane];
+            uint32_t x0 = (uint32_t) (p1>>32)^c1[lane]^key0;
+            uint32_t x2 = (uint32_t) (p0>>32)^c3[lane]^key1;
+            c0[lane] = x0;
+            c1[lane] = (uint32_t) p1;
+            c2[lane] = x2;
+            c3[lane] = (uint32_t) p0;
+        }
+        key0 += w0;
+        key1 += w1;
+    }
+}
+
+/**
+ * Convert two random words per lane into a pair of Gaussian random numbers with the Box-Muller transformation.
+ * The top 24 bits of the first word select the radius.  The top 24 bits of the second select an angle in the
+ * first quadrant, and its two lowest bits select the signs of the two outputs, which reflects the angle into
+ * a uniformly chosen quadrant.
+ */
+static void boxMuller(const uint32_t a[4], const uint32_t b[4], fvec4& x, fvec4& y) {
+    int radiusBits[4], angleBits[4];
+    float xSign[4], ySign[4];
+    for (int lane = 0; lane < 4; lane++) {
+        radiusBits[lane] = (int) (a[lane]>>8);
+        angleBits[lane] = (int) (b[lane]>>8);
+        xSign[lane] = ((b[lane]&1) ? -1.0f : 1.0f);
+        ySign[lane] = ((b[lane]&2) ? -1.0f : 1.0f);
+    }
+    const float scale = 1.0f/16777216.0f;
+    fvec4 u = (fvec4(ivec4(radiusBits))+0.5f)*scale;
+    fvec4 radius = sqrt(-2.0f*log(u));
+
+    // Evaluate sin and cos over [0, pi/2) with Taylor series that are accurate to single precision.
+
+    fvec4 phi = (fvec4(ivec4(angleBits))+0.5f)*(scale*1.5707963f);
+    fvec4 phi2 = phi*phi;
+    fvec4 sinPhi = phi*(1.0f+phi2*(-1.0f/6.0f+phi2*(1.0f/120.0f+phi2*(-1.0f/5040.0f+phi2*(1.0f/362880.0f+phi2*(-1.0f/39916800.0f))))));
+    fvec4 cosPhi = 1.0f+phi2*(-0.5f+phi2*(1.0f/24.0f+phi2*(-1.0f/720.0f+phi2*(1.0f/40320.0f+phi2*(-1.0f/3628800.0f+phi2*(1.0f/479001600.0f))))));
+    x = radius*cosPhi*fvec4(xSign);
+    y = radius*sinPhi*fvec4(ySign);
+}
+
+void CpuRandom::getGaussianRandoms(long long step, int start, int end, float* values) const {
+    // Each index is one Philox counter, which yields four words and hence four Gaussian values.  Four counters
+    // are processed together so the transformation can work on whole vectors.
+
+    for (int first = start; first < end; first += 4) {
+        uint32_t c0[4], c1[4], c2[4], c3[4];
+        for (int lane = 0; lane < 4; lane++) {
+            c0[lane] = (uint32_t) (first+lane);
+            c1[lane] = (uint32_t) step;
+            c2[lane] = (uint32_t) (((unsigned long long) step)>>32);
+            c3[lane] = 0;
+        }
+        philox4x32(c0, c1, c2, c3, counterSeed, 0x6A09E667);
+        fvec4 v[4];
+        boxMuller(c0, c1, v[0], v[1]);
+        boxMuller(c2, c3, v[2], v[3]);
+        transpose(v[0], v[1], v[2], v[3]);
+        int count = end-first;
+        if (count >= 4)
+            for (int lane = 0; lane < 4; lane++)
+                v[lane].store(values+4*(first-start+lane));
+        else
+            for (int lane = 0; lane < count; lane++) {
+                float temp[4];
+                v[lane].store(temp);
+                for (int j = 0; j < 4; j++)
+                    values[4*(first-start+lane)+j] = temp[j];
+            }
+    }
+}
+
+long long CpuRandom::nextStep() {
+    return stepCounter++;
+}
+
+long long CpuRandom::getStepCounter() const {
+    return stepCounter;
+}
+
+void CpuRandom::setStepCounter(long long step) {
+    stepCounter = step;
+}
@@ -30,60 +30,425 @@
  * -------------------------------------------------------------------------- */
 
 #include "CpuSETTLE.h"
-#include <atomic>
+#include <cmath>
+#if !defined(__ARM__) && !defined(__ARM64__) && !defined(__PPC__)
+    #include <emmintrin.h>
+#endif
 
 using namespace OpenMM;
 using namespace std;
 
+const int CpuSETTLE::LanesPerGroup = 8;
+
+namespace {
+
+/**
+ * A two element vector of doubles, used to solve two lanes at once.  GCC will not vectorize the solve loops
+ * on its own, since every call to sqrt() may set errno, so this makes the SIMD arithmetic explicit.  Every
+ * operation is correctly rounded, so the results are identical to the scalar code.
+ */
+#if !defined(__ARM__) && !defined(__ARM64__) && !defined(__PPC__)
+class dvec2 {
+public:
+    __m128d val;
+
+    dvec2(double v) : val(_mm_set1_pd(v)) {}
+    dvec2(__m128d v) : val(v) {}
+    dvec2(const double* v) : val(_mm_loadu_pd(v)) {}
+    void store(double* v) const {
+        _mm_storeu_pd(v, val);
+    }
+    dvec2 operator+(dvec2 other) const {
+        return _mm_add_pd(val, other.val);
+    }
+    dvec2 operator-(dvec2 other) const {
+        return _mm_sub_pd(val, other.val);
+    }
+    dvec2 operator*(dvec2 other) const {
+        return _mm_mul_pd(val, other.val);
+    }
+    dvec2 operator/(dvec2 other) const {
+        return _mm_div_pd(val, other.val);
+    }
+    void operator+=(dvec2 other) {
+        val = _mm_add_pd(val, other.val);
+    }
+    void operator-=(dvec2 other) {
+        val = _mm_sub_pd(val, other.val);
+    }
+    void operator*=(dvec2 other) {
+        val = _mm_mul_pd(val, other.val);
+    }
+    dvec2 operator-() const {
+        return _mm_xor_pd(val, _mm_set1_pd(-0.0));
+    }
+};
+
+static inline dvec2 sqrt(dvec2 v) {
+    return _mm_sqrt_pd(v.val);
+}
+#else
+class dvec2 {
+public:
+    double val[2];
+
+    dvec2(double v) : val{v, v} {}
+    dvec2(double v1, double v2) : val{v1, v2} {}
+    dvec2(const double* v) : val{v[0], v[1]} {}
+    void store(double* v) const {
+        v[0] = val[0];
+        v[1] = val[1];
+    }
+    dvec2 operator+(dvec2 other) const {
+        return dvec2(val[0]+other.val[0], val[1]+other.val[1]);
+    }
+    dvec2 operator-(dvec2 other) const {
+        return dvec2(val[0]-other.val[0], val[1]-other.val[1]);
+    }
+    dvec2 operator*(dvec2 other) const {
+        return dvec2(val[0]*other.val[0], val[1]*other.val[1]);
+    }
+    dvec2 operator/(dvec2 other) const {
+        return dvec2(val[0]/other.val[0], val[1]/other.val[1]);
+    }
+    void operator+=(dvec2 other) {
+        val[0] += other.val[0];
+        val[1] += other.val[1];
+    }
+    void operator-=(dvec2 other) {
+        val[0] -= other.val[0];
+        val[1] -= other.val[1];
+    }
+    void operator*=(dvec2 other) {
+        val[0] *= other.val[0];
+        val[1] *= other.val[1];
+    }
+    dvec2 operator-() const {
+        return dvec2(-val[0], -val[1]);
+    }
+};
+
+static inline dvec2 sqrt(dvec2 v) {
+    return dvec2(std::sqrt(v.val[0]), std::sqrt(v.val[1]));
+}
+#endif
+
+static inline dvec2 operator+(double v1, dvec2 v2) {
+    return dvec2(v1)+v2;
+}
+
+static inline dvec2 operator-(double v1, dvec2 v2) {
+    return dvec2(v1)-v2;
+}
+
+static inline dvec2 operator*(double v1, dvec2 v2) {
+    return dvec2(v1)*v2;
+}
+
+static inline dvec2 operator/(double v1, dvec2 v2) {
+    return dvec2(v1)/v2;
+}
+
+}
+
+/**
+ * A block of clusters.  The clusters are divided into groups of LanesPerGroup, whose parameters are stored
+ * in structure-of-arrays form.  Positions and velocities are gathered into lane arrays, the constraints are
+ * solved two lanes at a time with branch free dvec2 arithmetic, and the results are scattered back.  The last
+ * group is padded by repeating its final cluster; padded lanes are never written back.
+ */
+class CpuSETTLE::Block : public ReferenceSETTLEAlgorithm {
+public:
+    Block(const vector<int>& atom1, const vector<int>& atom2, const vector<int>& atom3,
+            const vector<double>& distance1, const vector<double>& distance2, vector<double>& masses);
+    void apply(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& atomCoordinatesP, vector<double>& inverseMasses, double tolerance);
+    void applyToVelocities(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& velocities, vector<double>& inverseMasses, double tolerance);
+private:
+    static const int Lanes = LanesPerGroup;
+    struct Group {
+        int numLanes;
+        int atom[3][Lanes];
+        double mass[3][Lanes], invTotalMass[Lanes], ra[Lanes], rb[Lanes], rc[Lanes], distance2[Lanes];
+    };
+    vector<Group> groups;
+};
+
+const int CpuSETTLE::Block::Lanes;
+
+CpuSETTLE::Block::Block(const vector<int>& atom1, const vector<int>& atom2, const vector<int>& atom3,
+            const vector<double>& distance1, const vector<double>& distance2, vector<double>& masses) :
+            ReferenceSETTLEAlgorithm(atom1, atom2, atom3, distance1, distance2, masses) {
+    int numClusters = atom1.size();
+    groups.resize((numClusters+Lanes-1)/Lanes);
+    for (int i = 0; i < groups.size(); i++) {
+        Group& group = groups[i];
+        group.numLanes = min(Lanes, numClusters-i*Lanes);
+        for (int j = 0; j < Lanes; j++) {
+            int cluster = i*Lanes+min(j, group.numLanes-1);
+            int atoms[] = {atom1[cluster], atom2[cluster], atom3[cluster]};
+            for (int k = 0; k < 3; k++) {
+                group.atom[k][j] = atoms[k];
+                group.mass[k][j] = masses[atoms[k]];
+            }
+            double m0 = group.mass[0][j], m1 = group.mass[1][j], m2 = group.mass[2][j];
+            group.invTotalMass[j] = 1/(m0+m1+m2);
+            double rc = 0.5*distance2[cluster];
+            double rb = sqrt(distance1[cluster]*distance1[cluster]-rc*rc);
+            double ra = rb*(m1+m2)*group.invTotalMass[j];
+            group.ra[j] = ra;
+            group.rb[j] = rb-ra;
+            group.rc[j] = rc;
+            group.distance2[j] = distance2[cluster];
+        }
+    }
+}
+
+void CpuSETTLE::Block::apply(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& atomCoordinatesP, vector<double>& inverseMasses, double tolerance) {
+    double ax[Lanes], ay[Lanes], az[Lanes], xb0[Lanes], yb0[Lanes], zb0[Lanes], xc0[Lanes], yc0[Lanes], zc0[Lanes];
+    double dx[3][Lanes], dy[3][Lanes], dz[3][Lanes];
+    for (const Group& group : groups) {
+        // Gather the positions of every lane.  All quantities are computed relative to the first atom's old
+        // position, exactly as in ReferenceSETTLEAlgorithm.
+
+        for (int j = 0; j < Lanes; j++) {
+            const Vec3& apos0 = atomCoordinates[group.atom[0][j]];
+            const Vec3& apos1 = atomCoordinates[group.atom[1][j]];
+            const Vec3& apos2 = atomCoordinates[group.atom[2][j]];
+            ax[j] = apos0[0];
+            ay[j] = apos0[1];
+            az[j] = apos0[2];
+            xb0[j] = apos1[0]-apos0[0];
+            yb0[j] = apos1[1]-apos0[1];
+            zb0[j] = apos1[2]-apos0[2];
+            xc0[j] = apos2[0]-apos0[0];
+            yc0[j] = apos2[1]-apos0[1];
+            zc0[j] = apos2[2]-apos0[2];
+            for (int k = 0; k < 3; k++) {
+                const Vec3& p = atomCoordinatesP[group.atom[k][j]];
+                dx[k][j] = p[0]-apos0[0];
+                dy[k][j] = p[1]-apos0[1];
+                dz[k][j] = p[2]-apos0[2];
+            }
+        }
+
+        // Solve the constraints for all lanes.
+
+        for (int j = 0; j < Lanes; j += 2) {
+            dvec2 m0(&group.mass[0][j]), m1(&group.mass[1][j]), m2(&group.mass[2][j]);
+            dvec2 invTotalMass(&group.invTotalMass[j]);
+            dvec2 dx0(&dx[0][j]), dy0(&dy[0][j]), dz0(&dz[0][j]);
+            dvec2 dx1(&dx[1][j]), dy1(&dy[1][j]), dz1(&dz[1][j]);
+            dvec2 dx2(&dx[2][j]), dy2(&dy[2][j]), dz2(&dz[2][j]);
+            dvec2 xb(&xb0[j]), yb(&yb0[j]), zb(&zb0[j]), xc(&xc0[j]), yc(&yc0[j]), zc(&zc0[j]);
+            dvec2 xcom = (dx0*m0 + dx1*m1 + dx2*m2) * invTotalMass;
+            dvec2 ycom = (dy0*m0 + dy1*m1 + dy2*m2) * invTotalMass;
+            dvec2 zcom = (dz0*m0 + dz1*m1 + dz2*m2) * invTotalMass;
+
+            dvec2 xa1 = dx0 - xcom;
+            dvec2 ya1 = dy0 - ycom;
+            dvec2 za1 = dz0 - zcom;
+            dvec2 xb1 = dx1 - xcom;
+            dvec2 yb1 = dy1 - ycom;
+            dvec2 zb1 = dz1 - zcom;
+            dvec2 xc1 = dx2 - xcom;
+            dvec2 yc1 = dy2 - ycom;
+            dvec2 zc1 = dz2 - zcom;
+
+            dvec2 xaksZd = yb*zc - zb*yc;
+            dvec2 yaksZd = zb*xc - xb*zc;
+            dvec2 zaksZd = xb*yc - yb*xc;
+            dvec2 xaksXd = ya1*zaksZd - za1*yaksZd;
+            dvec2 yaksXd = za1*xaksZd - xa1*zaksZd;
+            dvec2 zaksXd = xa1*yaksZd - ya1*xaksZd;
+            dvec2 xaksYd = yaksZd*zaksXd - zaksZd*yaksXd;
+            dvec2 yaksYd = zaksZd*xaksXd - xaksZd*zaksXd;
+            dvec2 zaksYd = xaksZd*yaksXd - yaksZd*xaksXd;
+
+            dvec2 axlng = 1/sqrt(xaksXd*xaksXd + yaksXd*yaksXd + zaksXd*zaksXd);
+            dvec2 aylng = 1/sqrt(xaksYd*xaksYd + yaksYd*yaksYd + zaksYd*zaksYd);
+            dvec2 azlng = 1/sqrt(xaksZd*xaksZd + yaksZd*yaksZd + zaksZd*zaksZd);
+            dvec2 trns11 = xaksXd*axlng;
+            dvec2 trns21 = yaksXd*axlng;
+            dvec2 trns31 = zaksXd*axlng;
+            dvec2 trns12 = xaksYd*aylng;
+            dvec2 trns22 = yaksYd*aylng;
+            dvec2 trns32 = zaksYd*aylng;
+            dvec2 trns13 = xaksZd*azlng;
+            dvec2 trns23 = yaksZd*azlng;
+            dvec2 trns33 = zaksZd*azlng;
+
+            dvec2 xb0d = trns11*xb + trns21*yb + trns31*zb;
+            dvec2 yb0d = trns12*xb + trns22*yb + trns32*zb;
+            dvec2 xc0d = trns11*xc + trns21*yc + trns31*zc;
+            dvec2 yc0d = trns12*xc + trns22*yc + trns32*zc;
+            dvec2 za1d = trns13*xa1 + trns23*ya1 + trns33*za1;
+            dvec2 xb1d = trns11*xb1 + trns21*yb1 + trns31*zb1;
+            dvec2 yb1d = trns12*xb1 + trns22*yb1 + trns32*zb1;
+            dvec2 zb1d = trns13*xb1 + trns23*yb1 + trns33*zb1;
+            dvec2 xc1d = trns11*xc1 + trns21*yc1 + trns31*zc1;
+            dvec2 yc1d = trns12*xc1 + trns22*yc1 + trns32*zc1;
+            dvec2 zc1d = trns13*xc1 + trns23*yc1 + trns33*zc1;
+
+            dvec2 ra(&group.ra[j]), rb(&group.rb[j]), rc(&group.rc[j]), distance2(&group.distance2[j]);
+            dvec2 sinphi = za1d / ra;
+            dvec2 cosphi = sqrt(1 - sinphi*sinphi);
+            dvec2 sinpsi = (zb1d - zc1d) / (2*rc*cosphi);
+            dvec2 cospsi = sqrt(1 - sinpsi*sinpsi);
+
+            dvec2 ya2d =   ra*cosphi;
+            dvec2 xb2d = - rc*cospsi;
+            dvec2 yb2d = - rb*cosphi - rc*sinpsi*sinphi;
+            dvec2 yc2d = - rb*cosphi + rc*sinpsi*sinphi;
+            dvec2 xb2d2 = xb2d*xb2d;
+            dvec2 hh2 = 4.0*xb2d2 + (yb2d-yc2d)*(yb2d-yc2d) + (zb1d-zc1d)*(zb1d-zc1d);
+            dvec2 deltx = 2.0*xb2d + sqrt(4.0*xb2d2 - hh2 + distance2*distance2);
+            xb2d -= deltx*0.5;
+
+            dvec2 alpha = (xb2d*(xb0d-xc0d) + yb0d*yb2d + yc0d*yc2d);
+            dvec2 beta = (xb2d*(yc0d-yb0d) + xb0d*yb2d + xc0d*yc2d);
+            dvec2 gamma = xb0d*yb1d - xb1d*yb0d + xc0d*yc1d - xc1d*yc0d;
+            dvec2 al2be2 = alpha*alpha + beta*beta;
+            dvec2 sintheta = (alpha*gamma - beta*sqrt(al2be2 - gamma*gamma)) / al2be2;
+
+            dvec2 costheta = sqrt(1 - sintheta*sintheta);
+            dvec2 xa3d = - ya2d*sintheta;
+            dvec2 ya3d =   ya2d*costheta;
+            dvec2 za3d = za1d;
+            dvec2 xb3d =   xb2d*costheta - yb2d*sintheta;
+            dvec2 yb3d =   xb2d*sintheta + yb2d*costheta;
+            dvec2 zb3d = zb1d;
+            dvec2 xc3d = - xb2d*costheta - yc2d*sintheta;
+            dvec2 yc3d = - xb2d*sintheta + yc2d*costheta;
+            dvec2 zc3d = zc1d;
+
+            (xcom + trns11*xa3d + trns12*ya3d + trns13*za3d).store(&dx[0][j]);
+            (ycom + trns21*xa3d + trns22*ya3d + trns23*za3d).store(&dy[0][j]);
+            (zcom + trns31*xa3d + trns32*ya3d + trns33*za3d).store(&dz[0][j]);
+            (xcom + trns11*xb3d + trns12*yb3d + trns13*zb3d).store(&dx[1][j]);
+            (ycom + trns21*xb3d + trns22*yb3d + trns23*zb3d).store(&dy[1][j]);
+            (zcom + trns31*xb3d + trns32*yb3d + trns33*zb3d).store(&dz[1][j]);
+            (xcom + trns11*xc3d + trns12*yc3d + trns13*zc3d).store(&dx[2][j]);
+            (ycom + trns21*xc3d + trns22*yc3d + trns23*zc3d).store(&dy[2][j]);
+            (zcom + trns31*xc3d + trns32*yc3d + trns33*zc3d).store(&dz[2][j]);
+        }
+
+        // Record the new positions.
+
+        for (int j = 0; j < group.numLanes; j++)
+            for (int k = 0; k < 3; k++)
+                atomCoordinatesP[group.atom[k][j]] = Vec3(ax[j]+dx[k][j], ay[j]+dy[k][j], az[j]+dz[k][j]);
+    }
+}
+
+void CpuSETTLE::Block::applyToVelocities(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& velocities, vector<double>& inverseMasses, double tolerance) {
+    double x[3][Lanes], y[3][Lanes], z[3][Lanes], vx[3][Lanes], vy[3][Lanes], vz[3][Lanes], invMass[3][Lanes];
+    for (const Group& group : groups) {
+        for (int j = 0; j < Lanes; j++)
+            for (int k = 0; k < 3; k++) {
+                int atom = group.atom[k][j];
+                const Vec3& pos = atomCoordinates[atom];
+                const Vec3& vel = velocities[atom];
+                x[k][j] = pos[0];
+                y[k][j] = pos[1];
+                z[k][j] = pos[2];
+                vx[k][j] = vel[0];
+                vy[k][j] = vel[1];
+                vz[k][j] = vel[2];
+                invMass[k][j] = inverseMasses[atom];
+            }
+
+        // This uses the same equations as ReferenceSETTLEAlgorithm::applyToVelocities(), which allow all three
+        // atoms to have different masses.
+
+        for (int j = 0; j < Lanes; j += 2) {
+            dvec2 mA(&group.mass[0][j]);
+            dvec2 mB(&group.mass[1][j]);
+            dvec2 mC(&group.mass[2][j]);
+            dvec2 invMass0(&invMass[0][j]), invMass1(&invMass[1][j]), invMass2(&invMass[2][j]);
+            dvec2 x0(&x[0][j]), y0(&y[0][j]), z0(&z[0][j]), x1(&x[1][j]), y1(&y[1][j]), z1(&z[1][j]), x2(&x[2][j]), y2(&y[2][j]), z2(&z[2][j]);
+            dvec2 vx0(&vx[0][j]), vy0(&vy[0][j]), vz0(&vz[0][j]), vx1(&vx[1][j]), vy1(&vy[1][j]), vz1(&vz[1][j]), vx2(&vx[2][j]), vy2(&vy[2][j]), vz2(&vz[2][j]);
+            dvec2 eABx = x1-x0, eABy = y1-y0, eABz = z1-z0;
+            dvec2 eBCx = x2-x1, eBCy = y2-y1, eBCz = z2-z1;
+            dvec2 eCAx = x0-x2, eCAy = y0-y2, eCAz = z0-z2;
+            dvec2 invLengthAB = 1/sqrt(eABx*eABx + eABy*eABy + eABz*eABz);
+            dvec2 invLengthBC = 1/sqrt(eBCx*eBCx + eBCy*eBCy + eBCz*eBCz);
+            dvec2 invLengthCA = 1/sqrt(eCAx*eCAx + eCAy*eCAy + eCAz*eCAz);
+            eABx *= invLengthAB;
+            eABy *= invLengthAB;
+            eABz *= invLengthAB;
+            eBCx *= invLengthBC;
+            eBCy *= invLengthBC;
+            eBCz *= invLengthBC;
+            eCAx *= invLengthCA;
+            eCAy *= invLengthCA;
+            eCAz *= invLengthCA;
+            dvec2 vAB = (vx1-vx0)*eABx + (vy1-vy0)*eABy + (vz1-vz0)*eABz;
+            dvec2 vBC = (vx2-vx1)*eBCx + (vy2-vy1)*eBCy + (vz2-vz1)*eBCz;
+            dvec2 vCA = (vx0-vx2)*eCAx + (vy0-vy2)*eCAy + (vz0-vz2)*eCAz;
+            dvec2 cA = -(eABx*eCAx + eABy*eCAy + eABz*eCAz);
+            dvec2 cB = -(eABx*eBCx + eABy*eBCy + eABz*eBCz);
+            dvec2 cC = -(eBCx*eCAx + eBCy*eCAy + eBCz*eCAz);
+            dvec2 s2A = 1-cA*cA;
+            dvec2 s2B = 1-cB*cB;
+            dvec2 s2C = 1-cC*cC;
+            dvec2 mABCinv = 1/(mA*mB*mC);
+            dvec2 invDenom = 1/((((s2A*mB+s2B*mA)*mC+(s2A*mB*mB+2*(cA*cB*cC+1)*mA*mB+s2B*mA*mA))*mC+s2C*mA*mB*(mA+mB))*mABCinv);
+            dvec2 tab = ((cB*cC*mA-cA*mB-cA*mC)*vCA + (cA*cC*mB-cB*mC-cB*mA)*vBC + (s2C*mA*mA*mB*mB*mABCinv+(mA+mB+mC))*vAB)*invDenom;
+            dvec2 tbc = ((cA*cB*mC-cC*mB-cC*mA)*vCA + (s2A*mB*mB*mC*mC*mABCinv+(mA+mB+mC))*vBC + (cA*cC*mB-cB*mA-cB*mC)*vAB)*invDenom;
+            dvec2 tca = ((s2B*mA*mA*mC*mC*mABCinv+(mA+mB+mC))*vCA + (cA*cB*mC-cC*mB-cC*mA)*vBC + (cB*cC*mA-cA*mB-cA*mC)*vAB)*invDenom;
+            (vx0 + (eABx*tab - eCAx*tca)*invMass0).store(&vx[0][j]);
+            (vy0 + (eABy*tab - eCAy*tca)*invMass0).store(&vy[0][j]);
+            (vz0 + (eABz*tab - eCAz*tca)*invMass0).store(&vz[0][j]);
+            (vx1 + (eBCx*tbc - eABx*tab)*invMass1).store(&vx[1][j]);
+            (vy1 + (eBCy*tbc - eABy*tab)*invMass1).store(&vy[1][j]);
+            (vz1 + (eBCz*tbc - eABz*tab)*invMass1).store(&vz[1][j]);
+            (vx2 + (eCAx*tca - eBCx*tbc)*invMass2).store(&vx[2][j]);
+            (vy2 + (eCAy*tca - eBCy*tbc)*invMass2).store(&vy[2][j]);
+            (vz2 + (eCAz*tca - eBCz*tbc)*invMass2).store(&vz[2][j]);
+        }
+        for (int j = 0; j < group.numLanes; j++)
+            for (int k = 0; k < 3; k++)
+                velocities[group.atom[k][j]] = Vec3(vx[k][j], vy[k][j], vz[k][j]);
+    }
+}
+
 CpuSETTLE::CpuSETTLE(const System& system, const ReferenceSETTLEAlgorithm& settle, ThreadPool& threads) : threads(threads) {
-    int numBlocks = 10*threads.getNumThreads();
+    // Divide whole groups of clusters between the blocks, so only the final block can contain a partial group.
+
     int numClusters = settle.getNumClusters();
+    int numGroups = (numClusters+LanesPerGroup-1)/LanesPerGroup;
+    int numBlocks = 10*threads.getNumThreads();
     vector<double> mass(system.getNumParticles());
     for (int i = 0; i < system.getNumParticles(); i++)
         mass[i] = system.getParticleMass(i);
     for (int i = 0; i < numBlocks; i++) {
-        int start = i*numClusters/numBlocks;
-        int end = (i+1)*numClusters/numBlocks;
+        int start = min(numClusters, (i*numGroups/numBlocks)*LanesPerGroup);
+        int end = min(numClusters, ((i+1)*numGroups/numBlocks)*LanesPerGroup);
         if (start != end) {
             int numThreadClusters = end-start;
             vector<int> atom1(numThreadClusters), atom2(numThreadClusters), atom3(numThreadClusters);
             vector<double> distance1(numThreadClusters), distance2(numThreadClusters);
             for (int j = 0; j < numThreadClusters; j++)
                 settle.getClusterParameters(start+j, atom1[j], atom2[j], atom3[j], distance1[j], distance2[j]);
-            threadSettle.push_back(new ReferenceSETTLEAlgorithm(atom1, atom2, atom3, distance1, distance2, mass));
+            threadSettle.push_back(new Block(atom1, atom2, atom3, distance1, distance2, mass));
         }
     }
 }
-
 CpuSETTLE::~CpuSETTLE() {
     for (auto settle : threadSettle)
         delete settle;
 }
 
 void CpuSETTLE::apply(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& atomCoordinatesP, vector<double>& inverseMasses, double tolerance) {
-    atomic<int> atomicCounter;
-    atomicCounter = 0;
-    threads.execute([&] (ThreadPool& threads, int threadIndex) {
-        while (true) {
-            int index = atomicCounter++;
-            if (index >= threadSettle.size())
-                break;
+    threads.parallelFor(0, threadSettle.size(), [&] (ThreadPool& threads, int threadIndex, int start, int end) {
+        for (int index = start; index < end; index++)
             threadSettle[index]->apply(atomCoordinates, atomCoordinatesP, inverseMasses, tolerance);
-        }
-    });
-    threads.waitForThreads();
+    }, 1);
 }
 
 void CpuSETTLE::applyToVelocities(vector<OpenMM::Vec3>& atomCoordinates, vector<OpenMM::Vec3>& velocities, vector<double>& inverseMasses, double tolerance) {
-    atomic<int> atomicCounter;
-    atomicCounter = 0;
-    threads.execute([&] (ThreadPool& threads, int threadIndex) {
-        while (true) {
-            int index = atomicCounter++;
-            if (index >= threadSettle.size())
-                break;
+    threads.parallelFor(0, threadSettle.size(), [&] (ThreadPool& threads, int threadIndex, int start, int end) {
+        for (int index = start; index < end; index++)
             threadSettle[index]->applyToVelocities(atomCoordinates, velocities, inverseMasses, tolerance);
-        }
-    });
-    threads.waitForThreads();
+    }, 1);
 }
@@ -32,5 +32,38 @@
 #include "CpuTests.h"
 #include "TestCompoundIntegrator.h"
 
+void testDifferentRandomSeeds() {
+    // A CustomIntegrator and a LangevinIntegrator with different random seeds should be able to share a Context.
+
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    bonds->addBond(0, 1, 1.0, 100.0);
+    system.addForce(bonds);
+    CompoundIntegrator integrator;
+    CustomIntegrator* custom = new CustomIntegrator(0.001);
+    custom->addPerDofVariable("noise", 0.0);
+    custom->addComputePerDof("noise", "gaussian");
+    custom->addComputePerDof("v", "v+0.01*noise+dt*f/m");
+    custom->addComputePerDof("x", "x+dt*v");
+    custom->setRandomNumberSeed(1);
+    LangevinIntegrator* langevin = new LangevinIntegrator(300.0, 1.0, 0.001);
+    langevin->setRandomNumberSeed(2);
+    integrator.addIntegrator(custom);
+    integrator.addIntegrator(langevin);
+    Context context(system, integrator, platform);
+    vector<Vec3> positions(2);
+    positions[1] = Vec3(1, 0, 0);
+    context.setPositions(positions);
+    integrator.setCurrentIntegrator(0);
+    integrator.step(10);
+    integrator.setCurrentIntegrator(1);
+    integrator.step(10);
+    integrator.setCurrentIntegrator(0);
+    integrator.step(10);
+}
+
 void runPlatformTests() {
+    testDifferentRandomSeeds();
 }
@@ -0,0 +1,124 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuTests.h"
+#include "TestCustomBondForce.h"
+#include "sfmt/SFMT.h"
+
+void testParallelComputation() {
+    System system;
+    const int numParticles = 200;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    CustomBondForce* force = new CustomBondForce("scale*k*(r-r0)^2");
+    force->addGlobalParameter("scale", 0.5);
+    force->addPerBondParameter("r0");
+    force->addPerBondParameter("k");
+    vector<double> params(2);
+    for (int i = 1; i < numParticles; i++) {
+        params[0] = 1.1;
+        params[1] = i;
+        force->addBond(i-1, i, params);
+    }
+    for (int i = 3; i < numParticles; i += 3) {
+        params[0] = 2.5;
+        params[1] = 0.5*i;
+        force->addBond(i-3, i, params);
+    }
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i, i%2, 0);
+    VerletIntegrator integrator1(0.01);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+}
+
+void testDeterministicForces() {
+    // With DeterministicForces set, forces, energies, and parameter derivatives should not depend on the number of threads.
+
+    System system;
+    const int numParticles = 200;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    CustomBondForce* force = new CustomBondForce("scale*k*(r-r0)^2");
+    force->addGlobalParameter("scale", 0.5);
+    force->addEnergyParameterDerivative("scale");
+    force->addPerBondParameter("r0");
+    force->addPerBondParameter("k");
+    for (int i = 1; i < numParticles; i++)
+        force->addBond(i-1, i, {1.1, (double) i});
+    for (int i = 3; i < numParticles; i += 3)
+        force->addBond(i-3, i, {2.5, 0.5*i});
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i+0.1*genrand_real2(sfmt), i%2+0.1*genrand_real2(sfmt), 0.1*genrand_real2(sfmt));
+    VerletIntegrator integrator(0.01);
+    ReferencePlatform referencePlatform;
+    Context reference(system, integrator, referencePlatform);
+    reference.setPositions(positions);
+    State referenceState = reference.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+    vector<State> states;
+    for (string threads : {"1", "3"}) {
+        map<string, string> properties;
+        properties[CpuPlatform::CpuThreads()] = threads;
+        properties[CpuPlatform::CpuDeterministicForces()] = "true";
+        VerletIntegrator integrator(0.01);
+        Context context(system, integrator, platform, properties);
+        context.setPositions(positions);
+        states.push_back(context.getState(State::Forces | State::Energy | State::ParameterDerivatives));
+    }
+    ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), states[0].getPotentialEnergy(), 1e-5);
+    ASSERT_EQUAL_TOL(referenceState.getEnergyParameterDerivatives().at("scale"), states[0].getEnergyParameterDerivatives().at("scale"), 1e-5);
+    ASSERT_EQUAL(states[0].getPotentialEnergy(), states[1].getPotentialEnergy());
+    ASSERT_EQUAL(states[0].getEnergyParameterDerivatives().at("scale"), states[1].getEnergyParameterDerivatives().at("scale"));
+    for (int i = 0; i < numParticles; i++) {
+        ASSERT_EQUAL_VEC(referenceState.getForces()[i], states[0].getForces()[i], 1e-5);
+        ASSERT_EQUAL_VEC(states[0].getForces()[i], states[1].getForces()[i], 0.0);
+    }
+}
+
+void runPlatformTests() {
+    testParallelComputation();
+    testDeterministicForces();
+}
@@ -0,0 +1,86 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuTests.h"
+#include "TestCustomHbondForce.h"
+
+void testLargeSystem(CustomHbondForce::NonbondedMethod method, bool triclinic) {
+    // Compare the CPU and Reference platforms for a system with many donors and acceptors.
+
+    const int numMolecules = 300;
+    const double boxSize = 4.0;
+    System system;
+    Vec3 boxVectors[3];
+    boxVectors[0] = Vec3(boxSize, 0, 0);
+    boxVectors[1] = (triclinic ? Vec3(0.8, boxSize, 0) : Vec3(0, boxSize, 0));
+    boxVectors[2] = (triclinic ? Vec3(-0.5, 1.0, boxSize) : Vec3(0, 0, boxSize));
+    system.setDefaultPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+    CustomHbondForce* force = new CustomHbondForce("k*(distance(d1,a1)-0.3)^2*cos(angle(d2,d1,a1))^2 + 0.1*cos(dihedral(d3,d2,d1,a1))");
+    force->addGlobalParameter("k", 2.0);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    for (int i = 0; i < numMolecules; i++) {
+        Vec3 pos(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+        for (int j = 0; j < 3; j++) {
+            system.addParticle(1.0);
+            positions.push_back(pos+Vec3(0.1*j, 0.05*j*j, 0.1*genrand_real2(sfmt)));
+        }
+        if (i%2 == 0)
+            force->addDonor(3*i, 3*i+1, 3*i+2);
+        else
+            force->addAcceptor(3*i, 3*i+1, 3*i+2);
+    }
+    for (int i = 0; i < force->getNumDonors(); i += 7)
+        force->addExclusion(i, (3*i)%force->getNumAcceptors());
+    system.addForce(force);
+    VerletIntegrator integrator1(0.01);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+}
+
+void runPlatformTests() {
+    testLargeSystem(CustomHbondForce::NoCutoff, false);
+    testLargeSystem(CustomHbondForce::CutoffNonPeriodic, false);
+    testLargeSystem(CustomHbondForce::CutoffPeriodic, false);
+    testLargeSystem(CustomHbondForce::CutoffPeriodic, true);
+}
@@ -32,5 +32,56 @@
 #include "CpuTests.h"
 #include "TestCustomManyParticleForce.h"
 
+void testTypeFiltersLargeSystem(bool centralParticleMode) {
+    // Use a particle count that is not a multiple of the block size, and place some particles
+    // outside the periodic box.
+
+    const int numParticles = 301;
+    const double boxSize = 2.5;
+    CustomManyParticleForce* force = new CustomManyParticleForce(3,
+        "c1*exp(-r12-r13)*(cos(theta1)+1/3)^2; r12 = distance(p1,p2); r13 = distance(p1,p3); theta1 = angle(p3,p1,p2)");
+    if (centralParticleMode)
+        force->setPermutationMode(CustomManyParticleForce::UniqueCentralParticle);
+    force->addPerParticleParameter("c");
+    force->setNonbondedMethod(CustomManyParticleForce::CutoffPeriodic);
+    force->setCutoffDistance(0.6);
+    set<int> f1, f2;
+    f1.insert(0);
+    f2.insert(1);
+    force->setTypeFilter(0, f1);
+    force->setTypeFilter(1, f2);
+    force->setTypeFilter(2, f2);
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions;
+    vector<double> params(1);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        params[0] = 1.0+genrand_real2(sfmt);
+        force->addParticle(params, i%3 == 0 ? 0 : (i%3 == 1 ? 1 : 2));
+        Vec3 pos(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+        if (i%7 == 0)
+            pos += Vec3(-boxSize, 2*boxSize, boxSize);
+        positions.push_back(pos);
+    }
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context1(system, integrator1, Platform::getPlatformByName("Reference"));
+    Context context2(system, integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT(state1.getPotentialEnergy() != 0.0);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-4);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+}
+
 void runPlatformTests() {
+    testTypeFiltersLargeSystem(false);
+    testTypeFiltersLargeSystem(true);
 }
@@ -31,6 +31,74 @@
 
 #include "CpuTests.h"
 #include "TestCustomNonbondedForce.h"
+#include "ReferencePlatform.h"
+
+void testInteractionGroupsWithCutoff() {
+    const int numParticles = 400;
+    const double boxSize = 4.0;
+    const double cutoff = 1.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    CustomNonbondedForce* nonbonded = new CustomNonbondedForce("a1*(r-b2)^2");
+    nonbonded->addPerParticleParameter("a");
+    nonbonded->addPerParticleParameter("b");
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    vector<double> params(2);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        params[0] = genrand_real2(sfmt);
+        params[1] = 0.5*genrand_real2(sfmt);
+        nonbonded->addParticle(params);
+        positions[i] = Vec3(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+        if (i%2 == 1)
+            nonbonded->addExclusion(i-1, i);
+    }
+
+    // The first group has atoms that are in both sets, and the expression is not symmetric, so
+    // this checks that every pair is computed once and with the atoms in the right order.
+
+    set<int> set1, set2, set3, set4;
+    for (int i = 0; i < 100; i++)
+        set1.insert(i);
+    for (int i = 50; i < numParticles; i++)
+        set2.insert(i);
+    for (int i = 200; i < 250; i++)
+        set3.insert(i);
+    for (int i = 300; i < numParticles; i++)
+        set4.insert(i);
+    nonbonded->addInteractionGroup(set1, set2);
+    nonbonded->addInteractionGroup(set3, set4);
+    nonbonded->setNonbondedMethod(CustomNonbondedForce::CutoffPeriodic);
+    nonbonded->setCutoffDistance(cutoff);
+    system.addForce(nonbonded);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context(system, integrator1, platform);
+    ReferencePlatform reference;
+    Context referenceContext(system, integrator2, reference);
+
+    // Move the particles a little at a time, so the group neighbor lists sometimes get reused
+    // and sometimes need to be rebuilt.
+
+    for (int step = 0; step < 20; step++) {
+        context.setPositions(positions);
+        referenceContext.setPositions(positions);
+        State state = context.getState(State::Forces | State::Energy);
+        State referenceState = referenceContext.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-4);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(referenceState.getForces()[i], state.getForces()[i], 1e-4);
+        for (int i = 0; i < numParticles; i++)
+            positions[i] += Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5)*0.04;
+    }
+
+    // Every interaction comes from the group lists, so the full neighbor list should never have been built.
+
+    ASSERT_EQUAL("0", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+}
 
 void runPlatformTests() {
+    testInteractionGroupsWithCutoff();
 }
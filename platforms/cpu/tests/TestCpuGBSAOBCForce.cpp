@@ -32,5 +32,53 @@
 #include "CpuTests.h"
 #include "TestGBSAOBCForce.h"
 
+void testExclusionsWithNeighborList() {
+    // The neighbor list omits pairs excluded by the NonbondedForce, but GBSA should still include them.
+
+    const int numMolecules = 300;
+    const double boxSize = 5.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    GBSAOBCForce* gbsa = new GBSAOBCForce();
+    NonbondedForce* nonbonded = new NonbondedForce();
+    gbsa->setNonbondedMethod(GBSAOBCForce::CutoffPeriodic);
+    nonbonded->setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    gbsa->setCutoffDistance(1.2);
+    nonbonded->setCutoffDistance(1.2);
+    vector<Vec3> positions;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        Vec3 pos(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+        for (int j = 0; j < 3; j++) {
+            system.addParticle(1.0);
+            double charge = (j == 0 ? -0.8 : 0.4);
+            gbsa->addParticle(charge, 0.15, 0.8);
+            nonbonded->addParticle(charge, 0.3, 0.5);
+            positions.push_back(pos+Vec3(0.1*j, 0.05*(j%2), 0));
+        }
+        for (int j = 0; j < 3; j++)
+            for (int k = j+1; k < 3; k++)
+                nonbonded->addException(3*i+j, 3*i+k, 0, 1, 0);
+    }
+    system.addForce(gbsa);
+    system.addForce(nonbonded);
+    LangevinIntegrator integrator1(0, 0.1, 0.001);
+    LangevinIntegrator integrator2(0, 0.1, 0.001);
+    ReferencePlatform reference;
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "4";
+    Context context(system, integrator1, platform, properties);
+    Context refContext(system, integrator2, reference);
+    context.setPositions(positions);
+    refContext.setPositions(positions);
+    State state = context.getState(State::Forces | State::Energy);
+    State refState = refContext.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(refState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-4);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        ASSERT_EQUAL_VEC(refState.getForces()[i], state.getForces()[i], 1e-3);
+}
+
 void runPlatformTests() {
+    testExclusionsWithNeighborList();
 }
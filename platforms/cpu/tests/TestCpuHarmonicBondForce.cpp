@@ -0,0 +1,163 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuTests.h"
+#include "TestHarmonicBondForce.h"
+#include "openmm/HarmonicAngleForce.h"
+#include "openmm/PeriodicTorsionForce.h"
+#include "openmm/RBTorsionForce.h"
+#include "sfmt/SFMT.h"
+
+void testParallelComputation() {
+    System system;
+    const int numParticles = 200;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    HarmonicBondForce* force = new HarmonicBondForce();
+    for (int i = 1; i < numParticles; i++)
+        force->addBond(i-1, i, 1.1, i);
+    for (int i = 3; i < numParticles; i += 3)
+        force->addBond(i-3, i, 2.5, 0.5*i);
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i, i%2, 0);
+    VerletIntegrator integrator1(0.01);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+}
+
+void testDoublePrecision() {
+    // Long bonds that are stretched only slightly lose most of their significant digits if the displacement
+    // is rounded to single precision.  The results should match the Reference platform far more closely than
+    // single precision could.
+
+    System system;
+    const int numParticles = 100;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    HarmonicBondForce* force = new HarmonicBondForce();
+    for (int i = 1; i < numParticles; i++)
+        force->addBond(i-1, i, 1.5, 1e5);
+    system.addForce(force);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(1.5*i+1e-5*genrand_real2(sfmt), 1e-5*genrand_real2(sfmt), 0);
+    VerletIntegrator integrator1(0.01);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-10);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-10);
+}
+
+void testConcurrentForces() {
+    // Create a chain with several different bonded forces, so there are many independent
+    // tasks to run at once.
+
+    System system;
+    const int numParticles = 100;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    HarmonicAngleForce* angles = new HarmonicAngleForce();
+    PeriodicTorsionForce* periodic = new PeriodicTorsionForce();
+    RBTorsionForce* rb = new RBTorsionForce();
+    for (int i = 1; i < numParticles; i++)
+        bonds->addBond(i-1, i, 1.0, 100.0);
+    for (int i = 2; i < numParticles; i++)
+        angles->addAngle(i-2, i-1, i, 2.0, 50.0);
+    for (int i = 3; i < numParticles; i++) {
+        periodic->addTorsion(i-3, i-2, i-1, i, 2, M_PI/3, 5.0);
+        rb->addTorsion(i-3, i-2, i-1, i, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6);
+    }
+    system.addForce(bonds);
+    system.addForce(angles);
+    system.addForce(periodic);
+    system.addForce(rb);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i, genrand_real2(sfmt), genrand_real2(sfmt));
+
+    // Compare the results to the Reference platform.
+
+    VerletIntegrator integrator1(0.01);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuConcurrentForces()] = "true";
+    properties[CpuPlatform::CpuThreads()] = "4";
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform, properties);
+    ASSERT_EQUAL("true", platform.getPropertyValue(context2, CpuPlatform::CpuConcurrentForces()));
+    context2.setPositions(positions);
+    for (int repeat = 0; repeat < 2; repeat++) {
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+    }
+
+    // Querying the energy of a single force group should give the right result.
+
+    angles->setForceGroup(1);
+    context1.reinitialize(true);
+    context2.reinitialize(true);
+    ASSERT_EQUAL_TOL(context1.getState(State::Energy, false, 1<<1).getPotentialEnergy(),
+            context2.getState(State::Energy, false, 1<<1).getPotentialEnergy(), 1e-5);
+}
+
+void runPlatformTests() {
+    testParallelComputation();
+    testDoublePrecision();
+    testConcurrentForces();
+}
@@ -31,6 +31,125 @@
 
 #include "CpuTests.h"
 #include "TestLangevinMiddleIntegrator.h"
+#include "CpuRandom.h"
+#include <map>
+#include <sstream>
+#include <string>
+
+void testGaussianRandoms() {
+    // Check the moments of the distribution, and that values can be generated in pieces.
+
+    CpuRandom random;
+    random.initialize(5, 1);
+    const int numIndices = 50000;
+    vector<float> values(4*numIndices);
+    random.getGaussianRandoms(3, 0, numIndices, &values[0]);
+    double mean = 0, var = 0, kurtosis = 0;
+    for (float x : values) {
+        mean += x;
+        var += x*x;
+        kurtosis += x*x*x*x;
+    }
+    int numValues = values.size();
+    mean /= numValues;
+    var = var/numValues-mean*mean;
+    kurtosis /= numValues;
+    ASSERT_EQUAL_TOL(0.0, mean, 0.01);
+    ASSERT_EQUAL_TOL(1.0, var, 0.01);
+    ASSERT_EQUAL_TOL(3.0, kurtosis, 0.05);
+    vector<float> values2(4*numIndices);
+    random.getGaussianRandoms(3, 0, 7, &values2[0]);
+    random.getGaussianRandoms(3, 7, numIndices, &values2[4*7]);
+    for (int i = 0; i < numValues; i++)
+        ASSERT_EQUAL(values[i], values2[i]);
+
+    // Different steps should give different values.
+
+    random.getGaussianRandoms(4, 0, numIndices, &values2[0]);
+    int numSame = 0;
+    for (int i = 0; i < numValues; i++)
+        if (values[i] == values2[i])
+            numSame++;
+    ASSERT(numSame < 10);
+}
+
+void testThreadCountIndependence() {
+    // Free particles feel only the random force, so their trajectories should be identical
+    // regardless of the number of threads.
+
+    const int numParticles = 103;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0+i%3);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i, 0, 0);
+    vector<vector<Vec3> > finalPositions;
+    for (string threads : {"1", "3"}) {
+        LangevinMiddleIntegrator integrator(300.0, 1.0, 0.002);
+        integrator.setRandomNumberSeed(17);
+        map<string, string> properties;
+        properties[CpuPlatform::CpuThreads()] = threads;
+        Context context(system, integrator, platform, properties);
+        context.setPositions(positions);
+        integrator.step(20);
+        finalPositions.push_back(context.getState(State::Positions).getPositions());
+    }
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(finalPositions[0][i], finalPositions[1][i], 1e-10);
+    ASSERT(finalPositions[0][0] != positions[0]);
+}
+
+void testNoiseAfterResettingStepCount() {
+    // Setting the step count back should not replay the same noise, but loading a checkpoint should.
+
+    const int numParticles = 10;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(i, 0, 0);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.002);
+    integrator.setRandomNumberSeed(5);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    context.setVelocitiesToTemperature(300.0, 1);
+    State initial = context.getState(State::Positions | State::Velocities);
+    integrator.step(5);
+    vector<Vec3> first = context.getState(State::Positions).getPositions();
+    context.setState(initial);
+    context.setStepCount(0);
+    integrator.step(5);
+    vector<Vec3> second = context.getState(State::Positions).getPositions();
+    for (int i = 0; i < numParticles; i++)
+        ASSERT(first[i] != second[i]);
+    stringstream checkpoint;
+    context.createCheckpoint(checkpoint);
+    integrator.step(5);
+    vector<Vec3> third = context.getState(State::Positions).getPositions();
+    context.loadCheckpoint(checkpoint);
+    integrator.step(5);
+    vector<Vec3> fourth = context.getState(State::Positions).getPositions();
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(third[i], fourth[i], 1e-10);
+
+    // A checkpoint without the counter, as written by older versions, should be rejected.
+
+    string data = checkpoint.str();
+    stringstream oldCheckpoint(data.substr(0, data.size()-sizeof(int)-sizeof(long long)));
+    bool threwException = false;
+    try {
+        context.loadCheckpoint(oldCheckpoint);
+    }
+    catch (OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
 
 void runPlatformTests() {
+    testGaussianRandoms();
+    testThreadCountIndependence();
+    testNoiseAfterResettingStepCount();
 }
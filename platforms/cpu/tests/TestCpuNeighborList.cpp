@@ -81,6 +81,16 @@ void testNeighborList(bool periodic, bool triclinic) {
     ThreadPool threads;
     CpuNeighborList neighborList(blockSize);
     neighborList.computeNeighborList(numParticles, positions, exclusions, boxVectors, periodic, cutoff, threads);
+
+    // The neighbors identified by sorted index should be the same atoms.
+
+    for (int i = 0; i < neighborList.getNumBlocks(); i++) {
+        const vector<int>& blockNeighbors = neighborList.getBlockNeighbors(i);
+        const vector<int>& sortedNeighbors = neighborList.getBlockSortedNeighbors(i);
+        ASSERT_EQUAL(blockNeighbors.size(), sortedNeighbors.size());
+        for (int j = 0; j < (int) blockNeighbors.size(); j++)
+            ASSERT_EQUAL(blockNeighbors[j], neighborList.getSortedAtoms()[sortedNeighbors[j]]);
+    }
     
     // Convert the neighbor list to a set for faster lookup.
     
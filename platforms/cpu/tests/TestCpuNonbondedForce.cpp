@@ -31,7 +31,686 @@
 
 #include "CpuTests.h"
 #include "TestNonbondedForce.h"
+#include "openmm/HarmonicAngleForce.h"
+#include "openmm/LangevinIntegrator.h"
+#include "openmm/PeriodicTorsionForce.h"
+#include "openmm/internal/ForceImpl.h"
+#include "openmm/internal/NonbondedForceImpl.h"
+#include <sstream>
+#include <thread>
+
+/**
+ * Create a periodic box of particles on a randomly perturbed cubic lattice, with alternating positive and
+ * negative charges and a NonbondedForce that uses a 1 nm cutoff.  Tests can modify the returned force before
+ * creating Contexts.
+ */
+NonbondedForce* createLatticeSystem(System& system, vector<Vec3>& positions, int gridSize, double boxSize, NonbondedForce::NonbondedMethod method, double charge, double mass=1.0) {
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    positions.clear();
+    for (int i = 0; i < gridSize; i++)
+        for (int j = 0; j < gridSize; j++)
+            for (int k = 0; k < gridSize; k++)
+                positions.push_back((Vec3(i, j, k)+Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*0.3)*(boxSize/gridSize));
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    nonbonded->setNonbondedMethod(method);
+    nonbonded->setCutoffDistance(1.0);
+    for (int i = 0; i < positions.size(); i++) {
+        system.addParticle(mass);
+        nonbonded->addParticle(i%2 == 0 ? charge : -charge, 0.2+0.01*(i%5), 0.5);
+    }
+    system.addForce(nonbonded);
+    return nonbonded;
+}
+
+/**
+ * Compute forces and energy at the positions in a State using a Context with the default properties,
+ * and check that they match the ones in the State.
+ */
+void compareToDefaultContext(const System& system, const State& state, double energyTol, double forceTol) {
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(state.getPositions());
+    State expected = context.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(expected.getPotentialEnergy(), state.getPotentialEnergy(), energyTol);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        ASSERT_EQUAL_VEC(expected.getForces()[i], state.getForces()[i], forceTol);
+}
+
+void testNeighborListRebuilds() {
+    // Check that the neighbor list is only rebuilt when particles have moved far enough.
+
+    System system;
+    vector<Vec3> positions;
+    createLatticeSystem(system, positions, 10, 5.0, NonbondedForce::CutoffPeriodic, 0.0);
+    int numParticles = system.getNumParticles();
+    VerletIntegrator integrator(0.001);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "4";
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    context.getState(State::Energy);
+    ASSERT_EQUAL("1", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+
+    // Tiny displacements should not require rebuilding it.
+
+    for (int i = 0; i < numParticles; i++)
+        positions[i][0] += 0.001;
+    context.setPositions(positions);
+    context.getState(State::Energy);
+    ASSERT_EQUAL("1", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+
+    // A large displacement of one particle should.
+
+    positions[0][1] += 1.0;
+    context.setPositions(positions);
+    State state2 = context.getState(State::Energy);
+    ASSERT_EQUAL("2", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+
+    // Make sure the energy still matches the Reference platform.
+
+    VerletIntegrator integrator2(0.001);
+    ReferencePlatform reference;
+    Context context2(system, integrator2, reference);
+    context2.setPositions(positions);
+    ASSERT_EQUAL_TOL(context2.getState(State::Energy).getPotentialEnergy(), state2.getPotentialEnergy(), 1e-4);
+}
+
+void testThreadAffinity() {
+    // Binding threads to cores should not change the results.
+
+    System system;
+    vector<Vec3> positions;
+    createLatticeSystem(system, positions, 8, 4.0, NonbondedForce::CutoffPeriodic, 0.5);
+    int numParticles = system.getNumParticles();
+    VerletIntegrator integrator1(0.001);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "4";
+    Context context1(system, integrator1, platform, properties);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL("none", platform.getPropertyValue(context1, CpuPlatform::CpuThreadAffinity()));
+    for (string affinity : {"compact", "scatter", "0", "1000"}) {
+        properties[CpuPlatform::CpuThreadAffinity()] = affinity;
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform, properties);
+        string value = platform.getPropertyValue(context2, CpuPlatform::CpuThreadAffinity());
+        ASSERT(value == affinity || value == "none");
+
+        // A core the process cannot run on is skipped, so the threads are left unbound.
+
+        if (affinity == "1000")
+            ASSERT_EQUAL("none", value);
+        context2.setPositions(positions);
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
+    }
+
+    // An illegal value should throw an exception.
+
+    properties[CpuPlatform::CpuThreadAffinity()] = "first";
+    VerletIntegrator integrator3(0.001);
+    bool threwException = false;
+    try {
+        Context context3(system, integrator3, platform, properties);
+    }
+    catch (OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testBlockedForceReduction() {
+    // The per-thread force arrays are only summed over the blocks each thread touched.  Make sure
+    // repeated evaluations with different cutoff methods and precisions all give correct forces.
+
+    for (NonbondedForce::NonbondedMethod method : {NonbondedForce::NoCutoff, NonbondedForce::CutoffPeriodic, NonbondedForce::PME}) {
+        System system;
+        vector<Vec3> positions;
+        NonbondedForce* nonbonded = createLatticeSystem(system, positions, 9, 4.0, method, 0.5);
+        int numParticles = system.getNumParticles();
+        for (int i = 1; i < numParticles; i += 2)
+            nonbonded->addException(i-1, i, 0.0, 1.0, 0.0);
+        VerletIntegrator integrator1(0.001);
+        ReferencePlatform reference;
+        Context context1(system, integrator1, reference);
+        context1.setPositions(positions);
+        State state1 = context1.getState(State::Forces);
+        for (string precision : {"single", "mixed", "double"}) {
+            VerletIntegrator integrator2(0.001);
+            map<string, string> properties;
+            properties[CpuPlatform::CpuThreads()] = "4";
+            properties[CpuPlatform::CpuPrecision()] = precision;
+            Context context2(system, integrator2, platform, properties);
+            context2.setPositions(positions);
+            State state2 = context2.getState(State::Forces);
+            for (int i = 0; i < numParticles; i++)
+                ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 5e-3);
+            for (int repeat = 0; repeat < 2; repeat++) {
+                State state3 = context2.getState(State::Forces);
+                for (int i = 0; i < numParticles; i++)
+                    ASSERT_EQUAL_VEC(state2.getForces()[i], state3.getForces()[i], 1e-5);
+            }
+        }
+    }
+}
+
+void testClusterPairKernel() {
+    // The cluster pair kernel should compute the same interactions as the default one.
+
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(1, sfmt);
+    for (NonbondedForce::NonbondedMethod method : {NonbondedForce::CutoffNonPeriodic, NonbondedForce::CutoffPeriodic, NonbondedForce::PME, NonbondedForce::LJPME}) {
+        for (bool triclinic : {false, true}) {
+            if (triclinic && method == NonbondedForce::CutoffNonPeriodic)
+                continue;
+            System system;
+            vector<Vec3> positions;
+            NonbondedForce* nonbonded = createLatticeSystem(system, positions, 8, 3.5, method, 0.5);
+            int numParticles = system.getNumParticles();
+            if (triclinic)
+                system.setDefaultPeriodicBoxVectors(Vec3(3.5, 0, 0), Vec3(0.5, 3.5, 0), Vec3(-0.4, 0.6, 3.5));
+            nonbonded->setUseSwitchingFunction(true);
+            nonbonded->setSwitchingDistance(0.8);
+            for (int i = 0; i < numParticles; i += 7) {
+                double charge, sigma, epsilon;
+                nonbonded->getParticleParameters(i, charge, sigma, epsilon);
+                nonbonded->setParticleParameters(i, charge, sigma, 0.0);
+            }
+            for (int i = 2; i < numParticles; i += 3)
+                nonbonded->addException(i-2, i, 0.0, 1.0, 0.0);
+            map<string, string> properties;
+            properties[CpuPlatform::CpuThreads()] = "3";
+            VerletIntegrator integrator1(0.001);
+            Context context1(system, integrator1, platform, properties);
+            ASSERT_EQUAL("Block", platform.getPropertyValue(context1, CpuPlatform::CpuNonbondedKernel()));
+            properties[CpuPlatform::CpuNonbondedKernel()] = "ClusterPair";
+            VerletIntegrator integrator2(0.001);
+            Context context2(system, integrator2, platform, properties);
+            ASSERT_EQUAL("ClusterPair", platform.getPropertyValue(context2, CpuPlatform::CpuNonbondedKernel()));
+
+            // Compare them, then move the particles far enough to rebuild the neighbor list and compare again.
+
+            vector<Vec3> pos = positions;
+            for (int iteration = 0; iteration < 2; iteration++) {
+                context1.setPositions(pos);
+                context2.setPositions(pos);
+                State state1 = context1.getState(State::Forces | State::Energy);
+                State state2 = context2.getState(State::Forces | State::Energy);
+                ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+                for (int i = 0; i < numParticles; i++)
+                    ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+                for (int i = 0; i < numParticles; i++)
+                    pos[i] += Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5)*0.4;
+            }
+        }
+    }
+
+    // An illegal value should throw an exception.
+
+    System system;
+    system.addParticle(1.0);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuNonbondedKernel()] = "Pairs";
+    VerletIntegrator integrator(0.001);
+    bool threwException = false;
+    try {
+        Context context(system, integrator, platform, properties);
+    }
+    catch (OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testPrecision() {
+    // Compute forces with each precision mode and compare them to the Reference platform.  Mixed precision
+    // should be closer to it than single precision, and double precision should match it almost exactly.
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce* nonbonded = createLatticeSystem(system, positions, 9, 3.5, NonbondedForce::CutoffPeriodic, 0.5);
+    int numParticles = system.getNumParticles();
+
+    // Round the positions to single precision so the Reference platform sees the same ones.  With a long
+    // cutoff and charges of the same sign, each atom has many neighbors whose forces do not cancel, so the
+    // error from summing them is large enough to measure.
+
+    for (Vec3& p : positions)
+        p = Vec3((float) p[0], (float) p[1], (float) p[2]);
+    nonbonded->setCutoffDistance(1.6);
+    for (int i = 0; i < numParticles; i++)
+        nonbonded->setParticleParameters(i, 0.5, 0.2+0.01*(i%5), i%7 == 0 ? 0.0 : 0.5);
+    for (int i = 2; i < numParticles; i += 3)
+        nonbonded->addException(i-2, i, 0.0, 1.0, 0.0);
+    ReferencePlatform reference;
+    VerletIntegrator referenceIntegrator(0.001);
+    Context referenceContext(system, referenceIntegrator, reference);
+    referenceContext.setPositions(positions);
+    State referenceState = referenceContext.getState(State::Forces | State::Energy);
+    for (string kernel : {"Block", "ClusterPair"}) {
+        map<string, double> forceError;
+        for (string precision : {"single", "mixed", "double"}) {
+            map<string, string> properties;
+            properties[CpuPlatform::CpuThreads()] = "3";
+            properties[CpuPlatform::CpuNonbondedKernel()] = kernel;
+            properties[CpuPlatform::CpuPrecision()] = precision;
+            VerletIntegrator integrator(0.001);
+            Context context(system, integrator, platform, properties);
+            ASSERT_EQUAL(precision, platform.getPropertyValue(context, CpuPlatform::CpuPrecision()));
+            context.setPositions(positions);
+            State state = context.getState(State::Forces | State::Energy);
+            double tol = (precision == "double" ? 1e-10 : 1e-4);
+            ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), state.getPotentialEnergy(), tol/10);
+            double error = 0.0;
+            for (int i = 0; i < numParticles; i++) {
+                ASSERT_EQUAL_VEC(referenceState.getForces()[i], state.getForces()[i], tol);
+                Vec3 delta = referenceState.getForces()[i]-state.getForces()[i];
+                error += delta.dot(delta);
+            }
+            forceError[precision] = sqrt(error/numParticles);
+        }
+        ASSERT(forceError["mixed"] < forceError["single"]);
+        ASSERT(forceError["double"] < forceError["mixed"]);
+    }
+
+    // An illegal value should throw an exception.
+
+    System system2;
+    system2.addParticle(1.0);
+    for (string precision : {"quadruple"}) {
+        map<string, string> properties;
+        properties[CpuPlatform::CpuPrecision()] = precision;
+        VerletIntegrator integrator(0.001);
+        bool threwException = false;
+        try {
+            Context context(system2, integrator, platform, properties);
+        }
+        catch (OpenMMException& ex) {
+            threwException = true;
+        }
+        ASSERT(threwException);
+    }
+}
+
+void testDoublePrecision() {
+    // In double precision mode, every nonbonded method should match the Reference platform to far better
+    // than single precision accuracy, including exceptions, switching, and deterministic force summation.
+
+    for (NonbondedForce::NonbondedMethod method : {NonbondedForce::NoCutoff, NonbondedForce::CutoffNonPeriodic, NonbondedForce::Ewald, NonbondedForce::PME, NonbondedForce::LJPME}) {
+        for (string deterministic : {"false", "true"}) {
+            System system;
+            vector<Vec3> positions;
+            NonbondedForce* nonbonded = createLatticeSystem(system, positions, 6, 3.0, method, 0.5);
+            int numParticles = system.getNumParticles();
+            if (method == NonbondedForce::CutoffNonPeriodic) {
+                nonbonded->setUseSwitchingFunction(true);
+                nonbonded->setSwitchingDistance(0.8);
+            }
+            for (int i = 1; i < numParticles; i += 2)
+                nonbonded->addException(i-1, i, 0.1, 0.2, 0.3);
+            VerletIntegrator integrator1(0.001);
+            ReferencePlatform reference;
+            Context context1(system, integrator1, reference);
+            context1.setPositions(positions);
+            State state1 = context1.getState(State::Forces | State::Energy);
+            map<string, string> properties;
+            properties[CpuPlatform::CpuThreads()] = "3";
+            properties[CpuPlatform::CpuPrecision()] = "double";
+            properties[CpuPlatform::CpuDeterministicForces()] = deterministic;
+            VerletIntegrator integrator2(0.001);
+            Context context2(system, integrator2, platform, properties);
+            context2.setPositions(positions);
+            State state2 = context2.getState(State::Forces | State::Energy);
+            ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-10);
+            for (int i = 0; i < numParticles; i++)
+                ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-8);
+        }
+    }
+}
+
+void testDeterministicForces() {
+    // With DeterministicForces set, forces, energies, and trajectories should be bitwise identical
+    // no matter how many threads are used.
+
+    for (NonbondedForce::NonbondedMethod method : {NonbondedForce::NoCutoff, NonbondedForce::CutoffPeriodic, NonbondedForce::PME}) {
+        System system;
+        vector<Vec3> positions;
+        NonbondedForce* nonbonded = createLatticeSystem(system, positions, 8, 3.2, method, 0.5);
+        int numParticles = system.getNumParticles();
+        HarmonicBondForce* bonds = new HarmonicBondForce();
+        HarmonicAngleForce* angles = new HarmonicAngleForce();
+        PeriodicTorsionForce* torsions = new PeriodicTorsionForce();
+        for (int i = 0; i < numParticles-3; i += 4) {
+            bonds->addBond(i, i+1, 0.4, 1000.0);
+            bonds->addBond(i+1, i+2, 0.4, 1000.0);
+            bonds->addBond(i+2, i+3, 0.4, 1000.0);
+            angles->addAngle(i, i+1, i+2, 2.0, 100.0);
+            angles->addAngle(i+1, i+2, i+3, 2.0, 100.0);
+            torsions->addTorsion(i, i+1, i+2, i+3, 3, 0.5, 5.0);
+            nonbonded->addException(i, i+1, 0.0, 1.0, 0.0);
+            nonbonded->addException(i+1, i+2, 0.0, 1.0, 0.0);
+            nonbonded->addException(i+2, i+3, 0.0, 1.0, 0.0);
+            nonbonded->addException(i, i+2, 0.0, 1.0, 0.0);
+            nonbonded->addException(i+1, i+3, 0.0, 1.0, 0.0);
+            nonbonded->addException(i, i+3, 0.25, 0.3, 0.2);
+        }
+        system.addForce(bonds);
+        system.addForce(angles);
+        system.addForce(torsions);
+        State expected;
+        for (int numThreads = 1; numThreads <= 4; numThreads++) {
+            map<string, string> properties;
+            stringstream threads;
+            threads << numThreads;
+            properties[CpuPlatform::CpuThreads()] = threads.str();
+            properties[CpuPlatform::CpuDeterministicForces()] = "true";
+            VerletIntegrator integrator(0.001);
+            Context context(system, integrator, platform, properties);
+            context.setPositions(positions);
+            integrator.step(10);
+            State state = context.getState(State::Positions | State::Forces | State::Energy);
+            if (numThreads == 1) {
+                expected = state;
+                continue;
+            }
+            ASSERT(expected.getPotentialEnergy() == state.getPotentialEnergy());
+            for (int i = 0; i < numParticles; i++) {
+                ASSERT(expected.getForces()[i] == state.getForces()[i]);
+                ASSERT(expected.getPositions()[i] == state.getPositions()[i]);
+            }
+        }
+    }
+}
+
+void testSharedThreadPool() {
+    // Several Contexts that share a ThreadPool and are integrated at the same time from different
+    // threads should produce the same trajectory as a Context with its own pool.
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce* nonbonded = createLatticeSystem(system, positions, 6, 2.4, NonbondedForce::CutoffPeriodic, 0.5);
+    int numParticles = system.getNumParticles();
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    for (int i = 0; i < numParticles-1; i += 2) {
+        bonds->addBond(i, i+1, 0.4, 1000.0);
+        nonbonded->addException(i, i+1, 0.0, 1.0, 0.0);
+    }
+    system.addForce(bonds);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "3";
+    properties[CpuPlatform::CpuDeterministicForces()] = "true";
+    const int numSteps = 20;
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform, properties);
+    ASSERT_EQUAL("false", platform.getPropertyValue(context, CpuPlatform::CpuSharedThreadPool()));
+    context.setPositions(positions);
+    integrator.step(numSteps);
+    State expected = context.getState(State::Positions);
+    properties[CpuPlatform::CpuSharedThreadPool()] = "true";
+    const int numContexts = 3;
+    vector<VerletIntegrator*> integrators;
+    vector<Context*> contexts;
+    for (int i = 0; i < numContexts; i++) {
+        integrators.push_back(new VerletIntegrator(0.001));
+        contexts.push_back(new Context(system, *integrators[i], platform, properties));
+        ASSERT_EQUAL("true", platform.getPropertyValue(*contexts[i], CpuPlatform::CpuSharedThreadPool()));
+        contexts[i]->setPositions(positions);
+    }
+    vector<thread> runners;
+    for (int i = 0; i < numContexts; i++)
+        runners.push_back(thread([&, i] () { integrators[i]->step(numSteps); }));
+    for (thread& t : runners)
+        t.join();
+    for (int i = 0; i < numContexts; i++) {
+        State state = contexts[i]->getState(State::Positions);
+        for (int j = 0; j < numParticles; j++)
+            ASSERT(expected.getPositions()[j] == state.getPositions()[j]);
+        delete contexts[i];
+        delete integrators[i];
+    }
+}
+
+void testPmeThreads() {
+    // Compute PME forces with reciprocal space on separate threads and make sure they match the
+    // results when it runs after direct space.
+
+    System system;
+    vector<Vec3> positions;
+    createLatticeSystem(system, positions, 8, 3.0, NonbondedForce::PME, 0.5);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "3";
+    for (string pmeThreads : {"0", "1", "2"}) {
+        properties[CpuPlatform::CpuPmeThreads()] = pmeThreads;
+        VerletIntegrator integrator(0.001);
+        Context context(system, integrator, platform, properties);
+        ASSERT_EQUAL("3", platform.getPropertyValue(context, CpuPlatform::CpuThreads()));
+        ASSERT_EQUAL(pmeThreads, platform.getPropertyValue(context, CpuPlatform::CpuPmeThreads()));
+        context.setPositions(positions);
+        compareToDefaultContext(system, context.getState(State::Positions | State::Forces | State::Energy), 1e-5, 1e-4);
+    }
+
+    // Split pools are never shared, since two Contexts that split their threads differently could deadlock.
+
+    properties[CpuPlatform::CpuPmeThreads()] = "1";
+    properties[CpuPlatform::CpuSharedThreadPool()] = "true";
+    VerletIntegrator integrator(0.001);
+    {
+        Context context(system, integrator, platform, properties);
+        ASSERT_EQUAL("false", platform.getPropertyValue(context, CpuPlatform::CpuSharedThreadPool()));
+    }
+
+    // It must leave at least one thread for direct space.
+
+    properties.erase(CpuPlatform::CpuSharedThreadPool());
+    properties[CpuPlatform::CpuPmeThreads()] = "3";
+    bool threwException = false;
+    try {
+        Context context(system, integrator, platform, properties);
+    }
+    catch (OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testPmeTuning() {
+    // Let the tuner pick PME parameters, then make sure the forces still agree with the default parameters.
+
+    const double boxSize = 3.1;
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce* nonbonded = createLatticeSystem(system, positions, 8, boxSize, NonbondedForce::PME, 0.5, 10.0);
+    double alpha;
+    int nx, ny, nz;
+    NonbondedForceImpl::calcPMEParameters(system, *nonbonded, alpha, nx, ny, nz, false);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuPmeTuning()] = "true";
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    context.setVelocitiesToTemperature(300.0);
+    integrator.step(100);
+    double tunedAlpha;
+    int tunedX, tunedY, tunedZ;
+    nonbonded->getPMEParametersInContext(context, tunedAlpha, tunedX, tunedY, tunedZ);
+
+    // A coarser grid may be paired with a different alpha, but the estimated error must stay within the tolerance.
+
+    double tolerance = nonbonded->getEwaldErrorTolerance();
+    double directError = 0.5*exp(-tunedAlpha*tunedAlpha*1.0*1.0);
+    double reciprocalError = pow(2*tunedAlpha*boxSize/(3*min(tunedX, min(tunedY, tunedZ))), 5.0);
+    ASSERT(directError+reciprocalError <= 2*tolerance);
+    stringstream expected;
+    expected << "alpha=" << tunedAlpha << " grid=" << tunedX << "x" << tunedY << "x" << tunedZ << " padding=";
+    string parameters = platform.getPropertyValue(context, CpuPlatform::CpuPmeParameters());
+    ASSERT_EQUAL(expected.str(), parameters.substr(0, expected.str().size()));
+    ASSERT_EQUAL("true", platform.getPropertyValue(context, CpuPlatform::CpuPmeTuning()));
+    compareToDefaultContext(system, context.getState(State::Positions | State::Forces | State::Energy), 1e-4, 5e-3);
+
+    // Tuning is disabled when deterministic forces are requested, so the default parameters are kept.
+
+    properties[CpuPlatform::CpuDeterministicForces()] = "true";
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform, properties);
+    context2.setPositions(positions);
+    integrator2.step(100);
+    double deterministicAlpha;
+    int deterministicX, deterministicY, deterministicZ;
+    nonbonded->getPMEParametersInContext(context2, deterministicAlpha, deterministicX, deterministicY, deterministicZ);
+    ASSERT_EQUAL_TOL(alpha, deterministicAlpha, 1e-10);
+    ASSERT_EQUAL(nx, deterministicX);
+    ASSERT_EQUAL(ny, deterministicY);
+    ASSERT_EQUAL(nz, deterministicZ);
+}
+
+/**
+ * A Force that does no work of its own, but replaces the measured time to build and to process the neighbor list,
+ * so the choice of padding does not depend on how fast the machine is.  It must be added after the NonbondedForce.
+ */
+class NeighborListTimingForce : public Force {
+public:
+    NeighborListTimingForce(double buildTime, double pairTime) : buildTime(buildTime), pairTime(pairTime) {
+    }
+    double buildTime, pairTime;
+protected:
+    ForceImpl* createImpl() const;
+};
+
+class NeighborListTimingForceImpl : public ForceImpl {
+public:
+    NeighborListTimingForceImpl(const NeighborListTimingForce& owner) : owner(owner) {
+    }
+    void initialize(ContextImpl& context) {
+    }
+    const Force& getOwner() const {
+        return owner;
+    }
+    double calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
+        CpuPlatform::PlatformData& data = CpuPlatform::getPlatformData(context);
+        data.neighborListBuildTime = owner.buildTime;
+        data.neighborListPairTime = owner.pairTime;
+        return 0.0;
+    }
+    map<string, double> getDefaultParameters() {
+        return map<string, double>();
+    }
+    vector<string> getKernelNames() {
+        return vector<string>();
+    }
+private:
+    const NeighborListTimingForce& owner;
+};
+
+ForceImpl* NeighborListTimingForce::createImpl() const {
+    return new NeighborListTimingForceImpl(*this);
+}
+
+void testAdaptivePadding() {
+    // When building the neighbor list is expensive compared to processing it, the padding should grow so it is
+    // rebuilt less often.  When processing it dominates, the padding should shrink.  In either case it only
+    // changes gradually, and the forces should be unaffected.
+
+    for (bool expensiveBuild : {true, false}) {
+        System system;
+        vector<Vec3> positions;
+        createLatticeSystem(system, positions, 6, 3.0, NonbondedForce::CutoffPeriodic, 0.2);
+        system.addForce(expensiveBuild ? new NeighborListTimingForce(1.0, 1e-6) : new NeighborListTimingForce(1e-9, 1.0));
+        map<string, string> properties;
+        properties[CpuPlatform::CpuAdaptivePadding()] = "true";
+        VerletIntegrator integrator(0.001);
+        Context context(system, integrator, platform, properties);
+        ASSERT_EQUAL("true", platform.getPropertyValue(context, CpuPlatform::CpuAdaptivePadding()));
+        context.setPositions(positions);
+        context.getState(State::Energy);
+        ASSERT_EQUAL("1", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+        double padding = stod(platform.getPropertyValue(context, CpuPlatform::CpuNeighborListPadding()));
+
+        // Let the list last for ten evaluations, then translate every particle far enough to force a rebuild.
+
+        for (int i = 1; i < 10; i++)
+            context.getState(State::Energy);
+        ASSERT_EQUAL("1", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+        for (Vec3& p : positions)
+            p += Vec3(1.0, 0, 0);
+        context.setPositions(positions);
+        State state = context.getState(State::Positions | State::Forces | State::Energy);
+        ASSERT_EQUAL("2", platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds()));
+        double newPadding = stod(platform.getPropertyValue(context, CpuPlatform::CpuNeighborListPadding()));
+        ASSERT_EQUAL_TOL(expensiveBuild ? 1.25*padding : 0.8*padding, newPadding, 1e-4);
+        compareToDefaultContext(system, state, 1e-5, 1e-4);
+    }
+}
+
+void testConcurrentNeighborList() {
+    // Simulate a hot fluid while building the neighbor list in the background, and check that the forces match
+    // the ones computed with a list built in the usual way.  With PME, reciprocal space is computed while the list
+    // is being built.
+
+    for (NonbondedForce::NonbondedMethod method : {NonbondedForce::CutoffPeriodic, NonbondedForce::PME}) {
+        for (string affinity : {"none", "compact"}) {
+            System system;
+            vector<Vec3> positions;
+            NonbondedForce* nonbonded = createLatticeSystem(system, positions, 8, 3.1, method, 0.2, 10.0);
+            int numParticles = system.getNumParticles();
+            HarmonicBondForce* bonds = new HarmonicBondForce();
+            for (int i = 1; i < numParticles; i += 2) {
+                bonds->addBond(i-1, i, 0.3, 1000.0);
+                nonbonded->addException(i-1, i, 0.0, 1.0, 0.0);
+            }
+            system.addForce(bonds);
+            map<string, string> properties;
+            properties[CpuPlatform::CpuThreads()] = "4";
+            properties[CpuPlatform::CpuThreadAffinity()] = affinity;
+            properties[CpuPlatform::CpuConcurrentNeighborList()] = "true";
+            properties[CpuPlatform::CpuSharedThreadPool()] = "true";
+            VerletIntegrator integrator(0.002);
+            Context context(system, integrator, platform, properties);
+            ASSERT_EQUAL("true", platform.getPropertyValue(context, CpuPlatform::CpuConcurrentNeighborList()));
+
+            // The builder's threads come out of the ones requested, and the Context does not use the shared pool.
+
+            ASSERT_EQUAL("4", platform.getPropertyValue(context, CpuPlatform::CpuThreads()));
+            ASSERT_EQUAL("false", platform.getPropertyValue(context, CpuPlatform::CpuSharedThreadPool()));
+            context.setPositions(positions);
+            context.setVelocitiesToTemperature(1000.0);
+            integrator.step(200);
+            ASSERT(stoi(platform.getPropertyValue(context, CpuPlatform::CpuNeighborListRebuilds())) > 2);
+            compareToDefaultContext(system, context.getState(State::Positions | State::Forces | State::Energy), 1e-5, 1e-4);
+        }
+    }
+
+    // With only one thread there is none left to build the list on, so it is built in the usual way.
+
+    System system;
+    vector<Vec3> positions;
+    createLatticeSystem(system, positions, 6, 3.0, NonbondedForce::CutoffPeriodic, 0.2);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "1";
+    properties[CpuPlatform::CpuConcurrentNeighborList()] = "true";
+    VerletIntegrator integrator(0.002);
+    Context context(system, integrator, platform, properties);
+    ASSERT_EQUAL("false", platform.getPropertyValue(context, CpuPlatform::CpuConcurrentNeighborList()));
+    ASSERT_EQUAL("1", platform.getPropertyValue(context, CpuPlatform::CpuThreads()));
+    context.setPositions(positions);
+    compareToDefaultContext(system, context.getState(State::Positions | State::Forces | State::Energy), 1e-5, 1e-4);
+}
 
 void runPlatformTests() {
     testHugeSystem();
+    testNeighborListRebuilds();
+    testThreadAffinity();
+    testBlockedForceReduction();
+    testClusterPairKernel();
+    testPrecision();
+    testDoublePrecision();
+    testDeterministicForces();
+    testSharedThreadPool();
+    testPmeThreads();
+    testPmeTuning();
+    testAdaptivePadding();
+    testConcurrentNeighborList();
 }
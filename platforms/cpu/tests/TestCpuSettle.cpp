@@ -31,6 +31,63 @@
 
 #include "CpuTests.h"
 #include "TestSettle.h"
+#include "CpuSETTLE.h"
+#include "openmm/internal/ThreadPool.h"
+
+void testMatchesReference() {
+    // Compare the vectorized blocks to the reference implementation for a number of clusters that does not fill
+    // the last group.
+
+    const int numMolecules = 37;
+    System system;
+    vector<int> atom1, atom2, atom3;
+    vector<double> distance1, distance2, masses, inverseMasses;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions, newPositions, velocities;
+    for (int i = 0; i < numMolecules; i++) {
+        double m[] = {16.0, 1.008, 1.008};
+        for (int j = 0; j < 3; j++) {
+            system.addParticle(m[j]);
+            masses.push_back(m[j]);
+            inverseMasses.push_back(1/m[j]);
+        }
+        atom1.push_back(3*i);
+        atom2.push_back(3*i+1);
+        atom3.push_back(3*i+2);
+        distance1.push_back(0.1);
+        distance2.push_back(0.1633);
+        Vec3 center((i%4)*0.4, (i/4)*0.4, (i/16)*0.4);
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.1, 0, 0));
+        positions.push_back(center+Vec3(-0.03333, 0.09428, 0));
+        for (int j = 0; j < 3; j++) {
+            newPositions.push_back(positions[3*i+j]+Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5)*0.01);
+            velocities.push_back(Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5));
+        }
+    }
+    ReferenceSETTLEAlgorithm reference(atom1, atom2, atom3, distance1, distance2, masses);
+    for (int numThreads : {1, 3}) {
+        ThreadPool threads(numThreads);
+        CpuSETTLE settle(system, reference, threads);
+        vector<Vec3> expectedPositions = newPositions, cpuPositions = newPositions;
+        reference.apply(positions, expectedPositions, inverseMasses, 1e-5);
+        settle.apply(positions, cpuPositions, inverseMasses, 1e-5);
+        vector<Vec3> expectedVelocities = velocities, cpuVelocities = velocities;
+        reference.applyToVelocities(expectedPositions, expectedVelocities, inverseMasses, 1e-5);
+        settle.applyToVelocities(expectedPositions, cpuVelocities, inverseMasses, 1e-5);
+        for (int i = 0; i < system.getNumParticles(); i++) {
+            ASSERT_EQUAL_VEC(expectedPositions[i], cpuPositions[i], 1e-10);
+            ASSERT_EQUAL_VEC(expectedVelocities[i], cpuVelocities[i], 1e-10);
+        }
+        for (int i = 0; i < numMolecules; i++) {
+            ASSERT_EQUAL_TOL(0.1, sqrt((cpuPositions[3*i+1]-cpuPositions[3*i]).dot(cpuPositions[3*i+1]-cpuPositions[3*i])), 1e-6);
+            ASSERT_EQUAL_TOL(0.1, sqrt((cpuPositions[3*i+2]-cpuPositions[3*i]).dot(cpuPositions[3*i+2]-cpuPositions[3*i])), 1e-6);
+            ASSERT_EQUAL_TOL(0.1633, sqrt((cpuPositions[3*i+2]-cpuPositions[3*i+1]).dot(cpuPositions[3*i+2]-cpuPositions[3*i+1])), 1e-6);
+        }
+    }
+}
 
 void runPlatformTests() {
+    testMatchesReference();
 }
@@ -0,0 +1,112 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuTests.h"
+#include "TestVerletIntegrator.h"
+
+void testParallelConstraints() {
+    // Build a system with constrained chains (handled by CCMA) and rigid waters (handled by SETTLE),
+    // and compare it to the Reference platform.
+
+    const int numChains = 10;
+    const int chainLength = 8;
+    const int numWaters = 50;
+    System system;
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    vector<Vec3> positions;
+    for (int i = 0; i < numChains; i++) {
+        int first = system.getNumParticles();
+        for (int j = 0; j < chainLength; j++) {
+            system.addParticle(j%2 == 0 ? 12.0 : 1.0);
+            positions.push_back(Vec3(0.15*j, 0.05*(j%2), 0.5*i));
+            if (j > 0)
+                system.addConstraint(first+j-1, first+j, 0.15);
+            if (j > 1)
+                bonds->addBond(first+j-2, first+j, 0.25, 100.0);
+        }
+    }
+    for (int i = 0; i < numWaters; i++) {
+        int first = system.getNumParticles();
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        Vec3 center(2.0+0.3*(i%5), 0.3*((i/5)%5), 0.3*(i/25));
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.1, 0, 0));
+        positions.push_back(center+Vec3(-0.0333, 0.0943, 0));
+        system.addConstraint(first, first+1, 0.1);
+        system.addConstraint(first, first+2, 0.1);
+        system.addConstraint(first+1, first+2, 0.1633);
+    }
+    system.addForce(bonds);
+    int numParticles = system.getNumParticles();
+    vector<Vec3> velocities(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++)
+        velocities[i] = Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    integrator1.setConstraintTolerance(1e-6);
+    integrator2.setConstraintTolerance(1e-6);
+    ReferencePlatform reference;
+    Context context1(system, integrator1, reference);
+    map<string, string> properties;
+    properties[CpuPlatform::CpuThreads()] = "4";
+    Context context2(system, integrator2, platform, properties);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    context1.applyConstraints(1e-6);
+    context2.applyConstraints(1e-6);
+    context1.setVelocities(velocities);
+    context2.setVelocities(velocities);
+    context1.applyVelocityConstraints(1e-6);
+    context2.applyVelocityConstraints(1e-6);
+    integrator1.step(20);
+    integrator2.step(20);
+    State state1 = context1.getState(State::Positions | State::Velocities);
+    State state2 = context2.getState(State::Positions | State::Velocities);
+    for (int i = 0; i < numParticles; i++) {
+        ASSERT_EQUAL_VEC(state1.getPositions()[i], state2.getPositions()[i], 1e-5);
+        ASSERT_EQUAL_VEC(state1.getVelocities()[i], state2.getVelocities()[i], 1e-4);
+    }
+    for (int i = 0; i < system.getNumConstraints(); i++) {
+        int p1, p2;
+        double distance;
+        system.getConstraintParameters(i, p1, p2, distance);
+        Vec3 delta = state2.getPositions()[p1]-state2.getPositions()[p2];
+        ASSERT_EQUAL_TOL(distance, sqrt(delta.dot(delta)), 2e-5);
+    }
+}
+
+void runPlatformTests() {
+    testParallelConstraints();
+}
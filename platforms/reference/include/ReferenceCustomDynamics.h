@@ -40,7 +40,7 @@
 namespace OpenMM {
 
 class ReferenceCustomDynamics : public ReferenceDynamics {
-private:
+protected:
 
     class DerivFunction;
     const OpenMM::CustomIntegrator& integrator;
@@ -62,11 +62,11 @@ private:
     std::vector<int> perDofVariableIndex, stepVariableIndex;
     std::vector<double> perDofVariable;
 
-    void initialize(OpenMM::ContextImpl& context, std::vector<double>& masses, std::map<std::string, double>& globals);
+    virtual void initialize(OpenMM::ContextImpl& context, std::vector<double>& masses, std::map<std::string, double>& globals);
     
     Lepton::ExpressionTreeNode replaceDerivFunctions(const Lepton::ExpressionTreeNode& node, OpenMM::ContextImpl& context);
     
-    void computePerDof(int numberOfAtoms, std::vector<OpenMM::Vec3>& results, const std::vector<OpenMM::Vec3>& atomCoordinates,
+    virtual void computePerDof(int numberOfAtoms, std::vector<OpenMM::Vec3>& results, const std::vector<OpenMM::Vec3>& atomCoordinates,
                   const std::vector<OpenMM::Vec3>& velocities, const std::vector<OpenMM::Vec3>& forces, const std::vector<double>& masses,
                   const std::vector<std::vector<OpenMM::Vec3> >& perDof, const Lepton::CompiledExpression& expression);
     
@@ -74,6 +74,7 @@ private:
                   const std::vector<OpenMM::Vec3>& velocities, const std::vector<OpenMM::Vec3>& forces, const std::vector<double>& masses,
                   const std::vector<std::vector<OpenMM::Vec3> >& perDof, const std::map<std::string, double>& globals, const VectorExpression& expression);
     
+    virtual double computeSum(int numberOfAtoms, const std::vector<OpenMM::Vec3>& values, const std::vector<double>& masses);
     void recordChangedParameters(OpenMM::ContextImpl& context, std::map<std::string, double>& globals);
 
     bool evaluateCondition(int step);
@@ -156,6 +156,30 @@ class ReferenceCustomHbondIxn : public ReferenceBondIxn {
                             std::vector<std::set<int> >& exclusions, const std::map<std::string, double>& globalParameters,
                             std::vector<OpenMM::Vec3>& forces, double* totalEnergy) const;
 
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the interactions between one donor and a list of candidate acceptors.  This
+         allows callers to select the acceptors with a spatial search and to divide donors
+         between threads, each of which should use its own ReferenceCustomHbondIxn.
+
+         @param donor              the index of the donor
+         @param acceptors          the indices of the acceptors to consider
+         @param atomCoordinates    atom coordinates
+         @param donorParameters    donor parameters values       donorParameters[donorIndex][parameterIndex]
+         @param acceptorParameters acceptor parameters values    acceptorParameters[acceptorIndex][parameterIndex]
+         @param exclusions         the acceptors that are excluded from interacting with this donor
+         @param variables          the values of variables that may appear in expressions.  On input
+                                   this should contain the values of all global parameters.
+         @param forces             force array (forces added)
+         @param totalEnergy        total energy
+
+         --------------------------------------------------------------------------------------- */
+
+      void calculateDonorIxn(int donor, const std::vector<int>& acceptors, std::vector<OpenMM::Vec3>& atomCoordinates,
+                             std::vector<std::vector<double> >& donorParameters, std::vector<std::vector<double> >& acceptorParameters,
+                             const std::set<int>& exclusions, std::map<std::string, double>& variables,
+                             std::vector<OpenMM::Vec3>& forces, double* totalEnergy) const;
+
 // ---------------------------------------------------------------------------------------
 
 };
@@ -303,10 +303,7 @@ void ReferenceCustomDynamics::update(ContextImpl& context, int numberOfAtoms, ve
                     computePerParticle(numberOfAtoms, sumBuffer, atomCoordinates, velocities, stepForces, masses, perDof, globals, stepVectorExpressions[step][0]);
                 else
                     computePerDof(numberOfAtoms, sumBuffer, atomCoordinates, velocities, stepForces, masses, perDof, stepExpressions[step][0]);
-                double sum = 0.0;
-                for (int j = 0; j < numberOfAtoms; j++)
-                    if (masses[j] != 0.0)
-                        sum += sumBuffer[j][0]+sumBuffer[j][1]+sumBuffer[j][2];
+                double sum = computeSum(numberOfAtoms, sumBuffer, masses);
                 globals[stepVariable[step]] = sum;
                 expressionSet.setVariable(stepVariableIndex[step], sum);
                 break;
@@ -405,6 +402,14 @@ void ReferenceCustomDynamics::computePerParticle(int numberOfAtoms, vector<Vec3>
     }
 }
 
+double ReferenceCustomDynamics::computeSum(int numberOfAtoms, const vector<Vec3>& values, const vector<double>& masses) {
+    double sum = 0.0;
+    for (int j = 0; j < numberOfAtoms; j++)
+        if (masses[j] != 0.0)
+            sum += values[j][0]+values[j][1]+values[j][2];
+    return sum;
+}
+
 bool ReferenceCustomDynamics::evaluateCondition(int step) {
     uniform = SimTKOpenMMUtilities::getUniformlyDistributedRandomNumber();
     gaussian = SimTKOpenMMUtilities::getNormallyDistributedRandomNumber();
@@ -464,9 +469,5 @@ double ReferenceCustomDynamics::computeKineticEnergy(OpenMM::ContextImpl& contex
     for (auto& global : globals)
         expressionSet.setVariable(expressionSet.getVariableIndex(global.first), global.second);
     computePerDof(numberOfAtoms, sumBuffer, atomCoordinates, velocities, forces, masses, perDof, kineticEnergyExpression);
-    double sum = 0.0;
-    for (int j = 0; j < numberOfAtoms; j++)
-        if (masses[j] != 0.0)
-            sum += sumBuffer[j][0]+sumBuffer[j][1]+sumBuffer[j][2];
-    return sum;
+    return computeSum(numberOfAtoms, sumBuffer, masses);
 }
@@ -145,6 +145,21 @@ void ReferenceCustomHbondIxn::calculatePairIxn(vector<Vec3>& atomCoordinates, ve
    }
 }
 
+void ReferenceCustomHbondIxn::calculateDonorIxn(int donor, const vector<int>& acceptors, vector<Vec3>& atomCoordinates,
+                                                vector<vector<double> >& donorParameters, vector<vector<double> >& acceptorParameters,
+                                                const set<int>& exclusions, map<string, double>& variables,
+                                                vector<Vec3>& forces, double* totalEnergy) const {
+   for (int j = 0; j < (int) donorParamNames.size(); j++)
+       variables[donorParamNames[j]] = donorParameters[donor][j];
+   for (int acceptor : acceptors) {
+      if (exclusions.find(acceptor) == exclusions.end()) {
+          for (int j = 0; j < (int) acceptorParamNames.size(); j++)
+              variables[acceptorParamNames[j]] = acceptorParameters[acceptor][j];
+          calculateOneIxn(donor, acceptor, atomCoordinates, variables, forces, totalEnergy);
+      }
+   }
+}
+
   /**---------------------------------------------------------------------------------------
 
      Calculate custom interaction between a donor and an acceptor
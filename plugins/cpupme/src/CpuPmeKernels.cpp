@@ -48,8 +48,10 @@ using namespace std;
 
 static const int PME_ORDER = 5;
 
-bool CpuCalcDispersionPmeReciprocalForceKernel::hasInitializedThreads = false;
-int CpuCalcDispersionPmeReciprocalForceKernel::numThreads = 0;
+// In deterministic mode the work is always divided into this many pieces, so the result does not depend
+// on the number of threads.
+static const int DETERMINISTIC_PARTITIONS = 16;
+
 
 static void spreadCharge(float* posq, float* grid, int gridx, int gridy, int gridz, int numParticles, Vec3* periodicBoxVectors, Vec3* recipBoxVectors,
         atomic<int>& atomicCounter, const float epsilonFactor, int threadIndex, int numThreads, bool deterministic) {
@@ -417,22 +419,96 @@ static void interpolateForces(float* posq, float* force, float* grid, int gridx,
     }
 }
 
-static void* threadBody(void* args) {
-    CpuCalcPmeReciprocalForceKernel& owner = *reinterpret_cast<CpuCalcPmeReciprocalForceKernel*>(args);
-    owner.runMainThread();
-    return 0;
+
+/**
+ * Add a task that does nothing, but completes once all of a set of other tasks have completed.
+ */
+static int addBarrier(ThreadPool::TaskGraph& graph, const vector<int>& dependencies) {
+    return graph.addTask([] (ThreadPool& threads, int threadIndex) {}, dependencies);
 }
 
-void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize, int numParticles, double alpha, bool deterministic) {
-    if (!hasInitializedThreads) {
-        numThreads = getNumProcessors();
-        char* threadsEnv = getenv("OPENMM_CPU_THREADS");
-        if (threadsEnv != NULL)
-            stringstream(threadsEnv) >> numThreads;
-        fftwf_init_threads();
-        hasInitializedThreads = true;
+/**
+ * Create a ThreadPool for a kernel whose platform did not provide one.
+ */
+static shared_ptr<ThreadPool> createDefaultThreadPool() {
+    int numThreads = getNumProcessors();
+    char* threadsEnv = getenv("OPENMM_CPU_THREADS");
+    if (threadsEnv != NULL)
+        stringstream(threadsEnv) >> numThreads;
+    return make_shared<ThreadPool>(numThreads);
+}
+
+CpuPmeFFT::CpuPmeFFT() {
+}
+
+CpuPmeFFT::~CpuPmeFFT() {
+    for (fftwf_plan plan : forwardSlabs)
+        fftwf_destroy_plan(plan);
+    for (fftwf_plan plan : backwardSlabs)
+        fftwf_destroy_plan(plan);
+    for (fftwf_plan plan : forwardColumns)
+        fftwf_destroy_plan(plan);
+    for (fftwf_plan plan : backwardColumns)
+        fftwf_destroy_plan(plan);
+}
+
+void CpuPmeFFT::initialize(int gridx, int gridy, int gridz, float* realGrid, fftwf_complex* complexGrid, int numGroups, bool deterministic) {
+    // FFTW_MEASURE may pick different algorithms each time it is run, which would change the rounding error.
+
+    unsigned int flags = (deterministic ? FFTW_ESTIMATE : FFTW_MEASURE);
+    int slabSize[] = {gridy, gridz};
+    int columnSize[] = {gridx};
+    int realSlab = gridy*gridz;
+    int numColumns = gridy*(gridz/2+1);
+    for (int i = 0; i < numGroups; i++) {
+        int start = (i*gridx)/numGroups;
+        int end = ((i+1)*gridx)/numGroups;
+        if (start == end)
+            continue;
+        float* real = realGrid+start*realSlab;
+        fftwf_complex* complex = complexGrid+start*numColumns;
+        forwardSlabs.push_back(fftwf_plan_many_dft_r2c(2, slabSize, end-start, real, NULL, 1, realSlab, complex, NULL, 1, numColumns, flags));
+        backwardSlabs.push_back(fftwf_plan_many_dft_c2r(2, slabSize, end-start, complex, NULL, 1, numColumns, real, NULL, 1, realSlab, flags));
+    }
+
+    // Each column runs along the x axis, so consecutive elements are a whole slab apart.
+
+    for (int i = 0; i < numGroups; i++) {
+        int start = (i*numColumns)/numGroups;
+        int end = ((i+1)*numColumns)/numGroups;
+        if (start == end)
+            continue;
+        fftwf_complex* complex = complexGrid+start;
+        forwardColumns.push_back(fftwf_plan_many_dft(1, columnSize, end-start, complex, NULL, numColumns, 1, complex, NULL, numColumns, 1, FFTW_FORWARD, flags));
+        backwardColumns.push_back(fftwf_plan_many_dft(1, columnSize, end-start, complex, NULL, numColumns, 1, complex, NULL, numColumns, 1, FFTW_BACKWARD, flags));
     }
-    threadEnergy.resize(numThreads);
+}
+
+int CpuPmeFFT::addForwardTasks(ThreadPool::TaskGraph& graph, const vector<int>& dependencies) {
+    vector<int> slabTasks, columnTasks;
+    for (fftwf_plan plan : forwardSlabs)
+        slabTasks.push_back(graph.addTask([plan] (ThreadPool& threads, int threadIndex) { fftwf_execute(plan); }, dependencies));
+    int slabsDone = addBarrier(graph, slabTasks);
+    for (fftwf_plan plan : forwardColumns)
+        columnTasks.push_back(graph.addTask([plan] (ThreadPool& threads, int threadIndex) { fftwf_execute(plan); }, vector<int>(1, slabsDone)));
+    return addBarrier(graph, columnTasks);
+}
+
+int CpuPmeFFT::addBackwardTasks(ThreadPool::TaskGraph& graph, const vector<int>& dependencies) {
+    vector<int> slabTasks, columnTasks;
+    for (fftwf_plan plan : backwardColumns)
+        columnTasks.push_back(graph.addTask([plan] (ThreadPool& threads, int threadIndex) { fftwf_execute(plan); }, dependencies));
+    int columnsDone = addBarrier(graph, columnTasks);
+    for (fftwf_plan plan : backwardSlabs)
+        slabTasks.push_back(graph.addTask([plan] (ThreadPool& threads, int threadIndex) { fftwf_execute(plan); }, vector<int>(1, columnsDone)));
+    return addBarrier(graph, slabTasks);
+}
+
+void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize, int numParticles, double alpha, bool deterministic) {
+    if (!threads)
+        threads = createDefaultThreadPool();
+    numPartitions = (deterministic ? DETERMINISTIC_PARTITIONS : threads->getNumThreads());
+    partitionEnergy.resize(numPartitions);
     gridx = findFFTDimension(xsize, false);
     gridy = findFFTDimension(ysize, false);
     gridz = findFFTDimension(zsize, true);
@@ -442,31 +518,13 @@ void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize
     force.resize(4*numParticles);
     recipEterm.resize(gridx*gridy*gridz);
     
-    // Initialize threads.
-    
-    isFinished = false;
-    pthread_cond_init(&startCondition, NULL);
-    pthread_cond_init(&endCondition, NULL);
-    pthread_mutex_init(&lock, NULL);
-    pthread_create(&mainThread, NULL, threadBody, this);
-    
-    // Wait until the main thread is up and running.
+// Initialize FFTW.
     
-    pthread_mutex_lock(&lock);
-    while (!isFinished)
-        pthread_cond_wait(&endCondition, &lock);
-    pthread_mutex_unlock(&lock);
-    
-    // Initialize FFTW.
-    
-    for (int i = 0; i < numThreads; i++)
+    for (int i = 0; i < numPartitions; i++)
         tempGrid.push_back((float*) fftwf_malloc(sizeof(float)*(gridx*gridy*gridz+3)));
     realGrid = tempGrid[0];
     complexGrid = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*gridx*gridy*(gridz/2+1));
-    fftwf_plan_with_nthreads(numThreads);
-    forwardFFT = fftwf_plan_dft_r2c_3d(gridx, gridy, gridz, realGrid, complexGrid, FFTW_MEASURE);
-    backwardFFT = fftwf_plan_dft_c2r_3d(gridx, gridy, gridz, complexGrid, realGrid, FFTW_MEASURE);
-    hasCreatedPlan = true;
+    fft.initialize(gridx, gridy, gridz, realGrid, complexGrid, numPartitions, deterministic);
     
     // Initialize the b-spline moduli.
 
@@ -522,103 +580,78 @@ void CpuCalcPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize
             if (moduli[i] < 1.0e-7f)
                 moduli[i] = (moduli[(i-1+ndata)%ndata]+moduli[(i+1)%ndata])*0.5f;
     }
+    createTaskGraph();
 }
 
 CpuCalcPmeReciprocalForceKernel::~CpuCalcPmeReciprocalForceKernel() {
-    isDeleted = true;
-    pthread_mutex_lock(&lock);
-    pthread_cond_broadcast(&startCondition);
-    pthread_mutex_unlock(&lock);
-    pthread_join(mainThread, NULL);
-    pthread_mutex_destroy(&lock);
-    pthread_cond_destroy(&startCondition);
-    pthread_cond_destroy(&endCondition);
     for (auto grid : tempGrid)
         fftwf_free(grid);
     if (complexGrid != NULL)
         fftwf_free(complexGrid);
-    if (hasCreatedPlan) {
-        fftwf_destroy_plan(forwardFFT);
-        fftwf_destroy_plan(backwardFFT);
-    }
 }
 
-void CpuCalcPmeReciprocalForceKernel::runMainThread() {
-    // This is the main thread that coordinates all the other ones.
+void CpuCalcPmeReciprocalForceKernel::createTaskGraph() {
+    const float epsilonFactor = sqrt(ONE_4PI_EPS0);
+    int gridSize = (gridx*gridy*gridz+3)/4;
+    int complexSize = gridx*gridy*(gridz/2+1);
 
-    pthread_mutex_lock(&lock);
-    isFinished = true;
-    pthread_cond_signal(&endCondition);
-    ThreadPool threads(numThreads);
-    while (true) {
-        // Wait for the signal to start.
+    // Spread the charges onto a separate grid for each partition, then sum them.  The reciprocal
+    // scale factors only depend on the box, so they can be computed at the same time.
 
-        pthread_cond_wait(&startCondition, &lock);
-        if (isDeleted)
-            break;
+    int loadPositions = graph.addTask([this] (ThreadPool& threads, int threadIndex) {
         posq = io->getPosq();
-        atomicCounter = 0;
-        threads.execute([&] (ThreadPool& threads, int threadIndex) { runWorkerThread(threads, threadIndex); }); // Signal threads to perform charge spreading.
-        threads.waitForThreads();
-        threads.resumeThreads(); // Signal threads to sum the charge grids.
-        threads.waitForThreads();
-        fftwf_execute_dft_r2c(forwardFFT, realGrid, complexGrid);
-        if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
-            threads.resumeThreads(); // Signal threads to compute the reciprocal scale factors.
-            threads.waitForThreads();
-        }
-        if (includeEnergy) {
-            threads.resumeThreads(); // Signal threads to compute energy.
-            threads.waitForThreads();
-            for (auto e : threadEnergy)
-                energy += e;
-        }
-        threads.resumeThreads(); // Signal threads to perform reciprocal convolution.
-        threads.waitForThreads();
-        fftwf_execute_dft_c2r(backwardFFT, complexGrid, realGrid);
-        atomicCounter = 0;
-        threads.resumeThreads(); // Signal threads to interpolate forces.
-        threads.waitForThreads();
-        isFinished = true;
-        lastBoxVectors[0] = periodicBoxVectors[0];
-        lastBoxVectors[1] = periodicBoxVectors[1];
-        lastBoxVectors[2] = periodicBoxVectors[2];
-        pthread_cond_signal(&endCondition);
+    });
+    vector<int> spreadTasks, etermTasks, sumTasks, energyTasks, convolutionTasks;
+    for (int i = 0; i < numPartitions; i++) {
+        spreadTasks.push_back(graph.addTask([this, i, epsilonFactor] (ThreadPool& threads, int threadIndex) {
+            spreadCharge(posq, tempGrid[i], gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, spreadCounter, epsilonFactor, i, numPartitions, deterministic);
+        }, vector<int>(1, loadPositions)));
+        etermTasks.push_back(graph.addTask([this, i] (ThreadPool& threads, int threadIndex) {
+            if (boxChanged)
+                computeReciprocalEterm((i*gridx)/numPartitions, ((i+1)*gridx)/numPartitions, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
+        }));
+    }
+    int spreadDone = addBarrier(graph, spreadTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        sumTasks.push_back(graph.addTask([this, i, gridSize] (ThreadPool& threads, int threadIndex) {
+            int gridStart = 4*((i*gridSize)/numPartitions);
+            int gridEnd = 4*(((i+1)*gridSize)/numPartitions);
+            for (int j = gridStart; j < gridEnd; j += 4) {
+                fvec4 sum(&realGrid[j]);
+                for (int k = 1; k < numPartitions; k++)
+                    sum += fvec4(&tempGrid[k][j]);
+                sum.store(&realGrid[j]);
+            }
+        }, vector<int>(1, spreadDone)));
     }
-    pthread_mutex_unlock(&lock);
-}
 
-void CpuCalcPmeReciprocalForceKernel::runWorkerThread(ThreadPool& threads, int index) {
-    int gridxStart = (index*gridx)/numThreads;
-    int gridxEnd = ((index+1)*gridx)/numThreads;
-    int gridSize = (gridx*gridy*gridz+3)/4;
-    int gridStart = 4*((index*gridSize)/numThreads);
-    int gridEnd = 4*(((index+1)*gridSize)/numThreads);
-    int complexSize = gridx*gridy*(gridz/2+1);
-    int complexStart = std::max(1, ((index*complexSize)/numThreads));
-    int complexEnd = (((index+1)*complexSize)/numThreads);
-    const float epsilonFactor = sqrt(ONE_4PI_EPS0);
-    spreadCharge(posq, tempGrid[index], gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, atomicCounter, epsilonFactor, index, numThreads, deterministic);
-    threads.syncThreads();
-    int numGrids = tempGrid.size();
-    for (int i = gridStart; i < gridEnd; i += 4) {
-        fvec4 sum(&realGrid[i]);
-        for (int j = 1; j < numGrids; j++)
-            sum += fvec4(&tempGrid[j][i]);
-        sum.store(&realGrid[i]);
+    // Transform the grid, compute the energy, and perform the convolution.
+
+    etermTasks.push_back(fft.addForwardTasks(graph, vector<int>(1, addBarrier(graph, sumTasks))));
+    int forwardDone = addBarrier(graph, etermTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        energyTasks.push_back(graph.addTask([this, i] (ThreadPool& threads, int threadIndex) {
+            if (includeEnergy)
+                partitionEnergy[i] = reciprocalEnergy((i*gridx)/numPartitions, ((i+1)*gridx)/numPartitions, complexGrid, recipEterm, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
+        }, vector<int>(1, forwardDone)));
     }
-    threads.syncThreads();
-    if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
-        computeReciprocalEterm(gridxStart, gridxEnd, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-        threads.syncThreads();
+    int energyDone = addBarrier(graph, energyTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        convolutionTasks.push_back(graph.addTask([this, i, complexSize] (ThreadPool& threads, int threadIndex) {
+            int complexStart = max(1, (i*complexSize)/numPartitions);
+            int complexEnd = ((i+1)*complexSize)/numPartitions;
+            reciprocalConvolution(complexStart, complexEnd, complexGrid, recipEterm);
+        }, vector<int>(1, energyDone)));
     }
-    if (includeEnergy) {
-        threadEnergy[index] = reciprocalEnergy(gridxStart, gridxEnd, complexGrid, recipEterm, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-        threads.syncThreads();
+
+    // Transform back and interpolate the forces.
+
+    int backwardDone = fft.addBackwardTasks(graph, vector<int>(1, addBarrier(graph, convolutionTasks)));
+    for (int i = 0; i < numPartitions; i++) {
+        graph.addTask([this, epsilonFactor] (ThreadPool& threads, int threadIndex) {
+            interpolateForces(posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, interpolateCounter, epsilonFactor, numPartitions);
+        }, vector<int>(1, backwardDone));
     }
-    reciprocalConvolution(complexStart, complexEnd, complexGrid, recipEterm);
-    threads.syncThreads();
-    interpolateForces(posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, atomicCounter, epsilonFactor, numThreads);
 }
 
 void CpuCalcPmeReciprocalForceKernel::beginComputation(IO& io, const Vec3* periodicBoxVectors, bool includeEnergy) {
@@ -627,7 +660,7 @@ void CpuCalcPmeReciprocalForceKernel::beginComputation(IO& io, const Vec3* perio
     this->periodicBoxVectors[1] = periodicBoxVectors[1];
     this->periodicBoxVectors[2] = periodicBoxVectors[2];
     this->includeEnergy = includeEnergy;
-    energy = 0.0;
+    boxChanged = (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]);
 
     // Invert the box vectors.
 
@@ -637,24 +670,27 @@ void CpuCalcPmeReciprocalForceKernel::beginComputation(IO& io, const Vec3* perio
     recipBoxVectors[1] = Vec3(-periodicBoxVectors[1][0]*periodicBoxVectors[2][2], periodicBoxVectors[0][0]*periodicBoxVectors[2][2], 0)*scale;
     recipBoxVectors[2] = Vec3(periodicBoxVectors[1][0]*periodicBoxVectors[2][1]-periodicBoxVectors[1][1]*periodicBoxVectors[2][0], -periodicBoxVectors[0][0]*periodicBoxVectors[2][1], periodicBoxVectors[0][0]*periodicBoxVectors[1][1])*scale;
 
-    // Do the calculation.
+    // Start the calculation.  It runs in the background until finishComputation() is called.
 
-    pthread_mutex_lock(&lock);
-    isFinished = false;
-    pthread_cond_signal(&startCondition);
-    pthread_mutex_unlock(&lock);
+    spreadCounter = 0;
+    interpolateCounter = 0;
+    threads->execute(graph);
 }
 
 double CpuCalcPmeReciprocalForceKernel::finishComputation(IO& io) {
-    pthread_mutex_lock(&lock);
-    while (!isFinished) {
-        pthread_cond_wait(&endCondition, &lock);
-    }
-    pthread_mutex_unlock(&lock);
+    threads->waitForThreads();
+    double energy = 0.0;
+    if (includeEnergy)
+        for (double e : partitionEnergy)
+            energy += e;
+    lastBoxVectors[0] = periodicBoxVectors[0];
+    lastBoxVectors[1] = periodicBoxVectors[1];
+    lastBoxVectors[2] = periodicBoxVectors[2];
     io.setForce(&force[0]);
     return energy;
 }
 
+
 bool CpuCalcPmeReciprocalForceKernel::isProcessorSupported() {
     return isVec4Supported();
 }
@@ -693,37 +729,11 @@ int CpuCalcPmeReciprocalForceKernel::findFFTDimension(int minimum, bool isZ) {
  * Everything below here is just a clone of the above, but to handle the dispersion term
  * instead of electrostatics.
  */
-
-bool CpuCalcPmeReciprocalForceKernel::hasInitializedThreads = false;
-int CpuCalcPmeReciprocalForceKernel::numThreads = 0;
-
-
-class CpuCalcDispersionPmeReciprocalForceKernel::ComputeTask : public ThreadPool::Task {
-public:
-    ComputeTask(CpuCalcDispersionPmeReciprocalForceKernel& owner) : owner(owner) {
-    }
-    void execute(ThreadPool& threads, int threadIndex) {
-        owner.runWorkerThread(threads, threadIndex);
-    }
-    CpuCalcDispersionPmeReciprocalForceKernel& owner;
-};
-
-static void* dispersionThreadBody(void* args) {
-    CpuCalcDispersionPmeReciprocalForceKernel& owner = *reinterpret_cast<CpuCalcDispersionPmeReciprocalForceKernel*>(args);
-    owner.runMainThread();
-    return 0;
-}
-
 void CpuCalcDispersionPmeReciprocalForceKernel::initialize(int xsize, int ysize, int zsize, int numParticles, double alpha, bool deterministic) {
-    if (!hasInitializedThreads) {
-        numThreads = getNumProcessors();
-        char* threadsEnv = getenv("OPENMM_CPU_THREADS");
-        if (threadsEnv != NULL)
-            stringstream(threadsEnv) >> numThreads;
-        fftwf_init_threads();
-        hasInitializedThreads = true;
-    }
-    threadEnergy.resize(numThreads);
+    if (!threads)
+        threads = createDefaultThreadPool();
+    numPartitions = (deterministic ? DETERMINISTIC_PARTITIONS : threads->getNumThreads());
+    partitionEnergy.resize(numPartitions);
     gridx = findFFTDimension(xsize, false);
     gridy = findFFTDimension(ysize, false);
     gridz = findFFTDimension(zsize, true);
@@ -733,31 +743,13 @@ void CpuCalcDispersionPmeReciprocalForceKernel::initialize(int xsize, int ysize,
     force.resize(4*numParticles);
     recipEterm.resize(gridx*gridy*gridz);
     
-    // Initialize threads.
-    
-    isFinished = false;
-    pthread_cond_init(&startCondition, NULL);
-    pthread_cond_init(&endCondition, NULL);
-    pthread_mutex_init(&lock, NULL);
-    pthread_create(&mainThread, NULL, dispersionThreadBody, this);
-    
-    // Wait until the main thread is up and running.
-    
-    pthread_mutex_lock(&lock);
-    while (!isFinished)
-        pthread_cond_wait(&endCondition, &lock);
-    pthread_mutex_unlock(&lock);
-    
-    // Initialize FFTW.
+// Initialize FFTW.
     
-    for (int i = 0; i < numThreads; i++)
+    for (int i = 0; i < numPartitions; i++)
         tempGrid.push_back((float*) fftwf_malloc(sizeof(float)*(gridx*gridy*gridz+3)));
     realGrid = tempGrid[0];
     complexGrid = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*gridx*gridy*(gridz/2+1));
-    fftwf_plan_with_nthreads(numThreads);
-    forwardFFT = fftwf_plan_dft_r2c_3d(gridx, gridy, gridz, realGrid, complexGrid, FFTW_MEASURE);
-    backwardFFT = fftwf_plan_dft_c2r_3d(gridx, gridy, gridz, complexGrid, realGrid, FFTW_MEASURE);
-    hasCreatedPlan = true;
+    fft.initialize(gridx, gridy, gridz, realGrid, complexGrid, numPartitions, deterministic);
     
     // Initialize the b-spline moduli.
 
@@ -813,106 +805,78 @@ void CpuCalcDispersionPmeReciprocalForceKernel::initialize(int xsize, int ysize,
             if (moduli[i] < 1.0e-7f)
                 moduli[i] = (moduli[i-1]+moduli[i+1])*0.5f;
     }
+    createTaskGraph();
 }
 
 CpuCalcDispersionPmeReciprocalForceKernel::~CpuCalcDispersionPmeReciprocalForceKernel() {
-    isDeleted = true;
-    pthread_mutex_lock(&lock);
-    pthread_cond_broadcast(&startCondition);
-    pthread_mutex_unlock(&lock);
-    pthread_join(mainThread, NULL);
-    pthread_mutex_destroy(&lock);
-    pthread_cond_destroy(&startCondition);
-    pthread_cond_destroy(&endCondition);
     for (auto grid : tempGrid)
         fftwf_free(grid);
     if (complexGrid != NULL)
         fftwf_free(complexGrid);
-    if (hasCreatedPlan) {
-        fftwf_destroy_plan(forwardFFT);
-        fftwf_destroy_plan(backwardFFT);
-    }
 }
 
-void CpuCalcDispersionPmeReciprocalForceKernel::runMainThread() {
-    // This is the main thread that coordinates all the other ones.
+void CpuCalcDispersionPmeReciprocalForceKernel::createTaskGraph() {
+    const float epsilonFactor = 1.0f;
+    int gridSize = (gridx*gridy*gridz+3)/4;
+    int complexSize = gridx*gridy*(gridz/2+1);
 
-    pthread_mutex_lock(&lock);
-    isFinished = true;
-    pthread_cond_signal(&endCondition);
-    ThreadPool threads(numThreads);
-    while (true) {
-        // Wait for the signal to start.
+    // Spread the charges onto a separate grid for each partition, then sum them.  The reciprocal
+    // scale factors only depend on the box, so they can be computed at the same time.
 
-        pthread_cond_wait(&startCondition, &lock);
-        if (isDeleted)
-            break;
+    int loadPositions = graph.addTask([this] (ThreadPool& threads, int threadIndex) {
         posq = io->getPosq();
-        ComputeTask task(*this);
-        atomicCounter = 0;
-        threads.execute(task); // Signal threads to perform charge spreading.
-        threads.waitForThreads();
-        threads.resumeThreads(); // Signal threads to sum the charge grids.
-        threads.waitForThreads();
-        fftwf_execute_dft_r2c(forwardFFT, realGrid, complexGrid);
-        if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
-            threads.resumeThreads(); // Signal threads to compute the reciprocal scale factors.
-            threads.waitForThreads();
-        }
-        if (includeEnergy) {
-            threads.resumeThreads(); // Signal threads to compute energy.
-            threads.waitForThreads();
-            for (auto e : threadEnergy)
-                energy += e;
-        }
-        threads.resumeThreads(); // Signal threads to perform reciprocal convolution.
-        threads.waitForThreads();
-        fftwf_execute_dft_c2r(backwardFFT, complexGrid, realGrid);
-        atomicCounter = 0;
-        threads.resumeThreads(); // Signal threads to interpolate forces.
-        threads.waitForThreads();
-        isFinished = true;
-        lastBoxVectors[0] = periodicBoxVectors[0];
-        lastBoxVectors[1] = periodicBoxVectors[1];
-        lastBoxVectors[2] = periodicBoxVectors[2];
-        pthread_cond_signal(&endCondition);
+    });
+    vector<int> spreadTasks, etermTasks, sumTasks, energyTasks, convolutionTasks;
+    for (int i = 0; i < numPartitions; i++) {
+        spreadTasks.push_back(graph.addTask([this, i, epsilonFactor] (ThreadPool& threads, int threadIndex) {
+            spreadCharge(posq, tempGrid[i], gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, spreadCounter, epsilonFactor, i, numPartitions, deterministic);
+        }, vector<int>(1, loadPositions)));
+        etermTasks.push_back(graph.addTask([this, i] (ThreadPool& threads, int threadIndex) {
+            if (boxChanged)
+                computeReciprocalDispersionEterm((i*gridx)/numPartitions, ((i+1)*gridx)/numPartitions, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
+        }));
+    }
+    int spreadDone = addBarrier(graph, spreadTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        sumTasks.push_back(graph.addTask([this, i, gridSize] (ThreadPool& threads, int threadIndex) {
+            int gridStart = 4*((i*gridSize)/numPartitions);
+            int gridEnd = 4*(((i+1)*gridSize)/numPartitions);
+            for (int j = gridStart; j < gridEnd; j += 4) {
+                fvec4 sum(&realGrid[j]);
+                for (int k = 1; k < numPartitions; k++)
+                    sum += fvec4(&tempGrid[k][j]);
+                sum.store(&realGrid[j]);
+            }
+        }, vector<int>(1, spreadDone)));
     }
-    pthread_mutex_unlock(&lock);
-}
 
-void CpuCalcDispersionPmeReciprocalForceKernel::runWorkerThread(ThreadPool& threads, int index) {
-    int gridxStart = (index*gridx)/numThreads;
-    int gridxEnd = ((index+1)*gridx)/numThreads;
-    int gridSize = (gridx*gridy*gridz+3)/4;
-    int gridStart = 4*((index*gridSize)/numThreads);
-    int gridEnd = 4*(((index+1)*gridSize)/numThreads);
-    int complexSize = gridx*gridy*(gridz/2+1);
-    int complexStart = std::max(1, ((index*complexSize)/numThreads));
-    int complexEnd = (((index+1)*complexSize)/numThreads);
-    const float epsilonFactor = 1.0f;
-    spreadCharge(posq, tempGrid[index], gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, atomicCounter, epsilonFactor, index, numThreads, deterministic);
-    threads.syncThreads();
-    int numGrids = tempGrid.size();
-    for (int i = gridStart; i < gridEnd; i += 4) {
-        fvec4 sum(&realGrid[i]);
-        for (int j = 1; j < numGrids; j++)
-            sum += fvec4(&tempGrid[j][i]);
-        sum.store(&realGrid[i]);
+    // Transform the grid, compute the energy, and perform the convolution.
+
+    etermTasks.push_back(fft.addForwardTasks(graph, vector<int>(1, addBarrier(graph, sumTasks))));
+    int forwardDone = addBarrier(graph, etermTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        energyTasks.push_back(graph.addTask([this, i] (ThreadPool& threads, int threadIndex) {
+            if (includeEnergy)
+                partitionEnergy[i] = reciprocalDispersionEnergy((i*gridx)/numPartitions, ((i+1)*gridx)/numPartitions, complexGrid, recipEterm, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
+        }, vector<int>(1, forwardDone)));
     }
-    threads.syncThreads();
-    if (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]) {
-        computeReciprocalDispersionEterm(gridxStart, gridxEnd, gridx, gridy, gridz, recipEterm, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-        threads.syncThreads();
+    int energyDone = addBarrier(graph, energyTasks);
+    for (int i = 0; i < numPartitions; i++) {
+        convolutionTasks.push_back(graph.addTask([this, i, complexSize] (ThreadPool& threads, int threadIndex) {
+            int complexStart = (i*complexSize)/numPartitions;
+            int complexEnd = ((i+1)*complexSize)/numPartitions;
+            reciprocalConvolution(complexStart, complexEnd, complexGrid, recipEterm);
+        }, vector<int>(1, energyDone)));
     }
-    if (includeEnergy) {
-        threadEnergy[index] = reciprocalDispersionEnergy(gridxStart, gridxEnd, complexGrid, recipEterm, gridx, gridy, gridz, alpha, bsplineModuli, periodicBoxVectors, recipBoxVectors);
-        threads.syncThreads();
+
+    // Transform back and interpolate the forces.
+
+    int backwardDone = fft.addBackwardTasks(graph, vector<int>(1, addBarrier(graph, convolutionTasks)));
+    for (int i = 0; i < numPartitions; i++) {
+        graph.addTask([this, epsilonFactor] (ThreadPool& threads, int threadIndex) {
+            interpolateForces(posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, interpolateCounter, epsilonFactor, numPartitions);
+        }, vector<int>(1, backwardDone));
     }
-    // For dispersion, we include the {0,0,0} term, so the start point needs to be redefined
-    complexStart = (index*complexSize)/numThreads;
-    reciprocalConvolution(complexStart, complexEnd, complexGrid, recipEterm);
-    threads.syncThreads();
-    interpolateForces(posq, &force[0], realGrid, gridx, gridy, gridz, numParticles, periodicBoxVectors, recipBoxVectors, atomicCounter, epsilonFactor, numThreads);
 }
 
 void CpuCalcDispersionPmeReciprocalForceKernel::beginComputation(CalcPmeReciprocalForceKernel::IO& io, const Vec3* periodicBoxVectors, bool includeEnergy) {
@@ -921,7 +885,7 @@ void CpuCalcDispersionPmeReciprocalForceKernel::beginComputation(CalcPmeReciproc
     this->periodicBoxVectors[1] = periodicBoxVectors[1];
     this->periodicBoxVectors[2] = periodicBoxVectors[2];
     this->includeEnergy = includeEnergy;
-    energy = 0.0;
+    boxChanged = (lastBoxVectors[0] != periodicBoxVectors[0] || lastBoxVectors[1] != periodicBoxVectors[1] || lastBoxVectors[2] != periodicBoxVectors[2]);
 
     // Invert the box vectors.
 
@@ -931,24 +895,27 @@ void CpuCalcDispersionPmeReciprocalForceKernel::beginComputation(CalcPmeReciproc
     recipBoxVectors[1] = Vec3(-periodicBoxVectors[1][0]*periodicBoxVectors[2][2], periodicBoxVectors[0][0]*periodicBoxVectors[2][2], 0)*scale;
     recipBoxVectors[2] = Vec3(periodicBoxVectors[1][0]*periodicBoxVectors[2][1]-periodicBoxVectors[1][1]*periodicBoxVectors[2][0], -periodicBoxVectors[0][0]*periodicBoxVectors[2][1], periodicBoxVectors[0][0]*periodicBoxVectors[1][1])*scale;
 
-    // Do the calculation.
+    // Start the calculation.  It runs in the background until finishComputation() is called.
 
-    pthread_mutex_lock(&lock);
-    isFinished = false;
-    pthread_cond_signal(&startCondition);
-    pthread_mutex_unlock(&lock);
+    spreadCounter = 0;
+    interpolateCounter = 0;
+    threads->execute(graph);
 }
 
 double CpuCalcDispersionPmeReciprocalForceKernel::finishComputation(CalcPmeReciprocalForceKernel::IO& io) {
-    pthread_mutex_lock(&lock);
-    while (!isFinished) {
-        pthread_cond_wait(&endCondition, &lock);
-    }
-    pthread_mutex_unlock(&lock);
+    threads->waitForThreads();
+    double energy = 0.0;
+    if (includeEnergy)
+        for (double e : partitionEnergy)
+            energy += e;
+    lastBoxVectors[0] = periodicBoxVectors[0];
+    lastBoxVectors[1] = periodicBoxVectors[1];
+    lastBoxVectors[2] = periodicBoxVectors[2];
     io.setForce(&force[0]);
     return energy;
 }
 
+
 bool CpuCalcDispersionPmeReciprocalForceKernel::isProcessorSupported() {
     return isVec4Supported();
 }
@@ -39,20 +39,71 @@
 #include "openmm/internal/ThreadPool.h"
 #include <atomic>
 #include <fftw3.h>
-#include <pthread.h>
+#include <memory>
 #include <vector>
 
 namespace OpenMM {
 
+/**
+ * This class performs the 3D FFTs for the CPU PME kernels as tasks in a ThreadPool::TaskGraph, so they can
+ * run on the same threads as the rest of the calculation.  The forward transform is done as 2D transforms of
+ * groups of slabs at constant x, followed by 1D transforms along x of groups of columns.  The backward
+ * transform does the same steps in reverse order.
+ */
+
+class CpuPmeFFT {
+public:
+    CpuPmeFFT();
+    ~CpuPmeFFT();
+    /**
+     * Create the FFTW plans.
+     *
+     * @param gridx          the x size of the grid
+     * @param gridy          the y size of the grid
+     * @param gridz          the z size of the grid
+     * @param realGrid       the real space grid, of size gridx*gridy*gridz
+     * @param complexGrid    the reciprocal space grid, of size gridx*gridy*(gridz/2+1)
+     * @param numGroups      the number of groups to divide the slabs and columns into
+     * @param deterministic  if true, plans are chosen without timing them so that every run gives identical results
+     */
+    void initialize(int gridx, int gridy, int gridz, float* realGrid, fftwf_complex* complexGrid, int numGroups, bool deterministic);
+    /**
+     * Add tasks to a graph that transform the real grid into the complex grid.
+     *
+     * @param graph         the graph to add the tasks to
+     * @param dependencies  tasks that must complete before the transform begins
+     * @return the index of a task that completes when the transform is finished
+     */
+    int addForwardTasks(ThreadPool::TaskGraph& graph, const std::vector<int>& dependencies);
+    /**
+     * Add tasks to a graph that transform the complex grid into the real grid.  This overwrites the complex grid.
+     *
+     * @param graph         the graph to add the tasks to
+     * @param dependencies  tasks that must complete before the transform begins
+     * @return the index of a task that completes when the transform is finished
+     */
+    int addBackwardTasks(ThreadPool::TaskGraph& graph, const std::vector<int>& dependencies);
+private:
+    std::vector<fftwf_plan> forwardSlabs, backwardSlabs, forwardColumns, backwardColumns;
+};
+
 /**
  * This is an optimized CPU implementation of CalcPmeReciprocalForceKernel.  It is both
- * vectorized (requiring SSE 4.1) and multithreaded.  It uses FFTW to perform the FFTs.
+ * vectorized (requiring SSE 4.1) and multithreaded.  It uses FFTW to perform the FFTs.  Every
+ * step of the calculation, including the FFTs, is a task in a ThreadPool::TaskGraph, so it can run
+ * on a ThreadPool provided by the platform.
  */
 
 class OPENMM_EXPORT_PME CpuCalcPmeReciprocalForceKernel : public CalcPmeReciprocalForceKernel {
 public:
     CpuCalcPmeReciprocalForceKernel(const std::string& name, const Platform& platform) : CalcPmeReciprocalForceKernel(name, platform),
-            hasCreatedPlan(false), isDeleted(false), realGrid(NULL), complexGrid(NULL) {
+            realGrid(NULL), complexGrid(NULL) {
+    }
+    /**
+     * Set the ThreadPool to run on.  If this is not called before initialize(), the kernel creates its own.
+     */
+    void setThreadPool(std::shared_ptr<ThreadPool> threads) {
+        this->threads = threads;
     }
     /**
      * Initialize the kernel.
@@ -81,14 +132,6 @@ public:
      * @return the potential energy due to the PME reciprocal space interactions
      */
     double finishComputation(IO& io);
-    /**
-     * This routine contains the code executed by the main thread.
-     */
-    void runMainThread();
-    /**
-     * This routine contains the code executed by each worker thread.
-     */
-    void runWorkerThread(ThreadPool& threads, int index);
     /**
      * Get whether the current CPU supports all features needed by this kernel.
      */
@@ -107,45 +150,51 @@ private:
      * Select a size for one grid dimension that FFTW can handle efficiently.
      */
     int findFFTDimension(int minimum, bool isZ);
-    static bool hasInitializedThreads;
-    static int numThreads;
-    int gridx, gridy, gridz, numParticles;
+    /**
+     * Build the graph of tasks that is executed for every force computation.
+     */
+    void createTaskGraph();
+    int gridx, gridy, gridz, numParticles, numPartitions;
     double alpha;
     bool deterministic;
-    bool hasCreatedPlan, isFinished, isDeleted;
     std::vector<float> force;
     std::vector<float> bsplineModuli[3];
     std::vector<float> recipEterm;
     Vec3 lastBoxVectors[3];
-    std::vector<float> threadEnergy;
+    std::vector<double> partitionEnergy;
     std::vector<float*> tempGrid;
     float* realGrid;
     fftwf_complex* complexGrid;
-    fftwf_plan forwardFFT, backwardFFT;
-    int waitCount;
-    pthread_cond_t startCondition, endCondition;
-    pthread_mutex_t lock;
-    pthread_t mainThread;
+    CpuPmeFFT fft;
+    std::shared_ptr<ThreadPool> threads;
+    ThreadPool::TaskGraph graph;
     // The following variables are used to store information about the calculation currently being performed.
     IO* io;
-    float energy;
     float* posq;
     Vec3 periodicBoxVectors[3], recipBoxVectors[3];
-    bool includeEnergy;
-    std::atomic<int> atomicCounter;
+    bool includeEnergy, boxChanged;
+    std::atomic<int> spreadCounter, interpolateCounter;
 };
 
 
 
 /**
  * This is an optimized CPU implementation of CalcDispersionPmeReciprocalForceKernel.  It is both
- * vectorized (requiring SSE 4.1) and multithreaded.  It uses FFTW to perform the FFTs.
+ * vectorized (requiring SSE 4.1) and multithreaded.  It uses FFTW to perform the FFTs.  Every
+ * step of the calculation, including the FFTs, is a task in a ThreadPool::TaskGraph, so it can run
+ * on a ThreadPool provided by the platform.
  */
 
 class OPENMM_EXPORT_PME CpuCalcDispersionPmeReciprocalForceKernel : public CalcDispersionPmeReciprocalForceKernel {
 public:
     CpuCalcDispersionPmeReciprocalForceKernel(const std::string& name, const Platform& platform) : CalcDispersionPmeReciprocalForceKernel(name, platform),
-            hasCreatedPlan(false), isDeleted(false), realGrid(NULL), complexGrid(NULL)  {
+            realGrid(NULL), complexGrid(NULL)  {
+    }
+    /**
+     * Set the ThreadPool to run on.  If this is not called before initialize(), the kernel creates its own.
+     */
+    void setThreadPool(std::shared_ptr<ThreadPool> threads) {
+        this->threads = threads;
     }
     /**
      * Initialize the kernel.
@@ -174,14 +223,6 @@ public:
      * @return the potential energy due to the PME reciprocal space interactions
      */
     double finishComputation(CalcPmeReciprocalForceKernel::IO& io);
-    /**
-     * This routine contains the code executed by the main thread.
-     */
-    void runMainThread();
-    /**
-     * This routine contains the code executed by each worker thread.
-     */
-    void runWorkerThread(ThreadPool& threads, int index);
     /**
      * Get whether the current CPU supports all features needed by this kernel.
      */
@@ -196,37 +237,34 @@ public:
      */
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
 private:
-    class ComputeTask;
     /**
      * Select a size for one grid dimension that FFTW can handle efficiently.
      */
     int findFFTDimension(int minimum, bool isZ);
-    static bool hasInitializedThreads;
-    static int numThreads;
-    int gridx, gridy, gridz, numParticles;
+    /**
+     * Build the graph of tasks that is executed for every force computation.
+     */
+    void createTaskGraph();
+    int gridx, gridy, gridz, numParticles, numPartitions;
     double alpha;
     bool deterministic;
-    bool hasCreatedPlan, isFinished, isDeleted;
     std::vector<float> force;
     std::vector<float> bsplineModuli[3];
     std::vector<float> recipEterm;
     Vec3 lastBoxVectors[3];
-    std::vector<float> threadEnergy;
+    std::vector<double> partitionEnergy;
     std::vector<float*> tempGrid;
     float* realGrid;
     fftwf_complex* complexGrid;
-    fftwf_plan forwardFFT, backwardFFT;
-    int waitCount;
-    pthread_cond_t startCondition, endCondition;
-    pthread_mutex_t lock;
-    pthread_t mainThread;
+    CpuPmeFFT fft;
+    std::shared_ptr<ThreadPool> threads;
+    ThreadPool::TaskGraph graph;
     // The following variables are used to store information about the calculation currently being performed.
     CalcPmeReciprocalForceKernel::IO* io;
-    float energy;
     float* posq;
     Vec3 periodicBoxVectors[3], recipBoxVectors[3];
-    bool includeEnergy;
-    std::atomic<int> atomicCounter;
+    bool includeEnergy, boxChanged;
+    std::atomic<int> spreadCounter, interpolateCounter;
 };
 
 } // namespace OpenMM
@@ -40,6 +40,7 @@
 #include "openmm/System.h"
 #include "openmm/VerletIntegrator.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/ThreadPool.h"
 #include "openmm/Units.h"
 #include "../src/CpuPmeKernels.h"
 #include "SimTKOpenMMRealType.h"
@@ -706,6 +707,48 @@ void testLJPME(bool triclinic) {
         ASSERT_EQUAL_VEC(refState.getForces()[i], Vec3(io.force[4*i], io.force[4*i+1], io.force[4*i+2]), 1e-3);
 }
 
+void testThreadPool() {
+    // Run the same calculation on ThreadPools of different sizes.  In deterministic mode the results
+    // should be identical.
+
+    const int numParticles = 200;
+    const double boxWidth = 3.0;
+    const double alpha = 3.0;
+    const int gridSize = 32;
+    Vec3 boxVectors[3] = {Vec3(boxWidth, 0, 0), Vec3(0.1*boxWidth, boxWidth, 0), Vec3(-0.2*boxWidth, 0.3*boxWidth, boxWidth)};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    IO io;
+    for (int i = 0; i < numParticles; i++) {
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(boxWidth*genrand_real2(sfmt));
+        io.posq.push_back(i%2 == 0 ? 1.0 : -1.0);
+    }
+    Platform& platform = Platform::getPlatformByName("Reference");
+    double firstEnergy;
+    vector<float> firstForces;
+    for (int numThreads : {1, 2, 4}) {
+        CpuCalcPmeReciprocalForceKernel pme(CalcPmeReciprocalForceKernel::Name(), platform);
+        pme.setThreadPool(make_shared<ThreadPool>(numThreads));
+        pme.initialize(gridSize, gridSize, gridSize, numParticles, alpha, true);
+        for (int step = 0; step < 2; step++) {
+            pme.beginComputation(io, boxVectors, true);
+            double energy = pme.finishComputation(io);
+            vector<float> forces(io.force, io.force+4*numParticles);
+            if (numThreads == 1 && step == 0) {
+                firstEnergy = energy;
+                firstForces = forces;
+            }
+            else {
+                ASSERT_EQUAL(firstEnergy, energy);
+                for (int i = 0; i < 4*numParticles; i++)
+                    ASSERT_EQUAL(firstForces[i], forces[i]);
+            }
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (!CpuCalcPmeReciprocalForceKernel::isProcessorSupported()) {
@@ -717,6 +760,7 @@ int main(int argc, char* argv[]) {
         testLJPME(false);
         testLJPME(true);
         test_water2_dpme_energies_forces_no_exclusions();
+        testThreadPool();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
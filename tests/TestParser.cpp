@@ -114,6 +114,30 @@ void verifyEvaluation(const string& expression, double x, double y, double expec
     ASSERT_EQUAL(&x, &compiled2.getVariableReference("x"));
     ASSERT_EQUAL(&y, &compiled2.getVariableReference("y"));
 
+    // Create a CompiledVectorExpression and see if it gives the same result for every value.
+
+    const int width = 6;
+    vector<double> xValues(width, x), yValues(width, y);
+    CompiledVectorExpression vectorCompiled = parsed.createCompiledVectorExpression(width);
+    ASSERT_EQUAL(width, vectorCompiled.getWidth());
+    if (vectorCompiled.getVariables().find("x") != vectorCompiled.getVariables().end())
+        for (int i = 0; i < width; i++)
+            vectorCompiled.getVariablePointer("x")[i] = x;
+    if (vectorCompiled.getVariables().find("y") != vectorCompiled.getVariables().end())
+        for (int i = 0; i < width; i++)
+            vectorCompiled.getVariablePointer("y")[i] = y;
+    const double* vectorValues = vectorCompiled.evaluate();
+    for (int i = 0; i < width; i++)
+        ASSERT_EQUAL_TOL(expectedValue, vectorValues[i], 1e-10);
+    variablePointers["x"] = &xValues[0];
+    variablePointers["y"] = &yValues[0];
+    CompiledVectorExpression vectorCompiled2 = parsed.createCompiledVectorExpression(width);
+    vectorCompiled2.setVariableLocations(variablePointers);
+    vectorValues = vectorCompiled2.evaluate();
+    for (int i = 0; i < width; i++)
+        ASSERT_EQUAL_TOL(expectedValue, vectorValues[i], 1e-10);
+    ASSERT_EQUAL(&xValues[0], vectorCompiled2.getVariablePointer("x"));
+
     // Make sure that variable renaming works.
 
     variables.clear();
@@ -222,6 +246,48 @@ void testCustomFunction(const string& expression, const string& equivalent) {
     verifySameValue(deriv3, deriv4, 2.0, -3.0);
 }
 
+/**
+ * Verify that a CompiledVectorExpression evaluates each value independently, for several widths.  Also check that
+ * a copy and an assigned expression read their own variables.
+ */
+
+void verifyVectorValues(const ParsedExpression& parsed, CompiledVectorExpression& compiled, double* x, double* y, double shift) {
+    int width = compiled.getWidth();
+    for (int i = 0; i < width; i++) {
+        x[i] = 0.7*i-2.0+shift;
+        y[i] = 1.5-0.4*i;
+    }
+    const double* values = compiled.evaluate();
+    for (int i = 0; i < width; i++) {
+        map<string, double> variables;
+        variables["x"] = 0.7*i-2.0+shift;
+        variables["y"] = 1.5-0.4*i;
+        assertNumbersEqual(parsed.evaluate(variables), values[i]);
+    }
+}
+
+void testVectorExpression(const string& expression) {
+    map<string, CustomFunction*> functions;
+    ExampleFunction exp;
+    functions["custom"] = &exp;
+    ParsedExpression parsed = Parser::parse(expression, functions);
+    for (int width : {7, 8, 32}) {
+        CompiledVectorExpression compiled = parsed.createCompiledVectorExpression(width);
+        verifyVectorValues(parsed, compiled, compiled.getVariablePointer("x"), compiled.getVariablePointer("y"), 0.0);
+        CompiledVectorExpression copy(compiled);
+        verifyVectorValues(parsed, copy, copy.getVariablePointer("x"), copy.getVariablePointer("y"), 0.3);
+        verifyVectorValues(parsed, compiled, compiled.getVariablePointer("x"), compiled.getVariablePointer("y"), -0.2);
+        vector<double> xValues(width), yValues(width);
+        map<string, double*> variablePointers;
+        variablePointers["x"] = &xValues[0];
+        variablePointers["y"] = &yValues[0];
+        CompiledVectorExpression assigned = Parser::parse("x+y").createCompiledVectorExpression(width);
+        assigned = copy;
+        assigned.setVariableLocations(variablePointers);
+        verifyVectorValues(parsed, assigned, &xValues[0], &yValues[0], 0.1);
+    }
+}
+
 int main() {
     try {
         verifyEvaluation("5", 5.0);
@@ -305,6 +371,10 @@ int main() {
         verifyDerivative("select(x, x^2, 3*x)", "select(x, 2*x, 3)");
         testCustomFunction("custom(x, y)/2", "x*y");
         testCustomFunction("custom(x^2, 1)+custom(2, y-1)", "2*x^2+4*(y-1)");
+        testVectorExpression("x^3-2*x^-2+y/x+sqrt(y^2)+exp(-x*y)");
+        testVectorExpression("select(step(x), min(x, y), abs(y))*cos(x)+erfc(y)");
+        testVectorExpression("custom(x, y)+3*(x+y)^2.5");
+        testVectorExpression("delta(x-0.1)+max(x, y)*atan2(y, x)+floor(y)-ceil(x)+log(x^2+1)+y^-5+tanh(x)");
         cout << Parser::parse("x*x").optimize() << endl;
         cout << Parser::parse("x*(x*x)").optimize() << endl;
         cout << Parser::parse("(x*x)*x").optimize() << endl;
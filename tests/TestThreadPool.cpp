@@ -0,0 +1,276 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2026 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/internal/ThreadPool.h"
+#include "openmm/OpenMMException.h"
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+void testParallelFor() {
+    ThreadPool threads(4);
+    const int numIndices = 1003;
+    for (int chunkSize : {0, 1, 7, 2000}) {
+        vector<int> count(numIndices, 0);
+        threads.parallelFor(0, numIndices, [&] (ThreadPool& pool, int threadIndex, int start, int end) {
+            ASSERT(threadIndex >= 0 && threadIndex < pool.getNumThreads());
+            ASSERT(start < end);
+            for (int i = start; i < end; i++)
+                count[i]++;
+        }, chunkSize);
+        for (int i = 0; i < numIndices; i++)
+            ASSERT_EQUAL(1, count[i]);
+    }
+    
+    // An empty range should not invoke the function at all.
+    
+    bool called = false;
+    threads.parallelFor(5, 5, [&] (ThreadPool& pool, int threadIndex, int start, int end) { called = true; });
+    ASSERT(!called);
+}
+
+void testTaskGraph() {
+    // Build a graph where each task depends on up to two earlier ones, and check that every task
+    // runs once and only after all its dependencies have finished.
+
+    ThreadPool threads(4);
+    const int numTasks = 500;
+    vector<atomic<int> > finished(numTasks);
+    vector<vector<int> > dependencies(numTasks);
+    ThreadPool::TaskGraph graph;
+    atomic<int> violations(0);
+    for (int i = 0; i < numTasks; i++) {
+        finished[i] = 0;
+        if (i > 0)
+            dependencies[i].push_back((7*i)%i);
+        if (i > 10)
+            dependencies[i].push_back(i-10);
+        int index = graph.addTask([&, i] (ThreadPool& pool, int threadIndex) {
+            for (int dependency : dependencies[i])
+                if (finished[dependency] == 0)
+                    violations++;
+            finished[i]++;
+        }, dependencies[i]);
+        ASSERT_EQUAL(i, index);
+    }
+    ASSERT_EQUAL(numTasks, graph.getNumTasks());
+    for (int repeat = 0; repeat < 3; repeat++) {
+        for (int i = 0; i < numTasks; i++)
+            finished[i] = 0;
+        threads.execute(graph);
+        threads.waitForThreads();
+        ASSERT_EQUAL(0, violations);
+        for (int i = 0; i < numTasks; i++)
+            ASSERT_EQUAL(1, finished[i]);
+    }
+
+    // Dependencies must refer to tasks that already exist.
+
+    bool threwException = false;
+    try {
+        graph.addTask([] (ThreadPool& pool, int threadIndex) {}, vector<int>(1, numTasks+5));
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    graph.clear();
+    ASSERT_EQUAL(0, graph.getNumTasks());
+    threads.execute(graph);
+    threads.waitForThreads();
+}
+
+void testTaskExceptions() {
+    // An exception thrown by a task should be rethrown in the parent thread, and the pool should still
+    // be usable afterward.
+
+    ThreadPool threads(4);
+    bool threwException = false;
+    try {
+        threads.execute([&] (ThreadPool& pool, int threadIndex) {
+            if (threadIndex == 1)
+                throw OpenMMException("task failed");
+        });
+        threads.waitForThreads();
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+
+    // When a task in a graph throws, the graph should still finish and the tasks that depend on it
+    // should not run.
+
+    const int numTasks = 200;
+    atomic<int> numRun(0);
+    ThreadPool::TaskGraph graph;
+    int failing = graph.addTask([&] (ThreadPool& pool, int threadIndex) {
+        throw OpenMMException("task failed");
+    });
+    for (int i = 1; i < numTasks; i++)
+        graph.addTask([&] (ThreadPool& pool, int threadIndex) { numRun++; }, vector<int>(1, failing));
+    threwException = false;
+    try {
+        threads.execute(graph);
+        threads.waitForThreads();
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    ASSERT_EQUAL(0, numRun);
+    vector<int> count(100, 0);
+    threads.parallelFor(0, 100, [&] (ThreadPool& pool, int threadIndex, int start, int end) {
+        for (int i = start; i < end; i++)
+            count[i]++;
+    });
+    for (int c : count)
+        ASSERT_EQUAL(1, c);
+}
+
+void testCompletionGuard() {
+    // If the parent thread throws an exception after starting a task, a CompletionGuard should finish
+    // the task and release the pool, so another parent thread can use it.
+
+    shared_ptr<ThreadPool> pool = ThreadPool::getSharedPool(3);
+    for (bool sync : {false, true}) {
+        atomic<int> finished(0);
+        try {
+            ThreadPool::CompletionGuard guard(*pool);
+            pool->execute([&] (ThreadPool& threads, int threadIndex) {
+                if (sync)
+                    threads.syncThreads();
+                finished++;
+            });
+            throw OpenMMException("parent failed");
+        }
+        catch (const OpenMMException& ex) {
+        }
+        ASSERT_EQUAL(pool->getNumThreads(), finished);
+        atomic<int> count(0);
+        thread other([&] () {
+            pool->execute([&] (ThreadPool& threads, int threadIndex) { count++; });
+            pool->waitForThreads();
+        });
+        other.join();
+        ASSERT_EQUAL(pool->getNumThreads(), count);
+    }
+
+    // A guard for a task that was already waited for should do nothing.
+
+    {
+        ThreadPool::CompletionGuard guard(*pool);
+        pool->execute([&] (ThreadPool& threads, int threadIndex) {});
+        pool->waitForThreads();
+    }
+    atomic<int> count(0);
+    thread other([&] () {
+        pool->execute([&] (ThreadPool& threads, int threadIndex) { count++; });
+        pool->waitForThreads();
+    });
+    other.join();
+    ASSERT_EQUAL(pool->getNumThreads(), count);
+}
+
+void testSharedPool() {
+    // Requests with the same number of threads should get the same pool.
+
+    shared_ptr<ThreadPool> pool1 = ThreadPool::getSharedPool(3);
+    shared_ptr<ThreadPool> pool2 = ThreadPool::getSharedPool(3);
+    shared_ptr<ThreadPool> pool3 = ThreadPool::getSharedPool(2);
+    ASSERT(pool1 == pool2);
+    ASSERT(pool1 != pool3);
+    ASSERT_EQUAL(3, pool1->getNumThreads());
+    ASSERT_EQUAL(2, pool3->getNumThreads());
+
+    // Have several parent threads use the pool at once.  Some of them run tasks that are split into
+    // phases with waitForThreads() and resumeThreads(), which must not be interleaved with work from
+    // the other parents.
+
+    const int numParents = 4;
+    const int numIndices = 1000;
+    atomic<int> errors(0);
+    vector<thread> parents;
+    for (int parent = 0; parent < numParents; parent++) {
+        parents.push_back(thread([&, parent] () {
+            ThreadPool& threads = *ThreadPool::getSharedPool(3);
+            for (int repeat = 0; repeat < 50; repeat++) {
+                vector<int> count(numIndices, 0);
+                threads.parallelFor(0, numIndices, [&] (ThreadPool& pool, int threadIndex, int start, int end) {
+                    for (int i = start; i < end; i++)
+                        count[i] += parent+1;
+                });
+                for (int i = 0; i < numIndices; i++)
+                    if (count[i] != parent+1)
+                        errors++;
+                vector<int> phase(threads.getNumThreads(), 0);
+                threads.execute([&] (ThreadPool& pool, int threadIndex) {
+                    phase[threadIndex] = 1;
+                    pool.syncThreads();
+                    phase[threadIndex] = 2;
+                });
+                threads.waitForThreads();
+                for (int p : phase)
+                    if (p != 1)
+                        errors++;
+                threads.resumeThreads();
+                threads.waitForThreads();
+                for (int p : phase)
+                    if (p != 2)
+                        errors++;
+            }
+        }));
+    }
+    for (thread& t : parents)
+        t.join();
+    ASSERT_EQUAL(0, errors);
+}
+
+int main() {
+    try {
+        testParallelFor();
+        testTaskGraph();
+        testTaskExceptions();
+        testCompletionGuard();
+        testSharedPool();
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}